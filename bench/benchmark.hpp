@@ -0,0 +1,111 @@
+/**
+    @file
+
+    Helpers shared by the benchmark programs.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_BENCH_BENCHMARK_HPP
+#define CRABGRAB_BENCH_BENCHMARK_HPP
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+
+#include <cstddef> // size_t
+#include <iomanip> // setw, setprecision
+#include <iostream> // cout
+#include <string>
+
+namespace crabgrab {
+namespace bench {
+
+/**
+ * Wall-clock stopwatch started on construction.
+ */
+class stopwatch
+{
+public:
+    stopwatch() : m_start(now()) {}
+
+    double seconds() const
+    {
+        return (now() - m_start).total_microseconds() / 1e6;
+    }
+
+private:
+    static boost::posix_time::ptime now()
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+    boost::posix_time::ptime m_start;
+};
+
+/**
+ * Run a function object `runs` times and return the mean seconds per run.
+ *
+ * The function is called once beforehand to warm up caches and allocators.
+ */
+template<typename Function>
+double time_per_run(Function f, int runs)
+{
+    f();
+
+    stopwatch timer;
+    for (int i = 0; i < runs; ++i)
+        f();
+
+    return timer.seconds() / runs;
+}
+
+inline void report_throughput(
+    const std::string& name, std::size_t bytes, double seconds)
+{
+    std::cout << std::left << std::setw(32) << name << std::right <<
+        std::fixed << std::setprecision(3) << std::setw(10) <<
+        seconds * 1e3 << " ms" << std::setw(10) << bytes / seconds / 1e9 <<
+        " GB/s" << std::endl;
+}
+
+/**
+ * Report an encoder's speed over `bytes_in` of raw pixels and how small it
+ * made them.
+ */
+inline void report_compression(
+    const std::string& name, std::size_t bytes_in, std::size_t bytes_out,
+    double seconds)
+{
+    std::cout << std::left << std::setw(32) << name << std::right <<
+        std::fixed << std::setprecision(3) << std::setw(10) <<
+        seconds * 1e3 << " ms" << std::setprecision(1) << std::setw(10) <<
+        bytes_in / seconds / 1e6 << " MB/s" << std::setw(12) << bytes_out <<
+        " bytes" << std::setw(8) << 100.0 * bytes_out / bytes_in << " %" <<
+        std::endl;
+}
+
+}}
+
+#endif
@@ -0,0 +1,368 @@
+/**
+    @file
+
+    Benchmark of the PNG encoder's match strategies on screenshots.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "benchmark.hpp" // time_per_run, report_compression, stopwatch
+
+#include "crabgrab/encode_bmp.hpp" // encode_as_png, encode_options
+#include "crabgrab/image_view.hpp" // image_view
+#include "crabgrab/thread_pool.hpp" // thread_pool
+
+#include <LodePNG/lodepng.h> // LodePNG::Decoder, LodePNG::loadFile
+
+#include <cstddef> // size_t
+#include <cstdlib> // atoi, rand
+#include <iostream> // cout, cerr
+#include <sstream> // ostringstream
+#include <string>
+#include <vector>
+
+using crabgrab::bench::report_compression;
+using crabgrab::bench::stopwatch;
+using crabgrab::bench::time_per_run;
+using crabgrab::encode_as_png;
+using crabgrab::encode_options;
+using crabgrab::image_view;
+using crabgrab::thread_pool;
+
+namespace channel_order = crabgrab::channel_order;
+namespace filter_strategy = crabgrab::filter_strategy;
+namespace match_strategy = crabgrab::match_strategy;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+
+struct screenshot
+{
+    string name;
+    unsigned int width;
+    unsigned int height;
+    vector<unsigned char> pixels; ///< RGBA
+};
+
+void fill(
+    screenshot& shot, unsigned int left, unsigned int top, unsigned int right,
+    unsigned int bottom, unsigned char r, unsigned char g, unsigned char b)
+{
+    for (unsigned int y = top; y < bottom && y < shot.height; ++y)
+    {
+        for (unsigned int x = left; x < right && x < shot.width; ++x)
+        {
+            unsigned char* pixel = &shot.pixels[(y * shot.width + x) * 4];
+            pixel[0] = r;
+            pixel[1] = g;
+            pixel[2] = b;
+            pixel[3] = 255;
+        }
+    }
+}
+
+/**
+ * A made-up desktop: flat background, windows with title bars and lines of
+ * "text", and a noisy rectangle standing in for a photo.
+ */
+screenshot synthetic_desktop(
+    unsigned int width, unsigned int height, unsigned int windows)
+{
+    screenshot shot;
+    std::ostringstream name;
+    name << "synthetic " << width << "x" << height << ", " << windows <<
+        " windows";
+    shot.name = name.str();
+    shot.width = width;
+    shot.height = height;
+    shot.pixels.resize(width * height * 4);
+
+    fill(shot, 0, 0, width, height, 58, 110, 165);
+    for (unsigned int i = 0; i < windows; ++i)
+    {
+        unsigned int left = std::rand() % (width / 2);
+        unsigned int top = std::rand() % (height / 2);
+        unsigned int right = left + width / 4 + std::rand() % (width / 4);
+        unsigned int bottom = top + height / 4 + std::rand() % (height / 4);
+
+        fill(shot, left, top, right, bottom, 240, 240, 240);
+        fill(shot, left, top, right, top + 24, 0, 84, 227);
+        for (unsigned int line = top + 34; line + 12 < bottom; line += 16)
+        {
+            for (unsigned int x = left + 8; x + 8 < right; x += 6)
+            {
+                if (std::rand() % 4 == 0)
+                    continue;
+                fill(
+                    shot, x, line + std::rand() % 3, x + 1 + std::rand() % 4,
+                    line + 9, 20, 20, 20);
+            }
+        }
+    }
+
+    unsigned int photo_left = width * 2 / 3;
+    unsigned int photo_top = height * 2 / 3;
+    for (unsigned int y = photo_top; y < height - 40; ++y)
+    {
+        for (unsigned int x = photo_left; x < width - 40; ++x)
+        {
+            unsigned char* pixel = &shot.pixels[(y * width + x) * 4];
+            pixel[0] = static_cast<unsigned char>(x + std::rand() % 16);
+            pixel[1] = static_cast<unsigned char>(y + std::rand() % 16);
+            pixel[2] = static_cast<unsigned char>(x + y);
+        }
+    }
+
+    fill(shot, 0, height - 40, width, height, 32, 32, 32);
+
+    return shot;
+}
+
+bool load_png(const string& filename, screenshot& shot)
+{
+    vector<unsigned char> file;
+    LodePNG::loadFile(file, filename);
+
+    LodePNG::Decoder decoder;
+    decoder.decode(shot.pixels, file);
+    if (file.empty() || decoder.hasError())
+        return false;
+
+    shot.name = filename;
+    shot.width = decoder.getWidth();
+    shot.height = decoder.getHeight();
+    return true;
+}
+
+class encode
+{
+public:
+    encode(
+        const screenshot& shot, const encode_options& options, size_t& size)
+        : m_shot(shot), m_options(options), m_size(size) {}
+
+    void operator()()
+    {
+        image_view view(
+            &m_shot.pixels[0], m_shot.width, m_shot.height, m_shot.width * 4,
+            channel_order::rgba, false);
+        m_size = encode_as_png(view, m_options).size();
+    }
+
+private:
+    const screenshot& m_shot;
+    encode_options m_options;
+    size_t& m_size;
+};
+
+void compare_strategies(const screenshot& shot, thread_pool& pool, int runs)
+{
+    std::cout << shot.name << std::endl;
+
+    size_t bytes = shot.pixels.size();
+    size_t size = 0;
+
+    double seconds = time_per_run(
+        encode(shot, encode_options(1, match_strategy::huffman_only), size),
+        runs);
+    report_compression("huffman-only", bytes, size, seconds);
+
+    encode_options fastest(1, match_strategy::run_length);
+    fastest.fixed_codes = true;
+    seconds = time_per_run(encode(shot, fastest, size), runs);
+    report_compression("run-length, fixed codes", bytes, size, seconds);
+
+    seconds = time_per_run(
+        encode(shot, encode_options(1, match_strategy::run_length), size),
+        runs);
+    report_compression("run-length", bytes, size, seconds);
+
+    unsigned int levels[] = { 1, 6, 9 };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+    {
+        std::ostringstream name;
+        name << "hash chains, level " << levels[i];
+        seconds = time_per_run(
+            encode(shot, encode_options(levels[i]), size), runs);
+        report_compression(name.str(), bytes, size, seconds);
+    }
+
+    if (pool.size() > 1)
+    {
+        std::ostringstream name;
+        name << "hash chains, level 6, " << pool.size() << " threads";
+        encode_options options(6);
+        options.threads = &pool;
+        seconds = time_per_run(encode(shot, options, size), runs);
+        report_compression(name.str(), bytes, size, seconds);
+    }
+}
+
+/**
+ * What each way of choosing the rows' filters does to the size and time.
+ *
+ * Timed with the default level and with run-length matching, the fastest
+ * strategy that still finds repeated rows, where the filter's share of the
+ * time is largest.
+ */
+void compare_filters(const screenshot& shot, int runs)
+{
+    const char* names[] = {
+        "minimum sum", "entropy", "screen", "screen hybrid" };
+    filter_strategy::type filters[] = {
+        filter_strategy::minimum_sum, filter_strategy::entropy,
+        filter_strategy::screen, filter_strategy::screen_hybrid };
+
+    size_t bytes = shot.pixels.size();
+    size_t size = 0;
+
+    match_strategy::type strategies[] = {
+        match_strategy::hash_chains, match_strategy::run_length };
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(filters) / sizeof(filters[0]); ++j)
+        {
+            encode_options options(6, strategies[i]);
+            options.filter = filters[j];
+            double seconds = time_per_run(encode(shot, options, size), runs);
+
+            std::ostringstream name;
+            name << names[j] << ((i == 0) ? ", level 6" : ", run-length");
+            report_compression(name.str(), bytes, size, seconds);
+        }
+    }
+}
+
+/**
+ * What optimal parsing buys over the best level, for what it costs.
+ *
+ * It is too slow to run more than once, so it is timed once only, and the
+ * bytes it saves over level 9 are given per second it took.  Encoding is
+ * single-threaded so that is CPU time too.  The level still sets how hard
+ * it looks for matches, which is most of the time it takes.
+ */
+void compare_optimal(const screenshot& shot)
+{
+    size_t bytes = shot.pixels.size();
+    size_t best_level_size = 0;
+
+    double seconds = time_per_run(
+        encode(shot, encode_options(9), best_level_size), 1);
+    report_compression("hash chains, level 9", bytes, best_level_size, seconds);
+
+    unsigned int levels[] = { 6, 9 };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+    {
+        size_t size = 0;
+        stopwatch timer;
+        encode(
+            shot, encode_options(levels[i], match_strategy::optimal_parsing),
+            size)();
+        seconds = timer.seconds();
+
+        std::ostringstream name;
+        name << "optimal parsing, level " << levels[i];
+        report_compression(name.str(), bytes, size, seconds);
+
+        double saved = static_cast<double>(best_level_size) - size;
+        std::cout << "    saves " << saved << " bytes on level 9, " <<
+            saved / seconds << " bytes per CPU-second" << std::endl;
+    }
+}
+}
+
+/**
+ * Usage: encode_bench [--filters] [--optimal] [runs [screenshot.png ...]]
+ *
+ * Without any PNGs, encodes made-up desktops at a few common sizes.  Real
+ * screenshots are better: the point is how flat UI compares with the
+ * synthetic stand-in.
+ *
+ * On a machine with more than one core, level 6 is also timed deflating on
+ * every core.
+ *
+ * --filters also compares the ways of choosing each row's filter.
+ *
+ * --optimal also weighs optimal parsing against level 9, which takes a
+ * while.
+ */
+int main(int argc, char* argv[])
+{
+    int first = 1;
+    bool filters = argc > first && string(argv[first]) == "--filters";
+    if (filters)
+        ++first;
+
+    bool optimal = argc > first && string(argv[first]) == "--optimal";
+    if (optimal)
+        ++first;
+
+    int runs = (argc > first) ? std::atoi(argv[first]) : 5;
+
+    vector<screenshot> corpus;
+    for (int i = first + 1; i < argc; ++i)
+    {
+        screenshot shot;
+        if (load_png(argv[i], shot))
+            corpus.push_back(shot);
+        else
+            std::cerr << "Couldn't load " << argv[i] << std::endl;
+    }
+
+    if (argc <= first + 1)
+    {
+        corpus.push_back(synthetic_desktop(1280, 1024, 3));
+        corpus.push_back(synthetic_desktop(1920, 1080, 6));
+        corpus.push_back(synthetic_desktop(2560, 1440, 10));
+    }
+
+    thread_pool pool;
+    for (size_t i = 0; i < corpus.size(); ++i)
+        compare_strategies(corpus[i], pool, runs);
+
+    if (filters)
+    {
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            std::cout << corpus[i].name << std::endl;
+            compare_filters(corpus[i], runs);
+        }
+    }
+
+    if (optimal)
+    {
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            std::cout << corpus[i].name << std::endl;
+            compare_optimal(corpus[i]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+/**
+    @file
+
+    Row conversion throughput: the old per-byte loop against each kernel.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "benchmark.hpp" // time_per_run, report_throughput
+
+#include "crabgrab/image_view.hpp" // image_view
+#include "crabgrab/row_conversion.hpp" // convert_image, instruction_set
+
+#include <cstdlib> // atoi, rand
+#include <iostream> // cout
+#include <vector>
+
+using crabgrab::bench::report_throughput;
+using crabgrab::bench::time_per_run;
+using crabgrab::best_instruction_set;
+using crabgrab::convert_image;
+using crabgrab::image_view;
+
+namespace channel_order = crabgrab::channel_order;
+namespace instruction_set = crabgrab::instruction_set;
+
+using std::vector;
+
+namespace {
+
+/**
+ * The conversion encode_as_png used to do: rows pushed back a byte at a time
+ * in reverse order, with every fourth byte replaced by 0xff.
+ */
+class legacy_conversion
+{
+public:
+    legacy_conversion(const image_view& image, vector<unsigned char>& out)
+        : m_image(image), m_out(out) {}
+
+    void operator()()
+    {
+        m_out.clear();
+        size_t row_width = m_image.width * 4;
+        for (size_t h = m_image.height; h > 0; --h)
+        {
+            const unsigned char* row = m_image.pixels + (h - 1) * row_width;
+            for (size_t i = 0; i < row_width; ++i)
+            {
+                if (i % 4 == 3)
+                    m_out.push_back(0xff);
+                else
+                    m_out.push_back(row[i]);
+            }
+        }
+    }
+
+private:
+    image_view m_image;
+    vector<unsigned char>& m_out;
+};
+
+class kernel_conversion
+{
+public:
+    kernel_conversion(
+        const image_view& image, channel_order::type out_order,
+        instruction_set::type isa, vector<unsigned char>& out)
+        : m_image(image), m_out_order(out_order), m_isa(isa), m_out(out) {}
+
+    void operator()()
+    {
+        convert_image(m_image, &m_out[0], m_out_order, m_isa);
+    }
+
+private:
+    image_view m_image;
+    channel_order::type m_out_order;
+    instruction_set::type m_isa;
+    vector<unsigned char>& m_out;
+};
+
+const char* isa_names[] = { "generic", "sse2", "ssse3", "avx2" };
+
+}
+
+/**
+ * Usage: row_conversion_bench [width height [runs]]
+ *
+ * Defaults to a 4K frame.
+ */
+int main(int argc, char* argv[])
+{
+    unsigned int width = (argc > 2) ? std::atoi(argv[1]) : 3840;
+    unsigned int height = (argc > 2) ? std::atoi(argv[2]) : 2160;
+    int runs = (argc > 3) ? std::atoi(argv[3]) : 20;
+
+    vector<unsigned char> pixels(width * height * 4);
+    for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = static_cast<unsigned char>(std::rand());
+
+    image_view image(
+        &pixels[0], width, height, width * 4, channel_order::bgrx, true);
+    size_t bytes = pixels.size();
+
+    std::cout << width << "x" << height << " BGRX, bottom-up, best "
+        "instruction set: " << isa_names[best_instruction_set()] << std::endl;
+
+    vector<unsigned char> out;
+    report_throughput(
+        "legacy push_back loop", bytes,
+        time_per_run(legacy_conversion(image, out), runs));
+
+    out.resize(width * height * 4);
+    for (int isa = instruction_set::generic; isa <= best_instruction_set();
+        ++isa)
+    {
+        report_throughput(
+            std::string("BGRX->RGBA ") + isa_names[isa], bytes,
+            time_per_run(
+                kernel_conversion(
+                    image, channel_order::rgba,
+                    static_cast<instruction_set::type>(isa), out), runs));
+    }
+
+    for (int isa = instruction_set::generic; isa <= best_instruction_set();
+        ++isa)
+    {
+        report_throughput(
+            std::string("BGRX->RGB ") + isa_names[isa], bytes,
+            time_per_run(
+                kernel_conversion(
+                    image, channel_order::rgb,
+                    static_cast<instruction_set::type>(isa), out), runs));
+    }
+
+    // The same frame captured at 16bpp is half the bytes to read
+    image_view image_565(
+        &pixels[0], width, height, width * 2, channel_order::rgb565, true);
+    size_t bytes_565 = bytes / 2;
+
+    for (int isa = instruction_set::generic; isa <= best_instruction_set();
+        ++isa)
+    {
+        report_throughput(
+            std::string("565->RGBA ") + isa_names[isa], bytes_565,
+            time_per_run(
+                kernel_conversion(
+                    image_565, channel_order::rgba,
+                    static_cast<instruction_set::type>(isa), out), runs));
+    }
+
+    for (int isa = instruction_set::generic; isa <= best_instruction_set();
+        ++isa)
+    {
+        report_throughput(
+            std::string("565->RGB ") + isa_names[isa], bytes_565,
+            time_per_run(
+                kernel_conversion(
+                    image_565, channel_order::rgb,
+                    static_cast<instruction_set::type>(isa), out), runs));
+    }
+
+    return 0;
+}
@@ -30,6 +30,7 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include "lodepng.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -37,6 +38,12 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #endif /*__cplusplus*/
 
+/*SSE2 is there on every x86-64 processor, and on x86 whenever the compiler was allowed to use it*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#endif
+
 #define VERSION_STRING "20110417"
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -63,91 +70,29 @@ Example: if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(9924);
 /*version of CERROR_BREAK that assumes the common case where the error variable is named "error"*/
 #define ERROR_BREAK(code) CERROR_BREAK(error, code)
 
-/*
-About these tools (vector, uivector, ucvector and string):
--LodePNG was originally written in C++. The vectors replace the std::vectors that were used in the C++ version.
--The string tools are made to avoid problems with compilers that declare things like strncat as deprecated.
--They're not used in the interface, only internally in this file, so all their functions are made static.
-*/
-
-#ifdef LODEPNG_COMPILE_ZLIB
-#ifdef LODEPNG_COMPILE_ENCODER
-
-typedef struct vector /*dynamic vector of void* pointers. This one is used only by the deflate compressor*/
-{
-  void* data;
-  size_t size; /*in groups of bytes depending on type*/
-  size_t allocsize; /*in bytes*/
-  unsigned typesize; /*sizeof the type you store in data*/
-} vector;
-
-static unsigned vector_resize(vector* p, size_t size) /*returns 1 if success, 0 if failure ==> nothing done*/
-{
-  if(size * p->typesize > p->allocsize)
-  {
-    size_t newsize = size * p->typesize * 2;
-    void* data = realloc(p->data, newsize);
-    if(data)
-    {
-      p->allocsize = newsize;
-      p->data = data;
-      p->size = size;
-    }
-    else return 0;
-  }
-  else p->size = size;
-  return 1;
-}
-
-static unsigned vector_resized(vector* p, size_t size, void dtor(void*)) /*resize and use destructor on elements if it gets smaller*/
-{
-  size_t i;
-  if(size < p->size)
-  {
-    for(i = size; i < p->size; i++)
-    {
-      dtor(&((char*)(p->data))[i * p->typesize]);
-    }
-  }
-  return vector_resize(p, size);
-}
-
-static void vector_cleanup(void* p)
-{
-  ((vector*)p)->size = ((vector*)p)->allocsize = 0;
-  free(((vector*)p)->data);
-  ((vector*)p)->data = NULL;
-}
-
-static void vector_cleanupd(vector* p, void dtor(void*)) /*clear and use destructor on elements*/
-{
-  vector_resized(p, 0, dtor);
-  vector_cleanup(p);
-}
-
-static void vector_init(vector* p, unsigned typesize)
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+void* lodepng_malloc(size_t size)
 {
-  p->data = NULL;
-  p->size = p->allocsize = 0;
-  p->typesize = typesize;
+  return malloc(size);
 }
 
-static void vector_swap(vector* p, vector* q) /*they're supposed to have the same typesize*/
+void* lodepng_realloc(void* ptr, size_t new_size)
 {
-  size_t tmp;
-  void* tmpp;
-  tmp = p->size; p->size = q->size; q->size = tmp;
-  tmp = p->allocsize; p->allocsize = q->allocsize; q->allocsize = tmp;
-  tmpp = p->data; p->data = q->data; q->data = tmpp;
+  return realloc(ptr, new_size);
 }
 
-static void* vector_get(vector* p, size_t index)
+void lodepng_free(void* ptr)
 {
-  return &((char*)p->data)[index * p->typesize];
+  free(ptr);
 }
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
-#endif /*LODEPNG_COMPILE_ENCODER*/
-#endif /*LODEPNG_COMPILE_ZLIB*/
+/*
+About these tools (uivector, ucvector and string):
+-LodePNG was originally written in C++. The vectors replace the std::vectors that were used in the C++ version.
+-The string tools are made to avoid problems with compilers that declare things like strncat as deprecated.
+-They're not used in the interface, only internally in this file, so all their functions are made static.
+*/
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
@@ -163,7 +108,7 @@ typedef struct uivector
 static void uivector_cleanup(void* p)
 {
   ((uivector*)p)->size = ((uivector*)p)->allocsize = 0;
-  free(((uivector*)p)->data);
+  lodepng_free(((uivector*)p)->data);
   ((uivector*)p)->data = NULL;
 }
 
@@ -173,7 +118,7 @@ static unsigned uivector_resize(uivector* p, size_t size)
   if(size * sizeof(unsigned) > p->allocsize)
   {
     size_t newsize = size * sizeof(unsigned) * 2;
-    void* data = realloc(p->data, newsize);
+    void* data = lodepng_realloc(p->data, newsize);
     if(data)
     {
       p->allocsize = newsize;
@@ -210,23 +155,6 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   return 1;
 }
 
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i < q->size; i++) p->data[i] = q->data[i];
-  return 1;
-}
-
-static void uivector_swap(uivector* p, uivector* q)
-{
-  size_t tmp;
-  unsigned* tmpp;
-  tmp = p->size; p->size = q->size; q->size = tmp;
-  tmp = p->allocsize; p->allocsize = q->allocsize; q->allocsize = tmp;
-  tmpp = p->data; p->data = q->data; q->data = tmpp;
-}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -243,7 +171,7 @@ typedef struct ucvector
 static void ucvector_cleanup(void* p)
 {
   ((ucvector*)p)->size = ((ucvector*)p)->allocsize = 0;
-  free(((ucvector*)p)->data);
+  lodepng_free(((ucvector*)p)->data);
   ((ucvector*)p)->data = NULL;
 }
 
@@ -253,7 +181,7 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
   if(size * sizeof(unsigned char) > p->allocsize)
   {
     size_t newsize = size * sizeof(unsigned char) * 2;
-    void* data = realloc(p->data, newsize);
+    void* data = lodepng_realloc(p->data, newsize);
     if(data)
     {
       p->allocsize = newsize;
@@ -279,6 +207,21 @@ static unsigned ucvector_resizev(ucvector* p, size_t size, unsigned char value)
 #endif /*LODEPNG_COMPILE_PNG*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*makes room for at least allocsize elements without changing the size. returns 1 if success, 0 if failure ==> nothing done*/
+static unsigned ucvector_reserve(ucvector* p, size_t allocsize)
+{
+  if(allocsize * sizeof(unsigned char) > p->allocsize)
+  {
+    void* data = lodepng_realloc(p->data, allocsize * sizeof(unsigned char));
+    if(!data) return 0;
+    p->allocsize = allocsize * sizeof(unsigned char);
+    p->data = (unsigned char*)data;
+  }
+  return 1;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 static void ucvector_init(ucvector* p)
 {
   p->data = NULL;
@@ -309,7 +252,7 @@ static unsigned ucvector_push_back(ucvector* p, unsigned char c)
 /*returns 1 if success, 0 if failure ==> nothing done*/
 static unsigned string_resize(char** out, size_t size)
 {
-  char* data = (char*)realloc(*out, size + 1);
+  char* data = (char*)lodepng_realloc(*out, size + 1);
   if(data)
   {
     data[size] = 0; /*null termination char*/
@@ -328,7 +271,7 @@ static void string_init(char** out)
 /*free the above pair again*/
 static void string_cleanup(char** out)
 {
-  free(*out);
+  lodepng_free(*out);
   *out = NULL;
 }
 
@@ -353,24 +296,64 @@ static void string_set(char** out, const char* in)
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_ENCODER
-/*TODO: this ignores potential out of memory errors*/
-static void addBitToStream(size_t* bitpointer, ucvector* bitstream, unsigned char bit)
+/*
+Writes bits to the end of out, least significant bit first, as deflate needs them. Bits gather in a
+64-bit accumulator and go out 4 bytes at a time, so writing a value costs a shift and an OR. Room for
+the bytes has to be made beforehand with BitWriter_reserve; writing itself never checks. Only the
+bytes of out up to out->size are final, the rest are still in the accumulator.
+*/
+typedef struct BitWriter
 {
-  if((*bitpointer) % 8 == 0) ucvector_push_back(bitstream, (unsigned char)0); /*add a new byte at the end*/
-  (bitstream->data[bitstream->size - 1]) |= (bit << ((*bitpointer) & 0x7)); /*earlier bit of huffman code is in a lesser significant bit of an earlier byte*/
-  (*bitpointer)++;
+  ucvector* out;
+  unsigned long long buffer; /*bits not yet in out, the first one in the least significant bit*/
+  unsigned numbits; /*number of bits in buffer, always less than 32 between writes*/
+} BitWriter;
+
+static void BitWriter_init(BitWriter* writer, ucvector* out)
+{
+  writer->out = out;
+  writer->buffer = 0;
+  writer->numbits = 0;
 }
 
-static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+/*makes sure there's room in out for nbits more bits and the padding after them. returns 1 if success, 0 if failure*/
+static unsigned BitWriter_reserve(BitWriter* writer, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  size_t needed = writer->out->size + (writer->numbits + nbits + 7) / 8;
+  if(needed <= writer->out->allocsize) return 1;
+  /*grow geometrically, so that reserving block after block doesn't copy the output over and over*/
+  if(needed < writer->out->allocsize * 2) needed = writer->out->allocsize * 2;
+  return ucvector_reserve(writer->out, needed);
 }
 
-static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+/*writes the lowest nbits bits of value, which mustn't have any higher bits set. nbits can be up to 32*/
+static void BitWriter_write(BitWriter* writer, unsigned value, unsigned nbits)
 {
-  size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  writer->buffer |= (unsigned long long)value << writer->numbits;
+  writer->numbits += nbits;
+  if(writer->numbits >= 32)
+  {
+    unsigned char* p = &writer->out->data[writer->out->size];
+    p[0] = (unsigned char)(writer->buffer);
+    p[1] = (unsigned char)(writer->buffer >> 8);
+    p[2] = (unsigned char)(writer->buffer >> 16);
+    p[3] = (unsigned char)(writer->buffer >> 24);
+    writer->out->size += 4;
+    writer->buffer >>= 32;
+    writer->numbits -= 32;
+  }
+}
+
+/*writes out what's left in the accumulator, padding the last byte with 0 bits, so the next write starts at a byte boundary*/
+static void BitWriter_flush(BitWriter* writer)
+{
+  while(writer->numbits > 0)
+  {
+    writer->out->data[writer->out->size++] = (unsigned char)writer->buffer;
+    writer->buffer >>= 8;
+    writer->numbits = writer->numbits > 8 ? writer->numbits - 8 : 0;
+  }
+  writer->buffer = 0;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -406,6 +389,7 @@ static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bits
 #define NUM_DEFLATE_CODE_SYMBOLS 288 /*256 literals, the end code, some length codes, and 2 unused codes*/
 #define NUM_DISTANCE_SYMBOLS 32 /*the distance codes have their own symbols, 30 used, 2 unused*/
 #define NUM_CODE_LENGTH_CODES 19 /*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros*/
+#define MAX_HUFFMAN_BITLEN 15 /*the longest code deflate allows*/
 
 /*the base lengths represented by codes 257-285*/
 static const unsigned LENGTHBASE[29]
@@ -429,71 +413,6 @@ static const unsigned CLCL_ORDER[NUM_CODE_LENGTH_CODES]
 
 /* ////////////////////////////////////////////////////////////////////////// */
 
-#ifdef LODEPNG_COMPILE_ENCODER
-/*
-A coin, this is the terminology used for the package-merge algorithm and the
-coin collector's problem. This is used to generate the huffman tree.
-A coin can be multiple coins (when they're merged)
-*/
-typedef struct Coin
-{
-  uivector symbols;
-  float weight; /*the sum of all weights in this coin*/
-} Coin;
-
-static void Coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
-
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void Coin_cleanup(void* c)
-{
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
-
-static void Coin_copy(Coin* c1, const Coin* c2)
-{
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
-}
-
-static void addCoins(Coin* c1, const Coin* c2)
-{
-  size_t i;
-  for(i = 0; i < c2->symbols.size; i++) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
-}
-
-/*
-Coin_sort: This uses a simple combsort to sort the data. This function is not critical for
-overall encoding speed and the data amount isn't that large.
-*/
-static void Coin_sort(Coin* data, size_t amount)
-{
-  size_t gap = amount;
-  unsigned char swapped = 0;
-  while((gap > 1) || swapped)
-  {
-    size_t i;
-    gap = (gap * 10) / 13; /*shrink factor 1.3*/
-    if(gap == 9 || gap == 10) gap = 11; /*combsort11*/
-    if(gap < 1) gap = 1;
-    swapped = 0;
-    for(i = 0; i < amount - gap; i++)
-    {
-      size_t j = i + gap;
-      if(data[j].weight < data[i].weight)
-      {
-        float temp = data[j].weight; data[j].weight = data[i].weight; data[i].weight = temp;
-        uivector_swap(&data[i].symbols, &data[j].symbols);
-        swapped = 1;
-      }
-    }
-  }
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
 /*
 Huffman tree struct, containing multiple representations of the tree
 */
@@ -590,38 +509,41 @@ static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
 }
 
 /*
-HuffmanTree_makeFromLengths2
-numcodes, lengths and maxbitlen must already be filled in correctly.
+HuffmanTree_makeCodes
+generate the canonical codes in tree1d from the lengths. numcodes, lengths and maxbitlen must already be
+filled in correctly.
 return value is error.
 */
-static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
+static unsigned HuffmanTree_makeCodes(HuffmanTree* tree)
 {
-  uivector blcount;
-  uivector nextcode;
-  unsigned bits, n, error = 0;
+  unsigned blcount[MAX_HUFFMAN_BITLEN + 1];
+  unsigned nextcode[MAX_HUFFMAN_BITLEN + 1];
+  unsigned bits, n;
 
-  uivector_init(&blcount);
-  uivector_init(&nextcode);
-  if(!uivector_resize(&tree->tree1d, tree->numcodes)
-  || !uivector_resizev(&blcount, tree->maxbitlen + 1, 0)
-  || !uivector_resizev(&nextcode, tree->maxbitlen + 1, 0))
-    error = 9902; /*alloc fail*/
+  if(tree->maxbitlen > MAX_HUFFMAN_BITLEN) return 9902;
+  if(!uivector_resize(&tree->tree1d, tree->numcodes)) return 9902; /*alloc fail*/
+  for(bits = 0; bits <= tree->maxbitlen; bits++) blcount[bits] = nextcode[bits] = 0;
 
-  if(!error)
-  {
-    /*step 1: count number of instances of each code length*/
-    for(bits = 0; bits < tree->numcodes; bits++) blcount.data[tree->lengths.data[bits]]++;
-    /*step 2: generate the nextcode values*/
-    for(bits = 1; bits <= tree->maxbitlen; bits++) nextcode.data[bits] = (nextcode.data[bits - 1] + blcount.data[bits - 1]) << 1;
-    /*step 3: generate all the codes*/
-    for(n = 0; n < tree->numcodes; n++) if(tree->lengths.data[n] != 0) tree->tree1d.data[n] = nextcode.data[tree->lengths.data[n]]++;
-  }
+  /*step 1: count number of instances of each code length*/
+  for(bits = 0; bits < tree->numcodes; bits++) blcount[tree->lengths.data[bits]]++;
+  /*step 2: generate the nextcode values*/
+  for(bits = 1; bits <= tree->maxbitlen; bits++) nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+  /*step 3: generate all the codes*/
+  for(n = 0; n < tree->numcodes; n++) if(tree->lengths.data[n] != 0) tree->tree1d.data[n] = nextcode[tree->lengths.data[n]]++;
 
-  uivector_cleanup(&blcount);
-  uivector_cleanup(&nextcode);
+  return 0;
+}
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+/*
+HuffmanTree_makeFromLengths2
+numcodes, lengths and maxbitlen must already be filled in correctly.
+return value is error.
+*/
+static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
+{
+  unsigned error = HuffmanTree_makeCodes(tree);
+  if(!error) error = HuffmanTree_make2DTree(tree);
+  return error;
 }
 
 /*
@@ -641,119 +563,172 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
-static unsigned HuffmanTree_fillInCoins(vector* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
+/*
+Huffman codes are written starting from their most significant bit, but everything else in deflate starts
+from the least significant one. The encoder reverses the bits of its codes once, when making the tree,
+so that writing a symbol is the same as writing any other value.
+*/
+static void HuffmanTree_reverseCodes(HuffmanTree* tree)
 {
-  unsigned i;
-  for(i = 0; i < numcodes; i++)
+  unsigned n, i;
+  for(n = 0; n < tree->numcodes; n++)
+  {
+    unsigned code = tree->tree1d.data[n], reversed = 0;
+    for(i = 0; i < tree->lengths.data[n]; i++) reversed |= ((code >> i) & 1) << (tree->lengths.data[n] - 1 - i);
+    tree->tree1d.data[n] = reversed;
+  }
+}
+
+/*the encoder only writes codes, so its trees get reversed codes and no 2D tree*/
+static unsigned HuffmanTree_makeReversedCodes(HuffmanTree* tree)
+{
+  unsigned error = HuffmanTree_makeCodes(tree);
+  if(!error) HuffmanTree_reverseCodes(tree);
+  return error;
+}
+
+/*
+Sort the symbols present by frequency, least frequent first, ties by symbol so the codes don't depend on how
+the sort goes. A combsort: there are a few hundred symbols at most.
+*/
+static void sortByFrequency(unsigned* symbols, size_t amount, const unsigned* frequencies)
+{
+  size_t gap = amount;
+  unsigned char swapped = 0;
+  while((gap > 1) || swapped)
   {
-    Coin* coin;
-    if(frequencies[i] == 0) continue; /*it's important to exclude symbols that aren't present*/
-    if(!vector_resize(coins, coins->size + 1))
+    size_t i;
+    gap = (gap * 10) / 13; /*shrink factor 1.3*/
+    if(gap == 9 || gap == 10) gap = 11; /*combsort11*/
+    if(gap < 1) gap = 1;
+    swapped = 0;
+    for(i = 0; i + gap < amount; i++)
     {
-      vector_cleanup(coins);
-      return 9904; /*alloc fail*/
+      unsigned a = symbols[i], b = symbols[i + gap];
+      if(frequencies[b] < frequencies[a] || (frequencies[b] == frequencies[a] && b < a))
+      {
+        symbols[i] = b; symbols[i + gap] = a;
+        swapped = 1;
+      }
     }
-    coin = (Coin*)(vector_get(coins, coins->size - 1));
-    Coin_init(coin);
-    coin->weight = frequencies[i] / (float)sum;
-    uivector_push_back(&coin->symbols, i);
   }
-  if(coins->size) Coin_sort((Coin*)coins->data, coins->size);
-  return 0;
 }
 
 /*
-HuffmanTree_makeFromFrequencies
-Create the Huffman tree given the symbol frequencies
+Turn the weights in A, n >= 2 of them in increasing order, into the lengths of a minimum redundancy code
+for them, longest first, in place: Moffat and Katajainen, "In-Place Calculation of Minimum-Redundancy Codes".
+The first pass builds the Huffman tree with the parent of each internal node where its weight was, the
+second turns those into the depths of the internal nodes and the third hands out the leaves, deepest first.
 */
-static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigned* frequencies, size_t numcodes, unsigned maxbitlen)
+static void minimumRedundancyLengths(unsigned* A, size_t n)
 {
-  unsigned i, j;
-  size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
+  size_t root, leaf, next, avbl, used, depth;
 
-  vector prev_row; /*type Coin, the previous row of coins*/
-  vector coins; /*type Coin, the coins of the currently calculated row*/
+  A[0] += A[1];
+  root = 0;
+  leaf = 2;
+  for(next = 1; next + 1 < n; next++)
+  {
+    /*the first node of the pair, an internal node or a leaf, whichever weighs less*/
+    if(leaf >= n || A[root] < A[leaf]) { A[next] = A[root]; A[root++] = (unsigned)next; }
+    else A[next] = A[leaf++];
+    /*and the second*/
+    if(leaf >= n || (root < next && A[root] < A[leaf])) { A[next] += A[root]; A[root++] = (unsigned)next; }
+    else A[next] += A[leaf++];
+  }
 
-  tree->maxbitlen = maxbitlen;
+  A[n - 2] = 0;
+  for(next = n - 2; next-- > 0;) A[next] = A[A[next]] + 1;
 
-  for(i = 0; i < numcodes; i++)
+  avbl = 1;
+  used = depth = 0;
+  root = n - 1; /*one past the internal node being looked at, they're counted down*/
+  next = n; /*and one past the leaf to be given a length*/
+  while(avbl > 0)
   {
-    if(frequencies[i] > 0)
-    {
-      numpresent++;
-      sum += frequencies[i];
-    }
+    while(root > 0 && A[root - 1] == depth) { used++; root--; }
+    while(avbl > used) { A[--next] = (unsigned)depth; avbl--; }
+    avbl = 2 * used;
+    depth++;
+    used = 0;
   }
+}
+
+/*
+HuffmanTree_makeFromFrequencies
+Create the Huffman tree given the symbol frequencies, with bit reversed codes for the encoder. No code is
+made longer than maxbitlen, at most 15.
+
+The lengths of a Huffman code come from minimumRedundancyLengths, on the stack. Where that makes codes
+too long, they are limited as zlib and miniz do: the ones too long are cut to maxbitlen and, to make the
+lengths a prefix code again, codes are taken from the longest lengths by lengthening a shorter code. That is
+not always quite optimal, unlike package-merge, but it is only needed for skewed frequencies and it takes
+microseconds rather than a heap full of coins.
+*/
+static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigned* frequencies, size_t numcodes, unsigned maxbitlen)
+{
+  unsigned symbols[NUM_DEFLATE_CODE_SYMBOLS]; /*the symbols present, least frequent first*/
+  unsigned lengths[NUM_DEFLATE_CODE_SYMBOLS]; /*their weights, then the lengths of their codes*/
+  unsigned blcount[MAX_HUFFMAN_BITLEN + 1];
+  size_t i, numpresent = 0;
+  unsigned bits, kraft;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
+  if(numcodes > NUM_DEFLATE_CODE_SYMBOLS || maxbitlen > MAX_HUFFMAN_BITLEN) return 9902;
+  tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   uivector_resize(&tree->lengths, 0);
   if(!uivector_resizev(&tree->lengths, tree->numcodes, 0)) return 9905;
 
+  for(i = 0; i < numcodes; i++) if(frequencies[i] > 0) symbols[numpresent++] = (unsigned)i;
+
   if(numpresent == 0) /*there are no symbols at all, in that case add one symbol of value 0 to the tree (see RFC 1951 section 3.2.7) */
   {
     tree->lengths.data[0] = 1;
-    return HuffmanTree_makeFromLengths2(tree);
+    return HuffmanTree_makeReversedCodes(tree);
   }
-  else if(numpresent == 1) /*the package merge algorithm gives wrong results if there's only one symbol (theoretically 0 bits would then suffice, but we need a proper symbol for zlib)*/
+  else if(numpresent == 1) /*theoretically 0 bits would then suffice, but we need a proper symbol for zlib*/
   {
-    for(i = 0; i < numcodes; i++) if(frequencies[i]) tree->lengths.data[i] = 1;
-    return HuffmanTree_makeFromLengths2(tree);
+    tree->lengths.data[symbols[0]] = 1;
+    return HuffmanTree_makeReversedCodes(tree);
   }
 
-  vector_init(&coins, sizeof(Coin));
-  vector_init(&prev_row, sizeof(Coin));
+  sortByFrequency(symbols, numpresent, frequencies);
+  for(i = 0; i < numpresent; i++) lengths[i] = frequencies[symbols[i]];
+  minimumRedundancyLengths(lengths, numpresent);
 
-  /*Package-Merge algorithm represented by coin collector's problem
-  For every symbol, maxbitlen coins will be created*/
+  /*count the codes of each length, the ones too long as maxbitlen*/
+  for(bits = 0; bits <= maxbitlen; bits++) blcount[bits] = 0;
+  for(i = 0; i < numpresent; i++) blcount[lengths[i] < maxbitlen ? lengths[i] : maxbitlen]++;
 
-  /*first row, lowest denominator*/
-  error = HuffmanTree_fillInCoins(&coins, frequencies, tree->numcodes, sum);
-  if(!error)
+  /*kraft is the space the codes take up, in codes of maxbitlen bits; while they take too much, make a code of
+  maxbitlen bits go and lengthen a shorter one, which makes room for it*/
+  kraft = 0;
+  for(bits = 1; bits <= maxbitlen; bits++) kraft += blcount[bits] << (maxbitlen - bits);
+  while(kraft > (1u << maxbitlen))
   {
-    for(j = 1; j <= maxbitlen && !error; j++) /*each of the remaining rows*/
+    blcount[maxbitlen]--;
+    for(bits = maxbitlen - 1; bits > 0; bits--)
     {
-      vector_swap(&coins, &prev_row); /*swap instead of copying*/
-      if(!vector_resized(&coins, 0, Coin_cleanup)) ERROR_BREAK(9906 /*alloc fail*/);
-      for(i = 0; i + 1 < prev_row.size; i += 2)
-      {
-        if(!vector_resize(&coins, coins.size + 1)) ERROR_BREAK(9907 /*alloc fail*/);
-        Coin_init((Coin*)vector_get(&coins, coins.size - 1));
-        Coin_copy((Coin*)vector_get(&coins, coins.size - 1), (Coin*)vector_get(&prev_row, i));
-        addCoins((Coin*)vector_get(&coins, coins.size - 1), (Coin*)vector_get(&prev_row, i + 1)); /*merge the coins into packages*/
-      }
-      if(j < maxbitlen)
+      if(blcount[bits])
       {
-        error = HuffmanTree_fillInCoins(&coins, frequencies, tree->numcodes, sum);
+        blcount[bits]--;
+        blcount[bits + 1] += 2;
+        break;
       }
     }
+    kraft--;
   }
 
-  if(!error)
+  /*the least frequent symbols get the longest codes*/
+  i = 0;
+  for(bits = maxbitlen; bits > 0; bits--)
   {
-    /*keep the coins with lowest weight, so that they add up to the amount of symbols - 1*/
-    vector_resized(&coins, numpresent - 1, Coin_cleanup);
-
-    /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
-    for(i = 0; i < coins.size; i++)
-    {
-      Coin* coin = (Coin*)vector_get(&coins, i);
-      for(j = 0; j < coin->symbols.size; j++) tree->lengths.data[coin->symbols.data[j]]++;
-    }
-
-    error = HuffmanTree_makeFromLengths2(tree);
+    unsigned j;
+    for(j = 0; j < blcount[bits]; j++) tree->lengths.data[symbols[i++]] = bits;
   }
 
-  vector_cleanupd(&coins, Coin_cleanup);
-  vector_cleanupd(&prev_row, Coin_cleanup);
-
-  return error;
-}
-
-static unsigned HuffmanTree_getCode(const HuffmanTree* tree, unsigned index)
-{
-  return tree->tree1d.data[index];
+  return HuffmanTree_makeReversedCodes(tree);
 }
 
 static unsigned HuffmanTree_getLength(const HuffmanTree* tree, unsigned index)
@@ -765,42 +740,27 @@ static unsigned HuffmanTree_getLength(const HuffmanTree* tree, unsigned index)
 /*get the literal and length code tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static unsigned generateFixedLitLenTree(HuffmanTree* tree)
 {
-  unsigned i, error = 0;
-  uivector bitlen;
-  uivector_init(&bitlen);
-  if(!uivector_resize(&bitlen, NUM_DEFLATE_CODE_SYMBOLS)) error = 9909;
-
-  if(!error)
-  {
-    /*288 possible codes: 0-255=literals, 256=endcode, 257-285=lengthcodes, 286-287=unused*/
-    for(i =   0; i <= 143; i++) bitlen.data[i] = 8;
-    for(i = 144; i <= 255; i++) bitlen.data[i] = 9;
-    for(i = 256; i <= 279; i++) bitlen.data[i] = 7;
-    for(i = 280; i <= 287; i++) bitlen.data[i] = 8;
+  unsigned i;
+  unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
 
-    error = HuffmanTree_makeFromLengths(tree, bitlen.data, NUM_DEFLATE_CODE_SYMBOLS, 15);
-  }
+  /*288 possible codes: 0-255=literals, 256=endcode, 257-285=lengthcodes, 286-287=unused*/
+  for(i =   0; i <= 143; i++) bitlen[i] = 8;
+  for(i = 144; i <= 255; i++) bitlen[i] = 9;
+  for(i = 256; i <= 279; i++) bitlen[i] = 7;
+  for(i = 280; i <= 287; i++) bitlen[i] = 8;
 
-  uivector_cleanup(&bitlen);
-  return error;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
 }
 
 /*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 {
-  unsigned i, error = 0;
-  uivector bitlen;
-  uivector_init(&bitlen);
-  if(!uivector_resize(&bitlen, NUM_DISTANCE_SYMBOLS)) error = 9910;
+  unsigned i;
+  unsigned bitlen[NUM_DISTANCE_SYMBOLS];
 
   /*there are 32 distance codes, but 30-31 are unused*/
-  if(!error)
-  {
-    for(i = 0; i < NUM_DISTANCE_SYMBOLS; i++) bitlen.data[i] = 5;
-    error = HuffmanTree_makeFromLengths(tree, bitlen.data, NUM_DISTANCE_SYMBOLS, 15);
-  }
-  uivector_cleanup(&bitlen);
-  return error;
+  for(i = 0; i < NUM_DISTANCE_SYMBOLS; i++) bitlen[i] = 5;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
 }
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -1155,49 +1115,103 @@ unsigned LodeFlate_inflate(ucvector* out, const unsigned char* in, size_t insize
 
 static const size_t MAX_SUPPORTED_DEFLATE_LENGTH = 258;
 
-/*bitlen is the size in bits of the code*/
-static void addHuffmanSymbol(size_t* bp, ucvector* compressed, unsigned code, unsigned bitlen)
-{
-  addBitsToStreamReversed(bp, compressed, code, bitlen);
-}
+/*the codes of the encoder's trees are stored bit reversed (see HuffmanTree_reverseCodes), ready to be written as they are*/
+static void addHuffmanSymbol(BitWriter* writer, const HuffmanTree* tree, unsigned symbol)
+{
+  BitWriter_write(writer, tree->tree1d.data[symbol], tree->lengths.data[symbol]);
+}
+
+/*the codes of the fixed lit/len tree (see generateFixedLitLenTree), bit reversed like the encoder's other codes*/
+static const unsigned FIXED_LITLEN_CODES[NUM_DEFLATE_CODE_SYMBOLS] = {
+    12, 140,  76, 204,  44, 172, 108, 236,  28, 156,  92, 220,  60, 188, 124, 252,   2, 130,  66, 194,  34, 162,  98, 226,
+    18, 146,  82, 210,  50, 178, 114, 242,  10, 138,  74, 202,  42, 170, 106, 234,  26, 154,  90, 218,  58, 186, 122, 250,
+     6, 134,  70, 198,  38, 166, 102, 230,  22, 150,  86, 214,  54, 182, 118, 246,  14, 142,  78, 206,  46, 174, 110, 238,
+    30, 158,  94, 222,  62, 190, 126, 254,   1, 129,  65, 193,  33, 161,  97, 225,  17, 145,  81, 209,  49, 177, 113, 241,
+     9, 137,  73, 201,  41, 169, 105, 233,  25, 153,  89, 217,  57, 185, 121, 249,   5, 133,  69, 197,  37, 165, 101, 229,
+    21, 149,  85, 213,  53, 181, 117, 245,  13, 141,  77, 205,  45, 173, 109, 237,  29, 157,  93, 221,  61, 189, 125, 253,
+    19, 275, 147, 403,  83, 339, 211, 467,  51, 307, 179, 435, 115, 371, 243, 499,  11, 267, 139, 395,  75, 331, 203, 459,
+    43, 299, 171, 427, 107, 363, 235, 491,  27, 283, 155, 411,  91, 347, 219, 475,  59, 315, 187, 443, 123, 379, 251, 507,
+     7, 263, 135, 391,  71, 327, 199, 455,  39, 295, 167, 423, 103, 359, 231, 487,  23, 279, 151, 407,  87, 343, 215, 471,
+    55, 311, 183, 439, 119, 375, 247, 503,  15, 271, 143, 399,  79, 335, 207, 463,  47, 303, 175, 431, 111, 367, 239, 495,
+    31, 287, 159, 415,  95, 351, 223, 479,  63, 319, 191, 447, 127, 383, 255, 511,   0,  64,  32,  96,  16,  80,  48, 112,
+     8,  72,  40, 104,  24,  88,  56, 120,   4,  68,  36, 100,  20,  84,  52, 116,   3, 131,  67, 195,  35, 163,  99, 227};
+
+static const unsigned FIXED_LITLEN_LENGTHS[NUM_DEFLATE_CODE_SYMBOLS] = {
+   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+   9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+   9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+   9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8};
+
+/*the codes of the fixed distance tree, 5 bits each, bit reversed*/
+static const unsigned FIXED_DISTANCE_CODES[NUM_DISTANCE_SYMBOLS] = {
+    0, 16,  8, 24,  4, 20, 12, 28,  2, 18, 10, 26,  6, 22, 14, 30,  1, 17,  9, 25,  5, 21, 13, 29,  3, 19, 11, 27,  7, 23, 15, 31};
+
+static const unsigned FIXED_DISTANCE_LENGTHS[NUM_DISTANCE_SYMBOLS] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5};
+
+/*the index into LENGTHBASE of the code for each length from 3 to 258 (the first 3 entries are unused)*/
+static const unsigned char LENGTH_CODE[259] = {
+     0,  0,  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9, 10, 10, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15,
+    15, 15, 15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19,
+    19, 19, 19, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    23, 23, 23, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 28};
 
-/*search the index in the array, that has the largest value smaller than or equal to the given value, given array must be sorted (if no value is smaller, it returns the size of the given array)*/
-static size_t searchCodeIndex(const unsigned* array, size_t array_size, size_t value)
-{
-  /*linear search implementation*/
-  /*for(size_t i = 1; i < array_size; i++) if(array[i] > value) return i - 1;
-  return array_size - 1;*/
+/*
+the index into DISTANCEBASE of the code for a distance d: DISTANCE_CODE[d - 1] for distances up to 256, and
+DISTANCE_CODE[256 + ((d - 1) >> 7)] for longer ones, which is the same for every distance in a run of 128
+*/
+static const unsigned char DISTANCE_CODE[512] = {
+     0,  1,  2,  3,  4,  4,  5,  5,  6,  6,  6,  6,  7,  7,  7,  7,  8,  8,  8,  8,  8,  8,  8,  8,  9,  9,  9,  9,  9,  9,  9,  9,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+    13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+     0, 14, 16, 17, 18, 18, 19, 19, 20, 20, 20, 20, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29};
 
-  /*binary search implementation (not that much faster) (precondition: array_size > 0)*/
-  size_t left  = 1;
-  size_t right = array_size - 1;
-  while(left <= right)
-  {
-    size_t mid = (left + right) / 2;
-    if(array[mid] <= value) left = mid + 1; /*the value to find is more to the right*/
-    else if(array[mid - 1] > value) right = mid - 1; /*the value to find is more to the left*/
-    else return mid - 1;
-  }
-  return array_size - 1;
+/*
+The LZ77 encoded data is a stream of 32-bit tokens, one for each literal byte and one for each
+length/distance pair, with everything needed to write it as deflate symbols already worked out:
+bits 0-8: the lit/len symbol: 0-255 a literal byte, 257-285 a length code
+bits 9-13: the extra length bits, for a length code
+bits 14-18: the distance code, for a length code
+bits 19-31: the extra distance bits, for a length code
+*/
+#define LZ77_SYMBOL(token) ((token) & 511)
+#define LZ77_LENGTH_EXTRA(token) (((token) >> 9) & 31)
+#define LZ77_DISTANCE_CODE(token) (((token) >> 14) & 31)
+#define LZ77_DISTANCE_EXTRA(token) ((token) >> 19)
+
+/*the distance code for a distance from 1 to 32768*/
+static unsigned getDistanceCode(size_t distance)
+{
+  return distance <= 256 ? DISTANCE_CODE[distance - 1] : DISTANCE_CODE[256 + ((distance - 1) >> 7)];
 }
 
 static void addLengthDistance(uivector* values, size_t length, size_t distance)
 {
-  /*values in encoded vector are those used by deflate:
-  0-255: literal bytes
-  256: end
-  257-285: length/distance pair (length code, followed by extra length bits, distance code, extra distance bits)
-  286-287: invalid*/
-
-  unsigned length_code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
+  unsigned length_code = LENGTH_CODE[length];
   unsigned extra_length = (unsigned)(length - LENGTHBASE[length_code]);
-  unsigned dist_code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
+  unsigned dist_code = getDistanceCode(distance);
   unsigned extra_distance = (unsigned)(distance - DISTANCEBASE[dist_code]);
 
-  uivector_push_back(values, length_code + FIRST_LENGTH_CODE_INDEX);
-  uivector_push_back(values, extra_length);
-  uivector_push_back(values, dist_code);
-  uivector_push_back(values, extra_distance);
+  uivector_push_back(values, (length_code + FIRST_LENGTH_CODE_INDEX) | (extra_length << 9) | (dist_code << 14) | (extra_distance << 19));
 }
 
 #if 0
@@ -1261,6 +1275,10 @@ making HASH_NUM_CHARACTERS larger (like 8), makes the file size larger but is a
 making HASH_NUM_CHARACTERS smaller (like 3), makes the file size smaller but is slower
 */
 
+/*
+Hash of the HASH_NUM_CHARACTERS bytes at pos (fewer near the end). It is not yet reduced
+modulo HASH_NUM_VALUES, so that updateHash can roll it along to the next position.
+*/
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
 {
   unsigned result = 0;
@@ -1269,183 +1287,629 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
   amount = HASH_NUM_CHARACTERS;
   if(pos + amount >= size) amount = size - pos;
   for(i = 0; i < amount; i++) result ^= (data[pos + i] << (i * HASH_SHIFT));
-  return result % HASH_NUM_VALUES;
+  return result;
 }
 
-static unsigned countInitialZeros(const unsigned char* data, size_t size, size_t pos)
+/*
+Given hash == getHash(data, size, pos), return getHash(data, size, pos + 1): the byte at pos is
+the only one not shifted, so it can be xored out and the rest shifted down one place.
+*/
+static unsigned updateHash(unsigned hash, const unsigned char* data, size_t size, size_t pos)
 {
-  size_t max_count = MAX_SUPPORTED_DEFLATE_LENGTH;
-  size_t i;
-  if(max_count > size - pos) max_count = size - pos;
-  for(i = 0; i < max_count; i++)
-  {
-    if(data[pos + i] != 0)
-      return i;
-  }
-  return max_count;
+  hash = (hash ^ data[pos]) >> HASH_SHIFT;
+  if(pos + HASH_NUM_CHARACTERS < size) hash ^= data[pos + HASH_NUM_CHARACTERS] << ((HASH_NUM_CHARACTERS - 1) * HASH_SHIFT);
+  return hash;
 }
 
-/*LZ77-encode the data using a hash table technique to let it encode faster. Return value is error code*/
-static unsigned encodeLZ77(uivector* out, const unsigned char* in, size_t insize, unsigned windowSize)
+/*
+The number of zeros starting at pos, at most the maximum deflate length. *zerosend is where the
+last run of zeros found ends, so each run is only scanned once however many positions it covers.
+*/
+static unsigned countInitialZeros(const unsigned char* data, size_t size, size_t pos, size_t* zerosend)
 {
-  /**generate hash table**/
-  vector table; /*HASH_NUM_VALUES uivectors; this represents what would be an std::vector<std::vector<unsigned> > in C++*/
-  uivector tablepos1, tablepos2;
-  uivector initialZerosTable; /*hash == 0 indicates a possible common case of a long sequence of zeros, store and use the amount here for a speedup*/
-  unsigned pos, i, error = 0;
-
-  vector_init(&table, sizeof(uivector));
-  if(!vector_resize(&table, HASH_NUM_VALUES)) return 9917;
-  for(i = 0; i < HASH_NUM_VALUES; i++)
+  if(*zerosend <= pos)
   {
-    uivector* v = (uivector*)vector_get(&table, i);
-    uivector_init(v);
+    *zerosend = pos;
+    while(*zerosend < size && data[*zerosend] == 0) (*zerosend)++;
   }
+  return (unsigned)(*zerosend - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? *zerosend - pos : MAX_SUPPORTED_DEFLATE_LENGTH);
+}
 
-  /*remember start and end positions in the tables to search in*/
-  uivector_init(&tablepos1);
-  uivector_init(&tablepos2);
-  uivector_init(&initialZerosTable);
+/*
+The hash chains of encodeLZ77, as zlib keeps them: head holds the most recent position with each
+hash value and prev links every position to the one before it with the same hash, so the
+candidates for a match are walked newest first until they fall out of the window. prev only needs
+to remember a window's worth of positions, so it is a ring indexed by position & prevmask.
+Everything is in flat arrays allocated once, and kept from one block to the next, and from one
+image to the next when the encoder has a context.
+*/
+typedef struct LZ77Table
+{
+  uivector head; /*HASH_NUM_VALUES entries: the last position with that hash, or NO_POSITION*/
+  uivector prev; /*the previous position with the same hash as this one, or NO_POSITION*/
+  uivector zeros; /*like prev; hash 0 indicates a possible common case of a long sequence of zeros, store its length here for a speedup*/
+  unsigned prevmask;
+} LZ77Table;
 
-  if(!uivector_resizev(&tablepos1, HASH_NUM_VALUES, 0)) error = 9918;
-  if(!uivector_resizev(&tablepos2, HASH_NUM_VALUES, 0)) error = 9919;
+/*
+Marks an empty chain. pos - NO_POSITION wraps round to pos + 1, which is always further back than
+the window reaches, so walking a chain stops at it without a separate test.
+*/
+static const unsigned NO_POSITION = (unsigned)(-1);
 
-  if(!error)
-  {
-    unsigned length, offset, tablepos, max_offset;
-    unsigned hash, initialZeros;
-    unsigned backpos, current_offset, t1, t2, skip, current_length;
-    const unsigned char *lastptr, *foreptr, *backptr;
+static void LZ77Table_cleanup(LZ77Table* t)
+{
+  uivector_cleanup(&t->head);
+  uivector_cleanup(&t->prev);
+  uivector_cleanup(&t->zeros);
+}
 
-    for(pos = 0; pos < insize; pos++)
-    {
-      length = 0, offset = 0; /*the length and offset found for the current position*/
-      max_offset = pos < windowSize ? pos : windowSize; /*how far back to test*/
+static void LZ77Table_init(LZ77Table* t)
+{
+  uivector_init(&t->head);
+  uivector_init(&t->prev);
+  uivector_init(&t->zeros);
+  t->prevmask = 0;
+}
 
-      /*/search for the longest string*/
-      /*first find out where in the table to start (the first value that is in the range from "pos - max_offset" to "pos")*/
-      hash = getHash(in, insize, pos);
-      initialZeros = countInitialZeros(in, insize, pos);
-      if(!uivector_push_back((uivector*)vector_get(&table, hash), pos)) ERROR_BREAK(9920 /*alloc fail*/);
-      if(hash == 0)
-      {
-        if(!uivector_push_back(&initialZerosTable, initialZeros)) ERROR_BREAK(9920 /*alloc fail*/);
-      }
+/*size the table for windowSize, only allocating if it has never been this big before*/
+static unsigned LZ77Table_reserve(LZ77Table* t, unsigned windowSize)
+{
+  size_t prevsize = 1;
 
-      while(((uivector*)vector_get(&table, hash))->data[tablepos1.data[hash]] < pos - max_offset)
-      {
-        tablepos1.data[hash]++; /*it now points to the first value in the table for which the index is larger than or equal to pos - max_offset*/
-      }
-      while(((uivector*)vector_get(&table, hash))->data[tablepos2.data[hash]] < pos)
-      {
-        tablepos2.data[hash]++; /*it now points to the first value in the table for which the index is larger than or equal to pos*/
-      }
+  /*a power of two larger than the window, so no position in the window has its slot reused yet*/
+  while(prevsize <= windowSize) prevsize *= 2;
+  t->prevmask = (unsigned)(prevsize - 1);
 
-      t1 = tablepos1.data[hash];
-      t2 = tablepos2.data[hash];
+  if(!uivector_resize(&t->head, HASH_NUM_VALUES)) return 9917;
+  if(!uivector_resize(&t->prev, prevsize)) return 9918;
+  if(!uivector_resize(&t->zeros, prevsize)) return 9919;
+  return 0;
+}
 
-      lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+/*forget all positions, but keep the memory for the next use*/
+static void LZ77Table_clear(LZ77Table* t)
+{
+  unsigned i;
+  for(i = 0; i < HASH_NUM_VALUES; i++) t->head.data[i] = NO_POSITION;
+}
 
-      for(tablepos = tablepos2.data[hash] - 1; tablepos >= t1 && tablepos < t2; tablepos--)
-      {
-        backpos = ((uivector*)vector_get(&table, hash))->data[tablepos];
-        current_offset = pos - backpos;
+static void LZ77Table_insert(LZ77Table* t, unsigned pos, unsigned hash, unsigned zeros)
+{
+  t->prev.data[pos & t->prevmask] = t->head.data[hash];
+  t->zeros.data[pos & t->prevmask] = zeros;
+  t->head.data[hash] = pos;
+}
 
-        /*test the next characters*/
-        foreptr = &in[pos];
-        backptr = &in[backpos];
+/*
+Find the longest match for in[pos..] among the positions chained to it, testing at most chainlength of
+them (0 for all), newest first so that of equally long matches the nearest wins. Sets length to 0 if
+nothing matches.
 
-        if(hash == 0)
-        {
-          skip = initialZerosTable.data[tablepos];
-          if(skip > initialZeros) skip = initialZeros;
-          if(skip > insize - pos) skip = insize - pos;
-          backptr += skip;
-          foreptr += skip;
-        }
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-        {
-          ++backptr;
-          ++foreptr;
-        }
-        current_length = (unsigned)(foreptr - &in[pos]);
-        if(current_length > length)
-        {
-          length = current_length; /*the longest length*/
-          offset = current_offset; /*the offset that is related to this longest length*/
-          if(current_length == MAX_SUPPORTED_DEFLATE_LENGTH) break; /*you can jump out of this for loop once a length of max length is found (gives significant speed gain)*/
-        }
+If frontier isn't NULL, every match of 3 or more longer than all the nearer ones is also added to it, as
+a length | distance << 9: so for any length, the first of them at least that long has the nearest
+distance to copy it from.
+*/
+static void findMatch(unsigned* length, unsigned* offset, const LZ77Table* t, const unsigned char* in, size_t insize,
+                      unsigned pos, unsigned hash, unsigned initialZeros, unsigned max_offset,
+                      unsigned chainlength, unsigned niceLength, uivector* frontier)
+{
+  unsigned backpos, skip, current_length;
+  const unsigned char *lastptr, *foreptr, *backptr;
+
+  *length = 0, *offset = 0;
+  lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+
+  for(backpos = t->prev.data[pos & t->prevmask]; pos - backpos <= max_offset; backpos = t->prev.data[backpos & t->prevmask])
+  {
+    /*test the next characters*/
+    foreptr = &in[pos];
+    backptr = &in[backpos];
+
+    if(hash == 0)
+    {
+      skip = t->zeros.data[backpos & t->prevmask];
+      if(skip > initialZeros) skip = initialZeros;
+      backptr += skip;
+      foreptr += skip;
+    }
+    while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
+    {
+      ++backptr;
+      ++foreptr;
+    }
+    current_length = (unsigned)(foreptr - &in[pos]);
+    if(current_length > *length)
+    {
+      *length = current_length; /*the longest length*/
+      *offset = pos - backpos; /*the offset that is related to this longest length*/
+      if(frontier && current_length >= 3) uivector_push_back(frontier, current_length | (*offset << 9));
+      if(current_length >= niceLength) break; /*you can jump out of this for loop once a long enough length is found (gives significant speed gain)*/
+    }
+    if(--chainlength == 0) break; /*wraps round from 0, so no limit then*/
+  }
+}
+
+/*
+LZ77-encode in[inpos..insize) using hash chains to let it encode faster. Return value is error code.
+The bytes before inpos are not encoded, but matches may refer back to the last windowSize of them.
+
+With lazy matching, a match isn't taken until the next position has been tried too: if a longer one
+starts there, the byte here goes out as a literal instead, as in zlib.
+*/
+static unsigned encodeLZ77(uivector* out, LZ77Table* t, const unsigned char* in, size_t inpos, size_t insize,
+                           const LodeZlib_CompressSettings* settings)
+{
+  unsigned windowSize = settings->windowSize;
+  unsigned niceLength = (unsigned)(settings->niceLength < MAX_SUPPORTED_DEFLATE_LENGTH ? settings->niceLength : MAX_SUPPORTED_DEFLATE_LENGTH);
+  unsigned pos, error = 0;
+  unsigned start = (unsigned)(inpos > windowSize ? inpos - windowSize : 0);
+  unsigned rollinghash = getHash(in, insize, start);
+  size_t zerosend = 0;
+  size_t matchend = inpos; /*positions before this are only put in the table, not encoded*/
+
+  unsigned length, offset, max_offset, chainlength;
+  unsigned hash, initialZeros;
+  unsigned prevlength = 0, prevoffset = 0; /*lazy matching: the match found at pos - 1*/
+  unsigned pending = 0; /*lazy matching: whether pos - 1 is still to be encoded*/
+
+  LZ77Table_clear(t);
+
+  /*the history is only hashed; from inpos on every position is hashed too, but also matched unless a match covers it*/
+  for(pos = start; pos < insize; rollinghash = updateHash(rollinghash, in, insize, pos), pos++)
+  {
+    hash = rollinghash % HASH_NUM_VALUES;
+    initialZeros = hash == 0 ? countInitialZeros(in, insize, pos, &zerosend) : 0;
+    LZ77Table_insert(t, pos, hash, initialZeros);
+    if(pos < matchend) continue;
+
+    length = 0, offset = 0; /*the length and offset found for the current position*/
+    if(!pending || prevlength < settings->maxLazy)
+    {
+      max_offset = pos < windowSize ? pos : windowSize; /*how far back to test*/
+      chainlength = settings->maxChainLength;
+      if(pending && prevlength >= settings->goodLength && chainlength >= 4) chainlength >>= 2; /*0 stays no limit*/
+      findMatch(&length, &offset, t, in, insize, pos, hash, initialZeros, max_offset, chainlength, niceLength, NULL);
+    }
+
+    if(pending)
+    {
+      if(prevlength >= 3 && length <= prevlength)
+      {
+        /*the match at pos - 1 is at least as good, and covers this position*/
+        addLengthDistance(out, prevlength, prevoffset);
+        matchend = pos - 1 + prevlength;
+        pending = 0;
+        continue;
       }
+      if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(9921 /*alloc fail*/);
+      pending = 0;
+    }
+
+    if(settings->maxLazy != 0)
+    {
+      prevlength = length, prevoffset = offset;
+      pending = 1;
+    }
+    /**encode it as length/distance pair or literal value**/
+    else if(length < 3) /*only lengths of 3 or higher are supported as length/distance pair*/
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(9921 /*alloc fail*/);
+    }
+    else
+    {
+      addLengthDistance(out, length, offset);
+      matchend = pos + length; /*the rest of the match is still hashed, for later matches to find*/
+    }
+  } /*end of the loop through each character of input*/
+
+  /*the last position can't start a match, as there is nothing after it to match*/
+  if(!error && pending)
+  {
+    if(!uivector_push_back(out, in[insize - 1])) error = 9921 /*alloc fail*/;
+  }
+
+  return error;
+}
+
+/*
+LZ77-encode in[inpos..insize) with only runs: like zlib's Z_RLE, but a run can repeat the bytes rleDistance or
+rleDistance2 back, not just the last one. No hash table is used, every position tries both distances and takes
+the longer match. Filtered screenshots are mostly runs of whole pixels, and of rows the same as the one above.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                          const LodeZlib_CompressSettings* settings)
+{
+  size_t distances[2];
+  size_t pos = inpos, i;
+  unsigned error = 0;
+
+  distances[0] = settings->rleDistance;
+  distances[1] = settings->rleDistance2;
+
+  while(pos < insize)
+  {
+    size_t length = 0, offset = 0;
+    size_t maxlength = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? insize - pos : MAX_SUPPORTED_DEFLATE_LENGTH;
+    for(i = 0; i < 2; i++)
+    {
+      size_t distance = distances[i], l = 0;
+      if(distance == 0 || distance > pos || distance > 32768) continue; /*unused, before the data, or too far for deflate*/
+      while(l < maxlength && in[pos + l] == in[pos + l - distance]) l++;
+      if(l > length) length = l, offset = distance;
+    }
+
+    if(length >= 3)
+    {
+      addLengthDistance(out, length, offset);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(9961 /*alloc fail*/);
+      pos++;
+    }
+  }
+
+  return error;
+}
 
-      /**encode it as length/distance pair or literal value**/
-      if(length < 3) /*only lengths of 3 or higher are supported as length/distance pair*/
+/*
+The working memory of deflate: the LZ77 table, and everything a block is built up in before it is
+written. None of it is freed from one block to the next, so once it has grown to fit, compressing
+block after block, or image after image through a LodePNG_EncodeContext, allocates nothing.
+*/
+typedef struct DeflateScratch
+{
+  LZ77Table table;
+  uivector lz77_encoded; /*The lz77 encoded data, as packed tokens (see LZ77_SYMBOL)*/
+  HuffmanTree tree_ll; /*tree for lit,len values*/
+  HuffmanTree tree_d; /*tree for distance codes*/
+  HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
+  uivector frequencies_ll; /*frequency of lit,len codes*/
+  uivector frequencies_d; /*frequency of dist codes*/
+  uivector frequencies_cl; /*frequency of code length codes*/
+  uivector bitlen_lld; /*lit,len,dist code lenghts (int bits), literally (without repeat codes).*/
+  uivector bitlen_lld_e; /*bitlen_lld encoded with repeat codes (shorter: this is a rudemtary run length compression)*/
+  uivector bitlen_cl; /*code length code lengths ("clcl"). The bit lengths of codes to represent tree_cl (these are written as is in the file, it would be crazy to compress these using yet another huffman tree that needs to be represented by yet another set of code lengths)*/
+  /*for optimal parsing (see encodeOptimal)*/
+  uivector matches; /*the match frontier of each position, as findMatch gives it*/
+  uivector matchstart; /*where the frontier of each position starts in matches, and one more for the end*/
+  uivector costs; /*the fewest bits to get to each position*/
+  uivector steps; /*the literal or match that gets there in that many, as a length | distance << 9*/
+  uivector lz77_pass; /*the parse being tried, while lz77_encoded holds the best so far*/
+  /*for blockSplitting (see deflateDynamic)*/
+  uivector block; /*the tokens of the dynamic block still open, which may have come from several calls*/
+  size_t blockscanned; /*how many of them findBlockSplits has counted, in whole chunks*/
+  unsigned blockcounts_ll[286]; /*how often each symbol occurs in those*/
+  unsigned blockcounts_d[30];
+  uivector splits; /*where findBlockSplits ends blocks*/
+} DeflateScratch;
+
+/*forget any open block left over from a stream that was given up, so a new one can start*/
+static void DeflateScratch_restart(DeflateScratch* scratch)
+{
+  scratch->block.size = 0;
+  scratch->blockscanned = 0;
+  memset(scratch->blockcounts_ll, 0, sizeof(scratch->blockcounts_ll));
+  memset(scratch->blockcounts_d, 0, sizeof(scratch->blockcounts_d));
+}
+
+static void DeflateScratch_init(DeflateScratch* scratch)
+{
+  LZ77Table_init(&scratch->table);
+  uivector_init(&scratch->lz77_encoded);
+  HuffmanTree_init(&scratch->tree_ll);
+  HuffmanTree_init(&scratch->tree_d);
+  HuffmanTree_init(&scratch->tree_cl);
+  uivector_init(&scratch->frequencies_ll);
+  uivector_init(&scratch->frequencies_d);
+  uivector_init(&scratch->frequencies_cl);
+  uivector_init(&scratch->bitlen_lld);
+  uivector_init(&scratch->bitlen_lld_e);
+  uivector_init(&scratch->bitlen_cl);
+  uivector_init(&scratch->matches);
+  uivector_init(&scratch->matchstart);
+  uivector_init(&scratch->costs);
+  uivector_init(&scratch->steps);
+  uivector_init(&scratch->lz77_pass);
+  uivector_init(&scratch->block);
+  uivector_init(&scratch->splits);
+  DeflateScratch_restart(scratch);
+}
+
+static void DeflateScratch_cleanup(DeflateScratch* scratch)
+{
+  LZ77Table_cleanup(&scratch->table);
+  uivector_cleanup(&scratch->lz77_encoded);
+  HuffmanTree_cleanup(&scratch->tree_ll);
+  HuffmanTree_cleanup(&scratch->tree_d);
+  HuffmanTree_cleanup(&scratch->tree_cl);
+  uivector_cleanup(&scratch->frequencies_ll);
+  uivector_cleanup(&scratch->frequencies_d);
+  uivector_cleanup(&scratch->frequencies_cl);
+  uivector_cleanup(&scratch->bitlen_lld);
+  uivector_cleanup(&scratch->bitlen_lld_e);
+  uivector_cleanup(&scratch->bitlen_cl);
+  uivector_cleanup(&scratch->matches);
+  uivector_cleanup(&scratch->matchstart);
+  uivector_cleanup(&scratch->costs);
+  uivector_cleanup(&scratch->steps);
+  uivector_cleanup(&scratch->lz77_pass);
+  uivector_cleanup(&scratch->block);
+  uivector_cleanup(&scratch->splits);
+}
+
+/*
+Optimal parsing, in the spirit of zopfli: instead of taking each match as it comes, like encodeLZ77, find the
+cheapest way to cover in[inpos..insize) with literals and matches as a shortest path through the positions,
+every length of every match being a step. What is cheapest depends on the Huffman codes, which depend on the
+parse, so it is done over: the first pass prices symbols by the fixed codes, each one after by the codes the
+parse before would get. Many times slower than the slowest level, for a few percent smaller.
+*/
+
+/*
+Whether pos is far enough into a long run of one byte that the only sensible thing to do is to copy the longest
+match from one byte back: at least the longest match from the start of the block, with two more of them still
+to come. Taking those without trying anything else saves most of the time on flat images. *runstart and *runend
+are the run that pos was last found in, so each run is only scanned once.
+*/
+static unsigned isInLongRun(const unsigned char* in, size_t inpos, size_t insize, size_t pos, size_t* runstart, size_t* runend)
+{
+  if(*runend <= pos)
+  {
+    *runstart = pos;
+    while(*runstart > inpos && in[*runstart - 1] == in[pos]) (*runstart)--;
+    *runend = pos + 1;
+    while(*runend < insize && in[*runend] == in[pos]) (*runend)++;
+  }
+  return pos - *runstart >= MAX_SUPPORTED_DEFLATE_LENGTH && *runend - pos > 2 * MAX_SUPPORTED_DEFLATE_LENGTH;
+}
+
+/*find the match frontier (see findMatch) of every position in in[inpos..insize) a parse may step from*/
+static unsigned findOptimalMatches(DeflateScratch* scratch, const unsigned char* in, size_t inpos, size_t insize,
+                                   const LodeZlib_CompressSettings* settings)
+{
+  LZ77Table* t = &scratch->table;
+  unsigned windowSize = settings->windowSize;
+  unsigned niceLength = (unsigned)(settings->niceLength < MAX_SUPPORTED_DEFLATE_LENGTH ? settings->niceLength : MAX_SUPPORTED_DEFLATE_LENGTH);
+  unsigned pos, hash, initialZeros, length, offset, max_offset;
+  unsigned start = (unsigned)(inpos > windowSize ? inpos - windowSize : 0);
+  unsigned rollinghash = getHash(in, insize, start);
+  size_t zerosend = 0, runstart = 0, runend = 0;
+
+  scratch->matches.size = 0;
+  if(!uivector_resize(&scratch->matchstart, insize - inpos + 1)) return 9962; /*alloc fail*/
+
+  LZ77Table_clear(t);
+  for(pos = start; pos < insize; rollinghash = updateHash(rollinghash, in, insize, pos), pos++)
+  {
+    hash = rollinghash % HASH_NUM_VALUES;
+    initialZeros = hash == 0 ? countInitialZeros(in, insize, pos, &zerosend) : 0;
+    LZ77Table_insert(t, pos, hash, initialZeros);
+    if(pos < inpos) continue;
+
+    scratch->matchstart.data[pos - inpos] = (unsigned)scratch->matches.size;
+    if(isInLongRun(in, inpos, insize, pos, &runstart, &runend)) continue; /*optimalParse won't look*/
+
+    /*room for the longest frontier there can be, so that findMatch can't run out*/
+    if(!uivector_resize(&scratch->matches, scratch->matches.size + MAX_SUPPORTED_DEFLATE_LENGTH)) return 9962; /*alloc fail*/
+    scratch->matches.size -= MAX_SUPPORTED_DEFLATE_LENGTH;
+    max_offset = pos < windowSize ? pos : windowSize;
+    findMatch(&length, &offset, t, in, insize, pos, hash, initialZeros, max_offset, settings->maxChainLength, niceLength,
+              &scratch->matches);
+  }
+  scratch->matchstart.data[insize - inpos] = (unsigned)scratch->matches.size;
+  return 0;
+}
+
+/*
+The cheapest parse of in[inpos..insize), using the frontiers findOptimalMatches found, when literal and
+lit/len symbols cost costs_ll bits each and distance codes costs_d, plus their extra bits.
+*/
+static unsigned optimalParse(uivector* out, DeflateScratch* scratch, const unsigned char* in, size_t inpos, size_t insize,
+                             const unsigned* costs_ll, const unsigned* costs_d)
+{
+  size_t size = insize - inpos, pos, i, j, count, runstart = 0, runend = 0;
+  unsigned lengthcost[MAX_SUPPORTED_DEFLATE_LENGTH + 1];
+  unsigned *costs, *steps, *matches = scratch->matches.data, *matchstart = scratch->matchstart.data;
+  unsigned length, distance, prevlength, cost, step;
+
+  if(!uivector_resize(&scratch->costs, size + 1)) return 9963; /*alloc fail*/
+  if(!uivector_resize(&scratch->steps, size + 1)) return 9963; /*alloc fail*/
+  costs = scratch->costs.data;
+  steps = scratch->steps.data;
+
+  for(length = 3; length <= MAX_SUPPORTED_DEFLATE_LENGTH; length++)
+  {
+    lengthcost[length] = costs_ll[FIRST_LENGTH_CODE_INDEX + LENGTH_CODE[length]] + LENGTHEXTRA[LENGTH_CODE[length]];
+  }
+  costs[0] = 0;
+  for(i = 1; i <= size; i++) costs[i] = (unsigned)(-1); /*not reached yet*/
+
+  for(pos = inpos; pos < insize; pos++)
+  {
+    i = pos - inpos;
+    while(isInLongRun(in, inpos, insize, pos, &runstart, &runend))
+    {
+      /*the longest match from one byte back, from each of the next MAX_SUPPORTED_DEFLATE_LENGTH positions*/
+      cost = lengthcost[MAX_SUPPORTED_DEFLATE_LENGTH] + costs_d[0];
+      step = (unsigned)MAX_SUPPORTED_DEFLATE_LENGTH | (1 << 9);
+      for(j = i; j < i + MAX_SUPPORTED_DEFLATE_LENGTH; j++)
       {
-        if(!uivector_push_back(out, in[pos])) ERROR_BREAK(9921 /*alloc fail*/);
+        if(costs[j] + cost < costs[j + MAX_SUPPORTED_DEFLATE_LENGTH])
+        {
+          costs[j + MAX_SUPPORTED_DEFLATE_LENGTH] = costs[j] + cost;
+          steps[j + MAX_SUPPORTED_DEFLATE_LENGTH] = step;
+        }
       }
-      else
+      pos += MAX_SUPPORTED_DEFLATE_LENGTH;
+      i += MAX_SUPPORTED_DEFLATE_LENGTH;
+    }
+
+    if(costs[i] + costs_ll[in[pos]] < costs[i + 1])
+    {
+      costs[i + 1] = costs[i] + costs_ll[in[pos]];
+      steps[i + 1] = 1;
+    }
+
+    /*each length is cheapest copied from the nearest distance that has it*/
+    prevlength = 2;
+    for(j = matchstart[i]; j < matchstart[i + 1]; j++)
+    {
+      length = matches[j] & 511;
+      distance = matches[j] >> 9;
+      cost = costs[i] + costs_d[getDistanceCode(distance)] + DISTANCEEXTRA[getDistanceCode(distance)];
+      step = distance << 9;
+      for(prevlength++; prevlength <= length; prevlength++)
       {
-        unsigned j, local_hash;
-        addLengthDistance(out, length, offset);
-        for(j = 0; j < length - 1; j++)
+        if(cost + lengthcost[prevlength] < costs[i + prevlength])
         {
-          pos++;
-          local_hash = getHash(in, insize, pos);
-          if(!uivector_push_back((uivector*)vector_get(&table, local_hash), pos)) ERROR_BREAK(9922 /*alloc fail*/);
-          if(local_hash == 0)
-          {
-            if(!uivector_push_back(&initialZerosTable, countInitialZeros(in, insize, pos))) ERROR_BREAK(9922 /*alloc fail*/);
-          }
+          costs[i + prevlength] = cost + lengthcost[prevlength];
+          steps[i + prevlength] = prevlength | step;
         }
       }
-    } /*end of the loop through each character of input*/
-  } /*end of "if(!error)"*/
+      prevlength = length;
+    }
+  }
 
-  /*cleanup*/
-  for(i = 0; i < table.size; i++)
+  /*follow the steps back from the end, once to count them and again to fill them in from the back*/
+  for(i = size, count = 0; i > 0; i -= steps[i] & 511) count++;
+  if(!uivector_resize(out, count)) return 9963; /*alloc fail*/
+  for(i = size, j = count; i > 0; i -= steps[i] & 511)
   {
-    uivector* v = (uivector*)vector_get(&table, i);
-    uivector_cleanup(v);
+    length = steps[i] & 511;
+    out->size = --j; /*the token goes in at j, and can't need more memory*/
+    if(length == 1) uivector_push_back(out, in[inpos + i - 1]);
+    else addLengthDistance(out, length, steps[i] >> 9);
   }
-  vector_cleanup(&table);
-  uivector_cleanup(&tablepos1);
-  uivector_cleanup(&tablepos2);
-  uivector_cleanup(&initialZerosTable);
+  out->size = count;
+  return 0;
+}
+
+/*
+Build Huffman trees for the symbols of an LZ77 parse, and return how many bits it takes with them, not counting
+the trees themselves. costs_ll and costs_d are set to the bits each symbol takes, for the next pass of
+optimalParse: those the parse doesn't use are priced at the longest code there can be.
+*/
+static unsigned priceLZ77(size_t* bits, unsigned* costs_ll, unsigned* costs_d, DeflateScratch* scratch, const uivector* lz77_encoded)
+{
+  unsigned error = 0;
+  size_t i;
+  scratch->frequencies_ll.size = 0;
+  scratch->frequencies_d.size = 0;
+  if(!uivector_resizev(&scratch->frequencies_ll, 286, 0)) return 9924; /*alloc fail*/
+  if(!uivector_resizev(&scratch->frequencies_d, 30, 0)) return 9925; /*alloc fail*/
+
+  *bits = 0;
+  for(i = 0; i < lz77_encoded->size; i++)
+  {
+    unsigned token = lz77_encoded->data[i];
+    scratch->frequencies_ll.data[LZ77_SYMBOL(token)]++;
+    if(LZ77_SYMBOL(token) > 256)
+    {
+      scratch->frequencies_d.data[LZ77_DISTANCE_CODE(token)]++;
+      *bits += LENGTHEXTRA[LZ77_SYMBOL(token) - FIRST_LENGTH_CODE_INDEX] + DISTANCEEXTRA[LZ77_DISTANCE_CODE(token)];
+    }
+  }
+  scratch->frequencies_ll.data[256] = 1;
+
+  error = HuffmanTree_makeFromFrequencies(&scratch->tree_ll, scratch->frequencies_ll.data, 286, 15);
+  if(!error) error = HuffmanTree_makeFromFrequencies(&scratch->tree_d, scratch->frequencies_d.data, 30, 15);
+  if(error) return error;
+
+  for(i = 0; i < NUM_DEFLATE_CODE_SYMBOLS; i++)
+  {
+    unsigned length = i < 286 ? HuffmanTree_getLength(&scratch->tree_ll, (unsigned)i) : 0;
+    if(length) *bits += (size_t)length * scratch->frequencies_ll.data[i];
+    costs_ll[i] = length ? length : MAX_HUFFMAN_BITLEN;
+  }
+  for(i = 0; i < NUM_DISTANCE_SYMBOLS; i++)
+  {
+    unsigned length = i < 30 ? HuffmanTree_getLength(&scratch->tree_d, (unsigned)i) : 0;
+    if(length) *bits += (size_t)length * scratch->frequencies_d.data[i];
+    costs_d[i] = length ? length : MAX_HUFFMAN_BITLEN;
+  }
+  return 0;
+}
+
+/*
+LZ77-encode in[inpos..insize) into scratch->lz77_encoded by optimal parsing: up to numIterations passes, each
+priced by the Huffman codes of the one before, keeping the smallest, and stopping early once a pass doesn't
+beat it. With fixed codes nothing changes from one pass to the next, so only one is made.
+*/
+static unsigned encodeOptimal(DeflateScratch* scratch, const unsigned char* in, size_t inpos, size_t insize,
+                              const LodeZlib_CompressSettings* settings)
+{
+  unsigned costs_ll[NUM_DEFLATE_CODE_SYMBOLS], costs_d[NUM_DISTANCE_SYMBOLS];
+  size_t bits, bestbits = 0;
+  unsigned iteration, error;
+
+  error = findOptimalMatches(scratch, in, inpos, insize, settings);
+  if(!error) error = optimalParse(&scratch->lz77_encoded, scratch, in, inpos, insize, FIXED_LITLEN_LENGTHS, FIXED_DISTANCE_LENGTHS);
+  if(error || settings->btype == 1) return error;
+  error = priceLZ77(&bestbits, costs_ll, costs_d, scratch, &scratch->lz77_encoded);
+
+  for(iteration = 1; !error && iteration < settings->numIterations; iteration++)
+  {
+    uivector swap;
+    error = optimalParse(&scratch->lz77_pass, scratch, in, inpos, insize, costs_ll, costs_d);
+    if(!error) error = priceLZ77(&bits, costs_ll, costs_d, scratch, &scratch->lz77_pass);
+    if(error || bits >= bestbits) break;
+
+    bestbits = bits;
+    swap = scratch->lz77_encoded;
+    scratch->lz77_encoded = scratch->lz77_pass;
+    scratch->lz77_pass = swap;
+  }
+
   return error;
 }
 
+/*LZ77-encode in[inpos..insize) into scratch->lz77_encoded with the strategy from the settings*/
+static unsigned encodeLZ77Strategy(DeflateScratch* scratch, const unsigned char* in, size_t inpos, size_t insize,
+                                   const LodeZlib_CompressSettings* settings)
+{
+  if(settings->strategy == 1) return encodeRLE(&scratch->lz77_encoded, in, inpos, insize, settings);
+  if(settings->strategy == 2) return encodeOptimal(scratch, in, inpos, insize, settings);
+  return encodeLZ77(&scratch->lz77_encoded, &scratch->table, in, inpos, insize, settings);
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(BitWriter* writer, const unsigned char* data, size_t datapos, size_t dataend, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte, 2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
-  size_t i, j, numdeflateblocks = datasize / 65536 + 1;
-  unsigned datapos = 0;
+  ucvector* out = writer->out;
+  size_t i, numdeflateblocks = (dataend - datapos + 65534) / 65535;
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+  if(!BitWriter_reserve(writer, 8 * (numdeflateblocks * 5 + (dataend - datapos)) + 7)) return 9956; /*alloc fail*/
   for(i = 0; i < numdeflateblocks; i++)
   {
-    unsigned BFINAL, BTYPE, LEN, NLEN;
-    unsigned char firstbyte;
+    unsigned BFINAL, LEN, NLEN;
+    unsigned char* p;
 
-    BFINAL = (i == numdeflateblocks - 1);
-    BTYPE = 0;
+    BFINAL = final && (i == numdeflateblocks - 1);
 
-    firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
-    ucvector_push_back(out, firstbyte);
+    BitWriter_write(writer, BFINAL, 1);
+    BitWriter_write(writer, 0, 2); /*BTYPE 0*/
+    BitWriter_flush(writer); /*the rest of the byte stays 0*/
 
     LEN = 65535;
-    if(datasize - datapos < 65535) LEN = (unsigned)datasize - datapos;
+    if(dataend - datapos < 65535) LEN = (unsigned)(dataend - datapos);
     NLEN = 65535 - LEN;
 
-    ucvector_push_back(out, (unsigned char)(LEN % 256));
-    ucvector_push_back(out, (unsigned char)(LEN / 256));
-    ucvector_push_back(out, (unsigned char)(NLEN % 256));
-    ucvector_push_back(out, (unsigned char)(NLEN / 256));
+    p = &out->data[out->size];
+    p[0] = (unsigned char)(LEN % 256);
+    p[1] = (unsigned char)(LEN / 256);
+    p[2] = (unsigned char)(NLEN % 256);
+    p[3] = (unsigned char)(NLEN / 256);
 
     /*Decompressed data*/
-    for(j = 0; j < 65535 && datapos < datasize; j++)
-    {
-      ucvector_push_back(out, data[datapos++]);
-    }
+    memcpy(&p[4], &data[datapos], LEN);
+    datapos += LEN;
+    out->size += 4 + LEN;
   }
 
   return 0;
@@ -1453,37 +1917,46 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
 
 /*
 write the lz77-encoded data, which has lit, len and dist codes, to compressed stream using huffman trees.
-tree_ll: the tree for lit and len codes.
-tree_d: the tree for distance codes.
+tokens: numtokens LZ77 tokens, see LZ77_SYMBOL.
+codes_ll, lengths_ll: the bit reversed codes, and their lengths, for lit and len symbols.
+codes_d, lengths_d: the same for distance codes.
 */
-static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded, const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
+static void writeLZ77data(BitWriter* writer, const unsigned* tokens, size_t numtokens, const unsigned* codes_ll, const unsigned* lengths_ll,
+                          const unsigned* codes_d, const unsigned* lengths_d)
 {
   size_t i = 0;
-  for(i = 0; i < lz77_encoded->size; i++)
+  for(i = 0; i < numtokens; i++)
   {
-    unsigned val = lz77_encoded->data[i];
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
+    unsigned token = tokens[i];
+    unsigned val = LZ77_SYMBOL(token);
+    BitWriter_write(writer, codes_ll[val], lengths_ll[val]);
     if(val > 256) /*for a length code, 3 more things have to be added*/
     {
-      unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
-      unsigned n_length_extra_bits = LENGTHEXTRA[length_index];
-      unsigned length_extra_bits = lz77_encoded->data[++i];
-
-      unsigned distance_code = lz77_encoded->data[++i];
-
-      unsigned distance_index = distance_code;
-      unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
-      unsigned distance_extra_bits = lz77_encoded->data[++i];
-
-      addBitsToStream(bp, out, length_extra_bits, n_length_extra_bits);
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_d, distance_code), HuffmanTree_getLength(tree_d, distance_code));
-      addBitsToStream(bp, out, distance_extra_bits, n_distance_extra_bits);
+      unsigned distance_code = LZ77_DISTANCE_CODE(token);
+      BitWriter_write(writer, LZ77_LENGTH_EXTRA(token), LENGTHEXTRA[val - FIRST_LENGTH_CODE_INDEX]);
+      BitWriter_write(writer, codes_d[distance_code], lengths_d[distance_code]);
+      BitWriter_write(writer, LZ77_DISTANCE_EXTRA(token), DISTANCEEXTRA[distance_code]);
     }
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, const unsigned char* data, size_t datasize, const LodeZlib_CompressSettings* settings)
+/*
+The most bits writeLZ77data can write for the tokens, plus the end code. No code is longer than 15 bits,
+and a length/distance pair has another code and up to 5+13 extra bits.
+*/
+static size_t maxLZ77Bits(const unsigned* tokens, size_t numtokens)
+{
+  size_t i, pairs = 0;
+  for(i = 0; i < numtokens; i++) pairs += LZ77_SYMBOL(tokens[i]) > 256;
+  return (numtokens + 1) * 15 + pairs * 33;
+}
+
+/*
+Write one block of type "dynamic", that is, with freely, optimally, created huffman trees. It holds the LZ77 tokens
+tokens[0..numtokens) or, without LZ77, the bytes literals[0..numliterals) as they are; the other one is NULL.
+*/
+static unsigned writeDynamicBlock(BitWriter* writer, DeflateScratch* scratch, const unsigned* tokens, size_t numtokens,
+                                  const unsigned char* literals, size_t numliterals, unsigned final)
 {
   unsigned error = 0;
 
@@ -1497,16 +1970,15 @@ static unsigned deflateDynamic(ucvector* out, const unsigned char* data, size_t
   of code lengths "cl". The code lenghts used to describe this third tree are
   the code length code lengths ("clcl").
   */
-  uivector lz77_encoded; /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  HuffmanTree tree_ll; /*tree for lit,len values*/
-  HuffmanTree tree_d; /*tree for distance codes*/
-  HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  uivector frequencies_ll; /*frequency of lit,len codes*/
-  uivector frequencies_d; /*frequency of dist codes*/
-  uivector frequencies_cl; /*frequency of code length codes*/
-  uivector bitlen_lld; /*lit,len,dist code lenghts (int bits), literally (without repeat codes).*/
-  uivector bitlen_lld_e; /*bitlen_lld encoded with repeat codes (shorter: this is a rudemtary run length compression)*/
-  uivector bitlen_cl; /*code length code lengths ("clcl"). The bit lengths of codes to represent tree_cl (these are written as is in the file, it would be crazy to compress these using yet another huffman tree that needs to be represented by yet another set of code lengths)*/
+  HuffmanTree* tree_ll = &scratch->tree_ll;
+  HuffmanTree* tree_d = &scratch->tree_d;
+  HuffmanTree* tree_cl = &scratch->tree_cl;
+  uivector* frequencies_ll = &scratch->frequencies_ll;
+  uivector* frequencies_d = &scratch->frequencies_d;
+  uivector* frequencies_cl = &scratch->frequencies_cl;
+  uivector* bitlen_lld = &scratch->bitlen_lld;
+  uivector* bitlen_lld_e = &scratch->bitlen_lld_e;
+  uivector* bitlen_cl = &scratch->bitlen_cl;
 
   /*
   Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
@@ -1515,84 +1987,64 @@ static unsigned deflateDynamic(ucvector* out, const unsigned char* data, size_t
   bitlen_cl is to bitlen_lld_e what bitlen_lld is to lz77_encoded.
   */
 
-  unsigned BFINAL = 1; /*make only one block... the first and final one*/
+  unsigned BFINAL = final;
   size_t numcodes_ll, numcodes_d, i;
-  size_t bp = 0; /*the bit pointer*/
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-  HuffmanTree_init(&tree_cl);
-  uivector_init(&frequencies_ll);
-  uivector_init(&frequencies_d);
-  uivector_init(&frequencies_cl);
-  uivector_init(&bitlen_lld);
-  uivector_init(&bitlen_lld_e);
-  uivector_init(&bitlen_cl);
+  /*empty everything left over from the previous block, keeping the memory*/
+  frequencies_ll->size = 0;
+  frequencies_d->size = 0;
+  frequencies_cl->size = 0;
+  bitlen_lld->size = 0;
+  bitlen_lld_e->size = 0;
+  bitlen_cl->size = 0;
 
   /*This while loop is never loops due to a break at the end, it is here to allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->useLZ77)
-    {
-      error = encodeLZ77(&lz77_encoded, data, datasize, settings->windowSize); /*LZ77 encoded*/
-      if(error) break;
-    }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(9923 /*alloc fail*/);
-      for(i = 0; i < datasize; i++) lz77_encoded.data[i] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
-
-    if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(9924 /*alloc fail*/);
-    if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(9925 /*alloc fail*/);
+    if(!uivector_resizev(frequencies_ll, 286, 0)) ERROR_BREAK(9924 /*alloc fail*/);
+    if(!uivector_resizev(frequencies_d, 30, 0)) ERROR_BREAK(9925 /*alloc fail*/);
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i < lz77_encoded.size; i++)
+    for(i = 0; i < numtokens; i++)
     {
-      unsigned symbol = lz77_encoded.data[i];
-      frequencies_ll.data[symbol]++;
-      if(symbol > 256)
-      {
-        unsigned dist = lz77_encoded.data[i + 2];
-        frequencies_d.data[dist]++;
-        i += 3;
-      }
+      frequencies_ll->data[LZ77_SYMBOL(tokens[i])]++;
+      if(LZ77_SYMBOL(tokens[i]) > 256) frequencies_d->data[LZ77_DISTANCE_CODE(tokens[i])]++;
     }
-    frequencies_ll.data[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
+    for(i = 0; i < numliterals; i++) frequencies_ll->data[literals[i]]++; /*no LZ77: only the literal tree is used*/
+    frequencies_ll->data[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
 
     /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
-    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll.data, frequencies_ll.size, 15);
+    error = HuffmanTree_makeFromFrequencies(tree_ll, frequencies_ll->data, frequencies_ll->size, 15);
     if(error) break;
-    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d.data, frequencies_d.size, 15);
+    error = HuffmanTree_makeFromFrequencies(tree_d, frequencies_d->data, frequencies_d->size, 15);
     if(error) break;
 
-    numcodes_ll = tree_ll.numcodes; if(numcodes_ll > 286) numcodes_ll = 286;
-    numcodes_d = tree_d.numcodes; if(numcodes_d > 30) numcodes_d = 30;
+    numcodes_ll = tree_ll->numcodes; if(numcodes_ll > 286) numcodes_ll = 286;
+    numcodes_d = tree_d->numcodes; if(numcodes_d > 30) numcodes_d = 30;
     /*store the code lengths of both generated trees in bitlen_lld*/
-    for(i = 0; i < numcodes_ll; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_ll, (unsigned)i));
-    for(i = 0; i < numcodes_d; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_d, (unsigned)i));
+    for(i = 0; i < numcodes_ll; i++) uivector_push_back(bitlen_lld, HuffmanTree_getLength(tree_ll, (unsigned)i));
+    for(i = 0; i < numcodes_d; i++) uivector_push_back(bitlen_lld, HuffmanTree_getLength(tree_d, (unsigned)i));
 
     /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times), 17 (3-10 zeroes), 18 (11-138 zeroes)*/
-    for(i = 0; i < (unsigned)bitlen_lld.size; i++)
+    for(i = 0; i < (unsigned)bitlen_lld->size; i++)
     {
       unsigned j = 0; /*amount of repititions*/
-      while(i + j + 1 < (unsigned)bitlen_lld.size && bitlen_lld.data[i + j + 1] == bitlen_lld.data[i]) j++;
+      while(i + j + 1 < (unsigned)bitlen_lld->size && bitlen_lld->data[i + j + 1] == bitlen_lld->data[i]) j++;
 
-      if(bitlen_lld.data[i] == 0 && j >= 2) /*repeat code for zeroes*/
+      if(bitlen_lld->data[i] == 0 && j >= 2) /*repeat code for zeroes*/
       {
         j++; /*include the first zero*/
         if(j <= 10) /*repeat code 17 supports max 10 zeroes*/
         {
-          uivector_push_back(&bitlen_lld_e, 17);
-          uivector_push_back(&bitlen_lld_e, j - 3);
+          uivector_push_back(bitlen_lld_e, 17);
+          uivector_push_back(bitlen_lld_e, j - 3);
         }
         else /*repeat code 18 supports max 138 zeroes*/
         {
           if(j > 138) j = 138;
-          uivector_push_back(&bitlen_lld_e, 18);
-          uivector_push_back(&bitlen_lld_e, j - 11);
+          uivector_push_back(bitlen_lld_e, 18);
+          uivector_push_back(bitlen_lld_e, j - 11);
         }
         i += (j - 1);
       }
@@ -1600,45 +2052,45 @@ static unsigned deflateDynamic(ucvector* out, const unsigned char* data, size_t
       {
         size_t k;
         unsigned num = j / 6, rest = j % 6;
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
+        uivector_push_back(bitlen_lld_e, bitlen_lld->data[i]);
         for(k = 0; k < num; k++)
         {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e,    6 - 3);
+          uivector_push_back(bitlen_lld_e, 16);
+          uivector_push_back(bitlen_lld_e,    6 - 3);
         }
         if(rest >= 3)
         {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, rest - 3);
+          uivector_push_back(bitlen_lld_e, 16);
+          uivector_push_back(bitlen_lld_e, rest - 3);
         }
         else j -= rest;
         i += j;
       }
       else /*too short to benefit from repeat code*/
       {
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
+        uivector_push_back(bitlen_lld_e, bitlen_lld->data[i]);
       }
     }
 
     /*generate tree_cl, the huffmantree of huffmantrees*/
 
-    if(!uivector_resizev(&frequencies_cl, NUM_CODE_LENGTH_CODES, 0)) ERROR_BREAK(9926 /*alloc fail*/);
-    for(i = 0; i < bitlen_lld_e.size; i++)
+    if(!uivector_resizev(frequencies_cl, NUM_CODE_LENGTH_CODES, 0)) ERROR_BREAK(9926 /*alloc fail*/);
+    for(i = 0; i < bitlen_lld_e->size; i++)
     {
-      frequencies_cl.data[bitlen_lld_e.data[i]]++;
+      frequencies_cl->data[bitlen_lld_e->data[i]]++;
       /*after a repeat code come the bits that specify the number of repetitions, those don't need to be in the frequencies_cl calculation*/
-      if(bitlen_lld_e.data[i] >= 16) i++;
+      if(bitlen_lld_e->data[i] >= 16) i++;
     }
 
-    error = HuffmanTree_makeFromFrequencies(&tree_cl, frequencies_cl.data, frequencies_cl.size, 7);
+    error = HuffmanTree_makeFromFrequencies(tree_cl, frequencies_cl->data, frequencies_cl->size, 7);
     if(error) break;
 
-    if(!uivector_resize(&bitlen_cl, NUM_CODE_LENGTH_CODES)) ERROR_BREAK(9927 /*alloc fail*/);
-    for(i = 0; i < NUM_CODE_LENGTH_CODES; i++) bitlen_cl.data[i] = HuffmanTree_getLength(&tree_cl, CLCL_ORDER[i]); /*lenghts of code length tree is in the order as specified by deflate*/
-    while(bitlen_cl.data[bitlen_cl.size - 1] == 0 && bitlen_cl.size > 4)
+    if(!uivector_resize(bitlen_cl, NUM_CODE_LENGTH_CODES)) ERROR_BREAK(9927 /*alloc fail*/);
+    for(i = 0; i < NUM_CODE_LENGTH_CODES; i++) bitlen_cl->data[i] = HuffmanTree_getLength(tree_cl, CLCL_ORDER[i]); /*lenghts of code length tree is in the order as specified by deflate*/
+    while(bitlen_cl->data[bitlen_cl->size - 1] == 0 && bitlen_cl->size > 4)
     {
       /*remove zeros at the end, but minimum size must be 4*/
-      if(!uivector_resize(&bitlen_cl, bitlen_cl.size - 1)) ERROR_BREAK(9928 /*alloc fail*/);
+      if(!uivector_resize(bitlen_cl, bitlen_cl->size - 1)) ERROR_BREAK(9928 /*alloc fail*/);
     }
     if(error) break;
 
@@ -1654,107 +2106,285 @@ static unsigned deflateDynamic(ucvector* out, const unsigned char* data, size_t
     - 256 (end code)
     */
 
+    /*the header is at most 3+14+19*3 bits, and each code length code takes at most 7 bits, with up to 7 extra bits in the value after it*/
+    if(!BitWriter_reserve(writer, 74 + bitlen_lld_e->size * 7
+                                  + (tokens ? maxLZ77Bits(tokens, numtokens) : (numliterals + 1) * 15))) ERROR_BREAK(9960 /*alloc fail*/);
+
     /*Write block type*/
-    addBitToStream(&bp, out, BFINAL);
-    addBitToStream(&bp, out, 0); /*first bit of BTYPE "dynamic"*/
-    addBitToStream(&bp, out, 1); /*second bit of BTYPE "dynamic"*/
+    BitWriter_write(writer, BFINAL, 1);
+    BitWriter_write(writer, 2, 2); /*BTYPE "dynamic"*/
 
     /*write the HLIT, HDIST and HCLEN values*/
     HLIT = (unsigned)(numcodes_ll - 257);
     HDIST = (unsigned)(numcodes_d - 1);
-    HCLEN = (unsigned)bitlen_cl.size - 4;
-    addBitsToStream(&bp, out, HLIT, 5);
-    addBitsToStream(&bp, out, HDIST, 5);
-    addBitsToStream(&bp, out, HCLEN, 4);
+    HCLEN = (unsigned)bitlen_cl->size - 4;
+    BitWriter_write(writer, HLIT, 5);
+    BitWriter_write(writer, HDIST, 5);
+    BitWriter_write(writer, HCLEN, 4);
 
     /*write the code lenghts of the code length alphabet*/
-    for(i = 0; i < HCLEN + 4; i++) addBitsToStream(&bp, out, bitlen_cl.data[i], 3);
+    for(i = 0; i < HCLEN + 4; i++) BitWriter_write(writer, bitlen_cl->data[i], 3);
 
     /*write the lenghts of the lit/len AND the dist alphabet*/
-    for(i = 0; i < bitlen_lld_e.size; i++)
+    for(i = 0; i < bitlen_lld_e->size; i++)
     {
-      addHuffmanSymbol(&bp, out, HuffmanTree_getCode(&tree_cl, bitlen_lld_e.data[i]), HuffmanTree_getLength(&tree_cl, bitlen_lld_e.data[i]));
+      addHuffmanSymbol(writer, tree_cl, bitlen_lld_e->data[i]);
       /*extra bits of repeat codes*/
-      if(bitlen_lld_e.data[i] == 16) addBitsToStream(&bp, out, bitlen_lld_e.data[++i], 2);
-      else if(bitlen_lld_e.data[i] == 17) addBitsToStream(&bp, out, bitlen_lld_e.data[++i], 3);
-      else if(bitlen_lld_e.data[i] == 18) addBitsToStream(&bp, out, bitlen_lld_e.data[++i], 7);
+      if(bitlen_lld_e->data[i] == 16) BitWriter_write(writer, bitlen_lld_e->data[++i], 2);
+      else if(bitlen_lld_e->data[i] == 17) BitWriter_write(writer, bitlen_lld_e->data[++i], 3);
+      else if(bitlen_lld_e->data[i] == 18) BitWriter_write(writer, bitlen_lld_e->data[++i], 7);
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(&bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64); /*the length of the end code 256 must be larger than 0*/
+    if(tokens) writeLZ77data(writer, tokens, numtokens, tree_ll->tree1d.data, tree_ll->lengths.data, tree_d->tree1d.data, tree_d->lengths.data);
+    else for(i = 0; i < numliterals; i++) addHuffmanSymbol(writer, tree_ll, literals[i]);
+    if(HuffmanTree_getLength(tree_ll, 256) == 0) ERROR_BREAK(64); /*the length of the end code 256 must be larger than 0*/
 
     /*write the end code*/
-    addHuffmanSymbol(&bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+    addHuffmanSymbol(writer, tree_ll, 256);
 
     break; /*end of error-while*/
   }
 
-  /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-  HuffmanTree_cleanup(&tree_cl);
-  uivector_cleanup(&frequencies_ll);
-  uivector_cleanup(&frequencies_d);
-  uivector_cleanup(&frequencies_cl);
-  uivector_cleanup(&bitlen_lld_e);
-  uivector_cleanup(&bitlen_lld);
-  uivector_cleanup(&bitlen_cl);
-
   return error;
 }
 
-static unsigned deflateFixed(ucvector* out, const unsigned char* data, size_t datasize, const LodeZlib_CompressSettings* settings)
+/*
+The bits it takes to code total symbols with codes of their entropy, a good enough estimate of what a Huffman
+code of them costs, where logsum is the sum of count * ln(count) over their counts. Kept that way, the entropy of
+two sets of counts added together can be updated symbol by symbol.
+*/
+static double entropyBits(double total, double logsum)
 {
-  HuffmanTree tree_ll; /*tree for literal values and length codes*/
-  HuffmanTree tree_d; /*tree for distance codes*/
+  return total > 0 ? (total * log(total) - logsum) / log(2.0) : 0;
+}
+
+static double countLogSum(const unsigned* counts, size_t n)
+{
+  double sum = 0;
+  size_t i;
+  for(i = 0; i < n; i++) if(counts[i]) sum += counts[i] * log((double)counts[i]);
+  return sum;
+}
+
+/*what adding the counts in chunk to those in block does to their countLogSum, and the total of chunk*/
+static void addCountLogSums(double* chunksum, double* mergedsum, double* chunktotal,
+                            const unsigned* block, const unsigned* chunk, size_t n)
+{
+  size_t i;
+  for(i = 0; i < n; i++)
+  {
+    double b = block[i], c = chunk[i];
+    if(!chunk[i]) continue;
+    *chunksum += c * log(c);
+    *mergedsum += (b + c) * log(b + c) - (block[i] ? b * log(b) : 0);
+    *chunktotal += c;
+  }
+}
+
+/*the LZ77 tokens findBlockSplits looks at together*/
+static const size_t SPLIT_CHUNK_SIZE = 1024;
+/*roughly what a dynamic block's header costs, in bits, for the trees of a typical screenshot*/
+static const double SPLIT_BLOCK_BITS = 600;
+/*the most tokens a block is let grow to before it is ended anyway, to bound the memory they take*/
+static const size_t SPLIT_MAX_BLOCK_SIZE = 131072;
+
+/*
+Find where to end blocks in scratch->block, the tokens of the dynamic block still open, so that each has Huffman
+trees of its own. The tokens are taken SPLIT_CHUNK_SIZE at a time: a chunk starts a new block when the entropy of
+its symbols on their own, plus what another block's header costs, is less than what adding them to the block so
+far would cost. Only the chunks not counted by the last call are looked at, and each is only counted and compared
+once, so however the tokens come this takes linear time.
+splits gets the index each block ends at. Unless final, a partial chunk at the end is left for next time.
+*/
+static unsigned findBlockSplits(DeflateScratch* scratch, unsigned final)
+{
+  const unsigned* tokens = scratch->block.data;
+  unsigned* block_ll = scratch->blockcounts_ll;
+  unsigned* block_d = scratch->blockcounts_d;
+  unsigned chunk_ll[286], chunk_d[30];
+  size_t chunkstart, chunkend, blockstart = 0, i;
+  double blocktotal_ll = 0, blocktotal_d = 0, blocksum_ll, blocksum_d;
+
+  for(i = 0; i < 286; i++) blocktotal_ll += block_ll[i];
+  for(i = 0; i < 30; i++) blocktotal_d += block_d[i];
+  blocksum_ll = countLogSum(block_ll, 286);
+  blocksum_d = countLogSum(block_d, 30);
+
+  scratch->splits.size = 0;
+  for(chunkstart = scratch->blockscanned; chunkstart < scratch->block.size; chunkstart = chunkend)
+  {
+    double chunksum_ll = 0, chunksum_d = 0, chunktotal_ll = 0, chunktotal_d = 0;
+    double mergedsum_ll = blocksum_ll, mergedsum_d = blocksum_d;
+    double together, apart;
+
+    if(scratch->block.size - chunkstart < SPLIT_CHUNK_SIZE && !final) break;
+    chunkend = scratch->block.size - chunkstart < SPLIT_CHUNK_SIZE ? scratch->block.size : chunkstart + SPLIT_CHUNK_SIZE;
+
+    memset(chunk_ll, 0, sizeof(chunk_ll));
+    memset(chunk_d, 0, sizeof(chunk_d));
+    for(i = chunkstart; i < chunkend; i++)
+    {
+      chunk_ll[LZ77_SYMBOL(tokens[i])]++;
+      if(LZ77_SYMBOL(tokens[i]) > 256) chunk_d[LZ77_DISTANCE_CODE(tokens[i])]++;
+    }
+    addCountLogSums(&chunksum_ll, &mergedsum_ll, &chunktotal_ll, block_ll, chunk_ll, 286);
+    addCountLogSums(&chunksum_d, &mergedsum_d, &chunktotal_d, block_d, chunk_d, 30);
 
-  unsigned BFINAL = 1; /*make only one block... the first and final one*/
+    together = entropyBits(blocktotal_ll + chunktotal_ll, mergedsum_ll) + entropyBits(blocktotal_d + chunktotal_d, mergedsum_d);
+    apart = entropyBits(blocktotal_ll, blocksum_ll) + entropyBits(blocktotal_d, blocksum_d)
+          + entropyBits(chunktotal_ll, chunksum_ll) + entropyBits(chunktotal_d, chunksum_d) + SPLIT_BLOCK_BITS;
+    if(chunkstart > blockstart && (apart < together || chunkend - blockstart > SPLIT_MAX_BLOCK_SIZE))
+    {
+      if(!uivector_push_back(&scratch->splits, (unsigned)chunkstart)) return 9964; /*alloc fail*/
+      blockstart = chunkstart;
+      memset(block_ll, 0, sizeof(scratch->blockcounts_ll));
+      memset(block_d, 0, sizeof(scratch->blockcounts_d));
+      blocktotal_ll = blocktotal_d = 0;
+      mergedsum_ll = chunksum_ll;
+      mergedsum_d = chunksum_d;
+    }
+    for(i = 0; i < 286; i++) block_ll[i] += chunk_ll[i];
+    for(i = 0; i < 30; i++) block_d[i] += chunk_d[i];
+    blocktotal_ll += chunktotal_ll;
+    blocktotal_d += chunktotal_d;
+    blocksum_ll = mergedsum_ll;
+    blocksum_d = mergedsum_d;
+  }
+  scratch->blockscanned = chunkstart;
+
+  return 0;
+}
+
+/*
+Deflate data[datapos..dataend) in blocks of type "dynamic", with matches allowed to reach back before datapos.
+
+With blockSplitting, blocks are ended where the symbols change enough for new trees to pay for themselves, such
+as where text gives way to a photo, rather than wherever the data is given in pieces: the last block is left open
+for the next call to carry on, unless this is the final one.
+*/
+static unsigned deflateDynamic(BitWriter* writer, DeflateScratch* scratch, const unsigned char* data, size_t datapos, size_t dataend,
+                               const LodeZlib_CompressSettings* settings, unsigned final)
+{
+  uivector* lz77_encoded = &scratch->lz77_encoded;
+  uivector* block = &scratch->block;
   unsigned error = 0;
-  size_t i, bp = 0; /*the bit pointer*/
+  size_t i, blockstart = 0;
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+  if(!settings->useLZ77) return writeDynamicBlock(writer, scratch, NULL, 0, &data[datapos], dataend - datapos, final);
 
-  generateFixedLitLenTree(&tree_ll);
-  generateFixedDistanceTree(&tree_d);
+  lz77_encoded->size = 0;
+  error = encodeLZ77Strategy(scratch, data, datapos, dataend, settings); /*LZ77 encoded*/
+  if(error) return error;
+  if(!settings->blockSplitting) return writeDynamicBlock(writer, scratch, lz77_encoded->data, lz77_encoded->size, NULL, 0, final);
 
-  addBitToStream(&bp, out, BFINAL);
-  addBitToStream(&bp, out, 1); /*first bit of BTYPE*/
-  addBitToStream(&bp, out, 0); /*second bit of BTYPE*/
+  i = block->size;
+  if(!uivector_resize(block, block->size + lz77_encoded->size)) return 9964; /*alloc fail*/
+  if(lz77_encoded->size) memcpy(&block->data[i], lz77_encoded->data, lz77_encoded->size * sizeof(unsigned));
+
+  error = findBlockSplits(scratch, final);
+  /*the final call ends the last block too*/
+  if(!error && final && !uivector_push_back(&scratch->splits, (unsigned)block->size)) error = 9964; /*alloc fail*/
+
+  for(i = 0; !error && i < scratch->splits.size; i++)
+  {
+    error = writeDynamicBlock(writer, scratch, block->data + blockstart, scratch->splits.data[i] - blockstart, NULL, 0,
+                              final && i + 1 == scratch->splits.size);
+    blockstart = scratch->splits.data[i];
+  }
+  if(error) return error;
+
+  /*what's left is the open block*/
+  if(blockstart > 0) memmove(block->data, block->data + blockstart, (block->size - blockstart) * sizeof(unsigned));
+  block->size -= blockstart;
+  scratch->blockscanned -= blockstart;
+  return 0;
+}
+
+/*
+Deflate for a block of type "fixed", with the trees predefined by deflate. Their codes are constant tables,
+so nothing has to be built or stored: with a greedy matcher this is the quickest way to compress.
+*/
+static unsigned deflateFixed(BitWriter* writer, DeflateScratch* scratch, const unsigned char* data, size_t datapos, size_t dataend,
+                             const LodeZlib_CompressSettings* settings, unsigned final)
+{
+  unsigned BFINAL = final;
+  unsigned error = 0;
+  size_t i;
 
   if(settings->useLZ77) /*LZ77 encoded*/
   {
-    uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, data, datasize, settings->windowSize);
-    if(!error) writeLZ77data(&bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
+    uivector* lz77_encoded = &scratch->lz77_encoded;
+    lz77_encoded->size = 0;
+    error = encodeLZ77Strategy(scratch, data, datapos, dataend, settings);
+    if(error) return error;
+    if(!BitWriter_reserve(writer, 3 + maxLZ77Bits(lz77_encoded->data, lz77_encoded->size))) return 9960; /*alloc fail*/
+
+    BitWriter_write(writer, BFINAL, 1);
+    BitWriter_write(writer, 1, 2); /*BTYPE "fixed"*/
+    writeLZ77data(writer, lz77_encoded->data, lz77_encoded->size, FIXED_LITLEN_CODES, FIXED_LITLEN_LENGTHS, FIXED_DISTANCE_CODES, FIXED_DISTANCE_LENGTHS);
   }
   else /*no LZ77, but still will be Huffman compressed*/
   {
-    for(i = 0; i < datasize; i++)
-    {
-      addHuffmanSymbol(&bp, out, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
-    }
+    /*literals take at most 9 bits, the end code 7*/
+    if(!BitWriter_reserve(writer, 3 + (dataend - datapos) * 9 + 7)) return 9960; /*alloc fail*/
+
+    BitWriter_write(writer, BFINAL, 1);
+    BitWriter_write(writer, 1, 2); /*BTYPE "fixed"*/
+    for(i = datapos; i < dataend; i++) BitWriter_write(writer, FIXED_LITLEN_CODES[data[i]], FIXED_LITLEN_LENGTHS[data[i]]);
   }
-  if(!error) addHuffmanSymbol(&bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256)); /*"end" code*/
+  BitWriter_write(writer, FIXED_LITLEN_CODES[256], FIXED_LITLEN_LENGTHS[256]); /*"end" code*/
 
-  /*cleanup*/
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+  return 0;
+}
 
-  return error;
+/*
+Write data[datapos..dataend) as one or more deflate blocks of the type in the settings, after what's already been written.
+The bytes before datapos are history that matches can refer back to.
+*/
+static unsigned deflateBlock(BitWriter* writer, DeflateScratch* scratch, const unsigned char* data, size_t datapos, size_t dataend,
+                             const LodeZlib_CompressSettings* settings, unsigned final)
+{
+  if(settings->btype == 0) return deflateNoCompression(writer, data, datapos, dataend, final);
+  if(settings->strategy > 2) return 83;
+
+  if(settings->useLZ77 && settings->strategy != 1) /*RLE needs no table*/
+  {
+    unsigned error = LZ77Table_reserve(&scratch->table, settings->windowSize);
+    if(error) return error;
+  }
+
+  if(settings->btype == 1) return deflateFixed(writer, scratch, data, datapos, dataend, settings, final);
+  else if(settings->btype == 2) return deflateDynamic(writer, scratch, data, datapos, dataend, settings, final);
+  else return 61;
+}
+
+/*
+End the dynamic block deflateDynamic left open, if any, without ending the stream, then pad to a byte boundary with
+an empty stored block like zlib's Z_SYNC_FLUSH. Whatever is deflated next can then be deflated on its own and simply
+appended. data[0..dataend) is the data deflated so far.
+*/
+static unsigned deflateSyncFlush(BitWriter* writer, DeflateScratch* scratch, const unsigned char* data, size_t dataend)
+{
+  if(scratch->block.size > 0)
+  {
+    unsigned error = writeDynamicBlock(writer, scratch, scratch->block.data, scratch->block.size, NULL, 0, 0);
+    if(error) return error;
+    DeflateScratch_restart(scratch);
+  }
+  return deflateNoCompression(writer, data, dataend, dataend, 0);
 }
 
 unsigned LodeFlate_deflate(ucvector* out, const unsigned char* data, size_t datasize, const LodeZlib_CompressSettings* settings)
 {
   unsigned error = 0;
-  if(settings->btype == 0) error = deflateNoCompression(out, data, datasize);
-  else if(settings->btype == 1) error = deflateFixed(out, data, datasize, settings);
-  else if(settings->btype == 2) error = deflateDynamic(out, data, datasize, settings);
-  else error = 61;
+  BitWriter writer;
+  DeflateScratch scratch;
+  BitWriter_init(&writer, out);
+  DeflateScratch_init(&scratch);
+  error = deflateBlock(&writer, &scratch, data, 0, datasize, settings, 1);
+  if(!error) BitWriter_flush(&writer);
+  DeflateScratch_cleanup(&scratch);
   return error;
 }
 
@@ -1793,6 +2423,27 @@ static unsigned adler32(const unsigned char* data, unsigned len)
   return update_adler32(1L, data, len);
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*
+The adler32 of two pieces of data one after the other, from the adler32 of each and the length of the second, as
+zlib's adler32_combine: the first sum gains the second's, and the second sum gains the first's first sum once for
+every byte of the second piece.
+*/
+static unsigned combineAdler32(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 2 * 65521) s2 -= 2 * 65521;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Reading and writing single bits and bytes from/to stream for Zlib      / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -1857,14 +2508,84 @@ unsigned LodeZlib_decompress(unsigned char** out, size_t* outsize, const unsigne
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned LodeZlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodeZlib_CompressSettings* settings)
+/*
+Working memory to deflate one segment of a stream in, while others are deflated on other threads. The threads
+allocate the buffers inside it themselves, which is only safe because nothing else touches them until the
+segments are freed.
+*/
+typedef struct DeflateSegment
 {
-  /*initially, *out must be NULL and outsize 0, if you just give some random *out that's pointing to a non allocated buffer, this'll crash*/
-  ucvector deflatedata, outv;
-  size_t i;
+  DeflateScratch scratch;
+  ucvector out; /*the segment's deflate blocks, ending at a byte boundary*/
+  unsigned adler; /*Adler32 of the segment's data alone*/
   unsigned error;
+} DeflateSegment;
 
-  unsigned ADLER32;
+typedef struct DeflateSegments
+{
+  DeflateSegment* data;
+  size_t size;
+} DeflateSegments;
+
+static void DeflateSegments_init(DeflateSegments* segments)
+{
+  segments->data = 0;
+  segments->size = 0;
+}
+
+static void DeflateSegments_cleanup(DeflateSegments* segments)
+{
+  size_t i;
+  for(i = 0; i < segments->size; i++)
+  {
+    DeflateScratch_cleanup(&segments->data[i].scratch);
+    ucvector_cleanup(&segments->data[i].out);
+  }
+  lodepng_free(segments->data);
+  DeflateSegments_init(segments);
+}
+
+/*makes sure there are at least size segments. returns 1 if success, 0 if failure*/
+static unsigned DeflateSegments_reserve(DeflateSegments* segments, size_t size)
+{
+  DeflateSegment* data;
+  if(size <= segments->size) return 1;
+  data = (DeflateSegment*)lodepng_realloc(segments->data, size * sizeof(DeflateSegment));
+  if(!data) return 0;
+  segments->data = data;
+  for(; segments->size < size; segments->size++)
+  {
+    DeflateScratch_init(&data[segments->size].scratch);
+    ucvector_init(&data[segments->size].out);
+  }
+  return 1;
+}
+
+/*
+A zlib stream that is compressed a piece at a time, so the whole of the
+uncompressed data never has to be in memory at once. Each piece becomes one or
+more deflate blocks, written straight after the previous ones.
+*/
+typedef struct DeflateStream
+{
+  ucvector* out;
+  BitWriter writer; /*writes to out*/
+  unsigned adler; /*Adler32 of the data so far*/
+  DeflateScratch* scratch; /*either someone else's, kept between streams, or ownscratch*/
+  DeflateScratch ownscratch;
+  const LodeZlib_CompressSettings* settings;
+  LodePNG_ParallelFor parallelFor; /*for DeflateStream_addSegments, NULL to deflate the segments one by one*/
+  void* parallelUser;
+  DeflateSegments* segments; /*either someone else's or ownsegments, like scratch*/
+  DeflateSegments ownsegments;
+} DeflateStream;
+
+/*
+Starts the zlib stream by appending its header to out. The stream works in scratch if it isn't NULL, otherwise
+in memory of its own that is freed by DeflateStream_cleanup.
+*/
+static unsigned DeflateStream_init(DeflateStream* stream, ucvector* out, const LodeZlib_CompressSettings* settings, DeflateScratch* scratch)
+{
   /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
   unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
   unsigned FLEVEL = 0;
@@ -1873,20 +2594,143 @@ unsigned LodeZlib_compress(unsigned char** out, size_t* outsize, const unsigned
   unsigned FCHECK = 31 - CMFFLG % 31;
   CMFFLG += FCHECK;
 
-  ucvector_init_buffer(&outv, *out, *outsize); /*ucvector-controlled version of the output buffer, for dynamic array*/
+  stream->out = out;
+  stream->adler = 1;
+  stream->settings = settings;
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
+  DeflateScratch_init(&stream->ownscratch);
+  stream->scratch = scratch ? scratch : &stream->ownscratch;
+  DeflateScratch_restart(stream->scratch);
+  stream->parallelFor = 0;
+  stream->parallelUser = 0;
+  DeflateSegments_init(&stream->ownsegments);
+  stream->segments = &stream->ownsegments;
 
-  ucvector_init(&deflatedata);
-  error = LodeFlate_deflate(&deflatedata, in, insize, settings);
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
+  BitWriter_init(&stream->writer, out);
+
+  return 0;
+}
+
+static void DeflateStream_cleanup(DeflateStream* stream)
+{
+  DeflateScratch_cleanup(&stream->ownscratch);
+  DeflateSegments_cleanup(&stream->ownsegments);
+}
 
+/*lets DeflateStream_addSegments run on other threads with parallelFor, working in segments if it isn't NULL*/
+static void DeflateStream_setParallel(DeflateStream* stream, LodePNG_ParallelFor parallelFor, void* parallelUser,
+                                      DeflateSegments* segments)
+{
+  stream->parallelFor = parallelFor;
+  stream->parallelUser = parallelUser;
+  if(segments) stream->segments = segments;
+}
+
+/*
+Compresses data[datapos..dataend) as the next piece of the stream. data[0..datapos) must be the end of
+the previous piece, or nothing, and is used as history for matches. After the final piece the stream
+is finished off with the checksum.
+*/
+static unsigned DeflateStream_add(DeflateStream* stream, const unsigned char* data, size_t datapos, size_t dataend, unsigned final)
+{
+  unsigned error = deflateBlock(&stream->writer, stream->scratch, data, datapos, dataend, stream->settings, final);
+  if(error) return error;
+
+  if(dataend > datapos) stream->adler = update_adler32(stream->adler, &data[datapos], (unsigned)(dataend - datapos));
+  if(final)
+  {
+    BitWriter_flush(&stream->writer);
+    LodeZlib_add32bitInt(stream->out, stream->adler);
+  }
+
+  return 0;
+}
+
+/*what DeflateStream_addSegments gives each run of deflateSegment*/
+typedef struct DeflateSegmentsJob
+{
+  DeflateSegment* segments;
+  const LodeZlib_CompressSettings* settings;
+  const unsigned char* data;
+  size_t datapos, dataend, segmentsize;
+  unsigned final;
+} DeflateSegmentsJob;
+
+/*deflates segment number index of a DeflateSegmentsJob, a LodePNG_ParallelFor job*/
+static void deflateSegment(unsigned index, void* jobdata)
+{
+  const DeflateSegmentsJob* job = (const DeflateSegmentsJob*)jobdata;
+  DeflateSegment* segment = &job->segments[index];
+  size_t start = job->datapos + index * job->segmentsize;
+  size_t end = job->dataend - start > job->segmentsize ? start + job->segmentsize : job->dataend;
+  unsigned last = job->final && end == job->dataend;
+  BitWriter writer;
+
+  segment->out.size = 0;
+  BitWriter_init(&writer, &segment->out);
+  DeflateScratch_restart(&segment->scratch);
+  segment->error = deflateBlock(&writer, &segment->scratch, job->data, start, end, job->settings, last);
+  if(!segment->error && !last) segment->error = deflateSyncFlush(&writer, &segment->scratch, job->data, end);
+  if(!segment->error) BitWriter_flush(&writer);
+  segment->adler = end > start ? adler32(&job->data[start], (unsigned)(end - start)) : 1;
+}
+
+/*
+Like DeflateStream_add, but data[datapos..dataend) is cut into segments of segmentsize bytes that are deflated at the
+same time, with parallelFor, as pigz does. Each is deflated on its own, with the 32K before it as history, and ends
+with a sync flush, so they can be put one after the other as they are. Their Adler32s are combined, rather than
+reading the data again. The output only depends on segmentsize, however many threads there are.
+Every piece of the stream has to be added this way, as the segments have to start at a byte boundary.
+*/
+static unsigned DeflateStream_addSegments(DeflateStream* stream, const unsigned char* data, size_t datapos, size_t dataend,
+                                          size_t segmentsize, unsigned final)
+{
+  DeflateSegmentsJob job;
+  size_t count = (dataend - datapos + segmentsize - 1) / segmentsize, i;
+  if(count == 0) count = 1; /*the final piece may be empty, but still has to end the stream*/
+  if(!DeflateSegments_reserve(stream->segments, count)) return 9965; /*alloc fail*/
+
+  job.segments = stream->segments->data;
+  job.settings = stream->settings;
+  job.data = data;
+  job.datapos = datapos;
+  job.dataend = dataend;
+  job.segmentsize = segmentsize;
+  job.final = final;
+  if(stream->parallelFor && count > 1) stream->parallelFor((unsigned)count, deflateSegment, &job, stream->parallelUser);
+  else for(i = 0; i < count; i++) deflateSegment((unsigned)i, &job);
+
+  for(i = 0; i < count; i++)
+  {
+    const DeflateSegment* segment = &stream->segments->data[i];
+    size_t start = datapos + i * segmentsize;
+    size_t end = dataend - start > segmentsize ? start + segmentsize : dataend;
+    if(segment->error) return segment->error;
+    if(!ucvector_resize(stream->out, stream->out->size + segment->out.size)) return 9965; /*alloc fail*/
+    if(segment->out.size) memcpy(&stream->out->data[stream->out->size - segment->out.size], segment->out.data, segment->out.size);
+    stream->adler = combineAdler32(stream->adler, segment->adler, end - start);
+  }
+  if(final) LodeZlib_add32bitInt(stream->out, stream->adler);
+
+  return 0;
+}
+
+unsigned LodeZlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodeZlib_CompressSettings* settings)
+{
+  /*initially, *out must be NULL and outsize 0, if you just give some random *out that's pointing to a non allocated buffer, this'll crash*/
+  ucvector outv;
+  DeflateStream stream;
+  unsigned error;
+
+  ucvector_init_buffer(&outv, *out, *outsize); /*ucvector-controlled version of the output buffer, for dynamic array*/
+
+  error = DeflateStream_init(&stream, &outv, settings, 0);
   if(!error)
   {
-    ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i < deflatedata.size; i++) ucvector_push_back(&outv, deflatedata.data[i]);
-    ucvector_cleanup(&deflatedata);
-    LodeZlib_add32bitInt(&outv, ADLER32);
+    error = DeflateStream_add(&stream, in, 0, insize, 1);
+    DeflateStream_cleanup(&stream);
   }
 
   *out = outv.data;
@@ -1908,9 +2752,50 @@ void LodeZlib_CompressSettings_init(LodeZlib_CompressSettings* settings)
   settings->btype = 2; /*compress with dynamic huffman tree (not in the mathematical sense, just not the predefined one)*/
   settings->useLZ77 = 1;
   settings->windowSize = 2048; /*this is a good tradeoff between speed and compression ratio*/
+  settings->maxChainLength = 0;
+  settings->niceLength = (unsigned)MAX_SUPPORTED_DEFLATE_LENGTH;
+  settings->maxLazy = 0;
+  settings->goodLength = (unsigned)MAX_SUPPORTED_DEFLATE_LENGTH;
+  settings->strategy = 0;
+  settings->rleDistance = 1;
+  settings->rleDistance2 = 0;
+  settings->numIterations = 15;
+  settings->blockSplitting = 1;
 }
 
-const LodeZlib_CompressSettings LodeZlib_defaultCompressSettings = {2, 1, 2048};
+const LodeZlib_CompressSettings LodeZlib_defaultCompressSettings = {2, 1, 2048, 0, 258, 0, 258, 0, 1, 0, 15, 1};
+
+/*
+zlib's tuning for each level: goodLength, maxLazy, niceLength, maxChainLength. Levels 1 to 3 take
+the first match found instead of also trying the next position, like zlib's deflate_fast.
+*/
+static const unsigned LEVEL_SETTINGS[9][4] =
+{
+  { 4,   0,   8,    4},
+  { 4,   0,  16,    8},
+  { 4,   0,  32,   32},
+  { 4,   4,  16,   16},
+  { 8,  16,  32,   32},
+  { 8,  16, 128,  128},
+  { 8,  32, 128,  256},
+  {32, 128, 258, 1024},
+  {32, 258, 258, 4096}
+};
+
+void LodeZlib_CompressSettings_initLevel(LodeZlib_CompressSettings* settings, unsigned level)
+{
+  const unsigned* tuning;
+  if(level < 1) level = 1;
+  if(level > 9) level = 9;
+  tuning = LEVEL_SETTINGS[level - 1];
+
+  LodeZlib_CompressSettings_init(settings);
+  settings->windowSize = 32768; /*with a chain length limit, a bigger window costs little time*/
+  settings->goodLength = tuning[0];
+  settings->maxLazy = tuning[1];
+  settings->niceLength = tuning[2];
+  settings->maxChainLength = tuning[3];
+}
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -1949,6 +2834,9 @@ in the other LodePNG functions.
 *out must be NULL and *outsize must be 0 initially, and after the function is done,
 *out must point to the decompressed data, *outsize must be the size of it, and must
 be the size of the useful data in bytes, not the alloc size.
+
+The encoder doesn't use LodePNG_compress for the image data itself: that is deflated
+with a DeflateStream straight into the IDAT chunk (see IDATChunk) to save copying it.
 */
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -2156,7 +3044,7 @@ unsigned LodePNG_append_chunk(unsigned char** out, size_t* outlength, const unsi
   size_t new_length = (*outlength) + total_chunk_length;
   if(new_length < total_chunk_length || new_length < (*outlength)) return 77; /*integer overflow happened*/
 
-  new_buffer = (unsigned char*)realloc(*out, new_length);
+  new_buffer = (unsigned char*)lodepng_realloc(*out, new_length);
   if(!new_buffer) return 9929; /*alloc fail*/
   (*out) = new_buffer;
   (*outlength) = new_length;
@@ -2173,7 +3061,7 @@ unsigned LodePNG_create_chunk(unsigned char** out, size_t* outlength, unsigned l
   unsigned char *chunk, *new_buffer;
   size_t new_length = (*outlength) + length + 12;
   if(new_length < length + 12 || new_length < (*outlength)) return 77; /*integer overflow happened*/
-  new_buffer = (unsigned char*)realloc(*out, new_length);
+  new_buffer = (unsigned char*)lodepng_realloc(*out, new_length);
   if(!new_buffer) return 9930; /*alloc fail*/
   (*out) = new_buffer;
   (*outlength) = new_length;
@@ -2253,7 +3141,7 @@ void LodePNG_InfoColor_cleanup(LodePNG_InfoColor* info)
 
 void LodePNG_InfoColor_clearPalette(LodePNG_InfoColor* info)
 {
-  if(info->palette) free(info->palette);
+  if(info->palette) lodepng_free(info->palette);
   info->palettesize = 0;
 }
 
@@ -2265,7 +3153,7 @@ unsigned LodePNG_InfoColor_addPalette(LodePNG_InfoColor* info, unsigned char r,
   {
     /*allocated data must be at least 4* palettesize (for 4 color bytes)*/
     size_t alloc_size = info->palettesize == 0 ? 4 : info->palettesize * 4 * 2;
-    data = (unsigned char*)realloc(info->palette, alloc_size);
+    data = (unsigned char*)lodepng_realloc(info->palette, alloc_size);
     if(!data) return 9931; /*alloc fail*/
     else info->palette = data;
   }
@@ -2336,7 +3224,7 @@ void LodePNG_UnknownChunks_init(LodePNG_UnknownChunks* chunks)
 void LodePNG_UnknownChunks_cleanup(LodePNG_UnknownChunks* chunks)
 {
   unsigned i;
-  for(i = 0; i < 3; i++) free(chunks->data[i]);
+  for(i = 0; i < 3; i++) lodepng_free(chunks->data[i]);
 }
 
 unsigned LodePNG_UnknownChunks_copy(LodePNG_UnknownChunks* dest, const LodePNG_UnknownChunks* src)
@@ -2349,7 +3237,7 @@ unsigned LodePNG_UnknownChunks_copy(LodePNG_UnknownChunks* dest, const LodePNG_U
   {
     size_t j;
     dest->datasize[i] = src->datasize[i];
-    dest->data[i] = (unsigned char*)malloc(src->datasize[i]);
+    dest->data[i] = (unsigned char*)lodepng_malloc(src->datasize[i]);
     if(!dest->data[i] && dest->datasize[i]) return 9932; /*alloc fail*/
     for(j = 0; j < src->datasize[i]; j++) dest->data[i][j] = src->data[i][j];
   }
@@ -2393,18 +3281,18 @@ void LodePNG_Text_clear(LodePNG_Text* text)
     string_cleanup(&text->keys[i]);
     string_cleanup(&text->strings[i]);
   }
-  free(text->keys);
-  free(text->strings);
+  lodepng_free(text->keys);
+  lodepng_free(text->strings);
 }
 
 unsigned LodePNG_Text_add(LodePNG_Text* text, const char* key, const char* str)
 {
-  char** new_keys = (char**)(realloc(text->keys, sizeof(char*) * (text->num + 1)));
-  char** new_strings = (char**)(realloc(text->strings, sizeof(char*) * (text->num + 1)));
+  char** new_keys = (char**)(lodepng_realloc(text->keys, sizeof(char*) * (text->num + 1)));
+  char** new_strings = (char**)(lodepng_realloc(text->strings, sizeof(char*) * (text->num + 1)));
   if(!new_keys || !new_strings)
   {
-    free(new_keys);
-    free(new_strings);
+    lodepng_free(new_keys);
+    lodepng_free(new_strings);
     return 9933; /*alloc fail*/
   }
 
@@ -2463,24 +3351,24 @@ void LodePNG_IText_clear(LodePNG_IText* text)
     string_cleanup(&text->transkeys[i]);
     string_cleanup(&text->strings[i]);
   }
-  free(text->keys);
-  free(text->langtags);
-  free(text->transkeys);
-  free(text->strings);
+  lodepng_free(text->keys);
+  lodepng_free(text->langtags);
+  lodepng_free(text->transkeys);
+  lodepng_free(text->strings);
 }
 
 unsigned LodePNG_IText_add(LodePNG_IText* text, const char* key, const char* langtag, const char* transkey, const char* str)
 {
-  char** new_keys = (char**)(realloc(text->keys, sizeof(char*) * (text->num + 1)));
-  char** new_langtags = (char**)(realloc(text->langtags, sizeof(char*) * (text->num + 1)));
-  char** new_transkeys = (char**)(realloc(text->transkeys, sizeof(char*) * (text->num + 1)));
-  char** new_strings = (char**)(realloc(text->strings, sizeof(char*) * (text->num + 1)));
+  char** new_keys = (char**)(lodepng_realloc(text->keys, sizeof(char*) * (text->num + 1)));
+  char** new_langtags = (char**)(lodepng_realloc(text->langtags, sizeof(char*) * (text->num + 1)));
+  char** new_transkeys = (char**)(lodepng_realloc(text->transkeys, sizeof(char*) * (text->num + 1)));
+  char** new_strings = (char**)(lodepng_realloc(text->strings, sizeof(char*) * (text->num + 1)));
   if(!new_keys || !new_langtags || !new_transkeys || !new_strings)
   {
-    free(new_keys);
-    free(new_langtags);
-    free(new_transkeys);
-    free(new_strings);
+    lodepng_free(new_keys);
+    lodepng_free(new_langtags);
+    lodepng_free(new_transkeys);
+    lodepng_free(new_strings);
     return 9934; /*alloc fail*/
   }
 
@@ -2572,7 +3460,7 @@ unsigned LodePNG_InfoColor_copy(LodePNG_InfoColor* dest, const LodePNG_InfoColor
   size_t i;
   LodePNG_InfoColor_cleanup(dest);
   *dest = *source;
-  dest->palette = (unsigned char*)malloc(source->palettesize * 4);
+  dest->palette = (unsigned char*)lodepng_malloc(source->palettesize * 4);
   if(!dest->palette && source->palettesize) return 9935; /*alloc fail*/
   for(i = 0; i < source->palettesize * 4; i++) dest->palette[i] = source->palette[i];
   return 0;
@@ -3455,9 +4343,9 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
     else if(LodePNG_chunk_type_equals(chunk, "PLTE"))
     {
       unsigned pos = 0;
-      if(decoder->infoPng.color.palette) free(decoder->infoPng.color.palette);
+      if(decoder->infoPng.color.palette) lodepng_free(decoder->infoPng.color.palette);
       decoder->infoPng.color.palettesize = chunkLength / 3;
-      decoder->infoPng.color.palette = (unsigned char*)malloc(4 * decoder->infoPng.color.palettesize);
+      decoder->infoPng.color.palette = (unsigned char*)lodepng_malloc(4 * decoder->infoPng.color.palettesize);
       if(!decoder->infoPng.color.palette && decoder->infoPng.color.palettesize)
       {
         decoder->infoPng.color.palettesize = 0;
@@ -3544,7 +4432,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           while(length < chunkLength && data[length] != 0) length++;
           if(length + 1 >= chunkLength) CERROR_BREAK(decoder->error, 75); /*error, end reached, no null terminator?*/
 
-          key = (char*)malloc(length + 1);
+          key = (char*)lodepng_malloc(length + 1);
           if(!key) CERROR_BREAK(decoder->error, 9938); /*alloc fail*/
 
           key[length] = 0;
@@ -3554,7 +4442,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           if(string2_begin > chunkLength) CERROR_BREAK(decoder->error, 75); /*error, end reached, no null terminator?*/
 
           length = chunkLength - string2_begin;
-          str = (char*)malloc(length + 1);
+          str = (char*)lodepng_malloc(length + 1);
           if(!str) CERROR_BREAK(decoder->error, 9939); /*alloc fail*/
 
           str[length] = 0;
@@ -3565,8 +4453,8 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           break;
         }
 
-        free(key);
-        free(str);
+        lodepng_free(key);
+        lodepng_free(str);
       }
     }
     /*compressed text chunk (zTXt)*/
@@ -3585,7 +4473,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           for(length = 0; length < chunkLength && data[length] != 0; length++) ;
           if(length + 2 >= chunkLength) CERROR_BREAK(decoder->error, 75); /*no null termination, corrupt?*/
 
-          key = (char*)malloc(length + 1);
+          key = (char*)lodepng_malloc(length + 1);
           if(!key) CERROR_BREAK(decoder->error, 9940); /*alloc fail*/
 
           key[length] = 0;
@@ -3606,7 +4494,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           break;
         }
 
-        free(key);
+        lodepng_free(key);
         ucvector_cleanup(&decoded);
         if(decoder->error) break;
       }
@@ -3630,7 +4518,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           for(length = 0; length < chunkLength && data[length] != 0; length++) ;
           if(length + 2 >= chunkLength) CERROR_BREAK(decoder->error, 75); /*no null termination char found*/
 
-          key = (char*)malloc(length + 1);
+          key = (char*)lodepng_malloc(length + 1);
           if(!key) CERROR_BREAK(decoder->error, 9941); /*alloc fail*/
 
           key[length] = 0;
@@ -3646,7 +4534,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           for(i = begin; i < chunkLength && data[i] != 0; i++) length++;
           if(begin + length + 1 >= chunkLength) CERROR_BREAK(decoder->error, 75); /*no null termination char found*/
 
-          langtag = (char*)malloc(length + 1);
+          langtag = (char*)lodepng_malloc(length + 1);
           if(!langtag) CERROR_BREAK(decoder->error, 9942); /*alloc fail*/
 
           langtag[length] = 0;
@@ -3658,7 +4546,7 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           for(i = begin; i < chunkLength && data[i] != 0; i++) length++;
           if(begin + length + 1 >= chunkLength) CERROR_BREAK(decoder->error, 75); /*no null termination, corrupt?*/
 
-          transkey = (char*)malloc(length + 1);
+          transkey = (char*)lodepng_malloc(length + 1);
           if(!transkey) CERROR_BREAK(decoder->error, 9943); /*alloc fail*/
 
           transkey[length] = 0;
@@ -3689,9 +4577,9 @@ static void decodeGeneric(LodePNG_Decoder* decoder, unsigned char** out, size_t*
           break;
         }
 
-        free(key);
-        free(langtag);
-        free(transkey);
+        lodepng_free(key);
+        lodepng_free(langtag);
+        lodepng_free(transkey);
         ucvector_cleanup(&decoded);
         if(decoder->error) break;
       }
@@ -3801,14 +4689,14 @@ void LodePNG_Decoder_decode(LodePNG_Decoder* decoder, unsigned char** out, size_
     }
 
     *outsize = (decoder->infoPng.width * decoder->infoPng.height * LodePNG_InfoColor_getBpp(&decoder->infoRaw.color) + 7) / 8;
-    *out = (unsigned char*)malloc(*outsize);
+    *out = (unsigned char*)lodepng_malloc(*outsize);
     if(!(*out))
     {
       decoder->error = 9947; /*alloc fail*/
       *outsize = 0;
     }
     else decoder->error = LodePNG_convert(*out, data, &decoder->infoRaw.color, &decoder->infoPng.color, decoder->infoPng.width, decoder->infoPng.height);
-    free(data);
+    lodepng_free(data);
   }
 }
 
@@ -3846,7 +4734,7 @@ unsigned LodePNG_decode_file(unsigned char** out, unsigned* w, unsigned* h, cons
   unsigned error;
   error = LodePNG_loadFile(&buffer, &buffersize, filename);
   if(!error) error = LodePNG_decode(out, w, h, buffer, buffersize, colorType, bitDepth);
-  free(buffer);
+  lodepng_free(buffer);
   return error;
 }
 
@@ -3906,15 +4794,90 @@ void LodePNG_Decoder_copy(LodePNG_Decoder* dest, const LodePNG_Decoder* source)
 /* / PNG Encoder                                                            / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-/*chunkName must be string of 4 characters*/
+struct LodePNG_EncodeContext
+{
+  DeflateScratch deflate;
+  DeflateSegments segments; /*for deflating with parallelFor*/
+  ucvector raw, scanlines, filtered; /*the band of rows compressRows works on*/
+};
+
+/*
+chunkName must be string of 4 characters. Unlike LodePNG_create_chunk, out grows like any ucvector, so adding
+many chunks doesn't realloc it each time.
+*/
 static unsigned addChunk(ucvector* out, const char* chunkName, const unsigned char* data, size_t length)
 {
-  unsigned error = LodePNG_create_chunk(&out->data, &out->size, (unsigned)length, chunkName, data);
-  if(error) return error;
-  out->allocsize = out->size; /*fix the allocsize again*/
+  size_t i, start = out->size;
+  unsigned char* chunk;
+  if(length > 2147483647 || out->size + length + 12 < out->size) return 77; /*too large for a chunk, or integer overflow*/
+  if(!ucvector_resize(out, out->size + length + 12)) return 9930; /*alloc fail*/
+  chunk = &out->data[start];
+
+  LodePNG_set32bitInt(chunk, (unsigned)length);
+  for(i = 0; i < 4; i++) chunk[4 + i] = chunkName[i];
+  for(i = 0; i < length; i++) chunk[8 + i] = data[i];
+  LodePNG_chunk_generate_crc(chunk);
+
   return 0;
 }
 
+/*
+An IDAT chunk written in place at the end of the PNG. The zlib data is compressed straight into it, and the CRC
+is brought up to date as each piece of it is finished, so the compressed image is never copied or read back.
+*/
+typedef struct IDATChunk
+{
+  ucvector* out;
+  size_t start; /*position of the chunk in out*/
+  size_t crcpos; /*out[start + 4..crcpos) is included in crc*/
+  unsigned crc; /*running CRC, not yet complemented*/
+} IDATChunk;
+
+/*appends the length (a placeholder until IDATChunk_finish) and type of the chunk, ready for its data*/
+static unsigned IDATChunk_begin(IDATChunk* chunk, ucvector* out)
+{
+  chunk->out = out;
+  chunk->start = out->size;
+  if(!ucvector_resize(out, out->size + 8)) return 9958; /*alloc fail*/
+  LodePNG_set32bitInt(&out->data[chunk->start], 0);
+  out->data[chunk->start + 4] = 'I';
+  out->data[chunk->start + 5] = 'D';
+  out->data[chunk->start + 6] = 'A';
+  out->data[chunk->start + 7] = 'T';
+  chunk->crcpos = chunk->start + 4;
+  chunk->crc = 0xffffffffu;
+  return 0;
+}
+
+/*adds out[crcpos..end) to the CRC. Those bytes must not change afterwards.*/
+static void IDATChunk_update(IDATChunk* chunk, size_t end)
+{
+  if(end <= chunk->crcpos) return;
+  chunk->crc = Crc32_update_crc(&chunk->out->data[chunk->crcpos], chunk->crc, end - chunk->crcpos);
+  chunk->crcpos = end;
+}
+
+/*everything appended to out since IDATChunk_begin is the data: fills in the length and appends the CRC*/
+static unsigned IDATChunk_finish(IDATChunk* chunk)
+{
+  size_t length = chunk->out->size - chunk->start - 8;
+  if(length > 2147483647) return 77; /*too large for a chunk*/
+  IDATChunk_update(chunk, chunk->out->size);
+  LodePNG_set32bitInt(&chunk->out->data[chunk->start], (unsigned)length);
+  LodePNG_add32bitInt(chunk->out, chunk->crc ^ 0xffffffffu);
+  return 0;
+}
+
+/*
+Room to reserve for the IDAT chunk of the given amount of filtered image data. Uncompressed data has a known
+size; otherwise this is only a guess, past which out grows as usual.
+*/
+static size_t estimateIDATSize(size_t datasize, const LodeZlib_CompressSettings* settings)
+{
+  if(settings->btype == 0) return datasize + (datasize / 65535 + 1) * 5 + 6 + 12; /*5 bytes per stored block*/
+  return datasize / 4 + 12;
+}
+
 static void writeSignature(ucvector* out)
 {
   /*8 bytes PNG signature, aka the magic bytes*/
@@ -4001,20 +4964,6 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNG_InfoColor* info)
   return error;
 }
 
-static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize, LodeZlib_CompressSettings* zlibsettings)
-{
-  ucvector zlibdata;
-  unsigned error = 0;
-
-  /*compress with the Zlib compressor*/
-  ucvector_init(&zlibdata);
-  error = LodePNG_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
-  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
-  ucvector_cleanup(&zlibdata);
-
-  return error;
-}
-
 static unsigned addChunk_IEND(ucvector* out)
 {
   unsigned error = 0;
@@ -4133,7 +5082,7 @@ static unsigned addChunk_bKGD(ucvector* out, const LodePNG_InfoPng* info)
 static unsigned addChunk_tIME(ucvector* out, const LodePNG_Time* time)
 {
   unsigned error = 0;
-  unsigned char* data = (unsigned char*)malloc(7);
+  unsigned char* data = (unsigned char*)lodepng_malloc(7);
   if(!data) return 9948; /*alloc fail*/
   data[0] = (unsigned char)(time->year / 256);
   data[1] = (unsigned char)(time->year % 256);
@@ -4143,7 +5092,7 @@ static unsigned addChunk_tIME(ucvector* out, const LodePNG_Time* time)
   data[5] = time->minute;
   data[6] = time->second;
   error = addChunk(out, "tIME", data, 7);
-  free(data);
+  lodepng_free(data);
   return error;
 }
 
@@ -4215,15 +5164,253 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       }
       else
       {
-        for(i =         0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i <    length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]); /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
+        for(i =         0; i < bytewidth; i++) out[i] = scanline[i];
+        for(i = bytewidth; i <    length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]); /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
+      }
+      break;
+    default: return; /*unexisting filter type given*/
+  }
+}
+
+/*filterStrategy 3 keeps the filter of the row above if its sum is no more than 1/FILTER_STICKINESS over the best*/
+static const size_t FILTER_STICKINESS = 8;
+
+/*the fewest bytes of scanlines worth filtering on another thread*/
+static const size_t FILTER_BAND_MIN = 65536;
+
+/*
+Adds what filter's heuristic counts against each filter type for the bytes of scanline from "from" to "to": every
+third byte of the filtered scanline, counted from the start of it, as an unsigned value. A NULL prevline counts as a
+row of zeros, which gives the same as filterScanline's special cases for the top row.
+*/
+static void addFilterCosts(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                           size_t from, size_t to, size_t bytewidth)
+{
+  size_t i = from + (3 - from % 3) % 3;
+  for(; i < to; i += 3)
+  {
+    unsigned char s = scanline[i];
+    unsigned char a = i >= bytewidth ? scanline[i - bytewidth] : 0;
+    unsigned char b = prevline ? prevline[i] : 0;
+    unsigned char c = prevline && i >= bytewidth ? prevline[i - bytewidth] : 0;
+    cost[0] += s;
+    cost[1] += (unsigned char)(s - a);
+    cost[2] += (unsigned char)(s - b);
+    cost[3] += (unsigned char)(s - (a + b) / 2);
+    cost[4] += (unsigned char)(s - paethPredictor(a, b, c));
+  }
+}
+
+#ifdef LODEPNG_SSE2
+/*paethPredictor of 16 bytes at a time, with its comparisons in 16 bits and its choice back in bytes*/
+static __m128i paethPredictorSSE2(__m128i a, __m128i b, __m128i c)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i nota[2], notb[2], pa, pb;
+  unsigned half;
+
+  for(half = 0; half < 2; half++)
+  {
+    __m128i a16 = half ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+    __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+    __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+    __m128i bc = _mm_sub_epi16(b16, c16), ac = _mm_sub_epi16(a16, c16), abc = _mm_add_epi16(bc, ac);
+    __m128i dpa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc)); /*there is no pabsw before SSSE3*/
+    __m128i dpb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+    __m128i dpc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+    nota[half] = _mm_or_si128(_mm_cmpgt_epi16(dpa, dpb), _mm_cmpgt_epi16(dpa, dpc));
+    notb[half] = _mm_cmpgt_epi16(dpb, dpc);
+  }
+  pa = _mm_packs_epi16(nota[0], nota[1]);
+  pb = _mm_packs_epi16(notb[0], notb[1]);
+  return _mm_or_si128(_mm_andnot_si128(pa, a), _mm_and_si128(pa, _mm_or_si128(_mm_andnot_si128(pb, b), _mm_and_si128(pb, c))));
+}
+
+/*filterScanline with type 4, for a scanline that isn't the top one*/
+static void filterPaethSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                            size_t length, size_t bytewidth)
+{
+  size_t i;
+  for(i = 0; i < bytewidth; i++) out[i] = scanline[i] - prevline[i];
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+    __m128i s = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(s, paethPredictorSSE2(a, b, c)));
+  }
+  for(; i < length; i++) out[i] = scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]);
+}
+
+/*
+addFilterCosts for the whole of a scanline that isn't the top one, 16 bytes at a time: every filter type is worked
+out from the same four loads, and the bytes that count are picked out with a mask and summed with psadbw.
+*/
+static void addFilterCostsSSE2(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, size_t bytewidth)
+{
+  /*the bytes that count, for a run of 16 starting 0, 1 or 2 bytes past a counted one*/
+  static const unsigned char MASKS[3][16] = {
+    {255,0,0,255,0,0,255,0,0,255,0,0,255,0,0,255},
+    {0,0,255,0,0,255,0,0,255,0,0,255,0,0,255,0},
+    {0,255,0,0,255,0,0,255,0,0,255,0,0,255,0,0}};
+  const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+  __m128i sum[5];
+  size_t i = bytewidth;
+  unsigned type;
+
+  addFilterCosts(cost, scanline, prevline, 0, bytewidth, bytewidth);
+  while(i + 16 <= length)
+  {
+    /*the sums are read back 32 bits a half, so every 48M bytes of scanline, before they can overflow that*/
+    size_t end = length - i > 50331648 ? i + 50331648 : length;
+    for(type = 0; type < 5; type++) sum[type] = zero;
+    for(; i + 16 <= end; i += 16)
+    {
+      __m128i mask = _mm_loadu_si128((const __m128i*)MASKS[i % 3]);
+      __m128i s = _mm_loadu_si128((const __m128i*)&scanline[i]);
+      __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      /*pavgb rounds up, and the average filter rounds down*/
+      __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      __m128i paeth = paethPredictorSSE2(a, b, c);
+
+      sum[0] = _mm_add_epi64(sum[0], _mm_sad_epu8(_mm_and_si128(s, mask), zero));
+      sum[1] = _mm_add_epi64(sum[1], _mm_sad_epu8(_mm_and_si128(_mm_sub_epi8(s, a), mask), zero));
+      sum[2] = _mm_add_epi64(sum[2], _mm_sad_epu8(_mm_and_si128(_mm_sub_epi8(s, b), mask), zero));
+      sum[3] = _mm_add_epi64(sum[3], _mm_sad_epu8(_mm_and_si128(_mm_sub_epi8(s, average), mask), zero));
+      sum[4] = _mm_add_epi64(sum[4], _mm_sad_epu8(_mm_and_si128(_mm_sub_epi8(s, paeth), mask), zero));
+    }
+    for(type = 0; type < 5; type++)
+    {
+      cost[type] += (unsigned)_mm_cvtsi128_si32(sum[type]) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum[type], 8));
+    }
+  }
+  addFilterCosts(cost, scanline, prevline, i, length, bytewidth);
+}
+#endif /*LODEPNG_SSE2*/
+
+/*
+The filter type whose output has the fewest bits by its entropy, the first if several tie. Every byte of the scanline
+is counted, for each type at once. hist has room for the five histograms.
+*/
+static unsigned filterByEntropy(const unsigned char* scanline, const unsigned char* prevline, size_t length,
+                                size_t bytewidth, unsigned* hist)
+{
+  double logsum, best = 0;
+  size_t i;
+  unsigned type, bestType = 0;
+
+  for(i = 0; i < 5 * 256; i++) hist[i] = 0;
+  for(i = 0; i < length; i++)
+  {
+    unsigned char s = scanline[i];
+    unsigned char a = i >= bytewidth ? scanline[i - bytewidth] : 0;
+    unsigned char b = prevline ? prevline[i] : 0;
+    unsigned char c = prevline && i >= bytewidth ? prevline[i - bytewidth] : 0;
+    hist[s]++;
+    hist[256 + (unsigned char)(s - a)]++;
+    hist[512 + (unsigned char)(s - b)]++;
+    hist[768 + (unsigned char)(s - (a + b) / 2)]++;
+    hist[1024 + (unsigned char)(s - paethPredictor(a, b, c))]++;
+  }
+
+  /*every type codes the same number of bytes, so the one with the largest countLogSum has the fewest bits*/
+  for(type = 0; type < 5; type++)
+  {
+    logsum = countLogSum(&hist[type * 256], 256);
+    if(type == 0 || logsum > best)
+    {
+      bestType = type;
+      best = logsum;
+    }
+  }
+  return bestType;
+}
+
+/*
+Filters h scanlines with the filter type the strategy (filterStrategy of LodePNG_EncodeSettings) picks for each.
+The sums are worked out without filtering the scanline, so only the winner is filtered, straight into out.
+lastType is the type of the row above, 5 for none, and is left with the type of the last row.
+*/
+static void filterAdaptive(unsigned char* out, const unsigned char* in, const unsigned char* prevline, unsigned h,
+                           size_t linebytes, size_t bytewidth, unsigned strategy, unsigned* lastType)
+{
+  size_t cost[5];
+  unsigned hist[5 * 256];
+  unsigned type, bestType, y;
+
+  for(y = 0; y < h; y++)
+  {
+    const unsigned char* scanline = &in[y * linebytes];
+
+    /*a row like the one above is all zeros with Up, and a row of one colour all zeros but its first pixel with Sub*/
+    if(strategy >= 2 && prevline && memcmp(scanline, prevline, linebytes) == 0) bestType = 2;
+    else if(strategy >= 2 && linebytes >= bytewidth && memcmp(&scanline[bytewidth], scanline, linebytes - bytewidth) == 0) bestType = 1;
+    else if(strategy == 1) bestType = filterByEntropy(scanline, prevline, linebytes, bytewidth, hist);
+    else
+    {
+      for(type = 0; type < 5; type++) cost[type] = 0;
+#ifdef LODEPNG_SSE2
+      if(prevline) addFilterCostsSSE2(cost, scanline, prevline, linebytes, bytewidth);
+      else
+#endif /*LODEPNG_SSE2*/
+      addFilterCosts(cost, scanline, prevline, 0, linebytes, bytewidth);
+
+      /*the first type with the smallest sum*/
+      bestType = 0;
+      for(type = 1; type < 5; type++) if(cost[type] < cost[bestType]) bestType = type;
+
+      /*sticking with the filter of the row above, if it does nearly as well, keeps similar rows filtered alike*/
+      if(strategy == 3 && *lastType < 5 && cost[*lastType] - cost[bestType] <= cost[bestType] / FILTER_STICKINESS)
+      {
+        bestType = *lastType;
       }
-      break;
-    default: return; /*unexisting filter type given*/
+    }
+
+    out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+#ifdef LODEPNG_SSE2
+    if(bestType == 4 && prevline) filterPaethSSE2(&out[y * (linebytes + 1) + 1], scanline, prevline, linebytes, bytewidth);
+    else
+#endif /*LODEPNG_SSE2*/
+    filterScanline(&out[y * (linebytes + 1) + 1], scanline, prevline, linebytes, bytewidth, bestType);
+    prevline = scanline;
+    *lastType = bestType;
   }
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, const LodePNG_InfoColor* info)
+/*what filter gives each run of filterBand*/
+typedef struct FilterBandsJob
+{
+  unsigned char* out;
+  const unsigned char* in;
+  const unsigned char* prevline;
+  size_t linebytes, bytewidth;
+  unsigned h, bandrows, strategy;
+} FilterBandsJob;
+
+/*filters band number index of a FilterBandsJob, a LodePNG_ParallelFor job*/
+static void filterBand(unsigned index, void* jobdata)
+{
+  const FilterBandsJob* job = (const FilterBandsJob*)jobdata;
+  unsigned y = index * job->bandrows;
+  unsigned count = job->h - y < job->bandrows ? job->h - y : job->bandrows;
+  /*the row above the band is already known, unfiltered, so no band waits for another*/
+  const unsigned char* prevline = y == 0 ? job->prevline : &job->in[(y - 1) * job->linebytes];
+  unsigned lastType = 5; /*only strategy 3 uses it, and isn't run in bands*/
+  filterAdaptive(&job->out[y * (job->linebytes + 1)], &job->in[y * job->linebytes], prevline, count,
+                 job->linebytes, job->bytewidth, job->strategy, &lastType);
+}
+
+/*
+prevline is the scanline above the first one in "in", or NULL if "in" starts at the top of the image, and lastType
+the filter type it was given, kept up to date for the next call (see filterAdaptive). With parallelFor in the
+settings, bands of the rows are filtered on numThreads threads.
+*/
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline, unsigned w, unsigned h, const LodePNG_InfoColor* info,
+                       const LodePNG_EncodeSettings* settings, unsigned* lastType)
 {
   /*
   For PNG filter method 0
@@ -4239,8 +5426,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   unsigned bpp = LodePNG_InfoColor_getBpp(info);
   size_t linebytes = (w * bpp + 7) / 8; /*the width of a scanline in bytes, not including the filter type*/
   size_t bytewidth = (bpp + 7) / 8; /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  const unsigned char* prevline = 0;
-  unsigned x, y;
+  unsigned y;
   unsigned heuristic;
   unsigned error = 0;
 
@@ -4264,47 +5450,31 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   }
   else if(heuristic == 1) /*adaptive filtering*/
   {
-    size_t sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned type, bestType = 0;
-
-    for(type = 0; type < 5; type++) ucvector_init(&attempt[type]);
-    for(type = 0; type < 5; type++)
+    unsigned bands = 1;
+    /*strategy 3 goes by the filter of the row above, so has to go row by row*/
+    if(settings->parallelFor && settings->numThreads > 1 && settings->filterStrategy != 3)
     {
-      if(!ucvector_resize(&attempt[type], linebytes)) ERROR_BREAK(9949 /*alloc fail*/);
+      /*a band per thread, unless there is too little to be worth handing to another thread*/
+      size_t worth = h * linebytes / FILTER_BAND_MIN;
+      bands = worth < settings->numThreads ? (unsigned)worth : settings->numThreads;
+      if(bands > h) bands = h;
+      if(bands == 0) bands = 1;
     }
 
-    if(!error)
+    if(bands == 1) filterAdaptive(out, in, prevline, h, linebytes, bytewidth, settings->filterStrategy, lastType);
+    else
     {
-      for(y = 0; y < h; y++)
-      {
-        /*try the 5 filter types*/
-        for(type = 0; type < 5; type++)
-        {
-          filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          for(x = 0; x < attempt[type].size; x+=3) sum[type] += attempt[type].data[x]; /*note that not all pixels are checked to speed this up while still having probably the best choice*/
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-      }
+      FilterBandsJob job;
+      job.out = out;
+      job.in = in;
+      job.prevline = prevline;
+      job.linebytes = linebytes;
+      job.bytewidth = bytewidth;
+      job.h = h;
+      job.bandrows = (h + bands - 1) / bands;
+      job.strategy = settings->filterStrategy;
+      settings->parallelFor((h + job.bandrows - 1) / job.bandrows, filterBand, &job, settings->parallelUser);
     }
-
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
   }
   #if 0 /*deflate the scanline with a fixed tree after every filter attempt to see which one deflates best. This is slow, and _does not work as expected_: the heuristic gives smaller result!*/
   else if(heuristic == 2) /*adaptive filtering by using deflate*/
@@ -4312,7 +5482,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     size_t size[5];
     ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest;
-    unsigned type = 0, bestType = 0;
+    unsigned type = 0, bestType = 0, x;
     unsigned char* dummy;
     LodeZlib_CompressSettings deflatesettings = LodeZlib_defaultCompressSettings;
     deflatesettings.btype = 1; /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose, to simulate the true case where the tree is the same for the whole image*/
@@ -4329,7 +5499,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         size[type] = 0;
         dummy = 0;
         LodePNG_compress(&dummy, &size[type], attempt[type].data, attempt[type].size, &deflatesettings);
-        free(dummy);
+        lodepng_free(dummy);
         /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || size[type] < smallest)
         {
@@ -4419,7 +5589,8 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
 }
 
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image*/
-static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in, const LodePNG_InfoPng* infoPng) /*return value is error*/
+static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in, const LodePNG_InfoPng* infoPng,
+                                    const LodePNG_EncodeSettings* settings) /*return value is error*/
 {
   /*
   This function converts the pure 2D image with the PNG's colortype, into filtered-padded-interlaced data. Steps:
@@ -4429,12 +5600,13 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   unsigned bpp = LodePNG_InfoColor_getBpp(&infoPng->color);
   unsigned w = infoPng->width;
   unsigned h = infoPng->height;
+  unsigned lastType = 5; /*the filter type of the row above, none at the top of the image or of a pass*/
   unsigned error = 0;
 
   if(infoPng->interlaceMethod == 0)
   {
     *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)malloc(*outsize);
+    *out = (unsigned char*)lodepng_malloc(*outsize);
     if(!(*out) && (*outsize)) error = 9950; /*alloc fail*/
 
     if(!error)
@@ -4447,16 +5619,16 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!error)
         {
           addPaddingBits(padded.data, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded.data, w, h, &infoPng->color);
+          error = filter(*out, padded.data, 0, w, h, &infoPng->color, settings, &lastType);
         }
         ucvector_cleanup(&padded);
       }
-      else error = filter(*out, in, w, h, &infoPng->color); /*we can immediatly filter into the out buffer, no other steps needed*/
+      else error = filter(*out, in, 0, w, h, &infoPng->color, settings, &lastType); /*we can immediatly filter into the out buffer, no other steps needed*/
     }
   }
   else /*interlaceMethod is 1 (Adam7)*/
   {
-    unsigned char* adam7 = (unsigned char*)malloc((h * w * bpp + 7) / 8);
+    unsigned char* adam7 = (unsigned char*)lodepng_malloc((h * w * bpp + 7) / 8);
     if(!adam7 && ((h * w * bpp + 7) / 8)) error = 9952; /*alloc fail*/
 
     while(!error) /*not a real while loop, used to break out to cleanup to avoid a goto*/
@@ -4468,13 +5640,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
       *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-      *out = (unsigned char*)malloc(*outsize);
+      *out = (unsigned char*)lodepng_malloc(*outsize);
       if(!(*out) && (*outsize)) ERROR_BREAK(9953 /*alloc fail*/);
 
       Adam7_interlace(adam7, in, w, h, bpp);
 
       for(i = 0; i < 7; i++)
       {
+        lastType = 5;
         if(bpp < 8)
         {
           ucvector padded;
@@ -4483,21 +5656,21 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           if(!error)
           {
             addPaddingBits(&padded.data[padded_passstart[i]], &adam7[passstart[i]], ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-            error = filter(&(*out)[filter_passstart[i]], &padded.data[padded_passstart[i]], passw[i], passh[i], &infoPng->color);
+            error = filter(&(*out)[filter_passstart[i]], &padded.data[padded_passstart[i]], 0, passw[i], passh[i], &infoPng->color, settings, &lastType);
           }
 
           ucvector_cleanup(&padded);
         }
         else
         {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]], passw[i], passh[i], &infoPng->color);
+          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]], 0, passw[i], passh[i], &infoPng->color, settings, &lastType);
         }
       }
 
       break;
     }
 
-    free(adam7);
+    lodepng_free(adam7);
   }
 
   return error;
@@ -4571,211 +5744,437 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
   unsigned char* inchunk = data;
   while((size_t)(inchunk - data) < datasize)
   {
-    unsigned error = LodePNG_append_chunk(&out->data, &out->size, inchunk);
-    if(error) return error; /*error: not enough memory*/
-    out->allocsize = out->size; /*fix the allocsize again*/
+    size_t i, length = LodePNG_chunk_length(inchunk) + 12;
+    if(!ucvector_resize(out, out->size + length)) return 9929; /*error: not enough memory*/
+    for(i = 0; i < length; i++) out->data[out->size - length + i] = inchunk[i];
     inchunk = LodePNG_chunk_next(inchunk);
   }
   return 0;
 }
 #endif /*LODEPNG_COMPILE_UNKNOWN_CHUNKS*/
 
-void LodePNG_Encoder_encode(LodePNG_Encoder* encoder, unsigned char** out, size_t* outsize, const unsigned char* image, unsigned w, unsigned h)
+/*the encoder's deflate settings, with the run-length distances of the image filled in: the pixel to the left and the one above*/
+static void getImageZlibSettings(LodeZlib_CompressSettings* zlibsettings, const LodePNG_Encoder* encoder, const LodePNG_InfoPng* info)
 {
-  LodePNG_InfoPng info;
-  ucvector outv;
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
-
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
-  encoder->error = 0;
-
-  info = encoder->infoPng; /*UNSAFE copy to avoid having to cleanup! but we will only change primitive parameters, and not invoke the cleanup function nor touch the palette's buffer so we use it safely*/
-  info.width = w;
-  info.height = h;
-
-  if(encoder->settings.autoLeaveOutAlphaChannel && isFullyOpaque(image, w, h, &encoder->infoRaw.color))
-  {
-    /*go to a color type without alpha channel*/
-    if(info.color.colorType == 6) info.color.colorType = 2;
-    else if(info.color.colorType == 4) info.color.colorType = 0;
-  }
-
-  if(encoder->settings.zlibsettings.windowSize > 32768)
-  {
-    encoder->error = 60; /*error: windowsize larger than allowed*/
-    return;
-  }
-  if(encoder->settings.zlibsettings.btype > 2)
-  {
-    encoder->error = 61; /*error: unexisting btype*/
-    return;
-  }
-  if(encoder->infoPng.interlaceMethod > 1)
-  {
-    encoder->error = 71; /*error: unexisting interlace mode*/
-    return;
-  }
-  if((encoder->error = checkColorValidity(info.color.colorType, info.color.bitDepth))) return; /*error: unexisting color type given*/
-  if((encoder->error = checkColorValidity(encoder->infoRaw.color.colorType, encoder->infoRaw.color.bitDepth))) return; /*error: unexisting color type given*/
-
-  if(!LodePNG_InfoColor_equal(&encoder->infoRaw.color, &info.color))
-  {
-    unsigned char* converted;
-    size_t size = (w * h * LodePNG_InfoColor_getBpp(&info.color) + 7) / 8;
+  unsigned bpp = LodePNG_InfoColor_getBpp(&info->color);
+  *zlibsettings = encoder->settings.zlibsettings;
+  zlibsettings->rleDistance = (bpp + 7) / 8;
+  /*the filtered scanlines have a filter type byte in front, and Adam7's passes are narrower than the image*/
+  zlibsettings->rleDistance2 = info->interlaceMethod == 0 ? (info->width * bpp + 7) / 8 + 1 : 0;
+}
 
-    if((info.color.colorType != 6 && info.color.colorType != 2) || (info.color.bitDepth != 8))
+/*checks the settings of the encoder and the PNG info it has derived from them*/
+static unsigned checkEncodeSettings(const LodePNG_Encoder* encoder, const LodePNG_InfoPng* info)
+{
+  unsigned error;
+  if(encoder->settings.zlibsettings.windowSize > 32768) return 60; /*error: windowsize larger than allowed*/
+  if(encoder->settings.zlibsettings.btype > 2) return 61; /*error: unexisting btype*/
+  if(encoder->settings.zlibsettings.strategy > 2) return 83; /*error: unexisting strategy*/
+  if(encoder->settings.filterStrategy > 3) return 84; /*error: unexisting filter strategy*/
+  if(encoder->infoPng.interlaceMethod > 1) return 71; /*error: unexisting interlace mode*/
+  if((error = checkColorValidity(info->color.colorType, info->color.bitDepth))) return error; /*error: unexisting color type given*/
+  if((error = checkColorValidity(encoder->infoRaw.color.colorType, encoder->infoRaw.color.bitDepth))) return error; /*error: unexisting color type given*/
+  if(!LodePNG_InfoColor_equal(&encoder->infoRaw.color, &info->color))
+  {
+    if((info->color.colorType != 6 && info->color.colorType != 2) || (info->color.bitDepth != 8))
     {
-      encoder->error = 59; /*for the output image, only these types are supported*/
-      return;
+      return 59; /*for the output image, only these types are supported*/
     }
-    converted = (unsigned char*)malloc(size);
-    if(!converted && size) encoder->error = 9955; /*alloc fail*/
-    if(!encoder->error) encoder->error = LodePNG_convert(converted, image, &info.color, &encoder->infoRaw.color, w, h);
-    if(!encoder->error) preProcessScanlines(&data, &datasize, converted, &info);/*filter(data.data, converted.data, w, h, LodePNG_InfoColor_getBpp(&info.color));*/
-    free(converted);
   }
-  else preProcessScanlines(&data, &datasize, image, &info);/*filter(data.data, image, w, h, LodePNG_InfoColor_getBpp(&info.color));*/
+  return 0;
+}
 
-  ucvector_init(&outv);
-  while(!encoder->error) /*not really a while loop, this is only used to break out if an error happens to avoid goto's to do the ucvector cleanup*/
+/*writes the signature and the chunks the encoder's settings call for before the IDAT chunk to outv*/
+static unsigned writeChunksBeforeIDAT(LodePNG_Encoder* encoder, ucvector* outv, const LodePNG_InfoPng* info)
+{
+  unsigned error = 0;
+
+  while(!error) /*not really a while loop, this is only used to break out if an error happens to avoid goto's*/
   {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*write signature and chunks*/
-    writeSignature(&outv);
+    writeSignature(outv);
     /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.bitDepth, info.color.colorType, info.interlaceMethod);
+    addChunk_IHDR(outv, info->width, info->height, info->color.bitDepth, info->color.colorType, info->interlaceMethod);
 #ifdef LODEPNG_COMPILE_UNKNOWN_CHUNKS
     /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks.data[0])
+    if(info->unknown_chunks.data[0])
     {
-      encoder->error = addUnknownChunks(&outv, info.unknown_chunks.data[0], info.unknown_chunks.datasize[0]);
-      if(encoder->error) break;
+      error = addUnknownChunks(outv, info->unknown_chunks.data[0], info->unknown_chunks.datasize[0]);
+      if(error) break;
     }
 #endif /*LODEPNG_COMPILE_UNKNOWN_CHUNKS*/
     /*PLTE*/
-    if(info.color.colorType == 3)
+    if(info->color.colorType == 3)
     {
-      if(info.color.palettesize == 0 || info.color.palettesize > 256)
+      if(info->color.palettesize == 0 || info->color.palettesize > 256)
       {
-        encoder->error = 68; /*invalid palette size*/
+        error = 68; /*invalid palette size*/
         break;
       }
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(outv, &info->color);
     }
-    if(encoder->settings.force_palette && (info.color.colorType == 2 || info.color.colorType == 6))
+    if(encoder->settings.force_palette && (info->color.colorType == 2 || info->color.colorType == 6))
     {
-      if(info.color.palettesize == 0 || info.color.palettesize > 256)
+      if(info->color.palettesize == 0 || info->color.palettesize > 256)
       {
-        encoder->error = 68; /*invalid palette size*/
+        error = 68; /*invalid palette size*/
         break;
       }
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(outv, &info->color);
     }
     /*tRNS*/
-    if(info.color.colorType == 3 && !isPaletteFullyOpaque(info.color.palette, info.color.palettesize))
+    if(info->color.colorType == 3 && !isPaletteFullyOpaque(info->color.palette, info->color.palettesize))
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(outv, &info->color);
     }
-    if((info.color.colorType == 0 || info.color.colorType == 2) && info.color.key_defined)
+    if((info->color.colorType == 0 || info->color.colorType == 2) && info->color.key_defined)
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(outv, &info->color);
     }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
+    if(info->background_defined) addChunk_bKGD(outv, info);
     /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
+    if(info->phys_defined) addChunk_pHYs(outv, info);
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 #ifdef LODEPNG_COMPILE_UNKNOWN_CHUNKS
     /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks.data[1])
+    if(info->unknown_chunks.data[1])
     {
-      encoder->error = addUnknownChunks(&outv, info.unknown_chunks.data[1], info.unknown_chunks.datasize[1]);
-      if(encoder->error) break;
+      error = addUnknownChunks(outv, info->unknown_chunks.data[1], info->unknown_chunks.datasize[1]);
+      if(error) break;
     }
 #endif /*LODEPNG_COMPILE_UNKNOWN_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
-    encoder->error = addChunk_IDAT(&outv, data, datasize, &encoder->settings.zlibsettings);
-    if(encoder->error) break;
+
+    break; /*this isn't really a while loop; no error happened so break out now!*/
+  }
+
+  return error;
+}
+
+/*writes the chunks the encoder's settings call for after the IDAT chunk, ending with IEND, to outv*/
+static unsigned writeChunksAfterIDAT(LodePNG_Encoder* encoder, ucvector* outv, const LodePNG_InfoPng* info)
+{
+  unsigned error = 0;
+
+  while(!error) /*not really a while loop, this is only used to break out if an error happens to avoid goto's*/
+  {
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    size_t i;
     /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
+    if(info->time_defined) addChunk_tIME(outv, &info->time);
     /*tEXt and/or zTXt*/
-    for(i = 0; i < info.text.num; i++)
+    for(i = 0; i < info->text.num; i++)
     {
-      if(strlen(info.text.keys[i]) > 79)
+      if(strlen(info->text.keys[i]) > 79)
       {
-        encoder->error = 66; /*text chunk too large*/
+        error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.text.keys[i]) < 1)
+      if(strlen(info->text.keys[i]) < 1)
       {
-        encoder->error = 67; /*text chunk too small*/
+        error = 67; /*text chunk too small*/
         break;
       }
       if(encoder->settings.text_compression)
-        addChunk_zTXt(&outv, info.text.keys[i], info.text.strings[i], &encoder->settings.zlibsettings);
+        addChunk_zTXt(outv, info->text.keys[i], info->text.strings[i], &encoder->settings.zlibsettings);
       else
-        addChunk_tEXt(&outv, info.text.keys[i], info.text.strings[i]);
+        addChunk_tEXt(outv, info->text.keys[i], info->text.strings[i]);
     }
     /*LodePNG version id in text chunk*/
     if(encoder->settings.add_id)
     {
       unsigned alread_added_id_text = 0;
-      for(i = 0; i < info.text.num; i++)
+      for(i = 0; i < info->text.num; i++)
       {
-        if(!strcmp(info.text.keys[i], "LodePNG"))
+        if(!strcmp(info->text.keys[i], "LodePNG"))
         {
           alread_added_id_text = 1;
           break;
         }
       }
       if(alread_added_id_text == 0)
-        addChunk_tEXt(&outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+        addChunk_tEXt(outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
     }
     /*iTXt*/
-    for(i = 0; i < info.itext.num; i++)
+    for(i = 0; i < info->itext.num; i++)
     {
-      if(strlen(info.itext.keys[i]) > 79)
+      if(strlen(info->itext.keys[i]) > 79)
       {
-        encoder->error = 66; /*text chunk too large*/
+        error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.itext.keys[i]) < 1)
+      if(strlen(info->itext.keys[i]) < 1)
       {
-        encoder->error = 67; /*text chunk too small*/
+        error = 67; /*text chunk too small*/
         break;
       }
-      addChunk_iTXt(&outv, encoder->settings.text_compression,
-                    info.itext.keys[i], info.itext.langtags[i], info.itext.transkeys[i], info.itext.strings[i],
+      addChunk_iTXt(outv, encoder->settings.text_compression,
+                    info->itext.keys[i], info->itext.langtags[i], info->itext.transkeys[i], info->itext.strings[i],
                     &encoder->settings.zlibsettings);
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 #ifdef LODEPNG_COMPILE_UNKNOWN_CHUNKS
     /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks.data[2])
+    if(info->unknown_chunks.data[2])
     {
-      encoder->error = addUnknownChunks(&outv, info.unknown_chunks.data[2], info.unknown_chunks.datasize[2]);
-      if(encoder->error) break;
+      error = addUnknownChunks(outv, info->unknown_chunks.data[2], info->unknown_chunks.datasize[2]);
+      if(error) break;
     }
 #endif /*LODEPNG_COMPILE_UNKNOWN_CHUNKS*/
     /*IEND*/
-    addChunk_IEND(&outv);
+    addChunk_IEND(outv);
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
 
-  free(data);
+
+  return error;
+}
+
+/*the rows in each segment of the image deflated with parallelFor, at least 1*/
+static unsigned getSegmentRows(const LodePNG_EncodeSettings* settings, unsigned h, size_t linebytes)
+{
+  size_t rows = settings->bandSize ? settings->bandSize / (linebytes + 1) : (h + settings->numThreads - 1) / settings->numThreads;
+  if(rows > h) rows = h;
+  return rows > 0 ? (unsigned)rows : 1;
+}
+
+void LodePNG_Encoder_encode(LodePNG_Encoder* encoder, unsigned char** out, size_t* outsize, const unsigned char* image, unsigned w, unsigned h)
+{
+  LodePNG_InfoPng info;
+  ucvector outv;
+  IDATChunk idat;
+  DeflateStream stream;
+  LodeZlib_CompressSettings zlibsettings; /*with the run-length distances of the image*/
+  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
+  size_t datasize = 0;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+  *outsize = 0;
+  encoder->error = 0;
+
+  info = encoder->infoPng; /*UNSAFE copy to avoid having to cleanup! but we will only change primitive parameters, and not invoke the cleanup function nor touch the palette's buffer so we use it safely*/
+  info.width = w;
+  info.height = h;
+
+  if(encoder->settings.autoLeaveOutAlphaChannel && isFullyOpaque(image, w, h, &encoder->infoRaw.color))
+  {
+    /*go to a color type without alpha channel*/
+    if(info.color.colorType == 6) info.color.colorType = 2;
+    else if(info.color.colorType == 4) info.color.colorType = 0;
+  }
+
+  if((encoder->error = checkEncodeSettings(encoder, &info))) return;
+
+  if(!LodePNG_InfoColor_equal(&encoder->infoRaw.color, &info.color))
+  {
+    unsigned char* converted;
+    size_t size = (w * h * LodePNG_InfoColor_getBpp(&info.color) + 7) / 8;
+
+    converted = (unsigned char*)lodepng_malloc(size);
+    if(!converted && size) encoder->error = 9955; /*alloc fail*/
+    if(!encoder->error) encoder->error = LodePNG_convert(converted, image, &info.color, &encoder->infoRaw.color, w, h);
+    if(!encoder->error) preProcessScanlines(&data, &datasize, converted, &info, &encoder->settings);/*filter(data.data, converted.data, w, h, LodePNG_InfoColor_getBpp(&info.color));*/
+    lodepng_free(converted);
+  }
+  else preProcessScanlines(&data, &datasize, image, &info, &encoder->settings);/*filter(data.data, image, w, h, LodePNG_InfoColor_getBpp(&info.color));*/
+
+  ucvector_init(&outv);
+  if(!encoder->error) encoder->error = writeChunksBeforeIDAT(encoder, &outv, &info);
+  if(!encoder->error && !ucvector_reserve(&outv, outv.size + estimateIDATSize(datasize, &encoder->settings.zlibsettings)))
+    encoder->error = 9959; /*alloc fail*/
+  /*compress with the Zlib compressor, straight into the IDAT chunk*/
+  if(!encoder->error) encoder->error = IDATChunk_begin(&idat, &outv);
+  getImageZlibSettings(&zlibsettings, encoder, &info);
+  if(!encoder->error) encoder->error = DeflateStream_init(&stream, &outv, &zlibsettings, encoder->context ? &encoder->context->deflate : 0);
+  if(!encoder->error && encoder->settings.parallelFor && encoder->settings.numThreads > 1)
+  {
+    /*numThreads segments at a time, each of whole rows, as compressRows deflates them. Interlaced scanlines aren't
+    all that long, but the segments don't have to be whole rows, only the same size for the same output.*/
+    size_t linebytes = (w * LodePNG_InfoColor_getBpp(&info.color) + 7) / 8;
+    size_t segmentsize = getSegmentRows(&encoder->settings, h, linebytes) * (linebytes + 1);
+    size_t bandsize = segmentsize * encoder->settings.numThreads, pos = 0;
+    DeflateStream_setParallel(&stream, encoder->settings.parallelFor, encoder->settings.parallelUser,
+                              encoder->context ? &encoder->context->segments : 0);
+    do
+    {
+      size_t end = datasize - pos > bandsize ? pos + bandsize : datasize;
+      encoder->error = DeflateStream_addSegments(&stream, data, pos, end, segmentsize, end == datasize);
+      pos = end;
+    }
+    while(!encoder->error && pos < datasize);
+    DeflateStream_cleanup(&stream);
+  }
+  else if(!encoder->error)
+  {
+    encoder->error = DeflateStream_add(&stream, data, 0, datasize, 1);
+    DeflateStream_cleanup(&stream);
+  }
+  lodepng_free(data);
+  if(!encoder->error) encoder->error = IDATChunk_finish(&idat);
+  if(!encoder->error) encoder->error = writeChunksAfterIDAT(encoder, &outv, &info);
+
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
 }
 
+/*
+Compresses the image a band of rows at a time into the IDAT chunk: each band is fetched from the callback,
+converted, filtered and deflated before the next is fetched, so only the compressed data grows with the size of
+the image. The chunk's CRC is brought up to date after every band, while its data is still in the cache.
+*/
+static unsigned compressRows(IDATChunk* idat, LodePNG_Encoder* encoder, const LodePNG_InfoPng* info, LodePNG_RowCallback rows, void* user)
+{
+  unsigned w = info->width, h = info->height;
+  size_t linebytes = (w * LodePNG_InfoColor_getBpp(&info->color) + 7) / 8; /*a scanline of the PNG, without the filter type*/
+  size_t rawlinebytes = (w * LodePNG_InfoColor_getBpp(&encoder->infoRaw.color) + 7) / 8; /*a row as the callback gives it*/
+  unsigned convert = !LodePNG_InfoColor_equal(&encoder->infoRaw.color, &info->color);
+  LodeZlib_CompressSettings zlibsettingsv;
+  const LodeZlib_CompressSettings* zlibsettings = &zlibsettingsv;
+  size_t history = 0; /*filtered bytes kept for matches to refer back to*/
+  unsigned bandrows = h;
+  unsigned threads = encoder->settings.numThreads;
+  unsigned parallel = encoder->settings.parallelFor && threads > 1;
+  unsigned segmentrows = 1;
+  unsigned lastType = 5; /*the filter type of the last row filtered, carried from band to band*/
+  LodePNG_EncodeContext* context = encoder->context;
+  ucvector ownraw, ownscanlines, ownfiltered;
+  ucvector* raw = context ? &context->raw : &ownraw;
+  ucvector* scanlines = context ? &context->scanlines : &ownscanlines;
+  ucvector* filtered = context ? &context->filtered : &ownfiltered;
+  DeflateStream stream;
+  size_t kept = 0; /*bytes of history at the start of filtered*/
+  unsigned y, i, count;
+  unsigned error = 0;
+
+  getImageZlibSettings(&zlibsettingsv, encoder, info);
+  if(zlibsettings->btype != 0 && zlibsettings->useLZ77)
+  {
+    if(zlibsettings->strategy != 1) history = zlibsettings->windowSize;
+    else history = zlibsettings->rleDistance2 > zlibsettings->rleDistance ? zlibsettings->rleDistance2 : zlibsettings->rleDistance;
+    if(history > 32768) history = 32768;
+  }
+
+  if(parallel)
+  {
+    /*a band is then numThreads segments, each bandSize or a numThreads'th of the image, deflated at the same time*/
+    segmentrows = getSegmentRows(&encoder->settings, h, linebytes);
+    bandrows = segmentrows <= h / threads ? segmentrows * threads : h;
+  }
+  else if(encoder->settings.bandSize && encoder->settings.bandSize / (linebytes + 1) < h)
+  {
+    bandrows = (unsigned)(encoder->settings.bandSize / (linebytes + 1));
+    if(bandrows == 0) bandrows = 1;
+  }
+
+  if(!context)
+  {
+    ucvector_init(raw);
+    ucvector_init(scanlines);
+    ucvector_init(filtered);
+  }
+
+  error = DeflateStream_init(&stream, idat->out, zlibsettings, context ? &context->deflate : 0);
+  if(error) return error;
+  if(parallel) DeflateStream_setParallel(&stream, encoder->settings.parallelFor, encoder->settings.parallelUser, context ? &context->segments : 0);
+
+  while(!error) /*not a real while loop, used to break out to cleanup to avoid a goto*/
+  {
+    /*the scanline before the band is kept in front of it, so the first row of a band can be filtered against it*/
+    if(!ucvector_resize(scanlines, (bandrows + 1) * linebytes)) ERROR_BREAK(9957 /*alloc fail*/);
+    if(convert && !ucvector_resize(raw, bandrows * rawlinebytes)) ERROR_BREAK(9957 /*alloc fail*/);
+    if(!ucvector_resize(filtered, history + bandrows * (linebytes + 1))) ERROR_BREAK(9957 /*alloc fail*/);
+
+    if(h == 0) error = DeflateStream_add(&stream, filtered->data, 0, 0, 1);
+
+    for(y = 0; y < h && !error; y += count)
+    {
+      size_t bandsize;
+      count = h - y < bandrows ? h - y : bandrows;
+      bandsize = count * (linebytes + 1);
+
+      if(convert)
+      {
+        if(rows(raw->data, y, count, user)) ERROR_BREAK(82);
+        for(i = 0; i < count; i++)
+        {
+          error = LodePNG_convert(&scanlines->data[(i + 1) * linebytes], &raw->data[i * rawlinebytes], (LodePNG_InfoColor*)&info->color, &encoder->infoRaw.color, w, 1);
+          if(error) break;
+        }
+        if(error) break;
+      }
+      else if(rows(&scanlines->data[linebytes], y, count, user)) ERROR_BREAK(82);
+
+      error = filter(&filtered->data[kept], &scanlines->data[linebytes], y == 0 ? 0 : scanlines->data, w, count, &info->color, &encoder->settings, &lastType);
+      if(error) break;
+
+      if(parallel) error = DeflateStream_addSegments(&stream, filtered->data, kept, kept + bandsize, segmentrows * (linebytes + 1), y + count == h);
+      else error = DeflateStream_add(&stream, filtered->data, kept, kept + bandsize, y + count == h);
+      if(error) break;
+      IDATChunk_update(idat, idat->out->size); /*bits still in the stream's accumulator aren't in out yet*/
+
+      /*carry the last scanline, and the end of the filtered data, over to the next band*/
+      memmove(scanlines->data, &scanlines->data[count * linebytes], linebytes);
+      i = (unsigned)(kept + bandsize < history ? kept + bandsize : history);
+      memmove(filtered->data, &filtered->data[kept + bandsize - i], i);
+      kept = i;
+    }
+
+    break;
+  }
+
+  DeflateStream_cleanup(&stream);
+  if(!context)
+  {
+    ucvector_cleanup(raw);
+    ucvector_cleanup(scanlines);
+    ucvector_cleanup(filtered);
+  }
+
+  return error;
+}
+
+void LodePNG_Encoder_encodeRows(LodePNG_Encoder* encoder, unsigned char** out, size_t* outsize, unsigned w, unsigned h, LodePNG_RowCallback rows, void* user)
+{
+  LodePNG_InfoPng info;
+  ucvector outv;
+  IDATChunk idat;
+
+  *out = 0;
+  *outsize = 0;
+  encoder->error = 0;
+
+  info = encoder->infoPng; /*UNSAFE copy, see LodePNG_Encoder_encode*/
+  info.width = w;
+  info.height = h;
+
+  if((encoder->error = checkEncodeSettings(encoder, &info))) return;
+  if(info.interlaceMethod != 0)
+  {
+    encoder->error = 81; /*Adam7 needs the whole image*/
+    return;
+  }
+
+  ucvector_init(&outv);
+  encoder->error = writeChunksBeforeIDAT(encoder, &outv, &info);
+  if(!encoder->error)
+  {
+    size_t datasize = (size_t)h * ((w * LodePNG_InfoColor_getBpp(&info.color) + 7) / 8 + 1);
+    if(!ucvector_reserve(&outv, outv.size + estimateIDATSize(datasize, &encoder->settings.zlibsettings)))
+      encoder->error = 9959; /*alloc fail*/
+  }
+  if(!encoder->error) encoder->error = IDATChunk_begin(&idat, &outv);
+  if(!encoder->error) encoder->error = compressRows(&idat, encoder, &info, rows, user);
+  if(!encoder->error) encoder->error = IDATChunk_finish(&idat);
+  if(!encoder->error) encoder->error = writeChunksAfterIDAT(encoder, &outv, &info);
+
+  *out = outv.data;
+  *outsize = outv.size;
+}
+
 unsigned LodePNG_encode(unsigned char** out, size_t* outsize, const unsigned char* image, unsigned w, unsigned h, unsigned colorType, unsigned bitDepth)
 {
   unsigned error;
@@ -4808,7 +6207,7 @@ unsigned LodePNG_encode_file(const char* filename, const unsigned char* image, u
   size_t buffersize;
   unsigned error = LodePNG_encode(&buffer, &buffersize, image, w, h, colorType, bitDepth);
   if(!error) error = LodePNG_saveFile(buffer, buffersize, filename);
-  free(buffer);
+  lodepng_free(buffer);
   return error;
 }
 
@@ -4828,18 +6227,49 @@ void LodePNG_EncodeSettings_init(LodePNG_EncodeSettings* settings)
   LodeZlib_CompressSettings_init(&settings->zlibsettings);
   settings->autoLeaveOutAlphaChannel = 1;
   settings->force_palette = 0;
+  settings->bandSize = 131072;
+  settings->filterStrategy = 0;
+  settings->numThreads = 0;
+  settings->parallelFor = 0;
+  settings->parallelUser = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 1;
   settings->text_compression = 0;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 }
 
+LodePNG_EncodeContext* LodePNG_EncodeContext_new(void)
+{
+  LodePNG_EncodeContext* context = (LodePNG_EncodeContext*)lodepng_malloc(sizeof(LodePNG_EncodeContext));
+  if(!context) return 0;
+
+  DeflateScratch_init(&context->deflate);
+  DeflateSegments_init(&context->segments);
+  ucvector_init(&context->raw);
+  ucvector_init(&context->scanlines);
+  ucvector_init(&context->filtered);
+  return context;
+}
+
+void LodePNG_EncodeContext_delete(LodePNG_EncodeContext* context)
+{
+  if(!context) return;
+
+  DeflateScratch_cleanup(&context->deflate);
+  DeflateSegments_cleanup(&context->segments);
+  ucvector_cleanup(&context->raw);
+  ucvector_cleanup(&context->scanlines);
+  ucvector_cleanup(&context->filtered);
+  lodepng_free(context);
+}
+
 void LodePNG_Encoder_init(LodePNG_Encoder* encoder)
 {
   LodePNG_EncodeSettings_init(&encoder->settings);
   LodePNG_InfoPng_init(&encoder->infoPng);
   LodePNG_InfoRaw_init(&encoder->infoRaw);
   encoder->error = 1;
+  encoder->context = 0;
 }
 
 void LodePNG_Encoder_cleanup(LodePNG_Encoder* encoder)
@@ -4889,7 +6319,7 @@ unsigned LodePNG_loadFile(unsigned char** out, size_t* outsize, const char* file
 
   /*read contents of the file into the vector*/
   *outsize = 0;
-  *out = (unsigned char*)malloc((size_t)size);
+  *out = (unsigned char*)lodepng_malloc((size_t)size);
   if(size && (*out)) (*outsize) = fread(*out, 1, (size_t)size, file);
 
   fclose(file);
@@ -5000,6 +6430,10 @@ const char* LodePNG_error_text(unsigned code)
     case 78: return "failed to open file for reading"; /*file doesn't exist or couldn't be opened for reading*/
     case 79: return "failed to open file for writing";
     case 80: return "tried creating a tree of 0 symbols";
+    case 81: return "band-wise encoding can't interlace, Adam7 needs the whole image at once";
+    case 82: return "the row callback of band-wise encoding failed";
+    case 83: return "invalid deflate strategy given in the settings of the encoder (only 0, 1 and 2 are allowed)";
+    case 84: return "invalid filter strategy given in the settings of the encoder (only 0, 1, 2 and 3 are allowed)";
     default: ; /*nothing to do here, checks for other error values are below*/
   }
 
@@ -5026,7 +6460,7 @@ namespace LodeZlib
     if(buffer)
     {
       out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-      free(buffer);
+      lodepng_free(buffer);
     }
     return error;
   }
@@ -5046,7 +6480,7 @@ namespace LodeZlib
     if(buffer)
     {
       out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-      free(buffer);
+      lodepng_free(buffer);
     }
     return error;
   }
@@ -5125,7 +6559,7 @@ namespace LodePNG
     if(buffer)
     {
       out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-      free(buffer);
+      lodepng_free(buffer);
     }
   }
 
@@ -5233,7 +6667,7 @@ namespace LodePNG
     if(buffer)
     {
       out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-      free(buffer);
+      lodepng_free(buffer);
     }
   }
 
@@ -5242,6 +6676,18 @@ namespace LodePNG
     encode(out, image.empty() ? 0 : &image[0], w, h);
   }
 
+  void Encoder::encodeRows(std::vector<unsigned char>& out, unsigned w, unsigned h, LodePNG_RowCallback rows, void* user)
+  {
+    unsigned char* buffer;
+    size_t buffersize;
+    LodePNG_Encoder_encodeRows(this, &buffer, &buffersize, w, h, rows, user);
+    if(buffer)
+    {
+      out.insert(out.end(), &buffer[0], &buffer[buffersize]);
+      lodepng_free(buffer);
+    }
+  }
+
   void Encoder::clearPalette()
   {
     LodePNG_InfoColor_clearPalette(&infoPng.color);
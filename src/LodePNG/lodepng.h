@@ -50,6 +50,25 @@ to disable code sections, which can give faster compile time and smaller binary.
 #define LODEPNG_COMPILE_ANCILLARY_CHUNKS /*any code or struct datamember related to chunks other than IHDR, IDAT, PLTE, tRNS, IEND*/
 #define LODEPNG_COMPILE_UNKNOWN_CHUNKS   /*handling of unknown chunks*/
 #define LODEPNG_COMPILE_ERROR_TEXT       /*ability to convert error numerical codes to English text string*/
+#ifndef LODEPNG_NO_COMPILE_ALLOCATORS
+#define LODEPNG_COMPILE_ALLOCATORS       /*the default lodepng_malloc, lodepng_realloc and lodepng_free, see below*/
+#endif /*LODEPNG_NO_COMPILE_ALLOCATORS*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* Memory Allocation                                                          */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+Every allocation LodePNG makes, including the buffers it returns to you, goes
+through these three functions. With LODEPNG_COMPILE_ALLOCATORS they simply call
+malloc, realloc and free. Define LODEPNG_NO_COMPILE_ALLOCATORS and provide your
+own definitions elsewhere to allocate from somewhere else, such as an arena.
+In that case, buffers returned by LodePNG must be released with lodepng_free
+rather than free.
+*/
+void* lodepng_malloc(size_t size);
+void* lodepng_realloc(void* ptr, size_t new_size);
+void lodepng_free(void* ptr);
 
 /* ////////////////////////////////////////////////////////////////////////// */
 /* Simple Functions                                                           */
@@ -282,10 +301,31 @@ typedef struct LodeZlib_CompressSettings /*deflate = compress*/
   unsigned btype; /*the block type for LZ (0, 1, 2 or 3, see zlib standard). Should be 2 for proper compression.*/
   unsigned useLZ77; /*whether or not to use LZ77. Should be 1 for proper compression.*/
   unsigned windowSize; /*the maximum is 32768, higher gives more compression but is slower. Typical value: 2048.*/
+  unsigned maxChainLength; /*the most earlier positions tested for a match at each position, 0 for no limit*/
+  unsigned niceLength; /*stop looking for a longer match once one this long is found (3 - 258)*/
+  unsigned maxLazy; /*only look for a longer match at the next position if the match found here is shorter than this, 0 for no lazy matching*/
+  unsigned goodLength; /*when looking for a longer match at the next position after one this long, test a quarter as many positions*/
+  unsigned strategy; /*how LZ77 finds matches. 0: in hash chains, as tuned by the settings above. 1: run-length only, trying just the two distances below, much faster and good for flat images. 2: optimal parsing, much slower but smallest*/
+  unsigned rleDistance; /*for strategy 1: a distance to look for repeats at, 0 for none. Typical value: 1. The PNG encoder sets it to the bytes per pixel.*/
+  unsigned rleDistance2; /*for strategy 1: a second distance, 0 for none. The PNG encoder sets it to the length of a filtered scanline, to repeat the row above.*/
+  unsigned numIterations; /*for strategy 2: the most times the parse is redone with the costs of the one before. Typical value: 15.*/
+  unsigned blockSplitting; /*for btype 2: whether to split the data into several blocks, each with its own Huffman trees, where that makes it smaller*/
 } LodeZlib_CompressSettings;
 
 extern const LodeZlib_CompressSettings LodeZlib_defaultCompressSettings;
 void LodeZlib_CompressSettings_init(LodeZlib_CompressSettings* settings);
+/*
+Set the LZ77 settings for a compression level from 1 (fastest) to 9 (smallest), like
+the levels of zlib. Levels outside that range are clamped to it.
+*/
+void LodeZlib_CompressSettings_initLevel(LodeZlib_CompressSettings* settings, unsigned level);
+
+/*
+Runs job(index, jobdata) for every index from 0 to count - 1, as many at the same time as it likes, and returns
+when they have all finished. user is whatever was given with it in the settings. The jobs don't depend on each
+other and never fail; they may call lodepng_malloc and lodepng_free from whichever thread they run on.
+*/
+typedef void (*LodePNG_ParallelFor)(unsigned count, void (*job)(unsigned index, void* jobdata), void* jobdata, void* user);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -628,6 +668,11 @@ typedef struct LodePNG_EncodeSettings
 
   unsigned autoLeaveOutAlphaChannel; /*automatically use color type without alpha instead of given one, if given image is opaque*/
   unsigned force_palette; /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette). If colortype is 3, PLTE is _always_ created.*/
+  size_t bandSize; /*LodePNG_Encoder_encodeRows: approximate size in bytes of the filtered rows processed at a time, 0 for the whole image at once*/
+  unsigned filterStrategy; /*how each row's filter type is chosen. 0: smallest sum, 1: smallest entropy, 2: 0 but repeated rows Up and one-colour rows Sub, 3: 2 but keeping the filter of the row above when nearly as good*/
+  unsigned numThreads; /*how many segments of the image are filtered and deflated at the same time with parallelFor, 0 or 1 for one thread*/
+  LodePNG_ParallelFor parallelFor; /*runs the segments on other threads, or NULL to encode the image on the calling thread (see numThreads)*/
+  void* parallelUser; /*given to parallelFor*/
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned add_id; /*add LodePNG version as text chunk*/
   unsigned text_compression; /*encode text chunks as zTXt chunks instead of tEXt chunks, and use compression in iTXt chunks*/
@@ -636,6 +681,17 @@ typedef struct LodePNG_EncodeSettings
 
 void LodePNG_EncodeSettings_init(LodePNG_EncodeSettings* settings);
 
+/*
+Working memory the encoder can keep from one image to the next: the LZ77 hash chains, the Huffman trees, the
+buffers deflate builds its blocks in and those encodeRows and the filter work in. These only ever grow, so once
+they fit the images being encoded, the encoder stops allocating anything but its output. Point an encoder's
+context at one to use it. Only one encode at a time may use a context.
+*/
+typedef struct LodePNG_EncodeContext LodePNG_EncodeContext;
+
+LodePNG_EncodeContext* LodePNG_EncodeContext_new(void); /*returns NULL if out of memory*/
+void LodePNG_EncodeContext_delete(LodePNG_EncodeContext* context);
+
 /*
 This struct has most input and output parameters the encoder uses,
 such as the settings, the info of the PNG and the raw data, and the error. Only
@@ -647,6 +703,7 @@ typedef struct LodePNG_Encoder
   LodePNG_InfoPng infoPng; /*the info specified by the user is not changed by the encoder. The encoder will try to generate a PNG close to the given info.*/
   LodePNG_InfoRaw infoRaw; /*put the properties of the input raw image in here*/
   unsigned error; /*error value filled in if error happened, or 0 if all went ok*/
+  LodePNG_EncodeContext* context; /*working memory to reuse, or NULL to allocate it afresh for every image. Not owned: copies of the encoder share it.*/
 } LodePNG_Encoder;
 
 /*init, cleanup and copy functions to use with this struct*/
@@ -656,6 +713,22 @@ void LodePNG_Encoder_copy(LodePNG_Encoder* dest, const LodePNG_Encoder* source);
 
 /*This function allocates the out buffer with standard malloc and stores the size in *outsize.*/
 void LodePNG_Encoder_encode(LodePNG_Encoder* encoder, unsigned char** out, size_t* outsize, const unsigned char* image, unsigned w, unsigned h);
+
+/*
+Gives LodePNG_Encoder_encodeRows the rows y to y + count - 1 of the image, written one after the other to out
+in the color type of infoRaw, each row starting on a new byte. Return nonzero to stop the encoding with error 82.
+*/
+typedef unsigned (*LodePNG_RowCallback)(unsigned char* out, unsigned y, unsigned count, void* user);
+
+/*
+Like LodePNG_Encoder_encode, but the image is fetched from the callback a band of rows at a time (see bandSize in
+the settings) and each band is converted, filtered and compressed before the next is fetched. This way the whole
+image, uncompressed, never has to be in memory; only the compressed result grows with its size.
+Because the image isn't seen ahead of time, autoLeaveOutAlphaChannel has no effect and Adam7 interlacing isn't
+supported (error 81). Matches can reach back across the edge between bands, but each band gets a deflate
+block of its own.
+*/
+void LodePNG_Encoder_encodeRows(LodePNG_Encoder* encoder, unsigned char** out, size_t* outsize, unsigned w, unsigned h, LodePNG_RowCallback rows, void* user);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -884,6 +957,9 @@ namespace LodePNG
     //encoding image to PNG buffer
     void encode(std::vector<unsigned char>& out, const std::vector<unsigned char>& image, unsigned w, unsigned h);
 
+    //encoding image to PNG buffer, fetching the image a band of rows at a time from the callback
+    void encodeRows(std::vector<unsigned char>& out, unsigned w, unsigned h, LodePNG_RowCallback rows, void* user);
+
     //error checking after decoding
     bool hasError() const;
     unsigned getError() const;
@@ -1239,6 +1315,46 @@ channel, resulting in a smaller PNG image.
 *) btype: the block type for LZ77. 0 = uncompressed, 1 = fixed huffman tree, 2 = dynamic huffman tree (best compression)
 *) useLZ77: whether or not to use LZ77 for compressed block types
 *) windowSize: the window size used by the LZ77 encoder (1 - 32768)
+*) maxChainLength, niceLength, maxLazy, goodLength: how hard the LZ77 encoder
+   looks for matches, with the same meaning as zlib's tuning parameters.
+   LodeZlib_CompressSettings_initLevel sets them, and windowSize, for a zlib-style
+   compression level from 1 to 9. The defaults test every position in the window
+   and take the longest match found straight away.
+*) strategy: 0 finds matches with the settings above. 1 is run-length encoding,
+   like zlib's Z_RLE: no hash table is kept, and each position only tries a match
+   with the pixel to its left and the one above (rleDistance and rleDistance2,
+   which the PNG encoder fills in). Much faster, and nearly as small on flat
+   images such as screenshots, but poor on photos. initLevel resets it to 0.
+   2 is optimal parsing, like zopfli's: every length of every match found with the
+   settings above is tried, to find the parse with the fewest bits by a shortest
+   path search, and that is repeated up to numIterations times with the costs of
+   the Huffman codes the last parse got. Seconds per image, for output a few percent
+   smaller than level 9; with maxChainLength 0 it can take minutes.
+*) blockSplitting: default 1. Screenshots mix text, flat areas and photos, whose
+   symbols are too different for one set of Huffman trees to suit them all, so
+   deflate blocks are split where the mix changes enough for new trees to pay
+   for themselves, estimated from the entropy of the symbols. 0 gives one block
+   per call of the deflater, or per band with encodeRows.
+*) filterStrategy: default 0. How the filter type of each row is chosen, for
+   color types with 8 or 16 bits per channel (the others aren't filtered):
+   0 takes the smallest sum of every third filtered byte, fast and good for photos.
+   1 takes the smallest entropy of all the filtered bytes, slower.
+   2 is for screenshots: a row the same as the one above is filtered with Up, which
+   makes it all zeros, and a row all of one color with Sub, which makes it zeros
+   after the first pixel. Other rows are as 0.
+   3 is 2, but keeps the filter type of the row above while its sum is within an
+   eighth of the smallest, so runs of similar rows, such as text, are filtered
+   alike and repeat better. It goes row by row, so isn't split over threads.
+*) numThreads, parallelFor: default 0 and NULL. With both set, the image is cut
+   into segments of whole rows, bandSize bytes each with encodeRows (or a
+   numThreads'th of the image if bandSize is 0), and numThreads of them are
+   deflated at the same time, each with the 32K before it as history, like pigz.
+   Blocks end at every segment, which costs a little compression, but the output
+   is still one standard zlib stream. It only depends on the segment size, not
+   on how the segments were run. Adaptive filtering is split into numThreads
+   bands of rows too, which doesn't change the output at all, as every row is
+   filtered against the unfiltered row above it. parallelFor is given the jobs;
+   see LodePNG_ParallelFor.
 *) force_palette: if colorType is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -575,7 +575,7 @@ public:
             (CColor::Convert(m_BitmapData[i].Blue, 8, BitCountBlue) << BitPosBlue) |
             (CColor::Convert(m_BitmapData[i].Green, 8, BitCountGreen) << BitPosGreen) | 
             (CColor::Convert(m_BitmapData[i].Red, 8, BitCountRed) << BitPosRed) | 
-            (CColor::Convert(m_BitmapData[i].Green, 8, BitCountAlpha) << BitPosAlpha);
+            (CColor::Convert(m_BitmapData[i].Alpha, 8, BitCountAlpha) << BitPosAlpha);
             
             if (IncludePadding) {
                 j++;
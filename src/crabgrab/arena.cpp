@@ -0,0 +1,440 @@
+/**
+    @file
+
+    Monotonic arena allocator for the memory used by a single grab.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/arena.hpp"
+
+#include "crabgrab/buffer_pool.hpp" // buffer_pool
+
+#include <LodePNG/lodepng.h> // lodepng_malloc, lodepng_realloc, lodepng_free
+
+#include <boost/thread/mutex.hpp> // mutex
+#include <boost/thread/tss.hpp> // thread_specific_ptr
+
+#include <algorithm> // max
+#include <cassert> // assert
+#include <cstdlib> // malloc, realloc, free
+#include <cstring> // memcpy
+
+using std::size_t;
+
+namespace crabgrab {
+
+/**
+ * Chunk header.  The chunk's memory follows it.
+ */
+struct arena::chunk
+{
+    chunk* next;
+    chunk* previous;
+    size_t reserved; ///< Size of the buffer borrowed for the chunk
+    size_t capacity;
+    size_t used;
+    size_t blocks; ///< Blocks carved from the chunk and not yet released
+    bool dedicated;
+};
+
+namespace {
+
+    const size_t alignment = 16;
+
+    size_t round_up(size_t size)
+    {
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+    /**
+     * Precedes every block so it can be resized and freed without the
+     * caller saying where it came from or how big it is.
+     */
+    struct block_header
+    {
+        arena* owner;
+        void* home;
+        size_t size;
+    };
+
+    const size_t header_size = round_up(sizeof(block_header));
+
+    block_header* header_of(const void* block)
+    {
+        return reinterpret_cast<block_header*>(
+            const_cast<unsigned char*>(
+                static_cast<const unsigned char*>(block)) - header_size);
+    }
+
+    void* block_of(block_header* header)
+    {
+        return reinterpret_cast<unsigned char*>(header) + header_size;
+    }
+
+    size_t block_footprint(size_t size)
+    {
+        return header_size + round_up(size);
+    }
+
+    boost::mutex process_statistics_mutex;
+    arena_statistics process_totals;
+
+    void no_cleanup(arena*) {}
+
+    boost::thread_specific_ptr<arena> current_arena(no_cleanup);
+}
+
+const size_t arena::default_chunk_size;
+
+arena::arena(size_t chunk_size, buffer_pool& pool)
+    :
+m_pool(pool), m_chunk_size(chunk_size), m_chunks(NULL), m_current(NULL),
+m_reported_bytes_allocated(0) {}
+
+arena::~arena()
+{
+    m_statistics.bytes_allocated = 0;
+    while (m_chunks)
+        release_chunk(m_chunks);
+}
+
+void arena::report_to_process(std::ptrdiff_t reserved, std::ptrdiff_t chunks)
+{
+    boost::mutex::scoped_lock lock(process_statistics_mutex);
+
+    process_totals.bytes_allocated +=
+        m_statistics.bytes_allocated - m_reported_bytes_allocated;
+    m_reported_bytes_allocated = m_statistics.bytes_allocated;
+
+    process_totals.bytes_reserved += reserved;
+    process_totals.chunks += chunks;
+    process_totals.peak_bytes_reserved = std::max(
+        process_totals.peak_bytes_reserved, process_totals.bytes_reserved);
+}
+
+size_t arena::chunk_header_size()
+{
+    return round_up(sizeof(chunk));
+}
+
+arena::chunk* arena::new_chunk(size_t size, bool dedicated)
+{
+    size_t reserved;
+    chunk* c = static_cast<chunk*>(m_pool.acquire(size, reserved));
+
+    c->reserved = reserved;
+    c->capacity = reserved - chunk_header_size();
+    c->used = 0;
+    c->blocks = 0;
+    c->dedicated = dedicated;
+    c->previous = NULL;
+    c->next = m_chunks;
+    if (m_chunks)
+        m_chunks->previous = c;
+    m_chunks = c;
+
+    m_statistics.bytes_reserved += reserved;
+    m_statistics.chunks += 1;
+    m_statistics.peak_bytes_reserved = std::max(
+        m_statistics.peak_bytes_reserved, m_statistics.bytes_reserved);
+    report_to_process(reserved, 1);
+
+    return c;
+}
+
+void arena::release_chunk(chunk* c)
+{
+    if (c->previous)
+        c->previous->next = c->next;
+    else
+        m_chunks = c->next;
+    if (c->next)
+        c->next->previous = c->previous;
+    if (m_current == c)
+        m_current = NULL;
+
+    m_statistics.bytes_reserved -= c->reserved;
+    m_statistics.chunks -= 1;
+    report_to_process(-static_cast<std::ptrdiff_t>(c->reserved), -1);
+
+    m_pool.release(c, c->reserved);
+}
+
+void* arena::carve(chunk* c, size_t size)
+{
+    size_t footprint = block_footprint(size);
+    if (c->capacity - c->used < footprint)
+        return NULL;
+
+    block_header* header = reinterpret_cast<block_header*>(
+        reinterpret_cast<unsigned char*>(c) + chunk_header_size() + c->used);
+    header->owner = this;
+    header->home = c;
+    header->size = size;
+
+    c->used += footprint;
+    c->blocks += 1;
+    m_statistics.bytes_allocated += footprint;
+
+    return block_of(header);
+}
+
+void* arena::allocate(size_t size)
+{
+    size_t footprint = block_footprint(size);
+
+    if (footprint > m_chunk_size / 4)
+        return carve(new_chunk(chunk_header_size() + footprint, true), size);
+
+    void* block = (m_current) ? carve(m_current, size) : NULL;
+    if (!block)
+    {
+        m_current = new_chunk(
+            std::max(m_chunk_size, chunk_header_size() + footprint), false);
+        block = carve(m_current, size);
+    }
+
+    return block;
+}
+
+void* arena::reallocate(void* block, size_t size)
+{
+    if (!block)
+        return allocate(size);
+
+    block_header* header = header_of(block);
+    assert(header->owner == this);
+
+    if (size <= header->size)
+        return block;
+
+    chunk* c = static_cast<chunk*>(header->home);
+    size_t old_footprint = block_footprint(header->size);
+    size_t new_footprint = block_footprint(size);
+
+    if (c->dedicated)
+    {
+        // The chunk's size class usually leaves room to grow into.  If not,
+        // the block moves to a bigger chunk of its own
+        if (new_footprint > c->capacity)
+        {
+            chunk* moved = new_chunk(chunk_header_size() + new_footprint, true);
+            header = reinterpret_cast<block_header*>(
+                reinterpret_cast<unsigned char*>(moved) + chunk_header_size());
+            std::memcpy(header, header_of(block), old_footprint);
+            header->home = moved;
+            moved->used = old_footprint;
+            moved->blocks = 1;
+            release_chunk(c);
+            c = moved;
+        }
+
+        c->used = new_footprint;
+        m_statistics.bytes_allocated += new_footprint - old_footprint;
+        header->size = size;
+        return block_of(header);
+    }
+
+    // The last block in the current chunk can grow into the free space
+    // after it
+    unsigned char* chunk_end =
+        reinterpret_cast<unsigned char*>(c) + chunk_header_size() + c->used;
+    bool is_last = reinterpret_cast<unsigned char*>(header) + old_footprint ==
+        chunk_end;
+    if (is_last && new_footprint <= m_chunk_size / 4 &&
+        c->used - old_footprint + new_footprint <= c->capacity)
+    {
+        c->used += new_footprint - old_footprint;
+        m_statistics.bytes_allocated += new_footprint - old_footprint;
+        header->size = size;
+        return block;
+    }
+
+    void* moved = allocate(size);
+    std::memcpy(moved, block, header->size);
+    deallocate(block);
+    return moved;
+}
+
+void arena::deallocate(void* block)
+{
+    if (!block)
+        return;
+
+    block_header* header = header_of(block);
+    assert(header->owner == this);
+
+    chunk* c = static_cast<chunk*>(header->home);
+    size_t footprint = block_footprint(header->size);
+    m_statistics.bytes_allocated -= footprint;
+
+    c->blocks -= 1;
+
+    // A chunk with nothing left in it is either started afresh, if we are
+    // still carving from it, or given back.  The encoder's growing buffers
+    // leave a trail of these behind them
+    if (c->blocks == 0)
+    {
+        if (c == m_current)
+            c->used = 0;
+        else
+            release_chunk(c);
+        return;
+    }
+
+    // Otherwise freeing the most recent block is the one case a bump
+    // allocator can undo
+    unsigned char* chunk_end =
+        reinterpret_cast<unsigned char*>(c) + chunk_header_size() + c->used;
+    if (reinterpret_cast<unsigned char*>(header) + footprint == chunk_end)
+        c->used -= footprint;
+}
+
+arena_statistics arena::statistics() const
+{
+    return m_statistics;
+}
+
+arena_statistics arena::process_statistics()
+{
+    boost::mutex::scoped_lock lock(process_statistics_mutex);
+    return process_totals;
+}
+
+arena* arena::owner(const void* block)
+{
+    return header_of(block)->owner;
+}
+
+arena_scope::arena_scope(arena& memory) : m_previous(current_arena.get())
+{
+    current_arena.reset(&memory);
+}
+
+arena_scope::~arena_scope()
+{
+    current_arena.reset(m_previous);
+}
+
+arena* arena_scope::current()
+{
+    return current_arena.get();
+}
+
+heap_scope::heap_scope() : m_previous(current_arena.get())
+{
+    current_arena.reset(NULL);
+}
+
+heap_scope::~heap_scope()
+{
+    current_arena.reset(m_previous);
+}
+
+void* allocate_scoped(size_t size)
+{
+    arena* memory = arena_scope::current();
+    if (memory)
+    {
+        try
+        {
+            return memory->allocate(size);
+        }
+        catch (const std::bad_alloc&)
+        {
+            return NULL;
+        }
+    }
+
+    block_header* header =
+        static_cast<block_header*>(std::malloc(header_size + size));
+    if (!header)
+        return NULL;
+
+    header->owner = NULL;
+    header->home = NULL;
+    header->size = size;
+    return block_of(header);
+}
+
+void* reallocate_scoped(void* block, size_t size)
+{
+    if (!block)
+        return allocate_scoped(size);
+
+    block_header* header = header_of(block);
+    if (header->owner)
+    {
+        try
+        {
+            return header->owner->reallocate(block, size);
+        }
+        catch (const std::bad_alloc&)
+        {
+            return NULL;
+        }
+    }
+
+    header = static_cast<block_header*>(std::realloc(header, header_size + size));
+    if (!header)
+        return NULL;
+
+    header->size = size;
+    return block_of(header);
+}
+
+void free_scoped(void* block)
+{
+    if (!block)
+        return;
+
+    block_header* header = header_of(block);
+    if (header->owner)
+        header->owner->deallocate(block);
+    else
+        std::free(header);
+}
+
+}
+
+// LodePNG is built with LODEPNG_NO_COMPILE_ALLOCATORS so that everything it
+// allocates comes from the grab's arena
+
+void* lodepng_malloc(size_t size)
+{
+    return crabgrab::allocate_scoped(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size)
+{
+    return crabgrab::reallocate_scoped(ptr, new_size);
+}
+
+void lodepng_free(void* ptr)
+{
+    crabgrab::free_scoped(ptr);
+}
@@ -0,0 +1,277 @@
+/**
+    @file
+
+    Monotonic arena allocator for the memory used by a single grab.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_ARENA_HPP
+#define CRABGRAB_ARENA_HPP
+
+#include "crabgrab/buffer_pool.hpp" // buffer_pool
+
+#include <boost/noncopyable.hpp> // noncopyable
+
+#include <cstddef> // size_t, ptrdiff_t
+#include <new> // bad_alloc, placement new
+
+namespace crabgrab {
+
+/**
+ * Memory usage counters for an arena or, summed, for the whole process.
+ */
+struct arena_statistics
+{
+    arena_statistics()
+        : bytes_allocated(0), bytes_reserved(0), chunks(0),
+          peak_bytes_reserved(0) {}
+
+    /// Bytes handed out and not yet given back, including block headers.
+    std::size_t bytes_allocated;
+
+    /// Bytes currently borrowed from the buffer pool for chunks.
+    std::size_t bytes_reserved;
+
+    /// Chunks currently obtained from the system.
+    std::size_t chunks;
+
+    /// Highest bytes_reserved has ever been.
+    std::size_t peak_bytes_reserved;
+};
+
+/**
+ * Monotonic allocator: memory is carved sequentially out of large chunks
+ * and only returned to the system, all at once, when the arena is destroyed.
+ *
+ * Processing a grab makes a lot of allocations that all die together at the
+ * end.  Taking them from an arena makes each one a pointer bump and freeing
+ * them O(1), and stops them fragmenting the heap of a long-running process.
+ *
+ * Blocks too big to share a chunk get one of their own, which is released
+ * as soon as the block is, so large buffers don't pin memory for the rest of
+ * the grab.  Likewise, a chunk is released as soon as every block in it has
+ * been.  A block can grow in place if it was the last one allocated.
+ *
+ * Chunks are borrowed from a buffer_pool so, from one grab to the next, the
+ * same memory is used again rather than returned to the system.
+ *
+ * An arena isn't thread-safe; each thread should use its own.
+ */
+class arena : boost::noncopyable
+{
+public:
+    static const std::size_t default_chunk_size = 256 * 1024;
+
+    explicit arena(
+        std::size_t chunk_size=default_chunk_size,
+        buffer_pool& pool=buffer_pool::shared());
+    ~arena();
+
+    /**
+     * @throws std::bad_alloc if the system is out of memory.
+     */
+    void* allocate(std::size_t size);
+
+    /**
+     * Resize a block from this arena, moving it if it can't grow in place.
+     *
+     * As with realloc, a NULL block allocates a new one.
+     *
+     * @throws std::bad_alloc if the system is out of memory, in which case
+     *         the original block is untouched.
+     */
+    void* reallocate(void* block, std::size_t size);
+
+    /**
+     * Give a block back.
+     *
+     * Its memory is only reused if it was the last block allocated or the
+     * last block alive in its chunk; otherwise it waits for the arena to be
+     * destroyed.
+     */
+    void deallocate(void* block);
+
+    arena_statistics statistics() const;
+
+    /**
+     * Counters summed over every arena in the process.
+     *
+     * The process-wide bytes_allocated is brought up to date whenever an
+     * arena gains or loses a chunk, rather than on every allocation.
+     */
+    static arena_statistics process_statistics();
+
+    /**
+     * The arena a block came from, or NULL if it was allocated by
+     * allocate_scoped with no arena in scope.
+     *
+     * Only valid for blocks from arena::allocate or allocate_scoped.
+     */
+    static arena* owner(const void* block);
+
+private:
+    struct chunk;
+
+    static std::size_t chunk_header_size();
+
+    chunk* new_chunk(std::size_t size, bool dedicated);
+    void release_chunk(chunk* c);
+    void* carve(chunk* c, std::size_t size);
+    void report_to_process(std::ptrdiff_t reserved, std::ptrdiff_t chunks);
+
+    buffer_pool& m_pool;
+    std::size_t m_chunk_size;
+    chunk* m_chunks;
+    chunk* m_current;
+    arena_statistics m_statistics;
+    std::size_t m_reported_bytes_allocated;
+};
+
+/**
+ * Makes an arena the current thread's source of memory for as long as the
+ * scope lives.
+ *
+ * Everything allocated by allocate_scoped in the meantime, which includes
+ * all the memory the PNG encoder uses, comes from the arena.  Scopes nest.
+ */
+class arena_scope : boost::noncopyable
+{
+public:
+    explicit arena_scope(arena& memory);
+    ~arena_scope();
+
+    /**
+     * The innermost arena in scope on this thread, or NULL.
+     */
+    static arena* current();
+
+private:
+    arena* m_previous;
+};
+
+/**
+ * Sends allocate_scoped back to the heap for as long as the scope lives,
+ * whatever arena is in scope around it.
+ *
+ * For memory that has to outlive the grab that first allocates it, such as
+ * an encoder_context's buffers.
+ */
+class heap_scope : boost::noncopyable
+{
+public:
+    heap_scope();
+    ~heap_scope();
+
+private:
+    arena* m_previous;
+};
+
+/**
+ * Allocate from the current thread's arena if there is one, otherwise from
+ * the heap.
+ *
+ * Blocks from either place are released with free_scoped, which works out
+ * where they came from, so a block may outlive the scope it was allocated
+ * in (though not the arena).
+ *
+ * @returns NULL if out of memory, like malloc.
+ */
+void* allocate_scoped(std::size_t size);
+void* reallocate_scoped(void* block, std::size_t size);
+void free_scoped(void* block);
+
+/**
+ * Standard allocator drawing from an arena.
+ *
+ * Lets standard containers keep their elements in a grab's arena.
+ */
+template<typename T>
+class arena_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef arena_allocator<U> other;
+    };
+
+    explicit arena_allocator(arena& memory) : m_arena(&memory) {}
+
+    template<typename U>
+    arena_allocator(const arena_allocator<U>& other)
+        : m_arena(other.memory()) {}
+
+    pointer allocate(size_type n, const void* /*hint*/=0)
+    {
+        return static_cast<pointer>(m_arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type /*n*/)
+    {
+        m_arena->deallocate(p);
+    }
+
+    void construct(pointer p, const T& value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    pointer address(reference r) const { return &r; }
+    const_pointer address(const_reference r) const { return &r; }
+
+    size_type max_size() const
+    {
+        return static_cast<size_type>(-1) / sizeof(T);
+    }
+
+    arena* memory() const { return m_arena; }
+
+private:
+    arena* m_arena;
+};
+
+template<typename T, typename U>
+inline bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+    return a.memory() == b.memory();
+}
+
+template<typename T, typename U>
+inline bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b)
+{
+    return !(a == b);
+}
+
+}
+
+#endif
@@ -0,0 +1,346 @@
+/**
+    @file
+
+    Zero-copy parsing of BMP files and DIBs held in memory.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/bmp_view.hpp"
+
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <stdexcept> // runtime_error, logic_error, out_of_range
+
+using boost::uint32_t;
+using boost::uint64_t;
+
+using std::size_t;
+
+namespace crabgrab {
+
+namespace {
+
+    const size_t file_header_size = 14; // sizeof(BITMAPFILEHEADER)
+    const size_t info_header_size = 40; // sizeof(BITMAPINFOHEADER)
+    const unsigned int bmp_signature = 0x4D42; // 'BM'
+
+    // Values of biCompression
+    const uint32_t bi_rgb = 0;
+    const uint32_t bi_rle8 = 1;
+    const uint32_t bi_rle4 = 2;
+    const uint32_t bi_bitfields = 3;
+    const uint32_t bi_alphabitfields = 6;
+
+    unsigned int read_uint16(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8);
+    }
+
+    uint32_t read_uint32(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) |
+            (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    long read_int32(const unsigned char* p)
+    {
+        return static_cast<boost::int32_t>(read_uint32(p));
+    }
+
+    void throw_malformed(const char* message)
+    {
+        BOOST_THROW_EXCEPTION(std::runtime_error(message));
+    }
+
+    /**
+     * Whether the set bits of a mask are all in one run.
+     *
+     * Adding the lowest set bit carries through the run and clears it, so
+     * nothing is left if there was no other.
+     */
+    bool is_contiguous(uint32_t mask)
+    {
+        return (mask & (mask + (mask & (~mask + 1)))) == 0;
+    }
+}
+
+bmp_view::bmp_view()
+    :
+m_width(0), m_height(0), m_bit_count(0), m_bottom_up(true),
+m_run_length_encoded(false), m_pixels(NULL), m_row_size(0),
+m_colour_table(NULL), m_colour_count(0), m_red_mask(0), m_green_mask(0),
+m_blue_mask(0), m_alpha_mask(0) {}
+
+bmp_view bmp_view::from_file_bytes(const unsigned char* data, size_t size)
+{
+    if (size < file_header_size || read_uint16(data) != bmp_signature)
+        throw_malformed("Not a BMP file");
+
+    size_t bits_offset = read_uint32(data + 10);
+    if (bits_offset > size)
+        throw_malformed("BMP pixel data is missing");
+
+    bmp_view view;
+    view.parse_info(
+        data + file_header_size, size - file_header_size, data + size);
+    view.locate_pixels(data + bits_offset, data + size);
+    return view;
+}
+
+bmp_view bmp_view::from_packed_dib(const unsigned char* data, size_t size)
+{
+    bmp_view view;
+    view.parse_info(data, size, data + size);
+
+    // In a packed DIB the pixels start straight after the colour table
+    view.locate_pixels(
+        view.m_colour_table + view.m_colour_count * 4, data + size);
+    return view;
+}
+
+void bmp_view::parse_info(
+    const unsigned char* info, size_t info_size, const unsigned char* end)
+{
+    if (info_size < 4)
+        throw_malformed("BMP header is truncated");
+
+    size_t header_size = read_uint32(info);
+    if (header_size < info_header_size)
+        throw_malformed("Unsupported BMP header version");
+    if (header_size > info_size)
+        throw_malformed("BMP header is truncated");
+
+    long width = read_int32(info + 4);
+    long height = read_int32(info + 8);
+    if (width <= 0 || height == 0)
+        throw_malformed("Invalid BMP dimensions");
+
+    m_width = width;
+    m_bottom_up = height > 0;
+    m_height = (m_bottom_up) ? height : -height;
+    m_bit_count = read_uint16(info + 14);
+
+    uint32_t compression = read_uint32(info + 16);
+    uint32_t colours_used = read_uint32(info + 32);
+
+    switch (m_bit_count)
+    {
+    case 1:
+    case 4:
+    case 8:
+    case 24:
+        break;
+    case 16:
+        m_red_mask = 0x7c00;
+        m_green_mask = 0x03e0;
+        m_blue_mask = 0x001f;
+        break;
+    case 32:
+        m_red_mask = 0x00ff0000;
+        m_green_mask = 0x0000ff00;
+        m_blue_mask = 0x000000ff;
+        break;
+    default:
+        throw_malformed("Invalid number of bits per pixel");
+    }
+
+    const unsigned char* after_header = info + header_size;
+
+    switch (compression)
+    {
+    case bi_rgb:
+        break;
+
+    case bi_rle8:
+    case bi_rle4:
+        if (m_bit_count != ((compression == bi_rle8) ? 8U : 4U))
+            throw_malformed("Run-length encoding doesn't match bit depth");
+        m_run_length_encoded = true;
+        break;
+
+    case bi_bitfields:
+    case bi_alphabitfields:
+        {
+            if (m_bit_count != 16 && m_bit_count != 32)
+                throw_malformed("Bitfields are only valid at 16 or 32bpp");
+
+            // Newer headers have room for the masks; the original
+            // BITMAPINFOHEADER is followed by them instead
+            size_t mask_count = (compression == bi_alphabitfields) ? 4 : 3;
+            const unsigned char* masks = info + info_header_size;
+            if (header_size == info_header_size)
+            {
+                if (static_cast<size_t>(end - after_header) < mask_count * 4)
+                    throw_malformed("BMP colour masks are truncated");
+                after_header += mask_count * 4;
+            }
+            else if (header_size >= info_header_size + 16)
+            {
+                mask_count = 4;
+            }
+
+            m_red_mask = read_uint32(masks);
+            m_green_mask = read_uint32(masks + 4);
+            m_blue_mask = read_uint32(masks + 8);
+            m_alpha_mask = (mask_count == 4) ? read_uint32(masks + 12) : 0;
+
+            if (!is_contiguous(m_red_mask) || !is_contiguous(m_green_mask) ||
+                !is_contiguous(m_blue_mask) || !is_contiguous(m_alpha_mask))
+                throw_malformed("BMP colour masks must be contiguous");
+
+            if ((m_red_mask & (m_green_mask | m_blue_mask | m_alpha_mask)) ||
+                (m_green_mask & (m_blue_mask | m_alpha_mask)) ||
+                (m_blue_mask & m_alpha_mask))
+                throw_malformed("BMP colour masks overlap");
+        }
+        break;
+
+    default:
+        throw_malformed("Unsupported BMP compression");
+    }
+
+    if (m_bit_count <= 8)
+    {
+        m_colour_count = 1U << m_bit_count;
+        if (colours_used != 0 && colours_used < m_colour_count)
+            m_colour_count = colours_used;
+    }
+    else
+    {
+        // Optional and only a hint for palette devices but it's still
+        // between the header and the pixels of a packed DIB
+        m_colour_count = colours_used;
+    }
+
+    if (static_cast<size_t>(end - after_header) / 4 < m_colour_count)
+        throw_malformed("BMP colour table is truncated");
+
+    m_colour_table = after_header;
+}
+
+void bmp_view::locate_pixels(
+    const unsigned char* pixels, const unsigned char* end)
+{
+    uint64_t row_size =
+        ((static_cast<uint64_t>(m_width) * m_bit_count + 31) / 32) * 4;
+    size_t available = end - pixels;
+
+    if (!m_run_length_encoded && row_size * m_height > available)
+        throw_malformed("BMP pixel data is truncated");
+
+    m_pixels = pixels;
+    m_row_size = static_cast<size_t>(row_size);
+}
+
+const unsigned char* bmp_view::row(unsigned int y) const
+{
+    if (m_run_length_encoded)
+        BOOST_THROW_EXCEPTION(
+            std::logic_error(
+                "Rows of a run-length encoded bitmap can't be found without "
+                "decoding the whole image"));
+    if (y >= m_height)
+        BOOST_THROW_EXCEPTION(std::out_of_range("Row is outside the bitmap"));
+
+    size_t memory_row = (m_bottom_up) ? m_height - 1 - y : y;
+    return m_pixels + memory_row * m_row_size;
+}
+
+boost::optional<image_view> bmp_view::direct_view() const
+{
+    if (m_run_length_encoded)
+        return boost::none;
+
+    channel_order::type order;
+    if (m_bit_count == 24)
+    {
+        order = channel_order::bgr;
+    }
+    else if (
+        m_bit_count == 16 && m_blue_mask == 0x001f && m_alpha_mask == 0 &&
+        ((m_red_mask == 0xf800 && m_green_mask == 0x07e0) ||
+         (m_red_mask == 0x7c00 && m_green_mask == 0x03e0)))
+    {
+        order = (m_red_mask == 0xf800) ?
+            channel_order::rgb565 : channel_order::rgb555;
+    }
+    else if (
+        m_bit_count == 32 && m_red_mask == 0x00ff0000 &&
+        m_green_mask == 0x0000ff00 && m_blue_mask == 0x000000ff)
+    {
+        if (m_alpha_mask == 0)
+            order = channel_order::bgrx;
+        else if (m_alpha_mask == 0xff000000)
+            order = channel_order::bgra;
+        else
+            return boost::none;
+    }
+    else
+    {
+        return boost::none;
+    }
+
+    return image_view(
+        m_pixels, m_width, m_height, m_row_size, order, m_bottom_up);
+}
+
+pixel_unpacker bmp_view::unpacker(channel_order::type out_order) const
+{
+    if (m_run_length_encoded)
+        BOOST_THROW_EXCEPTION(
+            std::logic_error(
+                "Rows of a run-length encoded bitmap can't be decoded "
+                "individually"));
+
+    if (m_bit_count <= 8)
+        return pixel_unpacker::indexed(
+            m_bit_count, m_colour_table, m_colour_count, out_order);
+    else
+        return pixel_unpacker::bitfields(
+            m_bit_count, m_red_mask, m_green_mask, m_blue_mask, m_alpha_mask,
+            out_order);
+}
+
+void bmp_view::decode_row(
+    unsigned int y, unsigned char* out, channel_order::type out_order) const
+{
+    unpacker(out_order)(row(y), out, m_width);
+}
+
+mapped_bmp_file::mapped_bmp_file(const boost::filesystem::path& file)
+    :
+m_file(file.string().c_str(), boost::interprocess::read_only),
+m_region(m_file, boost::interprocess::read_only) {}
+
+bmp_view mapped_bmp_file::view() const
+{
+    return bmp_view::from_file_bytes(
+        static_cast<const unsigned char*>(m_region.get_address()),
+        m_region.get_size());
+}
+
+}
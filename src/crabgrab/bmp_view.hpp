@@ -0,0 +1,177 @@
+/**
+    @file
+
+    Zero-copy parsing of BMP files and DIBs held in memory.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_BMP_VIEW_HPP
+#define CRABGRAB_BMP_VIEW_HPP
+
+#include "crabgrab/image_view.hpp" // image_view
+#include "crabgrab/pixel_unpack.hpp" // pixel_unpacker
+
+#include <boost/cstdint.hpp> // uint32_t
+#include <boost/filesystem/path.hpp> // path
+#include <boost/interprocess/file_mapping.hpp> // file_mapping
+#include <boost/interprocess/mapped_region.hpp> // mapped_region
+#include <boost/noncopyable.hpp> // noncopyable
+#include <boost/optional/optional.hpp> // optional
+
+#include <cstddef> // size_t, ptrdiff_t
+
+namespace crabgrab {
+
+/**
+ * Read-only view of a bitmap whose bytes are owned by someone else.
+ *
+ * Only the headers are parsed up front.  Pixels stay where they are and
+ * are decoded a row at a time when asked for, so viewing a BMP costs
+ * nothing however big it is.  The memory must outlive the view.
+ *
+ * Run-length encoded bitmaps can be viewed but, as their rows can't be
+ * found without decoding everything before them, not decoded.
+ */
+class bmp_view
+{
+public:
+
+    /**
+     * View of a complete BMP file, starting with its BITMAPFILEHEADER.
+     */
+    static bmp_view from_file_bytes(const unsigned char* data, std::size_t size);
+
+    /**
+     * View of a packed DIB: a BITMAPINFO immediately followed by the pixels,
+     * as found on the clipboard as CF_DIB.
+     */
+    static bmp_view from_packed_dib(
+        const unsigned char* data, std::size_t size);
+
+    unsigned int width() const { return m_width; }
+    unsigned int height() const { return m_height; }
+    unsigned int bit_count() const { return m_bit_count; }
+    bool bottom_up() const { return m_bottom_up; }
+    bool is_run_length_encoded() const { return m_run_length_encoded; }
+
+    /**
+     * Bytes from the start of one row to the next, including padding.
+     */
+    std::size_t row_size() const { return m_row_size; }
+
+    /**
+     * Undecoded bytes of the row `y` pixels from the top of the image.
+     *
+     * @throws std::logic_error if the bitmap is run-length encoded.
+     * @throws std::out_of_range if `y` isn't a row of the bitmap.
+     */
+    const unsigned char* row(unsigned int y) const;
+
+    /**
+     * Colour table as BGRX quads.
+     */
+    const unsigned char* colour_table() const { return m_colour_table; }
+    std::size_t colour_count() const { return m_colour_count; }
+
+    boost::uint32_t red_mask() const { return m_red_mask; }
+    boost::uint32_t green_mask() const { return m_green_mask; }
+    boost::uint32_t blue_mask() const { return m_blue_mask; }
+    boost::uint32_t alpha_mask() const { return m_alpha_mask; }
+
+    /**
+     * The pixels as an image_view, if they are already in a layout one can
+     * describe (uncompressed 24bpp or 32bpp BGR, or 16bpp 565 or 555).
+     */
+    boost::optional<image_view> direct_view() const;
+
+    /**
+     * Unpacker for this bitmap's pixel format.
+     *
+     * Create it once and use it for every row rather than calling
+     * decode_row repeatedly.
+     *
+     * @param out_order  channel_order::rgba or channel_order::rgb.  Pixels
+     *                   without an alpha channel come out opaque.
+     */
+    pixel_unpacker unpacker(channel_order::type out_order) const;
+
+    /**
+     * Decode one row into RGBA or RGB.
+     *
+     * @param y          Row number counting from the top of the image.
+     * @param out        Room for width() pixels of `out_order`.
+     * @param out_order  channel_order::rgba or channel_order::rgb.  Pixels
+     *                   without an alpha channel come out opaque.
+     */
+    void decode_row(
+        unsigned int y, unsigned char* out,
+        channel_order::type out_order) const;
+
+private:
+    bmp_view();
+
+    void parse_info(
+        const unsigned char* info, std::size_t info_size,
+        const unsigned char* end);
+    void locate_pixels(const unsigned char* pixels, const unsigned char* end);
+
+    unsigned int m_width;
+    unsigned int m_height;
+    unsigned int m_bit_count;
+    bool m_bottom_up;
+    bool m_run_length_encoded;
+    const unsigned char* m_pixels;
+    std::size_t m_row_size;
+    const unsigned char* m_colour_table;
+    std::size_t m_colour_count;
+    boost::uint32_t m_red_mask;
+    boost::uint32_t m_green_mask;
+    boost::uint32_t m_blue_mask;
+    boost::uint32_t m_alpha_mask;
+};
+
+/**
+ * A BMP file mapped read-only into memory.
+ *
+ * Lets a BMP on disk be viewed and encoded without reading it into a
+ * buffer first; the OS pages it in as the rows are touched.
+ */
+class mapped_bmp_file : boost::noncopyable
+{
+public:
+    explicit mapped_bmp_file(const boost::filesystem::path& file);
+
+    bmp_view view() const;
+
+private:
+    boost::interprocess::file_mapping m_file;
+    boost::interprocess::mapped_region m_region;
+};
+
+}
+
+#endif
@@ -0,0 +1,248 @@
+/**
+    @file
+
+    Recycled page-aligned buffers for frame-sized allocations.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/buffer_pool.hpp"
+
+#include <cassert> // assert
+#include <new> // bad_alloc
+
+#ifdef _WIN32
+#include <Windows.h> // VirtualAlloc, VirtualFree
+#else
+#include <stdlib.h> // posix_memalign, free
+#endif
+
+using std::size_t;
+
+namespace crabgrab {
+
+namespace {
+
+    void* allocate_pages(size_t size)
+    {
+#ifdef _WIN32
+        void* pages = ::VirtualAlloc(
+            NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        void* pages = NULL;
+        if (::posix_memalign(&pages, buffer_pool::page_size, size) != 0)
+            pages = NULL;
+#endif
+        if (!pages)
+            throw std::bad_alloc();
+        return pages;
+    }
+
+    void free_pages(void* pages)
+    {
+#ifdef _WIN32
+        ::VirtualFree(pages, 0, MEM_RELEASE);
+#else
+        ::free(pages);
+#endif
+    }
+}
+
+const size_t buffer_pool::page_size;
+const size_t buffer_pool::default_cache_limit;
+
+buffer_pool::buffer_pool(size_t cache_limit) : m_cache_limit(cache_limit) {}
+
+buffer_pool::~buffer_pool()
+{
+    assert(m_statistics.lent_buffers == 0);
+    trim();
+}
+
+size_t buffer_pool::size_class(size_t size)
+{
+    size_t pages = (size + page_size - 1) / page_size;
+    if (pages <= 4)
+        return ((pages == 0) ? 1 : pages) * page_size;
+
+    // Round up to a quarter of the highest power of two in the page count
+    size_t top = 1;
+    while (top <= pages / 2)
+        top *= 2;
+    size_t step = top / 4;
+
+    return ((pages + step - 1) / step) * step * page_size;
+}
+
+void* buffer_pool::acquire(size_t size, size_t& capacity)
+{
+    capacity = size_class(size);
+
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        std::map<size_t, std::vector<void*> >::iterator idle =
+            m_idle.find(capacity);
+        if (idle != m_idle.end() && !idle->second.empty())
+        {
+            void* buffer = idle->second.back();
+            idle->second.pop_back();
+            if (idle->second.empty())
+                m_idle.erase(idle);
+
+            m_statistics.hits += 1;
+            m_statistics.cached_bytes -= capacity;
+            m_statistics.cached_buffers -= 1;
+            m_statistics.lent_bytes += capacity;
+            m_statistics.lent_buffers += 1;
+            return buffer;
+        }
+
+        m_statistics.misses += 1;
+    }
+
+    // Don't hold up other threads while the system finds memory
+    void* buffer = allocate_pages(capacity);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_statistics.lent_bytes += capacity;
+    m_statistics.lent_buffers += 1;
+    return buffer;
+}
+
+void buffer_pool::release(void* buffer, size_t capacity)
+{
+    if (!buffer)
+        return;
+
+    assert(capacity == size_class(capacity));
+
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_statistics.lent_bytes -= capacity;
+        m_statistics.lent_buffers -= 1;
+
+        if (m_statistics.cached_bytes + capacity <= m_cache_limit)
+        {
+            m_idle[capacity].push_back(buffer);
+            m_statistics.cached_bytes += capacity;
+            m_statistics.cached_buffers += 1;
+            return;
+        }
+    }
+
+    free_pages(buffer);
+}
+
+void buffer_pool::trim()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    for (std::map<size_t, std::vector<void*> >::iterator idle =
+             m_idle.begin();
+         idle != m_idle.end(); ++idle)
+    {
+        for (size_t i = 0; i < idle->second.size(); ++i)
+            free_pages(idle->second[i]);
+    }
+
+    m_idle.clear();
+    m_statistics.cached_bytes = 0;
+    m_statistics.cached_buffers = 0;
+}
+
+size_t buffer_pool::cache_limit() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_cache_limit;
+}
+
+void buffer_pool::cache_limit(size_t limit)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_cache_limit = limit;
+    free_over_limit();
+}
+
+/**
+ * Free idle buffers, biggest first, until they fit under the cap.
+ *
+ * Must be called with the mutex held.
+ */
+void buffer_pool::free_over_limit()
+{
+    while (m_statistics.cached_bytes > m_cache_limit)
+    {
+        std::map<size_t, std::vector<void*> >::iterator biggest =
+            m_idle.end();
+        --biggest;
+
+        free_pages(biggest->second.back());
+        biggest->second.pop_back();
+        m_statistics.cached_bytes -= biggest->first;
+        m_statistics.cached_buffers -= 1;
+
+        if (biggest->second.empty())
+            m_idle.erase(biggest);
+    }
+}
+
+buffer_pool_statistics buffer_pool::statistics() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_statistics;
+}
+
+buffer_pool& buffer_pool::shared()
+{
+    // Built the first time it is asked for, so it is there for any arena
+    // or pooled_buffer built during static initialisation elsewhere and
+    // outlives them
+    static buffer_pool pool;
+    return pool;
+}
+
+namespace {
+
+    // Visual C++ before 2015 doesn't make building function statics
+    // thread-safe, so make sure the pool exists before main starts any
+    // threads
+    buffer_pool& shared_pool = buffer_pool::shared();
+}
+
+pooled_buffer::pooled_buffer(size_t size, buffer_pool& pool)
+    : m_pool(pool), m_data(NULL), m_size(size), m_capacity(0)
+{
+    m_data = static_cast<unsigned char*>(m_pool.acquire(size, m_capacity));
+}
+
+pooled_buffer::~pooled_buffer()
+{
+    m_pool.release(m_data, m_capacity);
+}
+
+}
@@ -0,0 +1,170 @@
+/**
+    @file
+
+    Recycled page-aligned buffers for frame-sized allocations.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_BUFFER_POOL_HPP
+#define CRABGRAB_BUFFER_POOL_HPP
+
+#include <boost/noncopyable.hpp> // noncopyable
+#include <boost/thread/mutex.hpp> // mutex
+
+#include <cstddef> // size_t
+#include <map>
+#include <vector>
+
+namespace crabgrab {
+
+struct buffer_pool_statistics
+{
+    buffer_pool_statistics()
+        : hits(0), misses(0), cached_bytes(0), cached_buffers(0),
+          lent_bytes(0), lent_buffers(0) {}
+
+    /// Requests satisfied by a cached buffer.
+    std::size_t hits;
+
+    /// Requests that had to go to the system.
+    std::size_t misses;
+
+    /// Idle buffers held for reuse.
+    std::size_t cached_bytes;
+    std::size_t cached_buffers;
+
+    /// Buffers currently borrowed.
+    std::size_t lent_bytes;
+    std::size_t lent_buffers;
+};
+
+/**
+ * Thread-safe cache of large page-aligned buffers.
+ *
+ * Every grab of a fixed-size desktop needs the same handful of frame-sized
+ * buffers: the captured pixels, their converted copy and the encoder's
+ * working space.  Rather than giving them back to the system after each
+ * grab, and having to fault the pages in again on the next, they are kept
+ * here and lent out again.
+ *
+ * Requests are rounded up to a size class so buffers of nearly the same size
+ * can be shared.  Classes are whole pages, spaced a quarter of a power of
+ * two apart above four pages, so at most a quarter of a buffer is wasted.
+ *
+ * The idle buffers are capped at `cache_limit` bytes; beyond that, returned
+ * buffers are freed.
+ */
+class buffer_pool : boost::noncopyable
+{
+public:
+    static const std::size_t page_size = 4096;
+    static const std::size_t default_cache_limit = 64 * 1024 * 1024;
+
+    explicit buffer_pool(std::size_t cache_limit=default_cache_limit);
+
+    /**
+     * Frees the cached buffers.  Borrowed buffers must have been returned.
+     */
+    ~buffer_pool();
+
+    /**
+     * Borrow a buffer of at least `size` bytes.
+     *
+     * @param[out] capacity  Actual size of the buffer, which must be passed
+     *                       back to release.
+     *
+     * @throws std::bad_alloc if the system is out of memory.
+     */
+    void* acquire(std::size_t size, std::size_t& capacity);
+
+    /**
+     * Return a buffer for reuse.
+     */
+    void release(void* buffer, std::size_t capacity);
+
+    /**
+     * Free every idle buffer.
+     */
+    void trim();
+
+    std::size_t cache_limit() const;
+
+    /**
+     * Change the cap on idle buffers, freeing any now over it.
+     */
+    void cache_limit(std::size_t limit);
+
+    buffer_pool_statistics statistics() const;
+
+    /**
+     * Size of the buffers that requests for `size` bytes are given.
+     */
+    static std::size_t size_class(std::size_t size);
+
+    /**
+     * The pool the rest of crabgrab borrows from by default.
+     */
+    static buffer_pool& shared();
+
+private:
+    void free_over_limit();
+
+    mutable boost::mutex m_mutex;
+    std::map<std::size_t, std::vector<void*> > m_idle;
+    std::size_t m_cache_limit;
+    buffer_pool_statistics m_statistics;
+};
+
+/**
+ * Buffer borrowed from a pool for as long as the object lives.
+ */
+class pooled_buffer : boost::noncopyable
+{
+public:
+    explicit pooled_buffer(
+        std::size_t size, buffer_pool& pool=buffer_pool::shared());
+    ~pooled_buffer();
+
+    unsigned char* data() { return m_data; }
+    const unsigned char* data() const { return m_data; }
+
+    /// Bytes requested.
+    std::size_t size() const { return m_size; }
+
+    /// Bytes actually available.
+    std::size_t capacity() const { return m_capacity; }
+
+private:
+    buffer_pool& m_pool;
+    unsigned char* m_data;
+    std::size_t m_size;
+    std::size_t m_capacity;
+};
+
+}
+
+#endif
@@ -32,15 +32,21 @@
 #ifndef CRAB_CONVERT_HBITMAP_HPP
 #define CRAB_CONVERT_HBITMAP_HPP
 
+#include "crabgrab/buffer_pool.hpp" // pooled_buffer
+#include "crabgrab/image_view.hpp" // image_view, channel_order
+
 #include <boost/filesystem/fstream.hpp> // ofstream
 #include <boost/filesystem/path.hpp> // path
+#include <boost/make_shared.hpp> // make_shared
 #include <boost/numeric/conversion/cast.hpp> // numeric_cast
 #include <boost/shared_ptr.hpp> // shared_ptr
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
 #include <cassert> // assert
-#include <cstdlib> // malloc, free
+#include <cstddef> // size_t
+#include <cstdlib> // malloc, free, abs
 #include <cstring> // memcpy, memset
+#include <stdexcept> // invalid_argument
 #include <utility> // make_pair
 #include <vector>
 
@@ -158,6 +164,16 @@ inline BITMAPFILEHEADER file_header_for_bitmap(
     return file_header;
 }
 
+/**
+ * BITMAPINFOHEADER with room after it for the three colour masks of a
+ * BI_BITFIELDS bitmap.
+ */
+struct dib_header_with_masks
+{
+    BITMAPINFOHEADER header;
+    DWORD masks[3];
+};
+
 inline unsigned char* write_file_header(
     unsigned char* p, const BITMAPFILEHEADER& file_header)
 {
@@ -207,6 +223,106 @@ inline std::vector<unsigned char> convert_hbitmap_to_bmp(
     return buffer;
 }
 
+/**
+ * Pixels of a bitmap as top-down DIB rows, just as GDI hands them out.
+ *
+ * Unlike the BMP produced by convert_hbitmap_to_bmp, nothing has to parse
+ * these again before they can be encoded; view() describes them as they are.
+ *
+ * The rows are 32-bit BGRX unless 16-bit 565 or 555 pixels were asked for,
+ * which halves the buffer and the memory traffic of filling it.  The
+ * encoder widens them to 8 bits per channel a row at a time.
+ *
+ * The pixels live in a buffer borrowed from the shared buffer_pool, so
+ * successive screenshots of the same size reuse the same memory.  Copies
+ * share the pixels.
+ */
+class dib_pixels
+{
+public:
+    dib_pixels(
+        unsigned int width, unsigned int height,
+        channel_order::type order=channel_order::bgrx)
+        :
+    m_width(width), m_height(height), m_order(order),
+    // DIB rows are padded to a whole number of DWORDs
+    m_stride(((width * bytes_per_pixel(order) + 3) / 4) * 4),
+    m_bits(boost::make_shared<pooled_buffer>(m_stride * height)) {}
+
+    unsigned int width() const { return m_width; }
+    unsigned int height() const { return m_height; }
+    channel_order::type order() const { return m_order; }
+
+    unsigned char* data() { return m_bits->data(); }
+
+    image_view view() const
+    {
+        return image_view(
+            m_bits->data(), m_width, m_height, m_stride, m_order, false);
+    }
+
+private:
+    unsigned int m_width;
+    unsigned int m_height;
+    channel_order::type m_order;
+    std::size_t m_stride;
+    boost::shared_ptr<pooled_buffer> m_bits;
+};
+
+/**
+ * Copy the pixels out of a bitmap in a layout the PNG encoder can take.
+ *
+ * Whatever the bitmap's own format, we ask GDI for the pixel format given
+ * and a negative height so the rows come back top-down and need no flipping
+ * later.  This is the only copy of the pixel data made before encoding.
+ *
+ * @param order  channel_order::bgrx for full depth, or channel_order::rgb565
+ *               or channel_order::rgb555 for half-size 16-bit pixels.
+ */
+inline dib_pixels convert_hbitmap_to_pixels(
+    HBITMAP bitmap, HDC device_context,
+    channel_order::type order=channel_order::bgrx)
+{
+    if (order != channel_order::bgrx && order != channel_order::rgb565 &&
+        order != channel_order::rgb555)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument(
+                "Pixels can only be captured as BGRX, 565 or 555"));
+
+    BITMAPINFOHEADER header = detail::dib_information(bitmap, device_context);
+
+    dib_pixels pixels(
+        boost::numeric_cast<unsigned int>(std::abs(header.biWidth)),
+        boost::numeric_cast<unsigned int>(std::abs(header.biHeight)),
+        order);
+
+    detail::dib_header_with_masks info = detail::dib_header_with_masks();
+    info.header.biSize = sizeof(BITMAPINFOHEADER);
+    info.header.biWidth = pixels.width();
+    info.header.biHeight = -static_cast<LONG>(pixels.height());
+    info.header.biPlanes = 1;
+    info.header.biBitCount =
+        static_cast<WORD>(bytes_per_pixel(order) * 8);
+    info.header.biCompression = BI_RGB;
+    // 565 has to be asked for with colour masks; 16-bit BI_RGB means 555
+    if (order == channel_order::rgb565)
+    {
+        info.header.biCompression = BI_BITFIELDS;
+        info.masks[0] = 0xf800;
+        info.masks[1] = 0x07e0;
+        info.masks[2] = 0x001f;
+    }
+
+    int rc = ::GetDIBits(
+        device_context, bitmap, 0, pixels.height(), pixels.data(),
+        reinterpret_cast<BITMAPINFO*>(&info), DIB_RGB_COLORS);
+    if (rc == 0)
+        BOOST_THROW_EXCEPTION(
+            std::exception("Failed to copy pixels out of bitmap"));
+
+    return pixels;
+}
+
 }
 
 #endif
@@ -31,83 +31,664 @@
 
 #include "crabgrab/encode_bmp.hpp"
 
+#include "crabgrab/arena.hpp" // arena, arena_scope, arena_allocator,
+                              // heap_scope
+#include "crabgrab/encoder_context.hpp" // encoder_context
+#include "crabgrab/pixel_unpack.hpp" // pixel_unpacker
+#include "crabgrab/row_conversion.hpp" // row_converter
+#include "crabgrab/thread_pool.hpp" // thread_pool
+
 #include <bitmap.h>
 #include <LodePNG/lodepng.h>
 
-#include <algorithm> // copy
-#include <cassert> // assert
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uint16_t, uint32_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/exception_ptr.hpp> // exception_ptr, current_exception
+#include <boost/optional/optional.hpp> // optional
+#include <boost/ref.hpp> // ref, cref
+
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // copy, fill
+#include <cstddef> // size_t
+#include <cstring> // memcpy
+#include <iostream> // cout
 #include <sstream> // stringstream
+#include <stdexcept> // invalid_argument
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::uint16_t;
+using boost::uint32_t;
 
 namespace crabgrab {
 
 namespace {
 
-    void convert_row(
-        unsigned char* row, size_t row_width,
-        std::vector<unsigned char>& raw_out)
+    /**
+     * Rows of an image_view, converted to the encoder's layout on demand.
+     */
+    struct view_rows
+    {
+        const image_view* image;
+        const row_converter* convert;
+        std::size_t raw_row_size;
+    };
+
+    unsigned int fetch_view_rows(
+        unsigned char* out, unsigned int y, unsigned int count, void* user)
+    {
+        const view_rows& rows = *static_cast<const view_rows*>(user);
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            (*rows.convert)(
+                rows.image->row(y + i), out + i * rows.raw_row_size,
+                rows.image->width);
+        }
+
+        return 0;
+    }
+
+    /**
+     * Rows of a bmp_view, unpacked to the encoder's layout on demand.
+     */
+    struct bitmap_rows
+    {
+        const bmp_view* bitmap;
+        const pixel_unpacker* unpack;
+        std::size_t raw_row_size;
+    };
+
+    unsigned int fetch_bitmap_rows(
+        unsigned char* out, unsigned int y, unsigned int count, void* user)
+    {
+        const bitmap_rows& rows = *static_cast<const bitmap_rows*>(user);
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            (*rows.unpack)(
+                rows.bitmap->row(y + i), out + i * rows.raw_row_size,
+                rows.bitmap->width());
+        }
+
+        return 0;
+    }
+
+    /**
+     * Rows of an indexed bitmap, which need no decoding at all.
+     *
+     * BMP packs 1, 2, 4 and 8-bit indices into bytes exactly as PNG does,
+     * leftmost pixel in the most significant bits, so only the row padding
+     * has to go.
+     */
+    unsigned int fetch_indexed_rows(
+        unsigned char* out, unsigned int y, unsigned int count, void* user)
+    {
+        const bmp_view& bitmap = *static_cast<const bmp_view*>(user);
+        std::size_t packed_row_size =
+            (bitmap.width() * bitmap.bit_count() + 7) / 8;
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            std::memcpy(
+                out + i * packed_row_size, bitmap.row(y + i),
+                packed_row_size);
+        }
+
+        return 0;
+    }
+
+    /**
+     * The distinct colours of an image, up to the 256 a palette holds.
+     *
+     * An open-addressed hash table of RGBA values, never more than half
+     * full so that a lookup seldom probes more than a slot or two.
+     */
+    class colour_table
+    {
+    public:
+        colour_table() : m_size(0)
+        {
+            std::fill(m_slots, m_slots + slot_count, 0);
+        }
+
+        /**
+         * Add a colour unless it is already in the table.
+         *
+         * @returns false if it isn't and the table is full.
+         */
+        bool add(uint32_t colour)
+        {
+            std::size_t slot = slot_of(colour);
+            if (m_slots[slot])
+                return true;
+            if (m_size == 256)
+                return false;
+
+            m_colours[m_size] = colour;
+            m_slots[slot] = static_cast<uint16_t>(++m_size);
+            return true;
+        }
+
+        /**
+         * Palette index of a colour that is in the table.
+         */
+        unsigned char index_of(uint32_t colour) const
+        {
+            return static_cast<unsigned char>(m_slots[slot_of(colour)] - 1);
+        }
+
+        std::size_t size() const { return m_size; }
+
+        uint32_t colour(std::size_t index) const { return m_colours[index]; }
+
+    private:
+        static const std::size_t slot_count = 512;
+
+        std::size_t slot_of(uint32_t colour) const
+        {
+            std::size_t slot = (colour * 2654435761U) >> 23;
+            while (m_slots[slot] && m_colours[m_slots[slot] - 1] != colour)
+                slot = (slot + 1) % slot_count;
+            return slot;
+        }
+
+        uint16_t m_slots[slot_count]; ///< 1 + index of colour, 0 for none
+        uint32_t m_colours[256];
+        std::size_t m_size;
+    };
+
+    inline uint32_t load_rgba(const unsigned char* pixel)
+    {
+        uint32_t colour;
+        std::memcpy(&colour, pixel, 4);
+        return colour;
+    }
+
+    /**
+     * Collect the colours of an image, if there are no more than 256.
+     *
+     * @param rgba  Room for a row of RGBA pixels.
+     */
+    bool find_palette(
+        const image_view& image, colour_table& colours, unsigned char* rgba)
+    {
+        row_converter convert(image.order, channel_order::rgba);
+        for (unsigned int y = 0; y < image.height; ++y)
+        {
+            convert(image.row(y), rgba, image.width);
+
+            // Runs of one colour are most of a screenshot
+            uint32_t last = load_rgba(rgba);
+            if (!colours.add(last))
+                return false;
+            for (unsigned int x = 1; x < image.width; ++x)
+            {
+                uint32_t colour = load_rgba(rgba + x * 4);
+                if (colour != last && !colours.add(colour))
+                    return false;
+                last = colour;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Rows of an image_view, looked up in its palette on demand.
+     */
+    struct palette_rows
+    {
+        const image_view* image;
+        const row_converter* convert;
+        const colour_table* colours;
+        unsigned char* rgba;
+    };
+
+    unsigned int fetch_palette_rows(
+        unsigned char* out, unsigned int y, unsigned int count, void* user)
+    {
+        const palette_rows& rows = *static_cast<const palette_rows*>(user);
+        unsigned int width = rows.image->width;
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            (*rows.convert)(rows.image->row(y + i), rows.rgba, width);
+            for (unsigned int x = 0; x < width; ++x)
+            {
+                out[i * width + x] =
+                    rows.colours->index_of(load_rgba(rows.rgba + x * 4));
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Rows fetched by another callback until a deadline, after which the
+     * encoder is told they can't be.
+     */
+    struct deadline_rows
+    {
+        LodePNG_RowCallback rows;
+        void* user;
+        ptime deadline;
+    };
+
+    unsigned int fetch_rows_before_deadline(
+        unsigned char* out, unsigned int y, unsigned int count, void* user)
+    {
+        const deadline_rows& rows = *static_cast<const deadline_rows*>(user);
+        if (microsec_clock::universal_time() > rows.deadline)
+            return 1;
+
+        return rows.rows(out, y, count, rows.user);
+    }
+
+    bool is_opaque(const unsigned char* rgba, std::size_t width)
+    {
+        for (std::size_t x = 0; x < width; ++x)
+        {
+            if (rgba[x * 4 + 3] != 255)
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Whether every pixel of an image with an alpha channel is opaque.
+     *
+     * Both channel orders with alpha keep it in the fourth byte.
+     */
+    bool is_opaque(const image_view& image)
+    {
+        for (unsigned int y = 0; y < image.height; ++y)
+        {
+            if (!is_opaque(image.row(y), image.width))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool is_opaque(const bmp_view& bitmap, arena& memory)
+    {
+        if (bitmap.width() == 0)
+            return true;
+
+        pixel_unpacker unpack = bitmap.unpacker(channel_order::rgba);
+        std::vector<unsigned char, arena_allocator<unsigned char> > row(
+            bitmap.width() * 4, 0, arena_allocator<unsigned char>(memory));
+
+        for (unsigned int y = 0; y < bitmap.height(); ++y)
+        {
+            unpack(bitmap.row(y), &row[0], bitmap.width());
+            if (!is_opaque(&row[0], bitmap.width()))
+                return false;
+        }
+
+        return true;
+    }
+
+    void set_compression(
+        LodePNG::Encoder& encoder, const encode_options& options)
+    {
+        if (options.level < 1 || options.level > 9)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument(
+                    "Compression level must be between 1 and 9"));
+
+        LodeZlib_CompressSettings& settings =
+            encoder.getSettings().zlibsettings;
+        LodeZlib_CompressSettings_initLevel(&settings, options.level);
+        switch (options.strategy)
+        {
+        case match_strategy::run_length:
+            settings.strategy = 1;
+            break;
+        case match_strategy::optimal_parsing:
+            settings.strategy = 2;
+            break;
+        default:
+            settings.strategy = 0;
+        }
+        settings.useLZ77 =
+            (options.strategy == match_strategy::huffman_only) ? 0 : 1;
+        settings.btype = (options.fixed_codes) ? 1 : 2;
+
+        // filter_strategy is in LodePNG's order
+        encoder.getSettings().filterStrategy = options.filter;
+    }
+
+    /**
+     * LodePNG's way into a thread_pool.
+     */
+    void parallel_for_in_pool(
+        unsigned int count, void (*job)(unsigned int, void*), void* job_data,
+        void* pool)
+    {
+        static_cast<thread_pool*>(pool)->parallel_for(
+            count, boost::bind(job, _1, job_data));
+    }
+
+    void set_threads(LodePNG::Encoder& encoder, const encode_options& options)
+    {
+        if (!options.threads)
+            return;
+
+        encoder.getSettings().numThreads = options.threads->size();
+        encoder.getSettings().parallelFor = parallel_for_in_pool;
+        encoder.getSettings().parallelUser = options.threads;
+    }
+
+    void set_colour_type(
+        LodePNG::Encoder& encoder, unsigned int colour_type,
+        unsigned int bit_depth)
+    {
+        // Telling the encoder the raw pixels are already in the PNG's colour
+        // type stops it converting each band
+        encoder.getInfoRaw().color.colorType = colour_type;
+        encoder.getInfoRaw().color.bitDepth = bit_depth;
+        encoder.getInfoPng().color.colorType = colour_type;
+        encoder.getInfoPng().color.bitDepth = bit_depth;
+    }
+
+    /**
+     * Encode rows fetched a band at a time, already in the PNG's colour
+     * type.
+     *
+     * The encoder never sees the whole image, only the band it is working
+     * on, so no full-size copy of the pixels is made.  That means it can't
+     * look ahead to decide whether to drop the alpha channel; the callers
+     * make that decision before choosing the colour type.
+     *
+     * A context's buffers have to outlive any arena in scope so, with one,
+     * the encoder allocates from the heap.  After the first few images it
+     * hardly allocates at all.
+     */
+    std::vector<unsigned char> encode_rows(
+        LodePNG::Encoder& encoder, unsigned int width, unsigned int height,
+        LodePNG_RowCallback rows, void* user, const encode_options& options)
     {
-        for (size_t i = 0; i < row_width; ++i)
+        std::vector<unsigned char> png_out;
+        set_compression(encoder, options);
+        set_threads(encoder, options);
+
+        deadline_rows before_deadline = { rows, user, options.deadline };
+        if (!options.deadline.is_not_a_date_time())
+        {
+            rows = fetch_rows_before_deadline;
+            user = &before_deadline;
+        }
+
+        encoder.getSettings().autoLeaveOutAlphaChannel = 0;
+        if (options.context)
+        {
+            heap_scope scope;
+            encoder.context = options.context->get();
+            encoder.encodeRows(png_out, width, height, rows, user);
+        }
+        else
+        {
+            encoder.encodeRows(png_out, width, height, rows, user);
+        }
+        if(encoder.hasError())
+        {
+            // Running out of time isn't worth reporting
+            if (!options.deadline.is_not_a_date_time() &&
+                microsec_clock::universal_time() > options.deadline)
+                return std::vector<unsigned char>();
+
+            std::cout << "Encoder error " << encoder.getError() << ": " <<
+                LodePNG_error_text(encoder.getError()) << std::endl;
+            return std::vector<unsigned char>();
+        }
+
+        return png_out;
+    }
+
+    std::vector<unsigned char> encode_rows(
+        unsigned int width, unsigned int height,
+        channel_order::type raw_order, LodePNG_RowCallback rows, void* user,
+        const encode_options& options)
+    {
+        LodePNG::Encoder encoder;
+        set_colour_type(
+            encoder, (raw_order == channel_order::rgba) ? 6 : 2, 8);
+        return encode_rows(encoder, width, height, rows, user, options);
+    }
+
+    /**
+     * Encode an indexed bitmap as a palette PNG of the same bit depth.
+     *
+     * The indices go into the PNG untouched and the colour table becomes its
+     * PLTE, so the pixels are never expanded to RGB.  BMP colour tables have
+     * no alpha so no tRNS is needed.
+     */
+    std::vector<unsigned char> encode_indexed(
+        const bmp_view& bitmap, const encode_options& options)
+    {
+        LodePNG::Encoder encoder;
+        set_colour_type(encoder, 3, bitmap.bit_count());
+
+        // A short colour table is padded out with black, which is what
+        // pixel_unpacker makes of indices past its end, as every index a
+        // PNG uses has to be in its palette
+        std::size_t palette_size = std::size_t(1) << bitmap.bit_count();
+        for (std::size_t i = 0; i < palette_size; ++i)
         {
-            if (i % 4 == 3)
-                raw_out.push_back(0xff);
+            if (i < bitmap.colour_count())
+            {
+                const unsigned char* bgrx = bitmap.colour_table() + i * 4;
+                encoder.addPalette(bgrx[2], bgrx[1], bgrx[0], 255);
+            }
             else
-                raw_out.push_back(row[i]);
+            {
+                encoder.addPalette(0, 0, 0, 255);
+            }
+        }
+
+        return encode_rows(
+            encoder, bitmap.width(), bitmap.height(), fetch_indexed_rows,
+            const_cast<bmp_view*>(&bitmap), options);
+    }
+
+    /**
+     * Encode an image of no more than 256 colours as an 8-bit palette PNG.
+     *
+     * LodePNG writes the palette's alpha as a tRNS chunk if any colour
+     * isn't opaque.
+     */
+    std::vector<unsigned char> encode_palette(
+        const image_view& image, const colour_table& colours,
+        unsigned char* rgba, const encode_options& options)
+    {
+        LodePNG::Encoder encoder;
+        set_colour_type(encoder, 3, 8);
+        for (std::size_t i = 0; i < colours.size(); ++i)
+        {
+            unsigned char colour[4];
+            uint32_t packed = colours.colour(i);
+            std::memcpy(colour, &packed, 4);
+            encoder.addPalette(colour[0], colour[1], colour[2], colour[3]);
+        }
+
+        row_converter convert(image.order, channel_order::rgba);
+        palette_rows rows = { &image, &convert, &colours, rgba };
+        return encode_rows(
+            encoder, image.width, image.height, fetch_palette_rows, &rows,
+            options);
+    }
+
+    /**
+     * A candidate of encode_smallest_png and what came of it.
+     */
+    struct race_entry
+    {
+        encode_options options;
+        std::vector<unsigned char> png;
+        boost::exception_ptr error;
+    };
+
+    void run_race_entry(
+        const image_view& image, std::vector<race_entry>& entries,
+        unsigned int index)
+    {
+        // Loop iterations mustn't throw, so the error is kept for the caller
+        try
+        {
+            entries[index].png = encode_as_png(image, entries[index].options);
+        }
+        catch (...)
+        {
+            entries[index].error = boost::current_exception();
         }
     }
 }
 
-std::vector<unsigned char> convert_bitmap_lines_to_raw(CBitmap& bitmap)
+std::vector<unsigned char> encode_as_png(
+    const image_view& image, const encode_options& options)
 {
-    std::vector<unsigned char> raw;
+    arena memory;
+    return encode_as_png(image, memory, options);
+}
 
-    size_t raw_byte_size;
-    bitmap.GetBits(NULL, raw_byte_size);
- 
-    // total size should be exact multiple of height
-    assert((raw_byte_size % bitmap.GetHeight()) == 0);
+std::vector<unsigned char> encode_as_png(
+    const image_view& image, arena& memory, const encode_options& options)
+{
+    arena_scope scope(memory);
 
-    size_t row_width = raw_byte_size / bitmap.GetHeight();
+    if (options.palette && image.width > 0 && image.height > 0)
+    {
+        std::vector<unsigned char, arena_allocator<unsigned char> > rgba(
+            image.width * 4, 0, arena_allocator<unsigned char>(memory));
+        colour_table colours;
+        if (find_palette(image, colours, &rgba[0]))
+            return encode_palette(image, colours, &rgba[0], options);
+    }
 
-    // total size should be exact multiple of row size
-    assert((raw_byte_size % row_width) == 0);
+    // An alpha channel with nothing to show is left out of the PNG
+    channel_order::type raw_order =
+        (has_alpha(image.order) && !is_opaque(image)) ?
+        channel_order::rgba : channel_order::rgb;
 
-    unsigned char* start = reinterpret_cast<unsigned char*>(bitmap.GetBits());
+    row_converter convert(image.order, raw_order);
+    view_rows rows = {
+        &image, &convert, image.width * bytes_per_pixel(raw_order) };
 
-    for (size_t h = bitmap.GetHeight(); h > 0; --h)
+    return encode_rows(
+        image.width, image.height, raw_order, fetch_view_rows, &rows,
+        options);
+}
+
+smallest_png encode_smallest_png(
+    const image_view& image, const std::vector<encode_options>& candidates,
+    thread_pool& threads, const boost::posix_time::time_duration& time_limit)
+{
+    if (candidates.empty())
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument("No options to encode the image with"));
+
+    ptime deadline = microsec_clock::universal_time() + time_limit;
+
+    std::vector<race_entry> entries(candidates.size());
+    for (std::size_t i = 0; i < candidates.size(); ++i)
     {
-        size_t row_offset = (h - 1) * row_width;
-        convert_row(start + row_offset, row_width, raw);
+        entries[i].options = candidates[i];
+        entries[i].options.context = NULL;
+        entries[i].options.threads = NULL;
+        entries[i].options.deadline = (i == 0) ? ptime() : deadline;
     }
 
-    return raw;
+    threads.parallel_for(
+        static_cast<unsigned int>(entries.size()),
+        boost::bind(
+            run_race_entry, boost::cref(image), boost::ref(entries), _1));
+
+    smallest_png smallest;
+    smallest.winner = 0;
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        if (entries[i].error)
+            boost::rethrow_exception(entries[i].error);
+
+        // An empty PNG was abandoned, or failed
+        if (!entries[i].png.empty() &&
+            (entries[smallest.winner].png.empty() ||
+             entries[i].png.size() < entries[smallest.winner].png.size()))
+            smallest.winner = i;
+    }
+
+    smallest.png.swap(entries[smallest.winner].png);
+    return smallest;
 }
 
 std::vector<unsigned char> encode_as_png(
-    const std::vector<unsigned char>& bmp_bytes)
+    const bmp_view& bitmap, const encode_options& options)
 {
+    if (bitmap.is_run_length_encoded())
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument(
+                "Run-length encoded bitmaps can only be encoded from their "
+                "file"));
+
+    boost::optional<image_view> direct = bitmap.direct_view();
+    if (direct)
+        return encode_as_png(*direct, options);
+
+    arena memory;
+    arena_scope scope(memory);
+
+    if (bitmap.bit_count() <= 8)
+        return encode_indexed(bitmap, options);
+
+    // Everything else is decoded straight into the encoder's input a band
+    // at a time.  Finding out whether the alpha channel is worth keeping
+    // costs an extra unpacking pass, one row at a time.
+    channel_order::type raw_order =
+        (bitmap.alpha_mask() != 0 && !is_opaque(bitmap, memory)) ?
+        channel_order::rgba : channel_order::rgb;
+
+    pixel_unpacker unpack = bitmap.unpacker(raw_order);
+    bitmap_rows rows = {
+        &bitmap, &unpack, bitmap.width() * bytes_per_pixel(raw_order) };
+
+    return encode_rows(
+        bitmap.width(), bitmap.height(), raw_order, fetch_bitmap_rows, &rows,
+        options);
+}
+
+std::vector<unsigned char> encode_as_png(
+    const std::vector<unsigned char>& bmp_bytes,
+    const encode_options& options)
+{
+    bmp_view bitmap = bmp_view::from_file_bytes(
+        (bmp_bytes.empty()) ? NULL : &bmp_bytes[0], bmp_bytes.size());
+    if (!bitmap.is_run_length_encoded())
+        return encode_as_png(bitmap, options);
+
+    // RLE rows can't be found without decoding the whole image so leave
+    // that to CBitmap
     std::stringstream stream;
     std::copy(
         bmp_bytes.begin(), bmp_bytes.end(),
         std::ostreambuf_iterator<char>(stream));
 
-    CBitmap bitmap;
+    CBitmap decoded;
     stream.seekg(0);
-    bitmap.Load(stream);
-
-    std::vector<unsigned char> png_out;
-    LodePNG::Encoder encoder;
-    encoder.getSettings().autoLeaveOutAlphaChannel = 1;
-    encoder.encode(
-        png_out, convert_bitmap_lines_to_raw(bitmap), bitmap.GetWidth(),
-        bitmap.GetHeight());
-    if(encoder.hasError())
-    {
-        std::cout << "Encoder error " << encoder.getError() << ": " <<
-            LodePNG_error_text(encoder.getError()) << std::endl;
-        return std::vector<unsigned char>();
-    }
+    decoded.Load(stream);
 
-    return png_out;
+    // CBitmap makes up alpha from the colour table's reserved bytes which are
+    // normally zero, so the fourth channel has to be treated as padding
+    return encode_as_png(
+        image_view(
+            static_cast<const unsigned char*>(decoded.GetBits()),
+            decoded.GetWidth(), decoded.GetHeight(), decoded.GetWidth() * 4,
+            channel_order::rgbx, bitmap.bottom_up()),
+        options);
 }
 
 }
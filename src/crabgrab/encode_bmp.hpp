@@ -32,12 +32,235 @@
 #ifndef CRABGRAB_ENCODE_BMP_HPP
 #define CRABGRAB_ENCODE_BMP_HPP
 
+#include "crabgrab/arena.hpp" // arena
+#include "crabgrab/bmp_view.hpp" // bmp_view
+#include "crabgrab/encoder_context.hpp" // encoder_context
+#include "crabgrab/image_view.hpp" // image_view
+#include "crabgrab/thread_pool.hpp" // thread_pool
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // ptime,
+                                                           // time_duration
+
+#include <cstddef> // size_t
 #include <vector>
 
 namespace crabgrab {
 
+/**
+ * How the encoder looks for repeated bytes to compress.
+ *
+ * `hash_chains` searches everything in the window, as deeply as the level
+ * says.  `run_length`, like zlib's Z_RLE, only looks for repeats of the
+ * pixel to the left and the row above.  It keeps no tables and is several
+ * times faster, and screenshots, being mostly flat fills, lose little by it.
+ * Photos lose a lot.
+ *
+ * `huffman_only` doesn't look for repeats at all and only Huffman codes the
+ * filtered bytes.  It takes no time matching but every byte then has to be
+ * coded, so on flat screenshots it is no faster than `run_length` and comes
+ * out several times the size.  It suits noisy images better.
+ *
+ * `optimal_parsing` goes the other way, for grabs worth keeping.  Rather
+ * than taking matches as they come, it works out the cheapest mix of
+ * matches and literals for the whole image, then again with the costs of
+ * the codes that gave, a few times over.  It takes tens of times as long
+ * as the same level with hash chains, for a PNG a few percent smaller.
+ */
+namespace match_strategy {
+    enum type
+    {
+        hash_chains,
+        run_length,
+        huffman_only,
+        optimal_parsing
+    };
+}
+
+/**
+ * How each row's PNG filter is chosen.
+ *
+ * `minimum_sum`, the usual heuristic, takes the filter leaving the smallest
+ * bytes.  It was made for photos.  `entropy` takes the one whose bytes
+ * would Huffman code the smallest, going by their entropy, and looks at
+ * every byte to do it so is slower.
+ *
+ * `screen` suits UI: a row the same as the one above is filtered to zeros
+ * with Up, and a row of one colour to zeros with Sub, without trying the
+ * others.  Any other row is as `minimum_sum`.  `screen_hybrid` also keeps
+ * the filter of the row above when it does nearly as well, so the rows of a
+ * window filter alike and repeat more.  It has to go row by row, so isn't
+ * spread over a thread pool.
+ *
+ * Palette images aren't filtered so aren't affected.
+ */
+namespace filter_strategy {
+    enum type
+    {
+        minimum_sum,
+        entropy,
+        screen,
+        screen_hybrid
+    };
+}
+
+/**
+ * How hard encode_as_png works at making the PNG small.
+ */
+struct encode_options
+{
+    encode_options()
+        : level(6), strategy(match_strategy::hash_chains), fixed_codes(false),
+          filter(filter_strategy::minimum_sum), palette(false), context(NULL),
+          threads(NULL) {}
+
+    explicit encode_options(
+        unsigned int level,
+        match_strategy::type strategy=match_strategy::hash_chains)
+        : level(level), strategy(strategy), fixed_codes(false),
+          filter(filter_strategy::minimum_sum), palette(false), context(NULL),
+          threads(NULL) {}
+
+    /**
+     * zlib-style compression level from 1, the fastest, to 9, the smallest.
+     *
+     * The fast levels take the first match that will do, which suits an
+     * interactive grab.  The slow ones search far deeper for longer matches
+     * and check whether a match one byte on would be longer still.
+     *
+     * Encoding throws std::invalid_argument for any other level.
+     */
+    unsigned int level;
+
+    /**
+     * How repeats are found.  With `run_length` the level makes no
+     * difference; with `optimal_parsing` it still sets how far back
+     * matches are looked for.
+     */
+    match_strategy::type strategy;
+
+    /**
+     * Use deflate's predefined Huffman codes instead of ones built for
+     * the image.
+     *
+     * Saves counting symbols, building the codes and writing them out, which
+     * is most of the work left once matching is cheap.  Flat screenshots
+     * come out a little bigger as the fixed codes suit them less well.
+     */
+    bool fixed_codes;
+
+    /**
+     * How rows are filtered before they are deflated.
+     */
+    filter_strategy::type filter;
+
+    /**
+     * Make an 8-bit palette PNG of an image with 256 colours or fewer.
+     *
+     * A third or a quarter of the bytes to filter and deflate, for UI with
+     * few colours, but finding the colours takes an extra pass over the
+     * image.  An image with more is encoded as if this were false.
+     */
+    bool palette;
+
+    /**
+     * Working memory to reuse rather than allocating afresh, or NULL.
+     *
+     * Worth keeping one for a series of encodes, such as repeated grabs.
+     * Its buffers are taken from the heap even when encoding in an arena.
+     */
+    encoder_context* context;
+
+    /**
+     * Threads to deflate on, or NULL to encode on the calling thread alone.
+     *
+     * With a pool, the image is deflated as separate segments of rows, as
+     * many at a time as the pool has threads, which makes the PNG a little
+     * bigger.  It is the same PNG however many threads the pool has.
+     */
+    thread_pool* threads;
+
+    /**
+     * When to give up on the encode and return an empty PNG, or
+     * not_a_date_time, the default, to take as long as it takes.
+     *
+     * Checked before each band of rows, in UTC.
+     */
+    boost::posix_time::ptime deadline;
+};
+
+/**
+ * Encode pixels as a PNG image.
+ *
+ * The pixels are read straight out of the view and put into the channel
+ * order PNG needs a band of rows at a time, just ahead of the encoder, so
+ * no converted copy of the whole image is ever made.
+ */
+std::vector<unsigned char> encode_as_png(
+    const image_view& image, const encode_options& options=encode_options());
+
+/**
+ * Encode pixels as a PNG image, taking all working memory from an arena.
+ *
+ * The band of converted pixels and everything the encoder allocates
+ * come from `memory`, so they cost a pointer bump each and are all released
+ * together when the arena is.  Only the returned PNG is on the heap.
+ */
+std::vector<unsigned char> encode_as_png(
+    const image_view& image, arena& memory,
+    const encode_options& options=encode_options());
+
+/**
+ * The PNG encode_smallest_png chose, and which of the candidates made it.
+ */
+struct smallest_png
+{
+    std::vector<unsigned char> png;
+    std::size_t winner;
+};
+
+/**
+ * Encode pixels as a PNG with each of several sets of options at once, and
+ * keep the smallest.
+ *
+ * The candidates are encoded as iterations of a loop on the pool, one
+ * thread each, so they race on however many cores it has.  Their own
+ * contexts and thread pools are ignored.  Any still running once
+ * `time_limit` is up are abandoned, except the first, which always
+ * finishes so that there is a PNG to return.  It should be the fastest.
+ *
+ * Which candidate won is worth logging: it says which settings suit the
+ * images actually being grabbed.
+ *
+ * @throws std::invalid_argument if there are no candidates, or if one of
+ *         them is invalid.
+ */
+smallest_png encode_smallest_png(
+    const image_view& image, const std::vector<encode_options>& candidates,
+    thread_pool& threads, const boost::posix_time::time_duration& time_limit);
+
+/**
+ * Encode a bitmap as a PNG image.
+ *
+ * Uncompressed 24- and 32-bit bitmaps, and 16-bit 565 and 555 ones, are
+ * encoded directly from their pixel array.  Indexed bitmaps become palette
+ * PNGs of the same bit depth, their indices copied across unchanged.  Other
+ * formats are decoded into the encoder's input a band of rows at a time.
+ *
+ * @throws std::invalid_argument if the bitmap is run-length encoded.  Its
+ *         rows can't be found without decoding the whole image, which the
+ *         overload taking the BMP file's bytes does.
+ */
+std::vector<unsigned char> encode_as_png(
+    const bmp_view& bitmap, const encode_options& options=encode_options());
+
+/**
+ * Encode a BMP file as a PNG image.
+ *
+ * @throws std::runtime_error if the bytes aren't a valid BMP file.
+ */
 std::vector<unsigned char> encode_as_png(
-    const std::vector<unsigned char>& bmp_bytes);
+    const std::vector<unsigned char>& bmp_bytes,
+    const encode_options& options=encode_options());
 
 }
 
@@ -0,0 +1,62 @@
+/**
+    @file
+
+    Encoder working memory kept from one image to the next.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/encoder_context.hpp"
+
+#include "crabgrab/arena.hpp" // heap_scope
+
+#include <LodePNG/lodepng.h> // LodePNG_EncodeContext_new,
+                             // LodePNG_EncodeContext_delete
+
+#include <new> // bad_alloc
+
+namespace crabgrab {
+
+encoder_context::encoder_context()
+{
+    heap_scope scope;
+
+    m_context = LodePNG_EncodeContext_new();
+    if (!m_context)
+        throw std::bad_alloc();
+}
+
+encoder_context::~encoder_context()
+{
+    LodePNG_EncodeContext_delete(m_context);
+}
+
+LodePNG_EncodeContext* encoder_context::get() const
+{
+    return m_context;
+}
+
+}
@@ -0,0 +1,73 @@
+/**
+    @file
+
+    Encoder working memory kept from one image to the next.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_ENCODER_CONTEXT_HPP
+#define CRABGRAB_ENCODER_CONTEXT_HPP
+
+#include <boost/noncopyable.hpp> // noncopyable
+
+struct LodePNG_EncodeContext;
+
+namespace crabgrab {
+
+/**
+ * Hash tables and scratch buffers for the PNG encoder that survive between
+ * encodes.
+ *
+ * Without one, every encode allocates and frees the deflate hash chains,
+ * the Huffman trees and the filtered scanlines all over again.  Passed in
+ * encode_options, the encoder instead grows the context's buffers to fit the
+ * largest image so far and, from then on, images of that size or smaller are
+ * encoded with no allocation beyond the PNG itself.
+ *
+ * The buffers are allocated on the heap, not in any arena in scope, so the
+ * context can outlive the grab that first used it.
+ *
+ * Only one encode can use a context at a time.
+ */
+class encoder_context : boost::noncopyable
+{
+public:
+    /**
+     * @throws std::bad_alloc if the system is out of memory.
+     */
+    encoder_context();
+    ~encoder_context();
+
+    LodePNG_EncodeContext* get() const;
+
+private:
+    LodePNG_EncodeContext* m_context;
+};
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+/**
+    @file
+
+    Non-owning view of pixel data in memory.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_IMAGE_VIEW_HPP
+#define CRABGRAB_IMAGE_VIEW_HPP
+
+#include <cstddef> // ptrdiff_t, size_t
+
+namespace crabgrab {
+
+/**
+ * Layout of the channels of a single pixel, in memory order.
+ *
+ * The `x` variants have a fourth byte whose value is undefined (GDI leaves
+ * rubbish there) so the pixels are treated as fully opaque.
+ *
+ * `rgb565` and `rgb555` are the 16-bit pixels of 16bpp DIBs: little-endian
+ * words with red in the most significant bits.  The top bit of an `rgb555`
+ * pixel is unused.
+ */
+namespace channel_order {
+    enum type
+    {
+        bgra,
+        bgrx,
+        bgr,
+        rgba,
+        rgbx,
+        rgb,
+        rgb565,
+        rgb555
+    };
+}
+
+inline std::size_t bytes_per_pixel(channel_order::type order)
+{
+    switch (order)
+    {
+    case channel_order::rgb565:
+    case channel_order::rgb555:
+        return 2;
+    case channel_order::bgr:
+    case channel_order::rgb:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+inline bool has_alpha(channel_order::type order)
+{
+    return order == channel_order::bgra || order == channel_order::rgba;
+}
+
+/**
+ * Strided view of pixels owned by someone else.
+ *
+ * This lets pixels be passed around in whatever layout they were produced in
+ * (a DIB straight from GetDIBits, the pixel array inside a BMP file, ...)
+ * without first copying them into the layout the consumer wants.
+ *
+ * `stride` is the distance in bytes from the start of one row in memory to
+ * the start of the next, including any padding.  Rows of a bottom-up image
+ * are stored with the bottom row first, as in most DIBs.
+ */
+struct image_view
+{
+    image_view(
+        const unsigned char* pixels, unsigned int width, unsigned int height,
+        std::ptrdiff_t stride, channel_order::type order, bool bottom_up)
+        :
+    pixels(pixels), width(width), height(height), stride(stride),
+    order(order), bottom_up(bottom_up) {}
+
+    /**
+     * Start of the row `y` pixels from the top of the image.
+     */
+    const unsigned char* row(unsigned int y) const
+    {
+        std::ptrdiff_t memory_row = (bottom_up) ? height - 1 - y : y;
+        return pixels + memory_row * stride;
+    }
+
+    const unsigned char* pixels;
+    unsigned int width;
+    unsigned int height;
+    std::ptrdiff_t stride;
+    channel_order::type order;
+    bool bottom_up;
+};
+
+}
+
+#endif
@@ -29,10 +29,14 @@
     @endif
 */
 
+#include "crabgrab/arena.hpp" // arena
 #include "crabgrab/clipboard.hpp" // put_clipboard_text
-#include "crabgrab/encode_bmp.hpp"
-#include "crabgrab/screenshot.hpp" // take_screenshot
+#include "crabgrab/encode_bmp.hpp" // encode_as_png, encode_options,
+                                    // encode_smallest_png
+#include "crabgrab/encoder_context.hpp" // encoder_context
+#include "crabgrab/screenshot.hpp" // take_screenshot_pixels
 #include "crabgrab/notification.hpp" // notification_icon
+#include "crabgrab/thread_pool.hpp" // thread_pool
 #include "crabgrab/twitpic/response.hpp" // handle_response
 #include "crabgrab/twitpic/twitpic.hpp"
 
@@ -40,13 +44,17 @@
 #include <winapi/gui/icon.hpp> // load_icon
 #include <winapi/hook.hpp> // windows_hook
 
+#include <boost/date_time/posix_time/posix_time_types.hpp> // seconds
 #include <boost/exception/diagnostic_information.hpp> // diagnostic_information
 #include <boost/make_shared.hpp> // make_shared
 #include <boost/shared_ptr.hpp> // shared_ptr
 #include <boost/thread.hpp> // thread
+#include <boost/thread/locks.hpp> // unique_lock, try_to_lock
+#include <boost/thread/mutex.hpp> // mutex
 
 #include <iostream> // cout, cin, cerr
 #include <string>
+#include <vector>
 
 #include <Windows.h>
 #include <tchar.h>
@@ -116,9 +124,111 @@ void error_message(const string& title, const string& message)
     }
 }
 
+/**
+ * Pixel format screenshots are captured in.
+ *
+ * Full-depth BGRX unless Crabgrab was started with --16bpp, which halves
+ * the size of every capture for remote sessions short of bandwidth.
+ */
+channel_order::type capture_order = channel_order::bgrx;
+
+/**
+ * How hard screenshots are compressed.
+ *
+ * Someone is waiting on every grab so the fastest level is used unless
+ * Crabgrab was started with --best, which trades CPU time for a smaller
+ * upload.  --rle goes the other way, only looking for runs of pixels, and
+ * --fastest further by using the fixed Huffman codes too.  --huffman-only
+ * doesn't look for repeats at all.  --archive spends seconds on each grab
+ * for a smaller PNG, with optimal parsing.  Level 6 finds nearly every
+ * match level 9 would in a fifth of the time.
+ */
+encode_options grab_options(1);
+
+/**
+ * Encoder working memory shared by successive grabs.
+ *
+ * A grab that starts while another is still encoding doesn't wait for it
+ * but encodes without one.
+ */
+encoder_context grab_context;
+boost::mutex grab_context_mutex;
+
+/**
+ * Threads grabs are deflated on, one per core.
+ *
+ * The user is waiting and the other cores are idle, so that is worth a PNG
+ * a little bigger than a single thread would make.  Grabs at the same time
+ * take turns.
+ */
+thread_pool grab_threads;
+
+/**
+ * Whether grabs race several sets of options on grab_threads and upload
+ * the smallest PNG.
+ *
+ * Crabgrab started with --race tries the usual options, which always
+ * finish, against the best level, a palette and the other filters, giving
+ * up on those still going after a few seconds.  Which wins is logged so
+ * that the defaults can follow what is actually grabbed.
+ */
+bool race_grabs = false;
+
+std::vector<unsigned char> race_grab(const dib_pixels& screenshot)
+{
+    std::vector<encode_options> candidates;
+    std::vector<string> names;
+
+    candidates.push_back(grab_options);
+    names.push_back("usual options");
+
+    candidates.push_back(encode_options(9));
+    names.push_back("level 9");
+
+    candidates.push_back(encode_options(6));
+    candidates.back().palette = true;
+    names.push_back("palette, level 6");
+
+    candidates.push_back(encode_options(6));
+    candidates.back().filter = filter_strategy::screen_hybrid;
+    names.push_back("screen hybrid filter, level 6");
+
+    candidates.push_back(encode_options(6));
+    candidates.back().filter = filter_strategy::entropy;
+    names.push_back("entropy filter, level 6");
+
+    smallest_png smallest = encode_smallest_png(
+        screenshot.view(), candidates, grab_threads,
+        boost::posix_time::seconds(3));
+
+    cout << "Smallest PNG, " << smallest.png.size() << " bytes, from " <<
+        names[smallest.winner] << endl;
+    return smallest.png;
+}
+
+std::vector<unsigned char> encode_grab(
+    const dib_pixels& screenshot, arena& memory)
+{
+    if (race_grabs)
+        return race_grab(screenshot);
+
+    encode_options options = grab_options;
+    options.threads = &grab_threads;
+
+    boost::unique_lock<boost::mutex> lock(
+        grab_context_mutex, boost::try_to_lock);
+    if (lock.owns_lock())
+        options.context = &grab_context;
+
+    return encode_as_png(screenshot.view(), memory, options);
+}
+
 void grab_window(HWND hwnd)
 {
-    std::vector<unsigned char> bmp = take_screenshot(hwnd);
+    // Everything the grab allocates while encoding dies with it
+    arena grab_memory;
+
+    dib_pixels screenshot = take_screenshot_pixels(hwnd, capture_order);
 
     std::cout << "TwitPic username: ";
     std::string username;
@@ -132,7 +242,8 @@ void grab_window(HWND hwnd)
         "Crabgrab", "Uploading your screenshot to TwitPic ...");
 
     std::string xml_response = twitpic::upload_image(
-        username, password, encode_as_png(bmp));
+        username, password,
+        encode_grab(screenshot, grab_memory));
 
     std::string url;
     try
@@ -282,6 +393,34 @@ void run()
 
 int _tmain(int argc, _TCHAR* argv[])
 {
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::basic_string<_TCHAR>(argv[i]) == _T("--16bpp"))
+            crabgrab::capture_order = crabgrab::channel_order::rgb565;
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--best"))
+            crabgrab::grab_options.level = 9;
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--rle"))
+            crabgrab::grab_options.strategy =
+                crabgrab::match_strategy::run_length;
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--fastest"))
+        {
+            crabgrab::grab_options.strategy =
+                crabgrab::match_strategy::run_length;
+            crabgrab::grab_options.fixed_codes = true;
+        }
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--huffman-only"))
+            crabgrab::grab_options.strategy =
+                crabgrab::match_strategy::huffman_only;
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--archive"))
+        {
+            crabgrab::grab_options.level = 6;
+            crabgrab::grab_options.strategy =
+                crabgrab::match_strategy::optimal_parsing;
+        }
+        else if (std::basic_string<_TCHAR>(argv[i]) == _T("--race"))
+            crabgrab::race_grabs = true;
+    }
+
     try
     {
         crabgrab::run();
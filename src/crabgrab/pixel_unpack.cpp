@@ -0,0 +1,431 @@
+/**
+    @file
+
+    Unpacking of BMP pixel formats into 8-bit RGB(A).
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/pixel_unpack.hpp"
+
+#include "crabgrab/row_conversion.hpp" // prepare_conversion
+
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <cstring> // memcpy, memset
+#include <stdexcept> // invalid_argument
+
+using boost::uint32_t;
+
+using std::size_t;
+
+namespace crabgrab {
+
+using detail::unpack_channel;
+using detail::unpack_state;
+
+namespace {
+
+    /**
+     * Position of the lowest set bit of a mask, at compile time.
+     */
+    template<uint32_t Mask>
+    struct mask_shift
+    {
+        static const unsigned int value =
+            (Mask & 1) ? 0 : 1 + mask_shift<(Mask >> 1)>::value;
+    };
+
+    template<>
+    struct mask_shift<0>
+    {
+        static const unsigned int value = 0;
+    };
+
+    /**
+     * Number of set bits in a mask, at compile time.
+     */
+    template<uint32_t Mask>
+    struct mask_width
+    {
+        static const unsigned int value =
+            (Mask & 1) + mask_width<(Mask >> 1)>::value;
+    };
+
+    template<>
+    struct mask_width<0>
+    {
+        static const unsigned int value = 0;
+    };
+
+    /**
+     * Widen a `bits`-bit channel to 8 bits by repeating its bits.
+     *
+     * Unlike a plain shift, this maps full intensity to 0xff.  When `bits`
+     * is a compile-time constant the loop disappears.
+     */
+    inline unsigned int widen_to_8_bits(unsigned int value, unsigned int bits)
+    {
+        if (bits == 0)
+            return 0;
+        if (bits >= 8)
+            return value >> (bits - 8);
+
+        unsigned int result = value;
+        unsigned int width = bits;
+        while (width < 8)
+        {
+            result = (result << bits) | value;
+            width += bits;
+        }
+
+        return (result >> (width - 8)) & 0xff;
+    }
+
+    template<uint32_t Mask>
+    inline unsigned char expand_channel(uint32_t pixel, unsigned char absent)
+    {
+        if (Mask == 0)
+            return absent;
+
+        return static_cast<unsigned char>(
+            widen_to_8_bits(
+                (pixel & Mask) >> mask_shift<Mask>::value,
+                mask_width<Mask>::value));
+    }
+
+    template<unsigned int Bytes>
+    uint32_t load_pixel(const unsigned char* p);
+
+    template<>
+    inline uint32_t load_pixel<2>(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8);
+    }
+
+    template<>
+    inline uint32_t load_pixel<4>(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) |
+            (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    /**
+     * Kernel for one particular set of masks, all resolved at compile time
+     * to a handful of ANDs, shifts and ORs per channel.
+     */
+    template<
+        unsigned int Bytes, uint32_t Red, uint32_t Green, uint32_t Blue,
+        uint32_t Alpha, size_t OutSize>
+    void unpack_fixed(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const unpack_state& /*state*/)
+    {
+        for (size_t x = 0; x < width; ++x, in += Bytes, out += OutSize)
+        {
+            uint32_t pixel = load_pixel<Bytes>(in);
+            out[0] = expand_channel<Red>(pixel, 0);
+            out[1] = expand_channel<Green>(pixel, 0);
+            out[2] = expand_channel<Blue>(pixel, 0);
+            if (OutSize == 4)
+                out[3] = expand_channel<Alpha>(pixel, 0xff);
+        }
+    }
+
+    inline unsigned char lookup_channel(
+        uint32_t pixel, const unpack_channel& channel)
+    {
+        return channel.scale[(pixel & channel.mask) >> channel.shift];
+    }
+
+    /**
+     * Kernel for masks we have no specialisation for.
+     */
+    template<unsigned int Bytes, size_t OutSize>
+    void unpack_generic(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const unpack_state& state)
+    {
+        const unpack_channel* channels = state.channels;
+
+        for (size_t x = 0; x < width; ++x, in += Bytes, out += OutSize)
+        {
+            uint32_t pixel = load_pixel<Bytes>(in);
+            out[0] = lookup_channel(pixel, channels[0]);
+            out[1] = lookup_channel(pixel, channels[1]);
+            out[2] = lookup_channel(pixel, channels[2]);
+            if (OutSize == 4)
+                out[3] = lookup_channel(pixel, channels[3]);
+        }
+    }
+
+    /**
+     * Kernel for formats that are just a channel order, which the
+     * vectorised row conversion handles.
+     */
+    void unpack_packed(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const unpack_state& state)
+    {
+        state.packed.kernel(in, out, width, state.packed);
+    }
+
+    /**
+     * Have unpack_packed convert pixels of `order`, with the row conversion
+     * kernel picked now rather than for every row.
+     */
+    void prepare_packed(unpack_state& state, channel_order::type order)
+    {
+        state.packed = detail::prepare_conversion(
+            order,
+            (state.out_size == 4) ? channel_order::rgba : channel_order::rgb,
+            best_instruction_set());
+    }
+
+    template<unsigned int Bits, size_t OutSize>
+    void unpack_indexed(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const unpack_state& state)
+    {
+        const unsigned int pixels_per_byte = 8 / Bits;
+        const unsigned int index_mask = (1U << Bits) - 1;
+
+        size_t x = 0;
+        for (; x + pixels_per_byte <= width; x += pixels_per_byte, ++in)
+        {
+            unsigned int byte = *in;
+            for (int i = pixels_per_byte - 1; i >= 0; --i, out += OutSize)
+            {
+                unsigned int index = (byte >> (i * Bits)) & index_mask;
+                std::memcpy(out, state.palette + index * 4, OutSize);
+            }
+        }
+
+        if (x == width)
+            return;
+
+        // Leftmost pixels are in the most significant bits
+        unsigned int byte = *in;
+        for (int i = pixels_per_byte - 1; x < width; ++x, --i, out += OutSize)
+        {
+            unsigned int index = (byte >> (i * Bits)) & index_mask;
+            std::memcpy(out, state.palette + index * 4, OutSize);
+        }
+    }
+
+    template<size_t OutSize>
+    detail::unpack_kernel select_bitfields_kernel(
+        unsigned int bit_count, uint32_t red, uint32_t green, uint32_t blue,
+        uint32_t alpha)
+    {
+        if (bit_count == 16)
+        {
+            if (red == 0x7c00 && green == 0x03e0 && blue == 0x001f &&
+                alpha == 0x8000)
+                return unpack_fixed<
+                    2, 0x7c00, 0x03e0, 0x001f, 0x8000, OutSize>;
+
+            return unpack_generic<2, OutSize>;
+        }
+        else
+        {
+            return unpack_generic<4, OutSize>;
+        }
+    }
+
+    template<size_t OutSize>
+    detail::unpack_kernel select_indexed_kernel(unsigned int bit_count)
+    {
+        switch (bit_count)
+        {
+        case 1:
+            return unpack_indexed<1, OutSize>;
+        case 4:
+            return unpack_indexed<4, OutSize>;
+        default:
+            return unpack_indexed<8, OutSize>;
+        }
+    }
+
+    void prepare_channel(
+        unpack_channel& channel, uint32_t mask, unsigned char absent)
+    {
+        channel.mask = mask;
+        channel.shift = 0;
+
+        if (mask == 0)
+        {
+            std::memset(channel.scale, absent, sizeof(channel.scale));
+            return;
+        }
+
+        while (!(mask & (1U << channel.shift)))
+            ++channel.shift;
+
+        unsigned int bits = 0;
+        for (uint32_t m = mask >> channel.shift; m & 1; m >>= 1)
+            ++bits;
+
+        // Wide channels are cut down to their top 8 bits before the lookup
+        if (bits > 8)
+        {
+            channel.shift += bits - 8;
+            bits = 8;
+        }
+
+        // A mask with gaps in it would index past the table, so nothing
+        // above the 8 bits being looked up is let through
+        channel.mask &= 0xffU << channel.shift;
+
+        std::memset(channel.scale, 0, sizeof(channel.scale));
+        for (unsigned int value = 0; value < (1U << bits); ++value)
+        {
+            channel.scale[value] =
+                static_cast<unsigned char>(widen_to_8_bits(value, bits));
+        }
+    }
+}
+
+pixel_unpacker::pixel_unpacker(
+    unsigned int bit_count, channel_order::type out_order)
+    : m_kernel(NULL)
+{
+    if (out_order != channel_order::rgba && out_order != channel_order::rgb)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument(
+                "Pixels can only be unpacked to RGBA or RGB"));
+
+    m_state.out_size = bytes_per_pixel(out_order);
+    m_state.bit_count = bit_count;
+    prepare_packed(m_state, channel_order::bgr);
+}
+
+pixel_unpacker pixel_unpacker::bitfields(
+    unsigned int bit_count, uint32_t red_mask, uint32_t green_mask,
+    uint32_t blue_mask, uint32_t alpha_mask, channel_order::type out_order)
+{
+    pixel_unpacker unpacker(bit_count, out_order);
+    unpack_state& state = unpacker.m_state;
+
+    if (bit_count == 24)
+    {
+        prepare_packed(state, channel_order::bgr);
+        unpacker.m_kernel = unpack_packed;
+        return unpacker;
+    }
+
+    if (bit_count != 16 && bit_count != 32)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument(
+                "Direct-colour pixels must be 16, 24 or 32 bits"));
+
+    if (bit_count == 16 && alpha_mask == 0 && blue_mask == 0x001f)
+    {
+        if (red_mask == 0xf800 && green_mask == 0x07e0)
+        {
+            prepare_packed(state, channel_order::rgb565);
+            unpacker.m_kernel = unpack_packed;
+            return unpacker;
+        }
+        else if (red_mask == 0x7c00 && green_mask == 0x03e0)
+        {
+            prepare_packed(state, channel_order::rgb555);
+            unpacker.m_kernel = unpack_packed;
+            return unpacker;
+        }
+    }
+
+    if (bit_count == 32 && green_mask == 0x0000ff00 &&
+        (alpha_mask == 0 || alpha_mask == 0xff000000))
+    {
+        bool alpha = alpha_mask != 0;
+        if (red_mask == 0x00ff0000 && blue_mask == 0x000000ff)
+        {
+            prepare_packed(
+                state, (alpha) ? channel_order::bgra : channel_order::bgrx);
+            unpacker.m_kernel = unpack_packed;
+            return unpacker;
+        }
+        else if (red_mask == 0x000000ff && blue_mask == 0x00ff0000)
+        {
+            prepare_packed(
+                state, (alpha) ? channel_order::rgba : channel_order::rgbx);
+            unpacker.m_kernel = unpack_packed;
+            return unpacker;
+        }
+    }
+
+    prepare_channel(state.channels[0], red_mask, 0);
+    prepare_channel(state.channels[1], green_mask, 0);
+    prepare_channel(state.channels[2], blue_mask, 0);
+    prepare_channel(state.channels[3], alpha_mask, 0xff);
+
+    unpacker.m_kernel = (state.out_size == 4) ?
+        select_bitfields_kernel<4>(
+            bit_count, red_mask, green_mask, blue_mask, alpha_mask) :
+        select_bitfields_kernel<3>(
+            bit_count, red_mask, green_mask, blue_mask, alpha_mask);
+
+    return unpacker;
+}
+
+pixel_unpacker pixel_unpacker::indexed(
+    unsigned int bit_count, const unsigned char* colour_table,
+    size_t colour_count, channel_order::type out_order)
+{
+    if (bit_count != 1 && bit_count != 4 && bit_count != 8)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument("Indexed pixels must be 1, 4 or 8 bits"));
+
+    pixel_unpacker unpacker(bit_count, out_order);
+    unpack_state& state = unpacker.m_state;
+
+    // Unused entries are opaque black
+    for (size_t i = 0; i < 256; ++i)
+    {
+        unsigned char* entry = state.palette + i * 4;
+        if (i < colour_count)
+        {
+            const unsigned char* quad = colour_table + i * 4;
+            entry[0] = quad[2];
+            entry[1] = quad[1];
+            entry[2] = quad[0];
+        }
+        else
+        {
+            entry[0] = entry[1] = entry[2] = 0;
+        }
+        entry[3] = 0xff;
+    }
+
+    unpacker.m_kernel = (state.out_size == 4) ?
+        select_indexed_kernel<4>(bit_count) :
+        select_indexed_kernel<3>(bit_count);
+
+    return unpacker;
+}
+
+}
@@ -0,0 +1,129 @@
+/**
+    @file
+
+    Unpacking of BMP pixel formats into 8-bit RGB(A).
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_PIXEL_UNPACK_HPP
+#define CRABGRAB_PIXEL_UNPACK_HPP
+
+#include "crabgrab/image_view.hpp" // channel_order
+#include "crabgrab/row_conversion.hpp" // detail::conversion
+
+#include <boost/cstdint.hpp> // uint32_t
+
+#include <cstddef> // size_t
+
+namespace crabgrab {
+
+namespace detail {
+
+    /**
+     * How to pull one channel out of a pixel that doesn't have a
+     * specialised kernel.
+     */
+    struct unpack_channel
+    {
+        boost::uint32_t mask;
+        unsigned int shift; ///< moves the channel's top 8 bits to the bottom
+        unsigned char scale[256]; ///< maps those bits to a full 8-bit value
+    };
+
+    struct unpack_state
+    {
+        std::size_t out_size;
+        unsigned int bit_count;
+        conversion packed; ///< for formats row_conversion has
+        unpack_channel channels[4]; ///< red, green, blue, alpha
+        unsigned char palette[256 * 4]; ///< already in output order
+    };
+
+    typedef void (*unpack_kernel)(
+        const unsigned char* in, unsigned char* out, std::size_t width,
+        const unpack_state& state);
+}
+
+/**
+ * Converts rows of one particular pixel format to RGBA or RGB.
+ *
+ * All the decisions about the format (bit depth, which masks, which
+ * kernel) are made once, when the unpacker is created, rather than for
+ * every pixel.  The common screen formats (565, 555, 24-bit BGR and 32-bit
+ * BGR(A)) go through the vectorised row_conversion kernels and 1555 gets a
+ * kernel specialised at compile time for its masks.  Any other masks fall
+ * back to a shift and table lookup per channel, still worked out in
+ * advance.
+ */
+class pixel_unpacker
+{
+public:
+
+    /**
+     * Unpacker for direct-colour pixels.
+     *
+     * @param bit_count  16, 24 or 32.  24-bit pixels are always BGR and the
+     *                   masks are ignored.
+     * @param alpha_mask Zero if the pixels have no alpha, in which case they
+     *                   come out opaque.
+     * @param out_order  channel_order::rgba or channel_order::rgb.
+     */
+    static pixel_unpacker bitfields(
+        unsigned int bit_count, boost::uint32_t red_mask,
+        boost::uint32_t green_mask, boost::uint32_t blue_mask,
+        boost::uint32_t alpha_mask, channel_order::type out_order);
+
+    /**
+     * Unpacker for 1, 4 or 8-bit pixels indexing a colour table.
+     *
+     * @param colour_table  BGRX quads.  The fourth byte is reserved so the
+     *                      pixels come out opaque.  Indices past the end of
+     *                      the table come out black.
+     */
+    static pixel_unpacker indexed(
+        unsigned int bit_count, const unsigned char* colour_table,
+        std::size_t colour_count, channel_order::type out_order);
+
+    /**
+     * Unpack `width` pixels from `in` into `out`.
+     */
+    void operator()(
+        const unsigned char* in, unsigned char* out, std::size_t width) const
+    {
+        m_kernel(in, out, width, m_state);
+    }
+
+private:
+    pixel_unpacker(unsigned int bit_count, channel_order::type out_order);
+
+    detail::unpack_kernel m_kernel;
+    detail::unpack_state m_state;
+};
+
+}
+
+#endif
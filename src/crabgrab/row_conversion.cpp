@@ -0,0 +1,642 @@
+/**
+    @file
+
+    Conversion of pixel rows into the layout the PNG encoder expects.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/row_conversion.hpp"
+
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // min
+#include <cstring> // memcpy, memset
+#include <stdexcept> // invalid_argument
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || \
+    defined(__x86_64__)
+#define CRABGRAB_X86 1
+#endif
+
+#if defined(CRABGRAB_X86)
+
+#include <emmintrin.h> // SSE2
+#include <tmmintrin.h> // SSSE3
+
+// Visual C++ only has AVX2 intrinsics from VS 2012
+#if defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1700)
+#define CRABGRAB_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h> // __cpuid, __cpuidex, _xgetbv
+#endif
+
+#endif
+
+// GCC only lets us use intrinsics for instruction sets we have either
+// enabled for the whole file or for the function using them.  Visual C++
+// lets us use them anywhere.
+#if defined(__GNUC__)
+#define CRABGRAB_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CRABGRAB_TARGET(isa)
+#endif
+
+using std::size_t;
+
+namespace crabgrab {
+
+using detail::conversion;
+using detail::pixel_layout;
+using detail::row_kernel;
+
+namespace {
+
+    instruction_set::type detect_instruction_set()
+    {
+#if !defined(CRABGRAB_X86)
+        return instruction_set::generic;
+#elif defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return instruction_set::avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return instruction_set::ssse3;
+        if (__builtin_cpu_supports("sse2"))
+            return instruction_set::sse2;
+        return instruction_set::generic;
+#elif defined(_MSC_VER)
+        int info[4];
+        ::__cpuid(info, 0);
+        int highest_leaf = info[0];
+
+        ::__cpuid(info, 1);
+        bool has_sse2 = (info[3] & (1 << 26)) != 0;
+        bool has_ssse3 = (info[2] & (1 << 9)) != 0;
+        bool has_osxsave = (info[2] & (1 << 27)) != 0;
+        bool has_avx = (info[2] & (1 << 28)) != 0;
+
+#if defined(CRABGRAB_AVX2)
+        // The OS must also be saving the YMM registers on context switches
+        if (highest_leaf >= 7 && has_osxsave && has_avx &&
+            (::_xgetbv(0) & 6) == 6)
+        {
+            ::__cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5))
+                return instruction_set::avx2;
+        }
+#else
+        (void)highest_leaf;
+        (void)has_osxsave;
+        (void)has_avx;
+#endif
+
+        if (has_ssse3)
+            return instruction_set::ssse3;
+        if (has_sse2)
+            return instruction_set::sse2;
+        return instruction_set::generic;
+#else
+        return instruction_set::generic;
+#endif
+    }
+
+    const instruction_set::type detected_instruction_set =
+        detect_instruction_set();
+
+    pixel_layout layout_of(channel_order::type order)
+    {
+        pixel_layout layout;
+        layout.size = bytes_per_pixel(order);
+        layout.green = 1;
+        layout.alpha = (has_alpha(order)) ? 3 : -1;
+
+        switch (order)
+        {
+        case channel_order::bgra:
+        case channel_order::bgrx:
+        case channel_order::bgr:
+            layout.red = 2;
+            layout.blue = 0;
+            break;
+        default:
+            layout.red = 0;
+            layout.blue = 2;
+            break;
+        }
+
+        return layout;
+    }
+
+    void convert_row_generic(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        const pixel_layout& layout = how.in;
+
+        if (how.out_size == 4)
+        {
+            for (size_t x = 0; x < width; ++x, in += layout.size, out += 4)
+            {
+                out[0] = in[layout.red];
+                out[1] = in[layout.green];
+                out[2] = in[layout.blue];
+                out[3] = (layout.alpha < 0) ? 0xff : in[layout.alpha];
+            }
+        }
+        else
+        {
+            for (size_t x = 0; x < width; ++x, in += layout.size, out += 3)
+            {
+                out[0] = in[layout.red];
+                out[1] = in[layout.green];
+                out[2] = in[layout.blue];
+            }
+        }
+    }
+
+    void copy_row(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        std::memcpy(out, in, width * how.out_size);
+    }
+
+    /**
+     * Widen a 5- or 6-bit channel to 8 bits by repeating its top bits, so
+     * full intensity comes out as 0xff.
+     */
+    inline unsigned char widen_5_bits(unsigned int value)
+    {
+        return static_cast<unsigned char>((value << 3) | (value >> 2));
+    }
+
+    inline unsigned char widen_6_bits(unsigned int value)
+    {
+        return static_cast<unsigned char>((value << 2) | (value >> 4));
+    }
+
+    /**
+     * 16-bit 565 or 555 pixels to 24- or 32-bit.
+     */
+    template<bool Is565>
+    void convert_row_16_bit_generic(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        for (size_t x = 0; x < width; ++x, in += 2, out += how.out_size)
+        {
+            unsigned int pixel = in[0] | (in[1] << 8);
+            out[0] = widen_5_bits((pixel >> ((Is565) ? 11 : 10)) & 0x1f);
+            out[1] = (Is565) ?
+                widen_6_bits((pixel >> 5) & 0x3f) :
+                widen_5_bits((pixel >> 5) & 0x1f);
+            out[2] = widen_5_bits(pixel & 0x1f);
+            if (how.out_size == 4)
+                out[3] = 0xff;
+        }
+    }
+
+#if defined(CRABGRAB_X86)
+
+    /**
+     * 32-bit to 32-bit pixels using only shifts and masks.
+     */
+    CRABGRAB_TARGET("sse2")
+    void convert_row_sse2(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        const bool swap_red_blue = how.in.red != 0;
+        const __m128i green_alpha = _mm_set1_epi32(0xff00ff00);
+        const __m128i red_blue = _mm_set1_epi32(0x00ff00ff);
+        const __m128i alpha_fill = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(how.alpha_fill));
+
+        size_t x = 0;
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i pixels = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(in + x * 4));
+
+            if (swap_red_blue)
+            {
+                __m128i rb = _mm_and_si128(pixels, red_blue);
+                rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+                pixels = _mm_or_si128(_mm_and_si128(pixels, green_alpha), rb);
+            }
+
+            pixels = _mm_or_si128(pixels, alpha_fill);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 4), pixels);
+        }
+
+        convert_row_generic(in + x * 4, out + x * 4, width - x, how);
+    }
+
+    /**
+     * Pack four registers of 12 useful bytes each into three full registers.
+     */
+    CRABGRAB_TARGET("sse2")
+    inline void store_packed_rgb(
+        unsigned char* out, __m128i a, __m128i b, __m128i c, __m128i d)
+    {
+        __m128i* p = reinterpret_cast<__m128i*>(out);
+        _mm_storeu_si128(p, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128(
+            p + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+        _mm_storeu_si128(
+            p + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+    }
+
+    /**
+     * 32-bit to 24- or 32-bit pixels in a single byte shuffle.
+     */
+    CRABGRAB_TARGET("ssse3")
+    void convert_row_ssse3(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        const __m128i shuffle = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(how.shuffle));
+        const __m128i alpha_fill = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(how.alpha_fill));
+        const __m128i* source = reinterpret_cast<const __m128i*>(in);
+
+        size_t x = 0;
+        if (how.out_size == 4)
+        {
+            for (; x + 4 <= width; x += 4, ++source)
+            {
+                __m128i pixels =
+                    _mm_shuffle_epi8(_mm_loadu_si128(source), shuffle);
+                _mm_storeu_si128(
+                    reinterpret_cast<__m128i*>(out + x * 4),
+                    _mm_or_si128(pixels, alpha_fill));
+            }
+        }
+        else
+        {
+            for (; x + 16 <= width; x += 16, source += 4)
+            {
+                store_packed_rgb(
+                    out + x * 3,
+                    _mm_shuffle_epi8(_mm_loadu_si128(source), shuffle),
+                    _mm_shuffle_epi8(_mm_loadu_si128(source + 1), shuffle),
+                    _mm_shuffle_epi8(_mm_loadu_si128(source + 2), shuffle),
+                    _mm_shuffle_epi8(_mm_loadu_si128(source + 3), shuffle));
+            }
+        }
+
+        convert_row_generic(in + x * 4, out + x * how.out_size, width - x, how);
+    }
+
+#if defined(CRABGRAB_AVX2)
+
+    /**
+     * As convert_row_ssse3 but eight pixels at a time.
+     *
+     * vpshufb can't move bytes between the two halves of the register so
+     * each half is packed on its own.
+     */
+    CRABGRAB_TARGET("avx2")
+    void convert_row_avx2(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        const __m128i shuffle_half = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(how.shuffle));
+        const __m256i shuffle = _mm256_broadcastsi128_si256(shuffle_half);
+        const __m256i alpha_fill = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(how.alpha_fill)));
+        const __m256i* source = reinterpret_cast<const __m256i*>(in);
+
+        size_t x = 0;
+        if (how.out_size == 4)
+        {
+            for (; x + 8 <= width; x += 8, ++source)
+            {
+                __m256i pixels =
+                    _mm256_shuffle_epi8(_mm256_loadu_si256(source), shuffle);
+                _mm256_storeu_si256(
+                    reinterpret_cast<__m256i*>(out + x * 4),
+                    _mm256_or_si256(pixels, alpha_fill));
+            }
+        }
+        else
+        {
+            for (; x + 16 <= width; x += 16, source += 2)
+            {
+                __m256i first =
+                    _mm256_shuffle_epi8(_mm256_loadu_si256(source), shuffle);
+                __m256i second = _mm256_shuffle_epi8(
+                    _mm256_loadu_si256(source + 1), shuffle);
+
+                store_packed_rgb(
+                    out + x * 3,
+                    _mm256_castsi256_si128(first),
+                    _mm256_extracti128_si256(first, 1),
+                    _mm256_castsi256_si128(second),
+                    _mm256_extracti128_si256(second, 1));
+            }
+        }
+
+        convert_row_ssse3(
+            in + x * 4, out + x * how.out_size, width - x, how);
+    }
+
+#endif
+
+    /**
+     * Widen eight 565 or 555 pixels to RGBA, four pixels to each register.
+     *
+     * Each channel is isolated and widened in its own 16-bit lanes, exactly
+     * as convert_row_16_bit_generic does it, and the lanes are then
+     * interleaved into pixels.
+     */
+    template<bool Is565>
+    CRABGRAB_TARGET("sse2")
+    inline void widen_16_bit_sse2(
+        const unsigned char* in, __m128i& low, __m128i& high)
+    {
+        const __m128i five_bits = _mm_set1_epi16(0x1f);
+        __m128i pixels =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+
+        __m128i red = _mm_and_si128(
+            _mm_srli_epi16(pixels, (Is565) ? 11 : 10), five_bits);
+        __m128i green = _mm_and_si128(
+            _mm_srli_epi16(pixels, 5), _mm_set1_epi16((Is565) ? 0x3f : 0x1f));
+        __m128i blue = _mm_and_si128(pixels, five_bits);
+
+        red = _mm_or_si128(_mm_slli_epi16(red, 3), _mm_srli_epi16(red, 2));
+        green = (Is565) ?
+            _mm_or_si128(_mm_slli_epi16(green, 2), _mm_srli_epi16(green, 4)) :
+            _mm_or_si128(_mm_slli_epi16(green, 3), _mm_srli_epi16(green, 2));
+        blue = _mm_or_si128(_mm_slli_epi16(blue, 3), _mm_srli_epi16(blue, 2));
+
+        __m128i red_green = _mm_or_si128(red, _mm_slli_epi16(green, 8));
+        __m128i blue_alpha = _mm_or_si128(
+            blue, _mm_set1_epi16(static_cast<short>(0xff00)));
+
+        low = _mm_unpacklo_epi16(red_green, blue_alpha);
+        high = _mm_unpackhi_epi16(red_green, blue_alpha);
+    }
+
+    /**
+     * 16-bit 565 or 555 pixels to 32-bit, eight at a time.
+     */
+    template<bool Is565>
+    CRABGRAB_TARGET("sse2")
+    void convert_row_16_bit_sse2(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        size_t x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            __m128i low, high;
+            widen_16_bit_sse2<Is565>(in + x * 2, low, high);
+
+            __m128i* target = reinterpret_cast<__m128i*>(out + x * 4);
+            _mm_storeu_si128(target, low);
+            _mm_storeu_si128(target + 1, high);
+        }
+
+        convert_row_16_bit_generic<Is565>(
+            in + x * 2, out + x * 4, width - x, how);
+    }
+
+    /**
+     * 16-bit 565 or 555 pixels to 24-bit, sixteen at a time.
+     *
+     * The pixels are widened to RGBA as by convert_row_16_bit_sse2 and the
+     * alpha bytes then squeezed out with the same shuffle as RGBA->RGB.
+     */
+    template<bool Is565>
+    CRABGRAB_TARGET("ssse3")
+    void convert_row_16_bit_ssse3(
+        const unsigned char* in, unsigned char* out, size_t width,
+        const conversion& how)
+    {
+        const __m128i shuffle = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(how.shuffle));
+
+        size_t x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i a, b, c, d;
+            widen_16_bit_sse2<Is565>(in + x * 2, a, b);
+            widen_16_bit_sse2<Is565>(in + x * 2 + 16, c, d);
+
+            store_packed_rgb(
+                out + x * 3,
+                _mm_shuffle_epi8(a, shuffle), _mm_shuffle_epi8(b, shuffle),
+                _mm_shuffle_epi8(c, shuffle), _mm_shuffle_epi8(d, shuffle));
+        }
+
+        convert_row_16_bit_generic<Is565>(
+            in + x * 2, out + x * 3, width - x, how);
+    }
+
+#endif
+
+    bool is_16_bit(channel_order::type order)
+    {
+        return order == channel_order::rgb565 ||
+            order == channel_order::rgb555;
+    }
+
+    /**
+     * Kernel widening 16-bit pixels, whose channels don't sit in bytes of
+     * their own so need shifting and masking rather than shuffling.
+     */
+    row_kernel select_16_bit_kernel(
+        channel_order::type in_order, size_t out_size,
+        instruction_set::type available)
+    {
+        bool is_565 = in_order == channel_order::rgb565;
+
+#if defined(CRABGRAB_X86)
+        if (out_size == 4 && available >= instruction_set::sse2)
+            return (is_565) ?
+                convert_row_16_bit_sse2<true> : convert_row_16_bit_sse2<false>;
+
+        if (out_size == 3 && available >= instruction_set::ssse3)
+            return (is_565) ?
+                convert_row_16_bit_ssse3<true> :
+                convert_row_16_bit_ssse3<false>;
+#else
+        (void)out_size;
+        (void)available;
+#endif
+
+        return (is_565) ?
+            convert_row_16_bit_generic<true> :
+            convert_row_16_bit_generic<false>;
+    }
+
+    void check_output_order(channel_order::type out_order)
+    {
+        if (out_order != channel_order::rgba && out_order != channel_order::rgb)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument(
+                    "Pixels can only be converted to RGBA or RGB"));
+    }
+}
+
+namespace detail {
+
+    conversion prepare_conversion(
+        channel_order::type in_order, channel_order::type out_order,
+        instruction_set::type limit)
+    {
+        check_output_order(out_order);
+
+        // The only shuffle the 16-bit kernels need is the RGBA->RGB one
+        conversion how;
+        how.in = layout_of(
+            (is_16_bit(in_order)) ? channel_order::rgba : in_order);
+        how.out_size = bytes_per_pixel(out_order);
+
+        // Each group of four input pixels becomes four output pixels;
+        // 0x80 makes pshufb write a zero
+        std::memset(how.shuffle, 0x80, sizeof(how.shuffle));
+        std::memset(how.alpha_fill, 0, sizeof(how.alpha_fill));
+        for (int i = 0; i < 4; ++i)
+        {
+            unsigned char* target = how.shuffle + i * how.out_size;
+            int source = i * 4;
+            target[0] = static_cast<unsigned char>(source + how.in.red);
+            target[1] = static_cast<unsigned char>(source + how.in.green);
+            target[2] = static_cast<unsigned char>(source + how.in.blue);
+            if (how.out_size == 4)
+            {
+                if (how.in.alpha < 0)
+                    how.alpha_fill[i * 4 + 3] = 0xff;
+                else
+                    target[3] = static_cast<unsigned char>(
+                        source + how.in.alpha);
+            }
+        }
+
+        instruction_set::type available =
+            std::min(limit, detected_instruction_set);
+
+        if (is_16_bit(in_order))
+        {
+            how.kernel = select_16_bit_kernel(
+                in_order, how.out_size, available);
+        }
+        else if (layout_of(out_order).red == how.in.red &&
+            how.in.size == how.out_size &&
+            (how.in.alpha >= 0 || how.out_size == 3))
+        {
+            how.kernel = copy_row;
+        }
+#if defined(CRABGRAB_X86)
+        else if (how.in.size == 4 && available >= instruction_set::ssse3)
+        {
+#if defined(CRABGRAB_AVX2)
+            how.kernel = (available >= instruction_set::avx2) ?
+                convert_row_avx2 : convert_row_ssse3;
+#else
+            how.kernel = convert_row_ssse3;
+#endif
+        }
+        else if (
+            how.in.size == 4 && how.out_size == 4 &&
+            available >= instruction_set::sse2)
+        {
+            how.kernel = convert_row_sse2;
+        }
+#endif
+        else
+        {
+            how.kernel = convert_row_generic;
+        }
+
+        return how;
+    }
+}
+
+instruction_set::type best_instruction_set()
+{
+    return detected_instruction_set;
+}
+
+row_converter::row_converter(
+    channel_order::type in_order, channel_order::type out_order)
+    : m_how(
+        detail::prepare_conversion(
+            in_order, out_order, detected_instruction_set))
+{}
+
+row_converter::row_converter(
+    channel_order::type in_order, channel_order::type out_order,
+    instruction_set::type limit)
+    : m_how(detail::prepare_conversion(in_order, out_order, limit))
+{}
+
+void convert_row(
+    const unsigned char* in, channel_order::type in_order,
+    unsigned char* out, channel_order::type out_order, size_t width,
+    instruction_set::type limit)
+{
+    row_converter(in_order, out_order, limit)(in, out, width);
+}
+
+void convert_row(
+    const unsigned char* in, channel_order::type in_order,
+    unsigned char* out, channel_order::type out_order, size_t width)
+{
+    convert_row(
+        in, in_order, out, out_order, width, detected_instruction_set);
+}
+
+void convert_image(
+    const image_view& image, unsigned char* out,
+    channel_order::type out_order, instruction_set::type limit)
+{
+    row_converter convert(image.order, out_order, limit);
+
+    size_t out_row_size = image.width * bytes_per_pixel(out_order);
+    for (unsigned int y = 0; y < image.height; ++y, out += out_row_size)
+    {
+        convert(image.row(y), out, image.width);
+    }
+}
+
+void convert_image(
+    const image_view& image, unsigned char* out,
+    channel_order::type out_order)
+{
+    convert_image(image, out, out_order, detected_instruction_set);
+}
+
+}
@@ -0,0 +1,216 @@
+/**
+    @file
+
+    Conversion of pixel rows into the layout the PNG encoder expects.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_ROW_CONVERSION_HPP
+#define CRABGRAB_ROW_CONVERSION_HPP
+
+#include "crabgrab/image_view.hpp" // image_view, channel_order
+
+#include <cstddef> // size_t
+
+namespace crabgrab {
+
+/**
+ * Sets of vector instructions the conversion kernels can be built from.
+ *
+ * Later entries are supersets of earlier ones.
+ */
+namespace instruction_set {
+    enum type
+    {
+        generic,
+        sse2,
+        ssse3,
+        avx2
+    };
+}
+
+/**
+ * The most capable instruction set this processor and OS support.
+ *
+ * Detected once, the first time it is needed.
+ */
+instruction_set::type best_instruction_set();
+
+namespace detail {
+
+    /**
+     * Where each channel lives within a pixel.
+     *
+     * `alpha` is negative for layouts without a usable alpha channel.
+     */
+    struct pixel_layout
+    {
+        std::size_t size;
+        int red;
+        int green;
+        int blue;
+        int alpha;
+    };
+
+    struct conversion;
+
+    typedef void (*row_kernel)(
+        const unsigned char* in, unsigned char* out, std::size_t width,
+        const conversion& how);
+
+    /**
+     * Everything the kernels need to know, worked out once per image rather
+     * than once per row.
+     */
+    struct conversion
+    {
+        pixel_layout in;
+        std::size_t out_size;
+
+        /// pshufb control moving 4 input pixels into output order
+        unsigned char shuffle[16];
+
+        /// OR-ed into 4 output RGBA pixels to make them opaque (or not)
+        unsigned char alpha_fill[16];
+
+        row_kernel kernel;
+    };
+
+    /**
+     * Pick the kernel converting `in_order` to `out_order` with at most
+     * `limit`, and the shuffle it needs.
+     *
+     * @throws std::invalid_argument if `out_order` is neither RGBA nor RGB.
+     */
+    conversion prepare_conversion(
+        channel_order::type in_order, channel_order::type out_order,
+        instruction_set::type limit);
+}
+
+/**
+ * Converts rows of one channel order to RGBA or RGB.
+ *
+ * The kernel and the shuffle it needs are worked out once, when the
+ * converter is created, so each row costs only the kernel itself.
+ */
+class row_converter
+{
+public:
+
+    /**
+     * Converter using the best kernel this processor supports.
+     *
+     * @param in_order   Layout of the input pixels.  Any channel order.
+     * @param out_order  Either channel_order::rgba or channel_order::rgb.
+     *
+     * @throws std::invalid_argument if `out_order` is neither.
+     */
+    row_converter(
+        channel_order::type in_order, channel_order::type out_order);
+
+    /**
+     * Converter using at most the given instruction set.
+     *
+     * If the processor doesn't support `limit`, the best it does support is
+     * used.
+     */
+    row_converter(
+        channel_order::type in_order, channel_order::type out_order,
+        instruction_set::type limit);
+
+    /**
+     * Convert `width` pixels from `in` into `out`, which must not overlap.
+     *
+     * Swizzles the channels and, if the input has no real alpha channel but
+     * the output does, makes every pixel opaque.
+     */
+    void operator()(
+        const unsigned char* in, unsigned char* out, std::size_t width) const
+    {
+        m_how.kernel(in, out, width, m_how);
+    }
+
+private:
+    detail::conversion m_how;
+};
+
+/**
+ * Convert one row of pixels to RGBA or RGB.
+ *
+ * Converting many rows of the same layout is cheaper with a row_converter.
+ *
+ * Swizzles the channels and, if the input has no real alpha channel but the
+ * output does, makes every pixel opaque.
+ *
+ * @param in         Start of the input row.
+ * @param in_order   Layout of the input pixels.  Any channel order.
+ * @param out        Start of the output row.  Must have room for `width`
+ *                   pixels of `out_order`.  Must not overlap `in`.
+ * @param out_order  Either channel_order::rgba or channel_order::rgb.
+ * @param width      Number of pixels in the row.
+ */
+void convert_row(
+    const unsigned char* in, channel_order::type in_order,
+    unsigned char* out, channel_order::type out_order, std::size_t width);
+
+/**
+ * Convert one row of pixels using at most the given instruction set.
+ *
+ * Mostly of use for testing and benchmarking the individual kernels.  If the
+ * processor doesn't support `limit`, the best it does support is used.
+ */
+void convert_row(
+    const unsigned char* in, channel_order::type in_order,
+    unsigned char* out, channel_order::type out_order, std::size_t width,
+    instruction_set::type limit);
+
+/**
+ * Convert a whole image to packed, top-down RGBA or RGB rows.
+ *
+ * Bottom-up images are flipped as part of the same pass.
+ *
+ * @param out  Buffer of at least
+ *             `image.width * image.height * bytes_per_pixel(out_order)`
+ *             bytes.
+ */
+void convert_image(
+    const image_view& image, unsigned char* out,
+    channel_order::type out_order);
+
+/**
+ * Convert a whole image using at most the given instruction set.
+ *
+ * Mostly of use for benchmarking the individual kernels.  If the processor
+ * doesn't support `limit`, the best it does support is used.
+ */
+void convert_image(
+    const image_view& image, unsigned char* out,
+    channel_order::type out_order, instruction_set::type limit);
+
+}
+
+#endif
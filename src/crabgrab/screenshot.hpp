@@ -32,7 +32,8 @@
 #ifndef CRABGRAB_SCREENSHOT_HPP
 #define CRABGRAB_SCREENSHOT_HPP
 
-#include "crabgrab/convert_hbitmap.hpp" // convert_hbitmap_to_bmp
+#include "crabgrab/convert_hbitmap.hpp" // convert_hbitmap_to_bmp,
+                                          // convert_hbitmap_to_pixels
 
 #include <winapi/error.hpp> // last_error
 
@@ -54,50 +55,105 @@
 
 namespace crabgrab {
 
+namespace detail {
+
+    typedef boost::shared_ptr<boost::remove_pointer<HDC>::type>
+        device_context_handle;
+    typedef boost::shared_ptr<boost::remove_pointer<HBITMAP>::type>
+        bitmap_handle;
+
+    /**
+     * Copy of a window's pixels still held by GDI.
+     *
+     * The bitmap must be read through the device context it was made
+     * compatible with so both are kept together.
+     */
+    struct window_snapshot
+    {
+        device_context_handle device_context;
+        bitmap_handle bitmap;
+    };
+
+    inline window_snapshot snapshot_window(HWND hwnd)
+    {
+        device_context_handle window_device_context(
+            ::GetWindowDC(hwnd), boost::bind<int>(::ReleaseDC, hwnd, _1));
+        if (!window_device_context)
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(
+                    std::runtime_error("Failed to get device context")) <<
+                boost::errinfo_api_function("GetWindowDC"));
+
+        window_snapshot snapshot;
+
+        snapshot.device_context = device_context_handle(
+            ::CreateCompatibleDC(window_device_context.get()), ::DeleteDC);
+        if (!snapshot.device_context)
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(
+                    std::runtime_error("Failed to create device context")) <<
+                boost::errinfo_api_function("CreateCompatibleDC"));
+
+        RECT r;
+        ::GetWindowRect(hwnd, &r);
+
+        snapshot.bitmap = bitmap_handle(
+            ::CreateCompatibleBitmap(
+                window_device_context.get(), r.right - r.left,
+                r.bottom - r.top),
+            ::DeleteObject);
+        if (!snapshot.bitmap)
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(
+                    std::runtime_error("Failed to create bitmap")) <<
+                boost::errinfo_api_function("CreateCompatibleBitmap"));
+
+        HBITMAP orig = reinterpret_cast<HBITMAP>(
+            ::SelectObject(
+                snapshot.device_context.get(), snapshot.bitmap.get()));
+        if (!::BitBlt(
+            snapshot.device_context.get(), 0, 0, r.right - r.left, 
+            r.bottom - r.top, window_device_context.get(), 0, 0, SRCCOPY))
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(winapi::last_error()) <<
+                boost::errinfo_api_function("BitBlt"));
+        ::SelectObject(snapshot.device_context.get(), orig);
+
+        return snapshot;
+    }
+}
+
+/**
+ * Take a screenshot of the window as a complete BMP file.
+ */
 inline std::vector<unsigned char> take_screenshot(
     HWND hwnd=::GetDesktopWindow())
 {
-    boost::shared_ptr<boost::remove_pointer<HDC>::type> window_device_context(
-        ::GetWindowDC(hwnd), boost::bind<int>(::ReleaseDC, hwnd, _1));
-    if (!window_device_context)
-        BOOST_THROW_EXCEPTION(
-            boost::enable_error_info(
-                std::runtime_error("Failed to get device context")) <<
-            boost::errinfo_api_function("GetWindowDC"));
-
-    boost::shared_ptr<boost::remove_pointer<HDC>::type> snapshot_device_context(
-        ::CreateCompatibleDC(window_device_context.get()), ::DeleteDC);
-    if (!snapshot_device_context)
-        BOOST_THROW_EXCEPTION(
-            boost::enable_error_info(
-                std::runtime_error("Failed to create device context")) <<
-            boost::errinfo_api_function("CreateCompatibleDC"));
-
-    RECT r;
-    ::GetWindowRect(hwnd, &r);
-
-    boost::shared_ptr<boost::remove_pointer<HBITMAP>::type> snapshot(
-        ::CreateCompatibleBitmap(
-            window_device_context.get(), r.right - r.left, r.bottom - r.top),
-            ::DeleteObject);
-    if (!snapshot)
-        BOOST_THROW_EXCEPTION(
-            boost::enable_error_info(
-                std::runtime_error("Failed to create bitmap")) <<
-            boost::errinfo_api_function("CreateCompatibleBitmap"));
-
-    HBITMAP orig = reinterpret_cast<HBITMAP>(
-        ::SelectObject(snapshot_device_context.get(), snapshot.get()));
-    if (!::BitBlt(
-        snapshot_device_context.get(), 0, 0, r.right - r.left, 
-        r.bottom - r.top, window_device_context.get(), 0, 0, SRCCOPY))
-        BOOST_THROW_EXCEPTION(
-            boost::enable_error_info(winapi::last_error()) <<
-            boost::errinfo_api_function("BitBlt"));
-    ::SelectObject(snapshot_device_context.get(), orig);
+    detail::window_snapshot snapshot = detail::snapshot_window(hwnd);
 
     return convert_hbitmap_to_bmp(
-        snapshot.get(), snapshot_device_context.get());
+        snapshot.bitmap.get(), snapshot.device_context.get());
+}
+
+/**
+ * Take a screenshot of the window as raw pixels.
+ *
+ * Cheaper than take_screenshot when the pixels are going straight to the
+ * encoder as there is no BMP file to build and then parse again.
+ *
+ * @param order  channel_order::bgrx for full colour.  channel_order::rgb565
+ *               or channel_order::rgb555 capture 16-bit pixels instead,
+ *               half the size, which suits remote sessions short of
+ *               bandwidth at the cost of some colour depth.
+ */
+inline dib_pixels take_screenshot_pixels(
+    HWND hwnd=::GetDesktopWindow(),
+    channel_order::type order=channel_order::bgrx)
+{
+    detail::window_snapshot snapshot = detail::snapshot_window(hwnd);
+
+    return convert_hbitmap_to_pixels(
+        snapshot.bitmap.get(), snapshot.device_context.get(), order);
 }
 
 }
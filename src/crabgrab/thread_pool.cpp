@@ -0,0 +1,140 @@
+/**
+    @file
+
+    Pool of worker threads for splitting work across cores.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/thread_pool.hpp"
+
+#include "crabgrab/arena.hpp" // heap_scope
+
+#include <boost/bind.hpp> // bind
+
+#include <algorithm> // max
+
+namespace crabgrab {
+
+thread_pool::thread_pool(unsigned int threads)
+    : m_size((threads) ? threads :
+             std::max(boost::thread::hardware_concurrency(), 1U)),
+      m_job(NULL), m_count(0), m_next(0), m_unfinished(0), m_stopping(false)
+{
+    try
+    {
+        for (unsigned int i = 1; i < m_size; ++i)
+            m_threads.create_thread(boost::bind(&thread_pool::work, this));
+    }
+    catch (...)
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+        m_work_ready.notify_all();
+        m_threads.join_all();
+        throw;
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        boost::mutex::scoped_lock loop_lock(m_loop_mutex);
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_ready.notify_all();
+    m_threads.join_all();
+}
+
+unsigned int thread_pool::size() const
+{
+    return m_size;
+}
+
+void thread_pool::parallel_for(
+    unsigned int count, const boost::function<void (unsigned int)>& job)
+{
+    if (count == 0)
+        return;
+
+    boost::mutex::scoped_lock loop_lock(m_loop_mutex);
+    heap_scope scope;
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_job = &job;
+    m_count = count;
+    m_next = 0;
+    m_unfinished = count;
+    m_work_ready.notify_all();
+
+    run_iterations(lock);
+    while (m_unfinished > 0)
+        m_work_done.wait(lock);
+
+    m_job = NULL;
+    m_count = m_next = 0;
+}
+
+void thread_pool::work()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    for (;;)
+    {
+        while (!m_stopping && m_next >= m_count)
+            m_work_ready.wait(lock);
+
+        if (m_stopping)
+            return;
+
+        run_iterations(lock);
+    }
+}
+
+/**
+ * Take iterations of the current loop until there are none left.
+ *
+ * The lock is only released while an iteration runs.
+ */
+void thread_pool::run_iterations(boost::unique_lock<boost::mutex>& lock)
+{
+    while (m_next < m_count)
+    {
+        unsigned int i = m_next++;
+        const boost::function<void (unsigned int)>& job = *m_job;
+
+        lock.unlock();
+        job(i);
+        lock.lock();
+
+        if (--m_unfinished == 0)
+            m_work_done.notify_all();
+    }
+}
+
+}
@@ -0,0 +1,107 @@
+/**
+    @file
+
+    Pool of worker threads for splitting work across cores.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef CRABGRAB_THREAD_POOL_HPP
+#define CRABGRAB_THREAD_POOL_HPP
+
+#include <boost/function.hpp> // function
+#include <boost/noncopyable.hpp> // noncopyable
+#include <boost/thread/condition_variable.hpp> // condition_variable
+#include <boost/thread/mutex.hpp> // mutex
+#include <boost/thread/thread.hpp> // thread_group
+
+namespace crabgrab {
+
+/**
+ * Threads kept waiting to run the iterations of a loop at the same time.
+ *
+ * Starting threads for every grab would cost more than some of the work
+ * they are given, so they are started once, with the pool, and wait between
+ * loops.  The thread that runs a loop takes iterations too, so a pool of
+ * `size()` threads starts one fewer than that.
+ *
+ * Whichever thread they run on, iterations allocate from the heap rather
+ * than any arena in scope: an iteration may free or grow what an earlier
+ * one, on another thread, allocated, and an arena isn't thread-safe.
+ */
+class thread_pool : boost::noncopyable
+{
+public:
+    /**
+     * @param threads  Threads to run loops on, counting the one calling
+     *                 parallel_for.  0 means one per core.
+     *
+     * @throws boost::thread_resource_error if a thread can't be started.
+     */
+    explicit thread_pool(unsigned int threads=0);
+
+    /**
+     * Waits for the loop running, if any, then stops the threads.
+     */
+    ~thread_pool();
+
+    /**
+     * Threads loops run on, including the caller.
+     */
+    unsigned int size() const;
+
+    /**
+     * Call `job(i)` for every `i` from 0 to `count - 1`, spread over the
+     * pool's threads, and return once every call has.
+     *
+     * The calls mustn't throw.  Only one loop runs at a time; a second
+     * caller waits for the first loop to finish.
+     */
+    void parallel_for(
+        unsigned int count, const boost::function<void (unsigned int)>& job);
+
+private:
+    void work();
+    void run_iterations(boost::unique_lock<boost::mutex>& lock);
+
+    boost::thread_group m_threads;
+    unsigned int m_size;
+
+    boost::mutex m_loop_mutex; ///< Held by the caller of parallel_for
+
+    boost::mutex m_mutex; ///< Guards everything below
+    boost::condition_variable m_work_ready;
+    boost::condition_variable m_work_done;
+    const boost::function<void (unsigned int)>* m_job;
+    unsigned int m_count;
+    unsigned int m_next; ///< Next iteration to give a thread
+    unsigned int m_unfinished; ///< Iterations not yet returned
+    bool m_stopping;
+};
+
+}
+
+#endif
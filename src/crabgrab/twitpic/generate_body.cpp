@@ -31,41 +31,82 @@
 
 #include "crabgrab/twitpic/generate_body.hpp"
 
-#include <sstream>
-
 namespace crabgrab {
 namespace twitpic {
 
+namespace {
+
+    const char crlf[] = "\r\n";
+
+    const char username_disposition[] =
+        "Content-Disposition: form-data; name=\"username\"";
+    const char password_disposition[] =
+        "Content-Disposition: form-data; name=\"password\"";
+    const char media_disposition[] =
+        "Content-Disposition: form-data; name=\"media\"; "
+        "filename=\"dummyfile.jpg\"";
+    const char media_type[] = "Content-Type: application/octet-stream";
+
+    /**
+     * Length of a string literal excluding its terminator.
+     */
+    template<size_t N>
+    size_t literal_size(const char (&)[N])
+    {
+        return N - 1;
+    }
+}
+
+std::string generate_body(
+    const std::string& username, const std::string& password,
+    const std::string& boundary, const unsigned char* image_bits,
+    size_t image_size)
+{
+    // The image makes up nearly all of the body so work out the exact size
+    // first and build it in a single allocation rather than letting a
+    // stream double its buffer repeatedly
+    size_t delimiter_size = 2 + boundary.size() + 2;
+    size_t body_size =
+        3 * delimiter_size +
+        literal_size(username_disposition) + 4 + username.size() + 2 +
+        literal_size(password_disposition) + 4 + password.size() + 2 +
+        literal_size(media_disposition) + 2 + literal_size(media_type) + 4 +
+        image_size + 2 +
+        2 + boundary.size() + 2 + 2 + 2;
+
+    std::string body;
+    body.reserve(body_size);
+
+    body.append("--").append(boundary).append(crlf);
+    body.append(username_disposition).append(crlf);
+    body.append(crlf);
+    body.append(username).append(crlf);
+
+    body.append("--").append(boundary).append(crlf);
+    body.append(password_disposition).append(crlf);
+    body.append(crlf);
+    body.append(password).append(crlf);
+
+    body.append("--").append(boundary).append(crlf);
+    body.append(media_disposition).append(crlf);
+    body.append(media_type).append(crlf);
+    body.append(crlf);
+    body.append(reinterpret_cast<const char*>(image_bits), image_size);
+    body.append(crlf);
+
+    body.append("--").append(boundary).append("--").append(crlf);
+    body.append(crlf);
+
+    return body;
+}
+
 std::string generate_body(
     const std::string& username, const std::string& password,
     const std::string& boundary, const std::vector<unsigned char>& image_bits)
 {
-    std::ostringstream body_data(std::ios_base::binary);
-    std::string crlf = "\r\n";
-
-    body_data << "--" + boundary << crlf;
-    body_data << "Content-Disposition: form-data; name=\"username\"" << crlf;
-    body_data << crlf;
-    body_data << username << crlf;
-
-    body_data << "--" + boundary << crlf;
-    body_data << "Content-Disposition: form-data; name=\"password\"" << crlf;
-    body_data << crlf;
-    body_data << password << crlf;
-
-    body_data << "--" + boundary << crlf;
-    body_data << "Content-Disposition: form-data; name=\"media\"; "
-        "filename=\"dummyfile.jpg\"" << crlf;
-    body_data << "Content-Type: application/octet-stream" << crlf;
-    body_data << crlf;
-    body_data.write(
-        reinterpret_cast<const char*>(&image_bits[0]), image_bits.size());
-    body_data << crlf;
-
-    body_data << "--" + boundary + "--" << crlf;
-    body_data << crlf;
-
-    return body_data.str();
+    return generate_body(
+        username, password, boundary,
+        (image_bits.empty()) ? NULL : &image_bits[0], image_bits.size());
 }
 
 }}
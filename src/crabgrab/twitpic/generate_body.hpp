@@ -32,12 +32,23 @@
 #ifndef CRABGRAB_GENERATE_BODY_HPP
 #define CRABGRAB_GENERATE_BODY_HPP
 
+#include <cstddef> // size_t
 #include <string>
 #include <vector>
 
 namespace crabgrab {
 namespace twitpic {
 
+/**
+ * Multipart form body for a TwitPic upload.
+ *
+ * The image is copied straight from wherever it is into the body.
+ */
+std::string generate_body(
+    const std::string& username, const std::string& password,
+    const std::string& boundary, const unsigned char* image_bits,
+    std::size_t image_size);
+
 std::string generate_body(
     const std::string& username, const std::string& password,
     const std::string& boundary, const std::vector<unsigned char>& image_bits);
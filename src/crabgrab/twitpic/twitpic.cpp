@@ -44,7 +44,7 @@ namespace twitpic {
 
 std::string upload_image(
     const std::string& username, const std::string& password,
-    const std::vector<unsigned char>& image_bits)
+    const unsigned char* image_bits, size_t image_size)
 {
     urdl::istream is;
     
@@ -57,8 +57,8 @@ std::string upload_image(
             "multipart/form-data; boundary=" + boundary));
     is.set_option(urdl::http::user_agent("crabgrab"));
 
-    std::string form_body = generate_body
-        (username, password, boundary, image_bits);
+    std::string form_body = generate_body(
+        username, password, boundary, image_bits, image_size);
 
     is.set_option(urdl::http::request_content(form_body));
 
@@ -79,4 +79,13 @@ std::string upload_image(
     return response.str();
 }
 
+std::string upload_image(
+    const std::string& username, const std::string& password,
+    const std::vector<unsigned char>& image_bits)
+{
+    return upload_image(
+        username, password, (image_bits.empty()) ? NULL : &image_bits[0],
+        image_bits.size());
+}
+
 }}
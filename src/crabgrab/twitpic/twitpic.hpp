@@ -32,12 +32,17 @@
 #ifndef CRAB_TWITPIC_HPP
 #define CRAB_TWITPIC_HPP
 
+#include <cstddef> // size_t
 #include <string>
 #include <vector>
 
 namespace crabgrab {
 namespace twitpic {
 
+std::string upload_image(
+    const std::string& username, const std::string& password,
+    const unsigned char* image_bits, std::size_t image_size);
+
 std::string upload_image(
     const std::string& username, const std::string& password,
     const std::vector<unsigned char>& image_bits);
@@ -0,0 +1,219 @@
+/**
+    @file
+
+    Tests for grab-lifetime arena allocation.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/arena.hpp" // test subject
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstring> // memset, memcmp
+#include <vector>
+
+using crabgrab::arena;
+using crabgrab::arena_allocator;
+using crabgrab::arena_scope;
+using crabgrab::arena_statistics;
+using crabgrab::allocate_scoped;
+using crabgrab::free_scoped;
+using crabgrab::heap_scope;
+using crabgrab::reallocate_scoped;
+
+using std::vector;
+
+BOOST_AUTO_TEST_SUITE(arena_tests)
+
+/**
+ * Small blocks are carved one after another out of the same chunk.
+ */
+BOOST_AUTO_TEST_CASE( allocate_from_one_chunk )
+{
+    arena memory(4096);
+
+    unsigned char* a = static_cast<unsigned char*>(memory.allocate(10));
+    unsigned char* b = static_cast<unsigned char*>(memory.allocate(10));
+    BOOST_REQUIRE(a);
+    BOOST_REQUIRE(b);
+    BOOST_CHECK(b > a);
+    BOOST_CHECK_EQUAL(memory.statistics().chunks, 1U);
+
+    BOOST_CHECK_EQUAL(arena::owner(a), &memory);
+}
+
+/**
+ * The last block allocated grows without moving and keeps its contents.
+ */
+BOOST_AUTO_TEST_CASE( grow_last_block_in_place )
+{
+    arena memory(4096);
+
+    unsigned char* block = static_cast<unsigned char*>(memory.allocate(16));
+    std::memset(block, 0xAB, 16);
+
+    unsigned char* grown =
+        static_cast<unsigned char*>(memory.reallocate(block, 200));
+    BOOST_CHECK_EQUAL(grown, block);
+    for (int i = 0; i < 16; ++i)
+        BOOST_CHECK_EQUAL(grown[i], 0xAB);
+}
+
+/**
+ * A block that isn't last moves when it grows, taking its contents along.
+ */
+BOOST_AUTO_TEST_CASE( grow_earlier_block_moves )
+{
+    arena memory(4096);
+
+    unsigned char* block = static_cast<unsigned char*>(memory.allocate(16));
+    std::memset(block, 0x5A, 16);
+    memory.allocate(16);
+
+    unsigned char* grown =
+        static_cast<unsigned char*>(memory.reallocate(block, 64));
+    BOOST_CHECK(grown != block);
+    for (int i = 0; i < 16; ++i)
+        BOOST_CHECK_EQUAL(grown[i], 0x5A);
+}
+
+/**
+ * Big blocks get their own chunk which goes back to the system as soon as
+ * the block is released.
+ */
+BOOST_AUTO_TEST_CASE( large_block_released_early )
+{
+    arena memory(4096);
+    memory.allocate(10);
+    arena_statistics before = memory.statistics();
+
+    void* big = memory.allocate(100000);
+    BOOST_REQUIRE(big);
+    BOOST_CHECK_EQUAL(memory.statistics().chunks, before.chunks + 1);
+    BOOST_CHECK(memory.statistics().bytes_reserved >= before.bytes_reserved + 100000);
+
+    memory.deallocate(big);
+    BOOST_CHECK_EQUAL(memory.statistics().chunks, before.chunks);
+    BOOST_CHECK_EQUAL(memory.statistics().bytes_reserved, before.bytes_reserved);
+    BOOST_CHECK(memory.statistics().peak_bytes_reserved >= before.bytes_reserved + 100000);
+}
+
+/**
+ * Arenas report their chunks to the process-wide totals and take them back
+ * when destroyed.
+ */
+BOOST_AUTO_TEST_CASE( process_statistics )
+{
+    arena_statistics before = arena::process_statistics();
+    {
+        arena memory(4096);
+        memory.allocate(10);
+        BOOST_CHECK_EQUAL(arena::process_statistics().chunks, before.chunks + 1);
+    }
+    BOOST_CHECK_EQUAL(arena::process_statistics().chunks, before.chunks);
+    BOOST_CHECK_EQUAL(
+        arena::process_statistics().bytes_reserved, before.bytes_reserved);
+}
+
+/**
+ * Scoped allocation uses the innermost arena and falls back to the heap
+ * outside any scope.
+ */
+BOOST_AUTO_TEST_CASE( nested_scopes )
+{
+    arena outer_memory;
+    arena inner_memory;
+
+    BOOST_CHECK(!arena_scope::current());
+
+    void* heap_block = allocate_scoped(8);
+    BOOST_REQUIRE(heap_block);
+    BOOST_CHECK(!arena::owner(heap_block));
+
+    {
+        arena_scope outer(outer_memory);
+        void* a = allocate_scoped(8);
+        BOOST_CHECK_EQUAL(arena::owner(a), &outer_memory);
+
+        {
+            arena_scope inner(inner_memory);
+            BOOST_CHECK_EQUAL(arena_scope::current(), &inner_memory);
+            void* b = allocate_scoped(8);
+            BOOST_CHECK_EQUAL(arena::owner(b), &inner_memory);
+
+            // Freed into whichever arena it came from, not the current one
+            free_scoped(a);
+        }
+
+        BOOST_CHECK_EQUAL(arena_scope::current(), &outer_memory);
+
+        // Heap blocks can be resized and freed while an arena is in scope
+        heap_block = reallocate_scoped(heap_block, 64);
+        BOOST_CHECK(!arena::owner(heap_block));
+        free_scoped(heap_block);
+    }
+
+    BOOST_CHECK(!arena_scope::current());
+}
+
+/**
+ * A heap scope hides any arena around it until it ends.
+ */
+BOOST_AUTO_TEST_CASE( heap_scope_inside_arena_scope )
+{
+    arena memory;
+    arena_scope scope(memory);
+
+    void* block;
+    {
+        heap_scope heap;
+        BOOST_CHECK(!arena_scope::current());
+        block = allocate_scoped(8);
+        BOOST_REQUIRE(block);
+        BOOST_CHECK(!arena::owner(block));
+    }
+
+    BOOST_CHECK_EQUAL(arena_scope::current(), &memory);
+    free_scoped(block);
+}
+
+/**
+ * Standard containers can keep their elements in an arena.
+ */
+BOOST_AUTO_TEST_CASE( vector_in_arena )
+{
+    arena memory;
+
+    vector<int, arena_allocator<int> > values((arena_allocator<int>(memory)));
+    for (int i = 0; i < 10000; ++i)
+        values.push_back(i);
+
+    BOOST_CHECK_EQUAL(values[9999], 9999);
+    BOOST_CHECK_EQUAL(arena::owner(&values[0]), &memory);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
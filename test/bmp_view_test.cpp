@@ -0,0 +1,317 @@
+/**
+    @file
+
+    Unit tests for parsing BMPs in memory.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/bmp_view.hpp" // test subject
+
+#include <boost/filesystem/fstream.hpp> // ofstream
+#include <boost/filesystem/operations.hpp> // remove
+#include <boost/filesystem/path.hpp> // path
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept> // runtime_error, logic_error, out_of_range
+#include <vector>
+
+using crabgrab::bmp_view;
+using crabgrab::image_view;
+using crabgrab::mapped_bmp_file;
+
+namespace channel_order = crabgrab::channel_order;
+
+using boost::filesystem::path;
+using boost::optional;
+
+using std::logic_error;
+using std::out_of_range;
+using std::runtime_error;
+using std::vector;
+
+namespace {
+
+    void put_uint16(vector<unsigned char>& bytes, size_t offset, unsigned int value)
+    {
+        bytes[offset] = value & 0xff;
+        bytes[offset + 1] = (value >> 8) & 0xff;
+    }
+
+    void put_uint32(vector<unsigned char>& bytes, size_t offset, unsigned long value)
+    {
+        put_uint16(bytes, offset, value & 0xffff);
+        put_uint16(bytes, offset + 2, (value >> 16) & 0xffff);
+    }
+
+    /**
+     * BITMAPINFOHEADER followed by room for `extra` bytes of masks or colour
+     * table, and zeroed pixel rows.
+     */
+    vector<unsigned char> make_dib(
+        long width, long height, unsigned int bit_count,
+        unsigned long compression, size_t extra)
+    {
+        size_t row_size = ((width * bit_count + 31) / 32) * 4;
+        size_t rows = (height < 0) ? -height : height;
+
+        vector<unsigned char> dib(40 + extra + row_size * rows);
+        put_uint32(dib, 0, 40);
+        put_uint32(dib, 4, width);
+        put_uint32(dib, 8, height);
+        put_uint16(dib, 12, 1);
+        put_uint16(dib, 14, bit_count);
+        put_uint32(dib, 16, compression);
+        return dib;
+    }
+
+    vector<unsigned char> make_file(const vector<unsigned char>& dib, size_t extra)
+    {
+        vector<unsigned char> file(14);
+        put_uint16(file, 0, 0x4D42);
+        put_uint32(file, 2, 14 + dib.size());
+        put_uint32(file, 10, 14 + 40 + extra);
+        file.insert(file.end(), dib.begin(), dib.end());
+        return file;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(bmp_view_tests)
+
+/**
+ * Bottom-up 24-bit BMPs are viewed in place, not decoded.
+ *
+ * Rows are numbered from the top whatever order they are stored in.
+ */
+BOOST_AUTO_TEST_CASE( view_24bpp_bottom_up )
+{
+    vector<unsigned char> file = make_file(make_dib(3, 2, 24, 0, 0), 0);
+    file[14 + 40] = 0x11; // first byte stored is the bottom row
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_CHECK_EQUAL(bitmap.width(), 3U);
+    BOOST_CHECK_EQUAL(bitmap.height(), 2U);
+    BOOST_CHECK_EQUAL(bitmap.row_size(), 12U);
+    BOOST_CHECK_EQUAL(bitmap.row(1), &file[14 + 40]);
+
+    optional<image_view> view = bitmap.direct_view();
+    BOOST_REQUIRE(view);
+    BOOST_CHECK_EQUAL(view->order, channel_order::bgr);
+    BOOST_CHECK(view->bottom_up);
+    BOOST_CHECK_EQUAL(view->row(1)[0], 0x11);
+}
+
+/**
+ * Top-down 32-bit BMPs view as BGRX because GDI leaves rubbish in the
+ * fourth byte.
+ */
+BOOST_AUTO_TEST_CASE( view_32bpp_top_down )
+{
+    vector<unsigned char> file = make_file(make_dib(2, -2, 32, 0, 0), 0);
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_CHECK(!bitmap.bottom_up());
+    BOOST_CHECK_EQUAL(bitmap.row(0), &file[14 + 40]);
+
+    optional<image_view> view = bitmap.direct_view();
+    BOOST_REQUIRE(view);
+    BOOST_CHECK_EQUAL(view->order, channel_order::bgrx);
+}
+
+/**
+ * 8-bit pixels are looked up in the colour table.
+ */
+BOOST_AUTO_TEST_CASE( decode_8bpp_palette )
+{
+    vector<unsigned char> dib = make_dib(2, 1, 8, 0, 2 * 4);
+    put_uint32(dib, 32, 2); // biClrUsed
+    put_uint32(dib, 40, 0x00102030); // entry 0, BGRX
+    put_uint32(dib, 44, 0x00405060); // entry 1
+    dib[48] = 1;
+    dib[49] = 0;
+    vector<unsigned char> file = make_file(dib, 2 * 4);
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_CHECK(!bitmap.direct_view());
+    BOOST_CHECK_EQUAL(bitmap.colour_count(), 2U);
+
+    unsigned char rgba[8];
+    bitmap.decode_row(0, rgba, channel_order::rgba);
+    unsigned char expected[] = { 0x40, 0x50, 0x60, 0xff, 0x10, 0x20, 0x30, 0xff };
+    BOOST_CHECK_EQUAL_COLLECTIONS(rgba, rgba + 8, expected, expected + 8);
+}
+
+/**
+ * 16-bit BI_BITFIELDS pixels are expanded to 8 bits per channel.
+ */
+BOOST_AUTO_TEST_CASE( decode_565_bitfields )
+{
+    vector<unsigned char> dib = make_dib(2, 1, 16, 3, 3 * 4);
+    put_uint32(dib, 40, 0xf800);
+    put_uint32(dib, 44, 0x07e0);
+    put_uint32(dib, 48, 0x001f);
+    put_uint16(dib, 52, 0xf800); // pure red
+    put_uint16(dib, 54, 0x07ff); // full green and blue
+    vector<unsigned char> file = make_file(dib, 3 * 4);
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+
+    unsigned char rgb[6];
+    bitmap.decode_row(0, rgb, channel_order::rgb);
+    unsigned char expected[] = { 0xff, 0, 0, 0, 0xff, 0xff };
+    BOOST_CHECK_EQUAL_COLLECTIONS(rgb, rgb + 6, expected, expected + 6);
+}
+
+/**
+ * 565 and 555 pixels view directly; the encoder widens them itself.
+ */
+BOOST_AUTO_TEST_CASE( view_16bpp )
+{
+    vector<unsigned char> dib = make_dib(2, 1, 16, 3, 3 * 4);
+    put_uint32(dib, 40, 0xf800);
+    put_uint32(dib, 44, 0x07e0);
+    put_uint32(dib, 48, 0x001f);
+    vector<unsigned char> file = make_file(dib, 3 * 4);
+
+    optional<image_view> view =
+        bmp_view::from_file_bytes(&file[0], file.size()).direct_view();
+    BOOST_REQUIRE(view);
+    BOOST_CHECK_EQUAL(view->order, channel_order::rgb565);
+
+    file = make_file(make_dib(2, 1, 16, 0, 0), 0);
+    view = bmp_view::from_file_bytes(&file[0], file.size()).direct_view();
+    BOOST_REQUIRE(view);
+    BOOST_CHECK_EQUAL(view->order, channel_order::rgb555);
+}
+
+/**
+ * Clipboard DIBs have no file header; the pixels follow the colour table.
+ */
+BOOST_AUTO_TEST_CASE( view_packed_dib )
+{
+    vector<unsigned char> dib = make_dib(9, 1, 1, 0, 2 * 4);
+    put_uint32(dib, 44, 0x00ffffff); // entry 1 is white
+    dib[48] = 0x80; // leftmost pixel set
+    dib[49] = 0x80; // ninth pixel set
+
+    bmp_view bitmap = bmp_view::from_packed_dib(&dib[0], dib.size());
+    BOOST_CHECK_EQUAL(bitmap.row(0), &dib[48]);
+
+    unsigned char rgb[9 * 3];
+    bitmap.decode_row(0, rgb, channel_order::rgb);
+    BOOST_CHECK_EQUAL(rgb[0], 0xff);
+    BOOST_CHECK_EQUAL(rgb[3], 0);
+    BOOST_CHECK_EQUAL(rgb[8 * 3], 0xff);
+}
+
+/**
+ * Pixel data shorter than the header claims must be rejected up front
+ * rather than read past the end later.
+ */
+BOOST_AUTO_TEST_CASE( reject_truncated )
+{
+    vector<unsigned char> file = make_file(make_dib(4, 4, 24, 0, 0), 0);
+    file.resize(file.size() - 1);
+
+    BOOST_CHECK_THROW(
+        bmp_view::from_file_bytes(&file[0], file.size()), runtime_error);
+}
+
+/**
+ * Colour masks with gaps in them, or sharing bits with another channel's,
+ * must be rejected rather than trusted to index lookup tables.
+ */
+BOOST_AUTO_TEST_CASE( reject_malformed_masks )
+{
+    vector<unsigned char> dib = make_dib(2, 1, 32, 3, 3 * 4);
+    put_uint32(dib, 40, 0x00ff00ff); // red has a gap
+    put_uint32(dib, 44, 0x0000ff00);
+    put_uint32(dib, 48, 0x0f000000);
+    vector<unsigned char> file = make_file(dib, 3 * 4);
+
+    BOOST_CHECK_THROW(
+        bmp_view::from_file_bytes(&file[0], file.size()), runtime_error);
+
+    put_uint32(dib, 40, 0x00ff0000);
+    put_uint32(dib, 48, 0x0000ffff); // blue overlaps green
+    file = make_file(dib, 3 * 4);
+
+    BOOST_CHECK_THROW(
+        bmp_view::from_file_bytes(&file[0], file.size()), runtime_error);
+}
+
+/**
+ * The rows of a run-length encoded bitmap can't be found without decoding
+ * it all, so asking for one is an error rather than a pointer into the
+ * compressed bytes.
+ */
+BOOST_AUTO_TEST_CASE( run_length_rows_refused )
+{
+    vector<unsigned char> dib = make_dib(4, 2, 8, 1, 2 * 4);
+    put_uint32(dib, 32, 2); // biClrUsed
+    vector<unsigned char> file = make_file(dib, 2 * 4);
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_REQUIRE(bitmap.is_run_length_encoded());
+    BOOST_CHECK(!bitmap.direct_view());
+    BOOST_CHECK_THROW(bitmap.row(0), logic_error);
+}
+
+/**
+ * Rows past the bottom of the bitmap aren't there to be had.
+ */
+BOOST_AUTO_TEST_CASE( row_out_of_range )
+{
+    vector<unsigned char> file = make_file(make_dib(3, 2, 24, 0, 0), 0);
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_CHECK_THROW(bitmap.row(2), out_of_range);
+}
+
+/**
+ * A BMP file on disk is viewed through a memory mapping.
+ */
+BOOST_AUTO_TEST_CASE( view_mapped_file )
+{
+    vector<unsigned char> file = make_file(make_dib(5, 3, 24, 0, 0), 0);
+    path file_path("bmp_view_test.bmp");
+    {
+        boost::filesystem::ofstream stream(file_path, std::ios::binary);
+        stream.write(reinterpret_cast<const char*>(&file[0]), file.size());
+    }
+
+    {
+        mapped_bmp_file mapped(file_path);
+        bmp_view bitmap = mapped.view();
+        BOOST_CHECK_EQUAL(bitmap.width(), 5U);
+        BOOST_CHECK_EQUAL(bitmap.height(), 3U);
+        BOOST_CHECK(bitmap.direct_view());
+    }
+
+    boost::filesystem::remove(file_path);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,165 @@
+/**
+    @file
+
+    Tests for the recycling buffer pool.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/buffer_pool.hpp" // test subject
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // max
+#include <cstddef> // size_t
+
+using crabgrab::buffer_pool;
+using crabgrab::buffer_pool_statistics;
+using crabgrab::pooled_buffer;
+
+using std::size_t;
+
+namespace {
+
+    /**
+     * Borrowed from the shared pool before main and given back after it,
+     * which the pool has to be built in time for and outlive.
+     */
+    pooled_buffer static_buffer(1024);
+}
+
+BOOST_AUTO_TEST_SUITE(buffer_pool_tests)
+
+/**
+ * Size classes are whole pages and waste at most a quarter of a buffer.
+ */
+BOOST_AUTO_TEST_CASE( size_classes )
+{
+    const size_t page = buffer_pool::page_size;
+
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(0), page);
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(1), page);
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(page + 1), 2 * page);
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(4 * page), 4 * page);
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(4 * page + 1), 5 * page);
+    BOOST_CHECK_EQUAL(buffer_pool::size_class(9 * page), 10 * page);
+
+    for (size_t size = 1; size < 64 * 1024 * 1024; size = size * 3 + 7)
+    {
+        size_t rounded = buffer_pool::size_class(size);
+        BOOST_CHECK(rounded >= size);
+        BOOST_CHECK_EQUAL(rounded % page, 0U);
+        BOOST_CHECK(rounded - size <= std::max(page, rounded / 4));
+        BOOST_CHECK_EQUAL(buffer_pool::size_class(rounded), rounded);
+    }
+}
+
+/**
+ * A returned buffer is lent out again for a request of the same class.
+ */
+BOOST_AUTO_TEST_CASE( reuse )
+{
+    buffer_pool pool;
+
+    size_t capacity;
+    void* first = pool.acquire(1920 * 1080 * 4, capacity);
+    BOOST_REQUIRE(first);
+    BOOST_CHECK_EQUAL(
+        reinterpret_cast<size_t>(first) % buffer_pool::page_size, 0U);
+    pool.release(first, capacity);
+
+    void* second = pool.acquire(1920 * 1080 * 4 - 100, capacity);
+    BOOST_CHECK_EQUAL(second, first);
+
+    buffer_pool_statistics statistics = pool.statistics();
+    BOOST_CHECK_EQUAL(statistics.misses, 1U);
+    BOOST_CHECK_EQUAL(statistics.hits, 1U);
+    BOOST_CHECK_EQUAL(statistics.lent_buffers, 1U);
+    BOOST_CHECK_EQUAL(statistics.lent_bytes, capacity);
+    BOOST_CHECK_EQUAL(statistics.cached_buffers, 0U);
+
+    pool.release(second, capacity);
+}
+
+/**
+ * Returned buffers that would take the idle total over the cap are freed.
+ */
+BOOST_AUTO_TEST_CASE( cache_limit )
+{
+    const size_t page = buffer_pool::page_size;
+    buffer_pool pool(3 * page);
+
+    size_t small_capacity;
+    size_t large_capacity;
+    void* small = pool.acquire(page, small_capacity);
+    void* large = pool.acquire(4 * page, large_capacity);
+
+    pool.release(small, small_capacity);
+    pool.release(large, large_capacity);
+
+    buffer_pool_statistics statistics = pool.statistics();
+    BOOST_CHECK_EQUAL(statistics.cached_buffers, 1U);
+    BOOST_CHECK_EQUAL(statistics.cached_bytes, page);
+    BOOST_CHECK_EQUAL(statistics.lent_buffers, 0U);
+
+    pool.cache_limit(0);
+    BOOST_CHECK_EQUAL(pool.statistics().cached_buffers, 0U);
+    BOOST_CHECK_EQUAL(pool.statistics().cached_bytes, 0U);
+}
+
+/**
+ * pooled_buffer borrows for its lifetime.
+ */
+BOOST_AUTO_TEST_CASE( scoped_buffer )
+{
+    buffer_pool pool;
+
+    {
+        pooled_buffer buffer(10000, pool);
+        BOOST_CHECK_EQUAL(buffer.size(), 10000U);
+        BOOST_CHECK(buffer.capacity() >= 10000U);
+        buffer.data()[9999] = 42;
+        BOOST_CHECK_EQUAL(pool.statistics().lent_buffers, 1U);
+    }
+
+    BOOST_CHECK_EQUAL(pool.statistics().lent_buffers, 0U);
+    BOOST_CHECK_EQUAL(pool.statistics().cached_buffers, 1U);
+
+    pool.trim();
+    BOOST_CHECK_EQUAL(pool.statistics().cached_buffers, 0U);
+}
+
+/**
+ * A buffer borrowed during static initialisation works like any other.
+ */
+BOOST_AUTO_TEST_CASE( static_buffer_from_shared_pool )
+{
+    BOOST_REQUIRE(static_buffer.data());
+    BOOST_CHECK_EQUAL(static_buffer.size(), 1024U);
+    BOOST_CHECK_GE(buffer_pool::shared().statistics().lent_buffers, 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
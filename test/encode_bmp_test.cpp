@@ -0,0 +1,667 @@
+/**
+    @file
+
+    Unit tests for PNG encoding.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/encode_bmp.hpp" // test subject
+
+#include "crabgrab/arena.hpp" // arena
+#include "crabgrab/encoder_context.hpp" // encoder_context
+#include "crabgrab/thread_pool.hpp" // thread_pool
+
+#include <LodePNG/lodepng.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock,
+                                                           // seconds
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // copy
+#include <cstddef> // size_t
+#include <stdexcept> // invalid_argument
+#include <vector>
+
+using crabgrab::arena;
+using crabgrab::bmp_view;
+using crabgrab::encode_as_png;
+using crabgrab::encode_options;
+using crabgrab::encode_smallest_png;
+using crabgrab::encoder_context;
+using crabgrab::image_view;
+using crabgrab::pixel_unpacker;
+using crabgrab::smallest_png;
+using crabgrab::thread_pool;
+
+namespace channel_order = crabgrab::channel_order;
+namespace filter_strategy = crabgrab::filter_strategy;
+namespace match_strategy = crabgrab::match_strategy;
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::seconds;
+
+using std::invalid_argument;
+using std::size_t;
+using std::vector;
+
+namespace {
+
+    const unsigned int width = 97;
+    const unsigned int height = 61;
+
+    /**
+     * Opaque RGBA pixels with enough repetition for the match finder to
+     * have something to do, and enough variety that it has to look for it.
+     */
+    vector<unsigned char> test_pixels()
+    {
+        vector<unsigned char> pixels(width * height * 4);
+        for (unsigned int y = 0; y < height; ++y)
+        {
+            for (unsigned int x = 0; x < width; ++x)
+            {
+                unsigned char* pixel = &pixels[(y * width + x) * 4];
+                pixel[0] = static_cast<unsigned char>((x / 5) * 40);
+                pixel[1] = static_cast<unsigned char>((x * y) % 7);
+                pixel[2] = static_cast<unsigned char>((y / 3) * 17);
+                pixel[3] = 255;
+            }
+        }
+
+        return pixels;
+    }
+
+    image_view view_of(const vector<unsigned char>& pixels)
+    {
+        return image_view(
+            &pixels[0], width, height, width * 4, channel_order::rgba, false);
+    }
+
+    /**
+     * Pixels in six colours, two of them translucent.
+     */
+    vector<unsigned char> few_colour_pixels()
+    {
+        const unsigned char colours[6][4] = {
+            { 255, 255, 255, 255 }, { 0, 0, 0, 255 }, { 0, 84, 227, 255 },
+            { 240, 240, 240, 255 }, { 20, 20, 20, 128 }, { 200, 0, 0, 0 } };
+
+        vector<unsigned char> pixels(width * height * 4);
+        for (unsigned int y = 0; y < height; ++y)
+        {
+            for (unsigned int x = 0; x < width; ++x)
+            {
+                const unsigned char* colour = colours[(x / 7 + y / 5) % 6];
+                std::copy(colour, colour + 4, &pixels[(y * width + x) * 4]);
+            }
+        }
+
+        return pixels;
+    }
+
+    unsigned int colour_type(const vector<unsigned char>& png)
+    {
+        LodePNG::Decoder decoder;
+        decoder.inspect(png);
+        BOOST_REQUIRE(!decoder.hasError());
+        return decoder.getInfoPng().color.colorType;
+    }
+
+    vector<unsigned char> decode(const vector<unsigned char>& png)
+    {
+        LodePNG::Decoder decoder;
+        vector<unsigned char> pixels;
+        decoder.decode(pixels, png);
+        BOOST_REQUIRE(!decoder.hasError());
+        return pixels;
+    }
+
+    /**
+     * The filtered scanlines a PNG's IDAT chunks inflate to.
+     */
+    vector<unsigned char> scanlines(const vector<unsigned char>& png)
+    {
+        vector<unsigned char> idat;
+        const unsigned char* chunk = &png[8];
+        while (chunk < &png[0] + png.size())
+        {
+            if (LodePNG_chunk_type_equals(chunk, "IDAT"))
+            {
+                const unsigned char* data = LodePNG_chunk_data_const(chunk);
+                idat.insert(
+                    idat.end(), data, data + LodePNG_chunk_length(chunk));
+            }
+            chunk = LodePNG_chunk_next_const(chunk);
+        }
+
+        vector<unsigned char> inflated;
+        BOOST_REQUIRE_EQUAL(LodeZlib::decompress(inflated, idat), 0U);
+        return inflated;
+    }
+
+    void put_uint32(vector<unsigned char>& bytes, size_t offset, unsigned long value)
+    {
+        for (size_t i = 0; i < 4; ++i)
+        {
+            bytes[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    }
+
+    /**
+     * A bottom-up BMP file of `bit_count`-bit indices whose colour table has
+     * only `colour_count` entries.
+     *
+     * Every index the bit depth allows is used, so some pixels point past
+     * the end of the table.  The table's fourth bytes are rubbish, as GDI's
+     * can be.
+     */
+    vector<unsigned char> indexed_bmp(
+        unsigned int bmp_width, unsigned int bmp_height,
+        unsigned int bit_count, unsigned int colour_count)
+    {
+        const size_t row_size = ((bmp_width * bit_count + 31) / 32) * 4;
+        const size_t offset = 14 + 40 + colour_count * 4;
+
+        vector<unsigned char> file(offset + row_size * bmp_height);
+        file[0] = 'B';
+        file[1] = 'M';
+        put_uint32(file, 2, file.size());
+        put_uint32(file, 10, offset);
+        put_uint32(file, 14, 40);
+        put_uint32(file, 18, bmp_width);
+        put_uint32(file, 22, bmp_height);
+        put_uint32(file, 26, 1 | (bit_count << 16)); // biPlanes, biBitCount
+        put_uint32(file, 46, colour_count); // biClrUsed
+
+        for (unsigned int i = 0; i < colour_count; ++i)
+        {
+            unsigned char* entry = &file[14 + 40 + i * 4];
+            entry[0] = static_cast<unsigned char>(10 + i * 40);
+            entry[1] = static_cast<unsigned char>(20 + i * 30);
+            entry[2] = static_cast<unsigned char>(255 - i * 50);
+            entry[3] = 0xab;
+        }
+
+        const unsigned int index_count = 1U << bit_count;
+        const unsigned int per_byte = 8 / bit_count;
+        for (unsigned int y = 0; y < bmp_height; ++y)
+        {
+            unsigned char* row = &file[offset + y * row_size];
+            for (unsigned int x = 0; x < bmp_width; ++x)
+            {
+                unsigned int index = (x + 3 * y) % index_count;
+                unsigned int shift = 8 - bit_count * (x % per_byte + 1);
+                row[x / per_byte] |=
+                    static_cast<unsigned char>(index << shift);
+            }
+        }
+
+        return file;
+    }
+
+    /**
+     * Check an indexed bitmap becomes a palette PNG at its own bit depth,
+     * with its colour table as the palette, padded with opaque black to
+     * a full 2^bits entries, and decodes to the pixels bmp_view unpacks.
+     */
+    void check_indexed_round_trip(const vector<unsigned char>& file)
+    {
+        bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+        const size_t palette_size = size_t(1) << bitmap.bit_count();
+        BOOST_REQUIRE_LT(bitmap.colour_count(), palette_size);
+
+        vector<unsigned char> png = encode_as_png(file);
+
+        LodePNG::Decoder decoder;
+        vector<unsigned char> decoded;
+        decoder.decode(decoded, png);
+        BOOST_REQUIRE(!decoder.hasError());
+        const LodePNG_InfoColor& info = decoder.getInfoPng().color;
+        BOOST_CHECK_EQUAL(info.colorType, 3U);
+        BOOST_CHECK_EQUAL(info.bitDepth, bitmap.bit_count());
+        BOOST_REQUIRE_EQUAL(info.palettesize, palette_size);
+
+        for (size_t i = 0; i < palette_size; ++i)
+        {
+            const unsigned char* entry = &info.palette[i * 4];
+            if (i < bitmap.colour_count())
+            {
+                const unsigned char* bgrx = bitmap.colour_table() + i * 4;
+                BOOST_CHECK_EQUAL(entry[0], bgrx[2]);
+                BOOST_CHECK_EQUAL(entry[1], bgrx[1]);
+                BOOST_CHECK_EQUAL(entry[2], bgrx[0]);
+            }
+            else
+            {
+                BOOST_CHECK_EQUAL(entry[0], 0);
+                BOOST_CHECK_EQUAL(entry[1], 0);
+                BOOST_CHECK_EQUAL(entry[2], 0);
+            }
+            BOOST_CHECK_EQUAL(entry[3], 255);
+        }
+
+        BOOST_REQUIRE_EQUAL(
+            decoded.size(), bitmap.width() * bitmap.height() * 4);
+
+        pixel_unpacker unpack = bitmap.unpacker(channel_order::rgba);
+        vector<unsigned char> expected(bitmap.width() * 4);
+        for (unsigned int y = 0; y < bitmap.height(); ++y)
+        {
+            unpack(bitmap.row(y), &expected[0], bitmap.width());
+            const unsigned char* row = &decoded[y * bitmap.width() * 4];
+            BOOST_CHECK_EQUAL_COLLECTIONS(
+                row, row + expected.size(), expected.begin(), expected.end());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(encode_bmp_tests)
+
+/**
+ * Every compression level gives back the same pixels.
+ */
+BOOST_AUTO_TEST_CASE( every_level_round_trips )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    for (unsigned int level = 1; level <= 9; ++level)
+    {
+        vector<unsigned char> png =
+            encode_as_png(view_of(pixels), encode_options(level));
+        vector<unsigned char> decoded = decode(png);
+
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+    }
+}
+
+/**
+ * Every way of choosing the rows' filters gives back the same pixels, with
+ * rows repeated and rows of one colour for the screen strategies to spot.
+ */
+BOOST_AUTO_TEST_CASE( every_filter_strategy_round_trips )
+{
+    vector<unsigned char> pixels = test_pixels();
+    size_t row = width * 4;
+    for (unsigned int y = 10; y < 20; ++y)
+        std::copy(&pixels[9 * row], &pixels[10 * row], &pixels[y * row]);
+    for (size_t i = 30 * row; i < 35 * row; ++i)
+        pixels[i] = (i % 4 == 3) ? 255 : 90;
+
+    filter_strategy::type filters[] = {
+        filter_strategy::minimum_sum, filter_strategy::entropy,
+        filter_strategy::screen, filter_strategy::screen_hybrid };
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i)
+    {
+        encode_options options;
+        options.filter = filters[i];
+        vector<unsigned char> decoded =
+            decode(encode_as_png(view_of(pixels), options));
+
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+    }
+}
+
+/**
+ * Spending more effort doesn't give a bigger file.
+ */
+BOOST_AUTO_TEST_CASE( best_level_no_bigger_than_fastest )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    size_t fastest = encode_as_png(view_of(pixels), encode_options(1)).size();
+    size_t best = encode_as_png(view_of(pixels), encode_options(9)).size();
+
+    BOOST_CHECK_LE(best, fastest);
+}
+
+/**
+ * Matching only runs still gives back the same pixels.
+ */
+BOOST_AUTO_TEST_CASE( run_length_round_trips )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    vector<unsigned char> png = encode_as_png(
+        view_of(pixels),
+        encode_options(6, match_strategy::run_length));
+    vector<unsigned char> decoded = decode(png);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+}
+
+/**
+ * The fast modes for the hotkey path, fixed codes and no matching at all,
+ * still give back the same pixels.
+ */
+BOOST_AUTO_TEST_CASE( fast_modes_round_trip )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    encode_options fixed(1, match_strategy::run_length);
+    fixed.fixed_codes = true;
+    encode_options huffman_only(1, match_strategy::huffman_only);
+    encode_options fixed_huffman_only(1, match_strategy::huffman_only);
+    fixed_huffman_only.fixed_codes = true;
+
+    encode_options modes[] = { fixed, huffman_only, fixed_huffman_only };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+    {
+        vector<unsigned char> decoded =
+            decode(encode_as_png(view_of(pixels), modes[i]));
+
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+    }
+}
+
+/**
+ * Optimal parsing gives back the same pixels, in a PNG no bigger than the
+ * best level manages.
+ */
+BOOST_AUTO_TEST_CASE( optimal_parsing_round_trips )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    vector<unsigned char> png = encode_as_png(
+        view_of(pixels), encode_options(9, match_strategy::optimal_parsing));
+    vector<unsigned char> decoded = decode(png);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+    BOOST_CHECK_LE(
+        png.size(), encode_as_png(view_of(pixels), encode_options(9)).size());
+}
+
+BOOST_AUTO_TEST_CASE( level_out_of_range )
+{
+    vector<unsigned char> pixels = test_pixels();
+
+    BOOST_CHECK_THROW(
+        encode_as_png(view_of(pixels), encode_options(0)), invalid_argument);
+    BOOST_CHECK_THROW(
+        encode_as_png(view_of(pixels), encode_options(10)), invalid_argument);
+}
+
+/**
+ * A reused context gives the same PNG as fresh working memory, even once it
+ * has outlived the arena it was first used in.
+ */
+BOOST_AUTO_TEST_CASE( context_reuse )
+{
+    vector<unsigned char> pixels = test_pixels();
+    vector<unsigned char> expected = encode_as_png(view_of(pixels));
+
+    encoder_context context;
+    encode_options options;
+    options.context = &context;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        arena memory;
+        vector<unsigned char> png =
+            encode_as_png(view_of(pixels), memory, options);
+
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            png.begin(), png.end(), expected.begin(), expected.end());
+    }
+}
+
+/**
+ * Deflating on several threads gives back the same pixels, in the same PNG
+ * whatever the number of threads, and with or without a context.
+ *
+ * The image has to span several of the encoder's bands to be split at all.
+ */
+BOOST_AUTO_TEST_CASE( parallel_deflate )
+{
+    const unsigned int big_width = 640;
+    const unsigned int big_height = 480;
+    vector<unsigned char> pixels(big_width * big_height * 4);
+    for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = (i % 4 == 3) ?
+            255 : static_cast<unsigned char>((i / 4) % 251 + (i / 9000) * 3);
+    image_view view(
+        &pixels[0], big_width, big_height, big_width * 4, channel_order::rgba,
+        false);
+
+    thread_pool pair(2);
+    encode_options options;
+    options.threads = &pair;
+    vector<unsigned char> expected = encode_as_png(view, options);
+
+    LodePNG::Decoder decoder;
+    vector<unsigned char> decoded;
+    decoder.decode(decoded, expected);
+    BOOST_REQUIRE(!decoder.hasError());
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+
+    thread_pool several(5);
+    encoder_context context;
+    options.threads = &several;
+    options.context = &context;
+    for (int i = 0; i < 2; ++i)
+    {
+        vector<unsigned char> png = encode_as_png(view, options);
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            png.begin(), png.end(), expected.begin(), expected.end());
+    }
+}
+
+/**
+ * Filtering bands of rows on several threads picks the same filter for every
+ * row as filtering them one after the other.
+ */
+BOOST_AUTO_TEST_CASE( parallel_filtering )
+{
+    const unsigned int big_width = 512;
+    const unsigned int big_height = 400;
+    vector<unsigned char> pixels(big_width * big_height * 4);
+    for (unsigned int y = 0; y < big_height; ++y)
+    {
+        for (unsigned int x = 0; x < big_width; ++x)
+        {
+            // Gradients one way or the other, and noise, so rows differ in
+            // the filter that suits them
+            unsigned char* pixel = &pixels[(y * big_width + x) * 4];
+            unsigned int kind = (y / 7) % 3;
+            pixel[0] = static_cast<unsigned char>(
+                (kind == 0) ? x : (kind == 1) ? y * 3 : (x * 7919) ^ y);
+            pixel[1] = static_cast<unsigned char>(x + y);
+            pixel[2] = static_cast<unsigned char>((x / 16) * 9);
+            pixel[3] = 255;
+        }
+    }
+    image_view view(
+        &pixels[0], big_width, big_height, big_width * 4, channel_order::rgba,
+        false);
+
+    encode_options options;
+    vector<unsigned char> expected = scanlines(encode_as_png(view, options));
+
+    thread_pool several(3);
+    options.threads = &several;
+    vector<unsigned char> filtered = scanlines(encode_as_png(view, options));
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        filtered.begin(), filtered.end(), expected.begin(), expected.end());
+}
+
+/**
+ * An image of few colours becomes a palette PNG of the same pixels,
+ * translucent ones included.
+ */
+BOOST_AUTO_TEST_CASE( palette )
+{
+    vector<unsigned char> pixels = few_colour_pixels();
+    encode_options options;
+    options.palette = true;
+
+    vector<unsigned char> png = encode_as_png(view_of(pixels), options);
+    BOOST_CHECK_EQUAL(colour_type(png), 3U);
+
+    vector<unsigned char> decoded = decode(png);
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+}
+
+/**
+ * An image of more colours than a palette holds is encoded as truecolour
+ * even if a palette is asked for.
+ */
+BOOST_AUTO_TEST_CASE( palette_too_many_colours )
+{
+    vector<unsigned char> pixels = test_pixels();
+    encode_options options;
+    options.palette = true;
+
+    vector<unsigned char> png = encode_as_png(view_of(pixels), options);
+    BOOST_CHECK_EQUAL(colour_type(png), 2U);
+
+    vector<unsigned char> decoded = decode(png);
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+}
+
+/**
+ * A 1-bit bitmap with a one-colour table becomes a two-colour palette PNG,
+ * its last byte of each row only part filled.
+ */
+BOOST_AUTO_TEST_CASE( indexed_1bpp_round_trips )
+{
+    check_indexed_round_trip(indexed_bmp(13, 3, 1, 1));
+}
+
+/**
+ * A 4-bit bitmap with a five-colour table becomes a sixteen-colour palette
+ * PNG, its odd width leaving a spare nibble at the end of each row.
+ */
+BOOST_AUTO_TEST_CASE( indexed_4bpp_round_trips )
+{
+    check_indexed_round_trip(indexed_bmp(7, 4, 4, 5));
+}
+
+/**
+ * A run-length encoded bitmap is refused cleanly rather than having its
+ * compressed bytes read as rows, far past the end of them.
+ */
+BOOST_AUTO_TEST_CASE( run_length_bitmap_rejected )
+{
+    // Two rows of 64 pixels in eight bytes: a run of index 1, then a run
+    // of index 0
+    const unsigned char rle8[] = { 64, 1, 0, 0, 64, 0, 0, 1 };
+    const size_t offset = 14 + 40 + 2 * 4;
+
+    vector<unsigned char> uncompressed = indexed_bmp(64, 2, 8, 2);
+    vector<unsigned char> file(offset + sizeof(rle8));
+    std::copy(
+        uncompressed.begin(), uncompressed.begin() + offset, file.begin());
+    std::copy(rle8, rle8 + sizeof(rle8), file.begin() + offset);
+    put_uint32(file, 2, file.size());
+    put_uint32(file, 30, 1); // BI_RLE8
+
+    bmp_view bitmap = bmp_view::from_file_bytes(&file[0], file.size());
+    BOOST_REQUIRE(bitmap.is_run_length_encoded());
+    BOOST_CHECK_THROW(encode_as_png(bitmap), invalid_argument);
+}
+
+/**
+ * An encode past its deadline gives up and returns nothing.
+ */
+BOOST_AUTO_TEST_CASE( deadline_passed )
+{
+    vector<unsigned char> pixels = test_pixels();
+    encode_options options;
+    options.deadline = microsec_clock::universal_time() - seconds(1);
+
+    BOOST_CHECK(encode_as_png(view_of(pixels), options).empty());
+}
+
+/**
+ * Racing candidates gives the PNG of whichever makes the smallest.
+ */
+BOOST_AUTO_TEST_CASE( smallest_png_wins )
+{
+    vector<unsigned char> pixels = few_colour_pixels();
+    vector<encode_options> candidates;
+    candidates.push_back(encode_options(1, match_strategy::huffman_only));
+    candidates.push_back(encode_options(6));
+    candidates.push_back(encode_options(6));
+    candidates.back().palette = true;
+
+    thread_pool pair(2);
+    smallest_png smallest = encode_smallest_png(
+        view_of(pixels), candidates, pair, seconds(60));
+
+    BOOST_CHECK_EQUAL(smallest.winner, 2U);
+    vector<unsigned char> expected =
+        encode_as_png(view_of(pixels), candidates[2]);
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        smallest.png.begin(), smallest.png.end(), expected.begin(),
+        expected.end());
+}
+
+/**
+ * The first candidate finishes even when there is no time for any of them,
+ * so there is always a PNG.
+ */
+BOOST_AUTO_TEST_CASE( first_candidate_always_finishes )
+{
+    vector<unsigned char> pixels = test_pixels();
+    vector<encode_options> candidates;
+    candidates.push_back(encode_options(1, match_strategy::run_length));
+    candidates.push_back(encode_options(9));
+
+    thread_pool pair(2);
+    smallest_png smallest = encode_smallest_png(
+        view_of(pixels), candidates, pair, seconds(0));
+
+    BOOST_CHECK_EQUAL(smallest.winner, 0U);
+    vector<unsigned char> decoded = decode(smallest.png);
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        decoded.begin(), decoded.end(), pixels.begin(), pixels.end());
+}
+
+/**
+ * An invalid candidate fails the race as it would fail on its own.
+ */
+BOOST_AUTO_TEST_CASE( invalid_candidate )
+{
+    vector<unsigned char> pixels = test_pixels();
+    vector<encode_options> candidates;
+    candidates.push_back(encode_options(1));
+    candidates.push_back(encode_options(12));
+
+    thread_pool pair(2);
+    BOOST_CHECK_THROW(
+        encode_smallest_png(view_of(pixels), candidates, pair, seconds(60)),
+        invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,233 @@
+/**
+    @file
+
+    Unit tests for the pixel format unpackers.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/pixel_unpack.hpp" // test subject
+
+#include <boost/cstdint.hpp> // uint32_t
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib> // rand, abs
+#include <vector>
+
+using crabgrab::pixel_unpacker;
+
+namespace channel_order = crabgrab::channel_order;
+
+using boost::uint32_t;
+
+using std::vector;
+
+namespace {
+
+    /**
+     * The obvious, slow way to expand a channel: scale to 0-255 and round.
+     * Bit replication gets within one of it.
+     */
+    int reference_channel(uint32_t pixel, uint32_t mask, int absent)
+    {
+        if (mask == 0)
+            return absent;
+
+        unsigned int shift = 0;
+        while (!(mask & (1U << shift)))
+            ++shift;
+        double maximum = static_cast<double>(mask >> shift);
+        return static_cast<int>(((pixel & mask) >> shift) * 255.0 / maximum + 0.5);
+    }
+
+    /**
+     * Unpack random pixels of the given masks and check every channel of
+     * every pixel.
+     *
+     * Odd widths make sure the vector kernels' tails get exercised.
+     */
+    void check_bitfields(
+        unsigned int bit_count, uint32_t red, uint32_t green, uint32_t blue,
+        uint32_t alpha)
+    {
+        const size_t width = 37;
+        size_t bytes = bit_count / 8;
+
+        vector<unsigned char> in(width * bytes);
+        for (size_t i = 0; i < in.size(); ++i)
+            in[i] = static_cast<unsigned char>(std::rand());
+
+        vector<unsigned char> out(width * 4);
+        pixel_unpacker::bitfields(
+            bit_count, red, green, blue, alpha, channel_order::rgba)(
+            &in[0], &out[0], width);
+
+        for (size_t x = 0; x < width; ++x)
+        {
+            uint32_t pixel = 0;
+            for (size_t b = 0; b < bytes; ++b)
+                pixel |= static_cast<uint32_t>(in[x * bytes + b]) << (8 * b);
+
+            int expected[] = {
+                reference_channel(pixel, red, 0),
+                reference_channel(pixel, green, 0),
+                reference_channel(pixel, blue, 0),
+                reference_channel(pixel, alpha, 0xff) };
+
+            for (int c = 0; c < 4; ++c)
+            {
+                int difference = out[x * 4 + c] - expected[c];
+                BOOST_CHECK_LE(std::abs(difference), 1);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(pixel_unpack_tests)
+
+BOOST_AUTO_TEST_CASE( unpack_565 )
+{
+    check_bitfields(16, 0xf800, 0x07e0, 0x001f, 0);
+}
+
+BOOST_AUTO_TEST_CASE( unpack_555 )
+{
+    check_bitfields(16, 0x7c00, 0x03e0, 0x001f, 0);
+}
+
+BOOST_AUTO_TEST_CASE( unpack_1555 )
+{
+    check_bitfields(16, 0x7c00, 0x03e0, 0x001f, 0x8000);
+}
+
+/**
+ * 16-bit masks we have no specialised kernel for.
+ */
+BOOST_AUTO_TEST_CASE( unpack_4444 )
+{
+    check_bitfields(16, 0x0f00, 0x00f0, 0x000f, 0xf000);
+}
+
+BOOST_AUTO_TEST_CASE( unpack_8888 )
+{
+    check_bitfields(32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+}
+
+BOOST_AUTO_TEST_CASE( unpack_x888 )
+{
+    check_bitfields(32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+}
+
+BOOST_AUTO_TEST_CASE( unpack_8888_red_low )
+{
+    check_bitfields(32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+}
+
+/**
+ * Channels wider than 8 bits keep their top 8 bits.
+ */
+BOOST_AUTO_TEST_CASE( unpack_2_10_10_10 )
+{
+    check_bitfields(32, 0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000);
+}
+
+/**
+ * Masks with gaps in them, which bmp_view refuses but which may still come
+ * from elsewhere, are cut down to the 8 bits above their lowest set bit
+ * rather than looking up channel values far past the end of the table.
+ */
+BOOST_AUTO_TEST_CASE( unpack_non_contiguous_masks )
+{
+    const size_t width = 37;
+
+    vector<unsigned char> in(width * 4);
+    for (size_t i = 0; i < in.size(); ++i)
+        in[i] = static_cast<unsigned char>(std::rand());
+
+    vector<unsigned char> out(width * 4);
+    pixel_unpacker::bitfields(
+        32, 0x00ff00ff, 0x0000ff00, 0, 0xf0f0f0f0, channel_order::rgba)(
+        &in[0], &out[0], width);
+
+    vector<unsigned char> expected(width * 4);
+    pixel_unpacker::bitfields(
+        32, 0x000000ff, 0x0000ff00, 0, 0x000000f0, channel_order::rgba)(
+        &in[0], &expected[0], width);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        out.begin(), out.end(), expected.begin(), expected.end());
+}
+
+/**
+ * 24-bit pixels are BGR and come out opaque.
+ */
+BOOST_AUTO_TEST_CASE( unpack_888 )
+{
+    unsigned char in[] = { 1, 2, 3, 4, 5, 6 };
+    unsigned char out[8];
+    pixel_unpacker::bitfields(24, 0, 0, 0, 0, channel_order::rgba)(
+        in, out, 2);
+
+    unsigned char expected[] = { 3, 2, 1, 0xff, 6, 5, 4, 0xff };
+    BOOST_CHECK_EQUAL_COLLECTIONS(out, out + 8, expected, expected + 8);
+}
+
+/**
+ * 4-bit indices, high nibble first, including a half-used final byte and an
+ * index past the end of the colour table.
+ */
+BOOST_AUTO_TEST_CASE( unpack_4bpp_indexed )
+{
+    unsigned char colour_table[] = { 10, 20, 30, 0, 40, 50, 60, 0 };
+    unsigned char in[] = { 0x01, 0x1f, 0x10 };
+    unsigned char out[5 * 3];
+    pixel_unpacker::indexed(4, colour_table, 2, channel_order::rgb)(
+        in, out, 5);
+
+    unsigned char expected[] = {
+        30, 20, 10, 60, 50, 40, 60, 50, 40, 0, 0, 0, 60, 50, 40 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(out, out + 15, expected, expected + 15);
+}
+
+/**
+ * 1-bit indices, most significant bit first.
+ */
+BOOST_AUTO_TEST_CASE( unpack_1bpp_indexed )
+{
+    unsigned char colour_table[] = { 0, 0, 0, 0, 255, 255, 255, 0 };
+    unsigned char in[] = { 0xa0, 0x80 };
+    unsigned char out[9 * 4];
+    pixel_unpacker::indexed(1, colour_table, 2, channel_order::rgba)(
+        in, out, 9);
+
+    BOOST_CHECK_EQUAL(out[0], 255);
+    BOOST_CHECK_EQUAL(out[4], 0);
+    BOOST_CHECK_EQUAL(out[8], 255);
+    BOOST_CHECK_EQUAL(out[3], 255);
+    BOOST_CHECK_EQUAL(out[8 * 4], 255);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,289 @@
+/**
+    @file
+
+    Unit tests for the row conversion kernels.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/row_conversion.hpp" // test subject
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // fill
+#include <cstddef> // size_t
+#include <cstdlib> // rand
+#include <vector>
+
+using crabgrab::best_instruction_set;
+using crabgrab::bytes_per_pixel;
+using crabgrab::convert_image;
+using crabgrab::convert_row;
+using crabgrab::image_view;
+using crabgrab::row_converter;
+
+namespace channel_order = crabgrab::channel_order;
+namespace instruction_set = crabgrab::instruction_set;
+
+using std::size_t;
+using std::vector;
+
+namespace {
+
+    /**
+     * Every possible 16-bit pixel, as little-endian words.
+     */
+    vector<unsigned char> every_16_bit_pixel()
+    {
+        vector<unsigned char> pixels(65536 * 2);
+        for (size_t value = 0; value < 65536; ++value)
+        {
+            pixels[value * 2] = static_cast<unsigned char>(value & 0xff);
+            pixels[value * 2 + 1] = static_cast<unsigned char>(value >> 8);
+        }
+
+        return pixels;
+    }
+
+    int widen(unsigned int value, unsigned int bits)
+    {
+        return (value << (8 - bits)) | (value >> (2 * bits - 8));
+    }
+
+    /**
+     * Widen every 16-bit pixel with every instruction set this processor
+     * has, checking each channel against bit replication and that cutting
+     * it back down to its original width gives back the bits it came from.
+     */
+    void check_every_pixel(
+        channel_order::type in_order, channel_order::type out_order)
+    {
+        const bool is_565 = in_order == channel_order::rgb565;
+        const unsigned int red_shift = (is_565) ? 11 : 10;
+        const unsigned int green_bits = (is_565) ? 6 : 5;
+        const size_t out_size = bytes_per_pixel(out_order);
+
+        vector<unsigned char> in = every_16_bit_pixel();
+        vector<unsigned char> out(65536 * out_size);
+
+        for (int isa = instruction_set::generic; isa <= best_instruction_set();
+            ++isa)
+        {
+            BOOST_TEST_MESSAGE("instruction set " << isa);
+
+            convert_row(
+                &in[0], in_order, &out[0], out_order, 65536,
+                static_cast<instruction_set::type>(isa));
+
+            for (unsigned int value = 0; value < 65536; ++value)
+            {
+                const unsigned char* pixel = &out[value * out_size];
+                unsigned int red = (value >> red_shift) & 0x1f;
+                unsigned int green = (value >> 5) & ((1U << green_bits) - 1);
+                unsigned int blue = value & 0x1f;
+
+                BOOST_REQUIRE_EQUAL(pixel[0], widen(red, 5));
+                BOOST_REQUIRE_EQUAL(pixel[1], widen(green, green_bits));
+                BOOST_REQUIRE_EQUAL(pixel[2], widen(blue, 5));
+                if (out_size == 4)
+                    BOOST_REQUIRE_EQUAL(pixel[3], 0xff);
+
+                BOOST_REQUIRE_EQUAL(pixel[0] >> 3, static_cast<int>(red));
+                BOOST_REQUIRE_EQUAL(
+                    pixel[1] >> (8 - green_bits), static_cast<int>(green));
+                BOOST_REQUIRE_EQUAL(pixel[2] >> 3, static_cast<int>(blue));
+            }
+        }
+    }
+
+    /**
+     * Convert a bottom-up BGRX image with padded rows, whose width needs
+     * both whole vectors and a tail, with every instruction set and check
+     * each pixel lands in the right row with its channels swapped.
+     */
+    void check_bottom_up_image(channel_order::type out_order)
+    {
+        const unsigned int width = 37;
+        const unsigned int height = 5;
+        const size_t stride = width * 4 + 12;
+        const size_t out_size = bytes_per_pixel(out_order);
+
+        vector<unsigned char> pixels(stride * height);
+        for (size_t i = 0; i < pixels.size(); ++i)
+            pixels[i] = static_cast<unsigned char>(std::rand());
+
+        image_view image(
+            &pixels[0], width, height, stride, channel_order::bgrx, true);
+
+        // One spare byte to catch the last row running over
+        vector<unsigned char> out(width * height * out_size + 1);
+
+        for (int isa = instruction_set::generic;
+            isa <= instruction_set::avx2; ++isa)
+        {
+            BOOST_TEST_MESSAGE("instruction set " << isa);
+
+            std::fill(out.begin(), out.end(), 0xaa);
+            convert_image(
+                image, &out[0], out_order,
+                static_cast<instruction_set::type>(isa));
+
+            for (unsigned int y = 0; y < height; ++y)
+            {
+                for (unsigned int x = 0; x < width; ++x)
+                {
+                    const unsigned char* stored =
+                        &pixels[(height - 1 - y) * stride + x * 4];
+                    const unsigned char* pixel =
+                        &out[(y * width + x) * out_size];
+
+                    BOOST_REQUIRE_EQUAL(pixel[0], stored[2]);
+                    BOOST_REQUIRE_EQUAL(pixel[1], stored[1]);
+                    BOOST_REQUIRE_EQUAL(pixel[2], stored[0]);
+                    if (out_size == 4)
+                        BOOST_REQUIRE_EQUAL(pixel[3], 0xff);
+                }
+            }
+
+            BOOST_REQUIRE_EQUAL(out.back(), 0xaa);
+        }
+    }
+
+    /**
+     * Convert rows of random pixels of every width from nothing up to a few
+     * vectors' worth with each instruction set as the limit and check they
+     * agree with the generic kernel, so the vector kernels' tails get
+     * exercised.  Limits this processor lacks fall back to what it has.
+     */
+    void check_every_width(
+        channel_order::type in_order, channel_order::type out_order)
+    {
+        const size_t max_width = 70;
+        const size_t out_size = bytes_per_pixel(out_order);
+
+        vector<unsigned char> in(max_width * bytes_per_pixel(in_order));
+        for (size_t i = 0; i < in.size(); ++i)
+            in[i] = static_cast<unsigned char>(std::rand());
+
+        // One spare pixel to catch kernels writing past the end of the row
+        vector<unsigned char> expected((max_width + 1) * out_size);
+        vector<unsigned char> actual((max_width + 1) * out_size);
+
+        row_converter generic(in_order, out_order, instruction_set::generic);
+
+        for (int isa = instruction_set::sse2; isa <= instruction_set::avx2;
+            ++isa)
+        {
+            BOOST_TEST_MESSAGE("instruction set " << isa);
+
+            row_converter convert(
+                in_order, out_order, static_cast<instruction_set::type>(isa));
+
+            for (size_t width = 0; width <= max_width; ++width)
+            {
+                std::fill(expected.begin(), expected.end(), 0xaa);
+                std::fill(actual.begin(), actual.end(), 0xaa);
+
+                generic(&in[0], &expected[0], width);
+                convert(&in[0], &actual[0], width);
+
+                BOOST_REQUIRE_EQUAL_COLLECTIONS(
+                    actual.begin(), actual.end(),
+                    expected.begin(), expected.end());
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(row_conversion_tests)
+
+/**
+ * 565 pixels widen to exactly what bit replication gives and nothing is
+ * lost: each channel's top bits are the bits it started as.
+ */
+BOOST_AUTO_TEST_CASE( widen_565_to_rgba )
+{
+    check_every_pixel(channel_order::rgb565, channel_order::rgba);
+}
+
+BOOST_AUTO_TEST_CASE( widen_565_to_rgb )
+{
+    check_every_pixel(channel_order::rgb565, channel_order::rgb);
+}
+
+/**
+ * The unused top bit of 555 pixels makes no difference.
+ */
+BOOST_AUTO_TEST_CASE( widen_555_to_rgba )
+{
+    check_every_pixel(channel_order::rgb555, channel_order::rgba);
+}
+
+BOOST_AUTO_TEST_CASE( widen_555_to_rgb )
+{
+    check_every_pixel(channel_order::rgb555, channel_order::rgb);
+}
+
+/**
+ * The vector kernels agree with the generic one at any width.
+ */
+BOOST_AUTO_TEST_CASE( widen_16_bit_any_width )
+{
+    check_every_width(channel_order::rgb565, channel_order::rgba);
+    check_every_width(channel_order::rgb565, channel_order::rgb);
+    check_every_width(channel_order::rgb555, channel_order::rgba);
+    check_every_width(channel_order::rgb555, channel_order::rgb);
+}
+
+/**
+ * The 32-bit kernels agree with the generic one at any width too, whether
+ * they shuffle, fill in alpha or drop it.
+ */
+BOOST_AUTO_TEST_CASE( convert_32_bit_any_width )
+{
+    check_every_width(channel_order::bgrx, channel_order::rgba);
+    check_every_width(channel_order::bgrx, channel_order::rgb);
+    check_every_width(channel_order::bgra, channel_order::rgba);
+    check_every_width(channel_order::bgra, channel_order::rgb);
+    check_every_width(channel_order::rgbx, channel_order::rgba);
+    check_every_width(channel_order::rgba, channel_order::rgb);
+}
+
+/**
+ * A bottom-up image is flipped to top-down in the same pass that converts
+ * it, skipping the padding at the end of each of its rows.
+ */
+BOOST_AUTO_TEST_CASE( convert_bottom_up_image_to_rgba )
+{
+    check_bottom_up_image(channel_order::rgba);
+}
+
+BOOST_AUTO_TEST_CASE( convert_bottom_up_image_to_rgb )
+{
+    check_bottom_up_image(channel_order::rgb);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
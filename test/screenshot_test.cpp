@@ -33,11 +33,14 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <cstddef> // ptrdiff_t
 #include <vector>
 
 #include <Windows.h> // GetForegroundWindow
 
+using crabgrab::dib_pixels;
 using crabgrab::take_screenshot;
+using crabgrab::take_screenshot_pixels;
 
 using std::vector;
 
@@ -61,4 +64,35 @@ BOOST_AUTO_TEST_CASE( grab_single_window )
     BOOST_CHECK_GT(bmp.size(), 100U);
 }
 
+/**
+ * Take complete screengrab as raw pixels.
+ *
+ * The pixels should be top-down 32-bit rows with no padding.
+ */
+BOOST_AUTO_TEST_CASE( grab_whole_desktop_pixels )
+{
+    dib_pixels pixels = take_screenshot_pixels();
+    BOOST_CHECK_GE(pixels.width(), 640U);
+    BOOST_CHECK_GE(pixels.height(), 480U);
+    BOOST_CHECK_EQUAL(
+        pixels.view().stride, static_cast<std::ptrdiff_t>(pixels.width() * 4));
+    BOOST_CHECK(!pixels.view().bottom_up);
+}
+
+/**
+ * Take complete screengrab as 16-bit 565 pixels.
+ *
+ * Rows are half the size but still padded to whole DWORDs.
+ */
+BOOST_AUTO_TEST_CASE( grab_whole_desktop_pixels_565 )
+{
+    dib_pixels pixels = take_screenshot_pixels(
+        ::GetDesktopWindow(), crabgrab::channel_order::rgb565);
+    BOOST_CHECK_GE(pixels.width(), 640U);
+    BOOST_CHECK_EQUAL(pixels.view().order, crabgrab::channel_order::rgb565);
+    BOOST_CHECK_EQUAL(
+        pixels.view().stride,
+        static_cast<std::ptrdiff_t>(((pixels.width() * 2 + 3) / 4) * 4));
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,176 @@
+/**
+    @file
+
+    Tests for the worker thread pool.
+
+    @if license
+
+    Copyright (C) 2011  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "crabgrab/thread_pool.hpp" // test subject
+
+#include "crabgrab/arena.hpp" // arena, arena_scope, allocate_scoped,
+                              // free_scoped
+
+#include <boost/bind.hpp> // bind
+#include <boost/ref.hpp> // ref
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/mutex.hpp> // mutex
+#include <boost/thread/thread.hpp> // thread, this_thread
+
+#include <algorithm> // count, max
+#include <cstddef> // size_t, ptrdiff_t
+#include <set>
+#include <vector>
+
+using crabgrab::arena;
+using crabgrab::arena_scope;
+using crabgrab::thread_pool;
+
+using std::set;
+using std::size_t;
+using std::vector;
+
+namespace {
+
+    void count_call(vector<unsigned int>& calls, unsigned int i)
+    {
+        ++calls[i];
+    }
+
+    /**
+     * Records which threads the iterations ran on, taking long enough that
+     * every thread gets some.
+     */
+    void note_thread(
+        set<boost::thread::id>& threads, boost::mutex& mutex, unsigned int)
+    {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+        boost::mutex::scoped_lock lock(mutex);
+        threads.insert(boost::this_thread::get_id());
+    }
+
+    void note_owner(vector<arena*>& owners, unsigned int i)
+    {
+        void* block = crabgrab::allocate_scoped(16);
+        owners[i] = arena::owner(block);
+        crabgrab::free_scoped(block);
+    }
+
+    void run_loop(thread_pool& pool, vector<unsigned int>& calls)
+    {
+        pool.parallel_for(
+            static_cast<unsigned int>(calls.size()),
+            boost::bind(count_call, boost::ref(calls), _1));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(thread_pool_tests)
+
+/**
+ * Every iteration runs exactly once, however many threads there are.
+ */
+BOOST_AUTO_TEST_CASE( every_iteration_once )
+{
+    unsigned int sizes[] = { 1, 2, 3, 8 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        thread_pool pool(sizes[i]);
+        BOOST_CHECK_EQUAL(pool.size(), sizes[i]);
+
+        for (unsigned int count = 0; count < 40; count += 13)
+        {
+            vector<unsigned int> calls(count);
+            run_loop(pool, calls);
+            BOOST_CHECK_EQUAL(
+                std::count(calls.begin(), calls.end(), 1U),
+                static_cast<std::ptrdiff_t>(count));
+        }
+    }
+}
+
+/**
+ * The default is a thread per core.
+ */
+BOOST_AUTO_TEST_CASE( default_size )
+{
+    thread_pool pool;
+    BOOST_CHECK_EQUAL(
+        pool.size(), std::max(boost::thread::hardware_concurrency(), 1U));
+}
+
+/**
+ * The caller takes iterations too, alongside the pool's own threads.
+ */
+BOOST_AUTO_TEST_CASE( iterations_spread_over_threads )
+{
+    thread_pool pool(4);
+    set<boost::thread::id> threads;
+    boost::mutex mutex;
+
+    pool.parallel_for(
+        64, boost::bind(
+            note_thread, boost::ref(threads), boost::ref(mutex), _1));
+
+    BOOST_CHECK(threads.size() > 1);
+    BOOST_CHECK(threads.size() <= 4);
+}
+
+/**
+ * Loops started from two threads at once take turns, and both finish.
+ */
+BOOST_AUTO_TEST_CASE( concurrent_loops )
+{
+    thread_pool pool(3);
+    vector<unsigned int> first(500), second(500);
+
+    boost::thread other(
+        boost::bind(run_loop, boost::ref(pool), boost::ref(second)));
+    run_loop(pool, first);
+    other.join();
+
+    BOOST_CHECK_EQUAL(std::count(first.begin(), first.end(), 1U), 500);
+    BOOST_CHECK_EQUAL(std::count(second.begin(), second.end(), 1U), 500);
+}
+
+/**
+ * Iterations allocate from the heap, even on the calling thread with an
+ * arena in scope.
+ */
+BOOST_AUTO_TEST_CASE( iterations_allocate_from_heap )
+{
+    arena memory;
+    arena_scope scope(memory);
+
+    thread_pool pool(2);
+    vector<arena*> owners(16, &memory);
+    pool.parallel_for(16, boost::bind(note_owner, boost::ref(owners), _1));
+
+    BOOST_CHECK_EQUAL(
+        std::count(owners.begin(), owners.end(), static_cast<arena*>(NULL)),
+        16);
+}
+
+BOOST_AUTO_TEST_SUITE_END();